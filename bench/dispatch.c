@@ -0,0 +1,200 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Measures the cost of resolving an epoll event to its client and touching
+ * the per-event state, comparing the hot/cold client table against the
+ * previous layout of individually allocated clients with an embedded buffer.
+ *
+ * Usage: bench-dispatch [connections] [events]
+ */
+
+#include "client.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Client layout before the hot/cold split */
+struct legacy_client
+{
+	char buffer[2048];
+	char addr[INET_ADDRSTRLEN];
+	void *srv;
+	int sd;
+	uint32_t gen;
+	uint32_t timer;
+	struct legacy_client *next;
+	struct legacy_client *prev;
+};
+
+/* Simple xorshift generator, good enough for picking slots */
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint32_t nextRandom(void)
+{
+	g_rng ^= g_rng << 13;
+	g_rng ^= g_rng >> 7;
+	g_rng ^= g_rng << 17;
+	return (uint32_t)g_rng;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double t, size_t ops, uint64_t check)
+{
+	printf("%-24s %8.2f ns/op  (check %llu)\n", name, t * 1e9 / ops,
+		(unsigned long long)check);
+}
+
+int main(int argc, char *argv[])
+{
+	struct cl_table t;
+	struct legacy_client **legacy;
+	uint64_t *handles;
+	uint32_t conns = 1000000;
+	size_t events = 20000000;
+	size_t i;
+	uint64_t check;
+	double start;
+
+	if (argc > 1)
+	{
+		conns = (uint32_t)strtoul(argv[1], NULL, 10);
+	}
+
+	if (argc > 2)
+	{
+		events = strtoul(argv[2], NULL, 10);
+	}
+
+	if (conns == 0 || events == 0)
+	{
+		fprintf(stderr, "Usage: %s [connections] [events]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%u connections, %zu events\n", conns, events);
+
+	if (clt_init(&t, conns, NULL) != 0)
+	{
+		fprintf(stderr, "Failed to allocate client table.\n");
+		return 1;
+	}
+
+	legacy = calloc(conns, sizeof(*legacy));
+	handles = malloc(events * sizeof(*handles));
+	if (legacy == NULL || handles == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (i = 0; i < conns; ++i)
+	{
+		legacy[i] = malloc(sizeof(struct legacy_client));
+		if (legacy[i] == NULL)
+		{
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+
+		memset(legacy[i], 0, sizeof(struct legacy_client));
+		legacy[i]->sd = (int)i + 3;
+		clt_acquire(&t, (int)i + 3);
+	}
+
+	/* Pre-generate the event stream so both runs see the same handles */
+	for (i = 0; i < events; ++i)
+	{
+		handles[i] = nextRandom() % conns;
+	}
+
+	/* Hot/cold table: validate generation, read fd, arm the timer */
+	check = 0;
+	start = now();
+	for (i = 0; i < events; ++i)
+	{
+		struct cl_hot *h = clt_lookup(&t, (uint32_t)handles[i], 0);
+
+		if (h != NULL)
+		{
+			check += h->sd;
+			h->timer = (uint32_t)i;
+		}
+	}
+	report("dispatch hot/cold", now() - start, events, check);
+
+	/* Legacy layout: chase the client pointer and do the same work */
+	check = 0;
+	start = now();
+	for (i = 0; i < events; ++i)
+	{
+		struct legacy_client *cl = legacy[handles[i]];
+
+		if (cl->gen == 0)
+		{
+			check += cl->sd;
+			cl->timer = (uint32_t)i;
+		}
+	}
+	report("dispatch legacy", now() - start, events, check);
+
+	/* Idle sweep over all clients */
+	check = 0;
+	start = now();
+	for (i = 0; i < conns; ++i)
+	{
+		const struct cl_hot *h = &t.hot[i];
+
+		if ((h->flags & CL_ACTIVE) && h->timer < events / 2)
+		{
+			check++;
+		}
+	}
+	report("sweep hot/cold", now() - start, conns, check);
+
+	check = 0;
+	start = now();
+	for (i = 0; i < conns; ++i)
+	{
+		if (legacy[i]->timer < events / 2)
+		{
+			check++;
+		}
+	}
+	report("sweep legacy", now() - start, conns, check);
+
+	for (i = 0; i < conns; ++i)
+	{
+		free(legacy[i]);
+	}
+
+	free(legacy);
+	free(handles);
+	clt_destroy(&t);
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "arena.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define HUGEPAGE_SIZE (2u * 1024 * 1024)
+
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+int arena_init(struct arena *a, size_t size, int flags)
+{
+	void *p = MAP_FAILED;
+
+	assert(a != NULL);
+
+	memset(a, 0, sizeof(struct arena));
+	size = ROUND_UP(size, HUGEPAGE_SIZE);
+
+	if (flags & ARENA_HUGEPAGES)
+	{
+		/* Fails unless hugepages are reserved (vm.nr_hugepages) */
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			a->backing = ARENA_HUGETLB;
+		}
+	}
+
+	if (p == MAP_FAILED)
+	{
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			perror("mmap");
+			return -1;
+		}
+
+		a->backing = ARENA_PAGES;
+
+#ifdef MADV_HUGEPAGE
+		if ((flags & ARENA_HUGEPAGES) && madvise(p, size, MADV_HUGEPAGE) == 0)
+		{
+			a->backing = ARENA_THP;
+		}
+#endif
+	}
+
+	if (flags & ARENA_LOCK)
+	{
+		if (mlock(p, size) == 0)
+		{
+			a->locked = 1;
+		}
+		else
+		{
+			perror("mlock");
+		}
+	}
+
+	a->base = p;
+	a->size = size;
+
+	return 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+	if (a == NULL || a->base == NULL)
+	{
+		return;
+	}
+
+	if (munmap(a->base, a->size) == -1)
+	{
+		perror("munmap");
+	}
+
+	memset(a, 0, sizeof(struct arena));
+}
+
+void *arena_alloc(struct arena *a, size_t size, size_t align)
+{
+	size_t off;
+
+	assert(a != NULL);
+	assert(align > 0 && (align & (align - 1)) == 0);
+
+	off = ROUND_UP(a->used, align);
+	if (a->base == NULL || off > a->size || size > a->size - off)
+	{
+		return NULL;
+	}
+
+	a->used = off + size;
+
+	/* Fresh anonymous mappings are already zeroed */
+	return a->base + off;
+}
+
+const char *arena_backingName(enum arena_backing backing)
+{
+	switch (backing)
+	{
+	case ARENA_HUGETLB:
+		return "hugetlb";
+	case ARENA_THP:
+		return "thp";
+	case ARENA_PAGES:
+		return "pages";
+	default:
+		return "none";
+	}
+}
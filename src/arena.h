@@ -0,0 +1,79 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Arena flags */
+#define ARENA_HUGEPAGES 0x01
+#define ARENA_LOCK 0x02
+
+/* Backing used for an arena */
+enum arena_backing
+{
+	ARENA_NONE = 0,
+	/* Explicit hugepages from the hugetlbfs reserve */
+	ARENA_HUGETLB,
+	/* Normal pages advised for transparent hugepages */
+	ARENA_THP,
+	/* Normal pages */
+	ARENA_PAGES
+};
+
+/*
+ * Bump allocator over a single anonymous mapping, used for large regions
+ * that are preallocated on start and live until shutdown.
+ */
+struct arena
+{
+	char *base;
+	/* Mapping size */
+	size_t size;
+	/* Bytes handed out */
+	size_t used;
+	enum arena_backing backing;
+	/* Non-zero if the mapping is locked into memory */
+	int locked;
+};
+
+/*
+ * Maps an arena of at least the given size. With ARENA_HUGEPAGES, explicit
+ * hugepages are tried first, then transparent hugepages, then normal pages.
+ * ARENA_LOCK locks the mapping into memory; failing to do so is not fatal.
+ * Returns 0 on success, -1 on failure.
+ */
+int arena_init(struct arena *a, size_t size, int flags);
+
+/*
+ * Unmaps an arena. Memory handed out becomes invalid.
+ */
+void arena_destroy(struct arena *a);
+
+/*
+ * Returns zeroed memory from the arena aligned to the given power of two.
+ * Returns NULL if the arena is exhausted.
+ */
+void *arena_alloc(struct arena *a, size_t size, size_t align);
+
+/*
+ * Returns a printable name for an arena backing.
+ */
+const char *arena_backingName(enum arena_backing backing);
+
+#endif
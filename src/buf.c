@@ -0,0 +1,237 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "buf.h"
+#include "arena.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Heap slab size, slabs are aligned to it to find them from a buffer */
+#define SLAB_SIZE (64 * BUF_SIZE)
+/* Buffers per slab, the first buffer-sized chunk holds the header */
+#define SLAB_BUFFERS (SLAB_SIZE / BUF_SIZE - 1)
+
+/* Header of a heap slab */
+struct bufslab
+{
+	struct bufslab *next;
+	/* Free buffers, counted while trimming */
+	size_t idle;
+};
+
+/*
+ * Returns the slab of a heap buffer.
+ */
+static struct bufslab *bufpool_slab(struct buf *b)
+{
+	return (struct bufslab *)((uintptr_t)b & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+/*
+ * Returns 1 if b is one of the preallocated buffers.
+ */
+static int bufpool_isFixed(const struct bufpool *pool, const struct buf *b)
+{
+	return (const char *)b >= pool->fixed && (const char *)b < pool->fixedEnd;
+}
+
+/*
+ * Put a contiguous run of buffers on the free list.
+ */
+static void bufpool_add(struct bufpool *pool, char *mem, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+	{
+		struct buf *b = (struct buf*)(mem + i * BUF_SIZE);
+
+		b->next = pool->free;
+		pool->free = b;
+	}
+
+	pool->total += count;
+}
+
+/*
+ * Allocate a slab of buffers from the heap and put them on the free list.
+ * Returns 0 on success, -1 on failure.
+ */
+static int bufpool_grow(struct bufpool *pool)
+{
+	struct bufslab *slab;
+
+	assert(pool != NULL);
+
+	slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+	if (slab == NULL)
+	{
+		return -1;
+	}
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->slabBytes += SLAB_SIZE;
+
+	bufpool_add(pool, (char *)slab + BUF_SIZE, SLAB_BUFFERS);
+
+	return 0;
+}
+
+int bufpool_init(struct bufpool *pool, size_t prealloc, struct arena *a)
+{
+	char *mem;
+
+	assert(pool != NULL);
+
+	memset(pool, 0, sizeof(struct bufpool));
+
+	if (prealloc == 0)
+	{
+		return 0;
+	}
+
+	if (a == NULL)
+	{
+		mem = malloc(prealloc * BUF_SIZE);
+		pool->fixedHeap = mem;
+	}
+	else
+	{
+		mem = arena_alloc(a, prealloc * BUF_SIZE, BUF_SIZE);
+	}
+
+	if (mem == NULL)
+	{
+		return -1;
+	}
+
+	pool->fixed = mem;
+	pool->fixedEnd = mem + prealloc * BUF_SIZE;
+	bufpool_add(pool, mem, prealloc);
+
+	return 0;
+}
+
+void bufpool_destroy(struct bufpool *pool)
+{
+	if (pool == NULL)
+	{
+		return;
+	}
+
+	while (pool->slabs != NULL)
+	{
+		struct bufslab *next = pool->slabs->next;
+
+		free(pool->slabs);
+		pool->slabs = next;
+	}
+
+	free(pool->fixedHeap);
+	memset(pool, 0, sizeof(struct bufpool));
+}
+
+struct buf *buf_get(struct bufpool *pool)
+{
+	struct buf *b;
+
+	assert(pool != NULL);
+
+	if (pool->free == NULL && bufpool_grow(pool) != 0)
+	{
+		return NULL;
+	}
+
+	b = pool->free;
+	pool->free = b->next;
+	pool->used++;
+
+	b->next = NULL;
+	b->off = 0;
+	b->len = 0;
+
+	return b;
+}
+
+void buf_put(struct bufpool *pool, struct buf *b)
+{
+	assert(pool != NULL);
+
+	if (b == NULL)
+	{
+		return;
+	}
+
+	b->next = pool->free;
+	pool->free = b;
+	pool->used--;
+}
+
+void bufpool_trim(struct bufpool *pool)
+{
+	struct bufslab *slab, **link;
+	struct buf *b, **next;
+
+	assert(pool != NULL);
+
+	for (slab = pool->slabs; slab != NULL; slab = slab->next)
+	{
+		slab->idle = 0;
+	}
+
+	for (b = pool->free; b != NULL; b = b->next)
+	{
+		if (!bufpool_isFixed(pool, b))
+		{
+			bufpool_slab(b)->idle++;
+		}
+	}
+
+	/* Unlink the buffers of idle slabs, then free the slabs */
+	next = &pool->free;
+	while ((b = *next) != NULL)
+	{
+		if (!bufpool_isFixed(pool, b) &&
+			bufpool_slab(b)->idle == SLAB_BUFFERS)
+		{
+			*next = b->next;
+		}
+		else
+		{
+			next = &b->next;
+		}
+	}
+
+	link = &pool->slabs;
+	while ((slab = *link) != NULL)
+	{
+		if (slab->idle == SLAB_BUFFERS)
+		{
+			*link = slab->next;
+			free(slab);
+			pool->total -= SLAB_BUFFERS;
+			pool->slabBytes -= SLAB_SIZE;
+		}
+		else
+		{
+			link = &slab->next;
+		}
+	}
+}
@@ -0,0 +1,95 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BUF_H
+#define BUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of a pooled buffer including its header */
+#define BUF_SIZE 2048
+
+/* Pooled buffer, chained to form per-client queues */
+struct buf
+{
+	struct buf *next;
+	/* Offset of the first unconsumed byte */
+	uint32_t off;
+	/* Offset one past the last valid byte */
+	uint32_t len;
+	char data[];
+};
+
+#define BUF_CAPACITY (BUF_SIZE - offsetof(struct buf, data))
+
+struct arena;
+struct bufslab;
+
+/*
+ * Fixed-size buffer pool. Buffers added when the preallocated ones run out
+ * come from heap slabs, which bufpool_trim frees again once all their
+ * buffers are back.
+ */
+struct bufpool
+{
+	/* Free buffers */
+	struct buf *free;
+	/* Heap allocated slabs, chained through their headers */
+	struct bufslab *slabs;
+	/* Preallocated buffers, and their memory if it is not from an arena */
+	char *fixed;
+	char *fixedEnd;
+	void *fixedHeap;
+	/* Buffers handed out */
+	size_t used;
+	/* Buffers owned by the pool */
+	size_t total;
+	/* Bytes held by heap slabs */
+	size_t slabBytes;
+};
+
+/*
+ * Initializes a buffer pool and preallocates the given number of buffers,
+ * from the arena if one is given.
+ * Returns 0 on success, -1 on failure.
+ */
+int bufpool_init(struct bufpool *pool, size_t prealloc, struct arena *a);
+
+/*
+ * Releases all memory owned by the pool. Buffers still handed out become
+ * invalid.
+ */
+void bufpool_destroy(struct bufpool *pool);
+
+/*
+ * Takes a buffer from the pool, growing it if necessary.
+ * Returns NULL on failure.
+ */
+struct buf *buf_get(struct bufpool *pool);
+
+/*
+ * Returns a buffer to the pool.
+ */
+void buf_put(struct bufpool *pool, struct buf *b);
+
+/*
+ * Frees the heap slabs none of whose buffers are handed out.
+ */
+void bufpool_trim(struct bufpool *pool);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "capture.h"
+#include "tsc.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+int cap_open(struct capture *c, const char *path, size_t size, int payload)
+{
+	struct timespec ts;
+	int fd, rc;
+
+	memset(c, 0, sizeof(struct capture));
+	size &= ~(size_t)7;
+	if (size < 4096)
+	{
+		fprintf(stderr, "Capture file too small.\n");
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		perror("open");
+		return -1;
+	}
+
+	c->mapSize = sizeof(struct cap_header) + size;
+
+	/* Allocate all blocks now rather than on the first write fault */
+	rc = posix_fallocate(fd, 0, c->mapSize);
+	if (rc != 0)
+	{
+		fprintf(stderr, "posix_fallocate: %s\n", strerror(rc));
+		goto on_error;
+	}
+
+	c->hdr = mmap(NULL, c->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c->hdr == MAP_FAILED)
+	{
+		perror("mmap");
+		c->hdr = NULL;
+		goto on_error;
+	}
+
+	close(fd);
+	madvise(c->hdr, c->mapSize, MADV_SEQUENTIAL);
+
+	tsc_calibrate();
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	memcpy(c->hdr->magic, CAP_MAGIC, sizeof(c->hdr->magic));
+	c->hdr->size = size;
+	c->hdr->startNs = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	c->hdr->ticksPerUs = tsc_ticksPerUs();
+	c->data = (uint8_t *)(c->hdr + 1);
+	c->start = tsc_now();
+	c->payload = payload;
+
+	return 0;
+
+on_error:
+	close(fd);
+	unlink(path);
+	return -1;
+}
+
+void cap_close(struct capture *c)
+{
+	if (c->hdr != NULL)
+	{
+		munmap(c->hdr, c->mapSize);
+		c->hdr = NULL;
+	}
+}
+
+/*
+ * Drop records from the tail until the ring has room for a record of the
+ * given size at head.
+ */
+static void cap_reserve(struct capture *c, size_t need)
+{
+	struct cap_header *hdr = c->hdr;
+
+	/* Records live in [tail, head) or, once wrapped, [tail, size) + [0, head) */
+	while (hdr->records > 0 && hdr->tail >= hdr->head &&
+		hdr->tail < hdr->head + need)
+	{
+		const struct cap_record *r =
+			(const struct cap_record *)(c->data + hdr->tail);
+
+		if (r->type == CAP_PAD)
+		{
+			hdr->tail = 0;
+			continue;
+		}
+
+		hdr->tail += cap_recordSize(r->flags & CAP_PAYLOAD ? r->len : 0);
+		hdr->records--;
+		hdr->dropped++;
+
+		/* No room for another record before the end */
+		if (hdr->size - hdr->tail < sizeof(struct cap_record))
+		{
+			hdr->tail = 0;
+		}
+	}
+
+	if (hdr->records == 0)
+	{
+		hdr->tail = hdr->head;
+	}
+}
+
+void cap_write(struct capture *c, enum cap_type type, uint64_t conn,
+	const void *data, uint32_t len)
+{
+	struct cap_header *hdr = c->hdr;
+	struct cap_record *r;
+	size_t stored = (c->payload && data != NULL) ? len : 0;
+	size_t size = cap_recordSize(stored);
+
+	/* Payloads that would take more than half the ring are cut */
+	if (size > hdr->size / 2)
+	{
+		stored = 0;
+		size = cap_recordSize(0);
+	}
+
+	/* Wrap around if the record does not fit before the end */
+	if (hdr->head + size > hdr->size)
+	{
+		cap_reserve(c, hdr->size - hdr->head);
+		if (hdr->size - hdr->head >= sizeof(struct cap_record))
+		{
+			r = (struct cap_record *)(c->data + hdr->head);
+			r->type = CAP_PAD;
+		}
+
+		hdr->head = 0;
+	}
+
+	cap_reserve(c, size);
+
+	r = (struct cap_record *)(c->data + hdr->head);
+	r->ticks = tsc_now() - c->start;
+	r->conn = conn;
+	r->len = len;
+	r->type = (uint16_t)type;
+	r->flags = stored > 0 ? CAP_PAYLOAD : 0;
+
+	if (stored > 0)
+	{
+		memcpy(r + 1, data, stored);
+	}
+
+	hdr->head += size;
+	hdr->records++;
+}
@@ -0,0 +1,119 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAP_MAGIC "EPSCAP01"
+
+/* Record types */
+enum cap_type
+{
+	/* Filler up to the end of the data area, the next record is at 0 */
+	CAP_PAD = 0,
+	CAP_CONNECT,
+	/* Data received from a client */
+	CAP_IN,
+	/* Data queued for a client */
+	CAP_OUT,
+	CAP_CLOSE
+};
+
+/* Record flags */
+#define CAP_PAYLOAD 0x01u
+
+/*
+ * Record header. The payload, if captured, follows the header and the record
+ * is padded to a multiple of 8 bytes.
+ */
+struct cap_record
+{
+	/* Time stamp counter ticks since the capture started */
+	uint64_t ticks;
+	/* Client id */
+	uint64_t conn;
+	/* Number of bytes transferred */
+	uint32_t len;
+	uint16_t type;
+	uint16_t flags;
+};
+
+/*
+ * File header, followed by the data area. The data area is a ring: records
+ * are appended at head and the oldest record starts at tail.
+ */
+struct cap_header
+{
+	char magic[8];
+	/* Size of the data area in bytes */
+	uint64_t size;
+	uint64_t head;
+	uint64_t tail;
+	/* Number of records and bytes overwritten by newer ones */
+	uint64_t records;
+	uint64_t dropped;
+	/* Wall clock time of the first record in nanoseconds since the epoch */
+	uint64_t startNs;
+	/* Time stamp counter frequency */
+	double ticksPerUs;
+};
+
+/* Open capture file */
+struct capture
+{
+	struct cap_header *hdr;
+	/* Data area */
+	uint8_t *data;
+	/* Mapping length */
+	size_t mapSize;
+	/* tsc_now() at the start of the capture */
+	uint64_t start;
+	/* Store payloads, not just byte counts */
+	int payload;
+};
+
+/*
+ * Returns the total size of a record with the given stored payload length.
+ */
+static inline size_t cap_recordSize(size_t stored)
+{
+	return (sizeof(struct cap_record) + stored + 7) & ~(size_t)7;
+}
+
+/*
+ * Creates a capture file with a data area of the given size. The file is
+ * preallocated and mapped, so recording does not make system calls.
+ * Returns 0 on success, -1 on failure.
+ */
+int cap_open(struct capture *c, const char *path, size_t size, int payload);
+
+/*
+ * Unmaps a capture file.
+ */
+void cap_close(struct capture *c);
+
+/*
+ * Appends a record, overwriting the oldest records if the ring is full.
+ * data may be NULL if there is no payload.
+ */
+void cap_write(struct capture *c, enum cap_type type, uint64_t conn,
+	const void *data, uint32_t len);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "client.h"
+#include "arena.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Alignment of the arrays within an arena */
+#define CL_ALIGN 64
+
+size_t clt_memSize(uint32_t capacity)
+{
+	return (size_t)capacity * (sizeof(struct cl_hot) + sizeof(struct cl_cold)) +
+		2 * CL_ALIGN;
+}
+
+int clt_init(struct cl_table *t, uint32_t capacity, struct arena *a)
+{
+	uint32_t i;
+
+	assert(t != NULL);
+	assert(capacity > 0);
+
+	memset(t, 0, sizeof(struct cl_table));
+
+	if (a != NULL)
+	{
+		t->hot = arena_alloc(a, capacity * sizeof(struct cl_hot), CL_ALIGN);
+		t->cold = arena_alloc(a, capacity * sizeof(struct cl_cold), CL_ALIGN);
+		if (t->hot == NULL || t->cold == NULL)
+		{
+			t->hot = NULL;
+			t->cold = NULL;
+			return -1;
+		}
+
+		t->inArena = 1;
+	}
+	else
+	{
+		t->hot = calloc(capacity, sizeof(struct cl_hot));
+		t->cold = calloc(capacity, sizeof(struct cl_cold));
+		if (t->hot == NULL || t->cold == NULL)
+		{
+			clt_destroy(t);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < capacity; ++i)
+	{
+		t->hot[i].sd = -1;
+		t->cold[i].nextFree = (i + 1 < capacity) ? i + 1 : CL_SLOT_NONE;
+	}
+
+	t->capacity = capacity;
+	t->freeSlot = 0;
+
+	return 0;
+}
+
+void clt_destroy(struct cl_table *t)
+{
+	if (t == NULL)
+	{
+		return;
+	}
+
+	/* Arena memory is released with the arena */
+	if (!t->inArena)
+	{
+		free(t->hot);
+		free(t->cold);
+	}
+
+	memset(t, 0, sizeof(struct cl_table));
+	t->freeSlot = CL_SLOT_NONE;
+}
+
+uint32_t clt_acquire(struct cl_table *t, int sd)
+{
+	uint32_t slot;
+	struct cl_hot *h;
+	struct cl_cold *c;
+
+	assert(t != NULL);
+
+	slot = t->freeSlot;
+	if (slot == CL_SLOT_NONE)
+	{
+		return CL_SLOT_NONE;
+	}
+
+	h = &t->hot[slot];
+	c = &t->cold[slot];
+	t->freeSlot = c->nextFree;
+	t->count++;
+
+	h->sd = sd;
+	h->flags = CL_ACTIVE;
+	h->outLen = 0;
+	h->timer = 0;
+
+	memset(c, 0, sizeof(struct cl_cold));
+	c->nextFree = CL_SLOT_NONE;
+
+	return slot;
+}
+
+void clt_release(struct cl_table *t, uint32_t slot)
+{
+	struct cl_hot *h;
+
+	assert(t != NULL);
+	assert(slot < t->capacity);
+
+	h = &t->hot[slot];
+	assert(h->flags & CL_ACTIVE);
+
+	h->sd = -1;
+	h->flags = 0;
+	h->gen++;
+
+	t->cold[slot].nextFree = t->freeSlot;
+	t->freeSlot = slot;
+	t->count--;
+}
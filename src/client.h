@@ -0,0 +1,212 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define CL_SLOT_NONE UINT32_MAX
+#define CL_GEN_MASK 0xFFFFFFu
+
+/* Client state flags */
+#define CL_ACTIVE 0x01u
+/* EPOLLOUT is armed until the output queue drains */
+#define CL_WANT_WRITE 0x02u
+/* Reads are suspended because the memory budget is exceeded */
+#define CL_PAUSED 0x04u
+/* Connection to the admin interface */
+#define CL_ADMIN 0x08u
+/* Send queue grows faster than the peer drains it */
+#define CL_SLOW 0x10u
+/* Received data goes to the ingest sink, ctx holds the framing state */
+#define CL_SINK 0x20u
+/* Same-host client talking through shared memory rings, ctx holds the
+ * struct local_conn */
+#define CL_LOCAL 0x40u
+/* Received data are statsd lines, ctx holds the partial line */
+#define CL_STATSD 0x80u
+/* Received data are JSON lines, ctx holds the struct jsonl_conn */
+#define CL_JSON 0x100u
+/* Accepted on the TLS listener */
+#define CL_TLS 0x200u
+/* Speaks WebSocket, ctx holds the struct ws_conn */
+#define CL_WS 0x400u
+/* Sends RPC requests, ctx holds the struct rpc_conn */
+#define CL_RPC 0x800u
+/* Carries multiplexed streams, ctx holds the struct mux_conn */
+#define CL_MUX 0x1000u
+/* Input was left when the client got paused, it goes before new reads */
+#define CL_HELD 0x2000u
+/* The first bytes may still be a compression hello, they wait in hello */
+#define CL_HELLO 0x4000u
+
+struct arena;
+struct buf;
+struct compress_conn;
+struct tls_conn;
+
+/*
+ * Per-client state touched on every event and by sweeps over the table.
+ * Kept small so that a cache line covers several clients.
+ */
+struct cl_hot
+{
+	/* Socket */
+	int sd;
+	/* CL_* flags */
+	uint32_t flags;
+	/* Bytes waiting in the output queue */
+	uint32_t outLen;
+	/* Idle deadline in loop ticks, 0 if not armed */
+	uint32_t timer;
+	/* Incremented whenever the slot is released */
+	uint32_t gen;
+};
+
+/* Per-client traffic counters */
+struct cl_stats
+{
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t reads;
+	uint64_t writes;
+	/* Time stamp counter ticks spent dispatching events of the client */
+	uint64_t cycles;
+};
+
+/* Smoothed TCP_INFO samples of a client */
+struct cl_tcp
+{
+	/* Monotonic time of the last sample in ms, 0 if never sampled */
+	uint64_t sampledMs;
+	/* Smoothed round trip time and its variation in microseconds */
+	uint32_t rtt;
+	uint32_t rttvar;
+	/* Total retransmitted segments */
+	uint32_t retrans;
+	/* Congestion window in segments */
+	uint32_t cwnd;
+	/* Unacknowledged segments */
+	uint32_t unacked;
+	/* Bytes queued in user space and in the kernel at the last sample */
+	uint32_t queued;
+	/* Smoothed queue growth in bytes per second */
+	int32_t growth;
+	/* Consecutive samples with a growing queue */
+	uint32_t growing;
+};
+
+/* Per-client state only needed when the client actually does something */
+struct cl_cold
+{
+	/* Remote IP address */
+	char addr[INET_ADDRSTRLEN];
+	/* Remote IPv4 address in network byte order, 0 for other families */
+	uint32_t ip;
+	/* Traffic counters */
+	struct cl_stats stats;
+	/* Transport metrics */
+	struct cl_tcp tcp;
+	/* Output queue */
+	struct buf *outHead;
+	struct buf *outTail;
+	/* Handler context */
+	void *ctx;
+	/* Compression state, NULL unless negotiated */
+	struct compress_conn *z;
+	/* Start of a compression hello received so far, see CL_HELLO */
+	char hello[8];
+	/* TLS state until the keys are in the kernel, NULL otherwise */
+	struct tls_conn *tls;
+	/* Next free slot while the slot is unused */
+	uint32_t nextFree;
+};
+
+/*
+ * Client table. The hot and cold arrays are indexed by the same slot and
+ * preallocated at the configured capacity.
+ */
+struct cl_table
+{
+	struct cl_hot *hot;
+	struct cl_cold *cold;
+	/* Number of slots */
+	uint32_t capacity;
+	/* Number of slots in use */
+	uint32_t count;
+	/* Head of the free slot list */
+	uint32_t freeSlot;
+	/* Non-zero if the arrays were allocated from an arena */
+	int inArena;
+};
+
+/*
+ * Allocates a client table with the given number of slots, from the arena if
+ * one is given and from the heap otherwise.
+ * Returns 0 on success, -1 on failure.
+ */
+int clt_init(struct cl_table *t, uint32_t capacity, struct arena *a);
+
+/*
+ * Returns the number of bytes needed for a table of the given capacity,
+ * including alignment padding within an arena.
+ */
+size_t clt_memSize(uint32_t capacity);
+
+/*
+ * Frees the memory owned by a client table.
+ */
+void clt_destroy(struct cl_table *t);
+
+/*
+ * Takes a free slot and marks it active.
+ * Returns CL_SLOT_NONE if the table is full.
+ */
+uint32_t clt_acquire(struct cl_table *t, int sd);
+
+/*
+ * Releases a slot and invalidates all handles referring to it.
+ */
+void clt_release(struct cl_table *t, uint32_t slot);
+
+/*
+ * Checks that a (slot, generation) pair refers to an active client.
+ * Returns the hot entry or NULL for stale handles.
+ */
+static inline struct cl_hot *clt_lookup(const struct cl_table *t,
+	uint32_t slot, uint32_t gen)
+{
+	struct cl_hot *h;
+
+	if (slot >= t->capacity)
+	{
+		return NULL;
+	}
+
+	h = &t->hot[slot];
+	if ((h->gen & CL_GEN_MASK) != gen || !(h->flags & CL_ACTIVE))
+	{
+		return NULL;
+	}
+
+	return h;
+}
+
+#endif
@@ -0,0 +1,382 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compress.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Raw deflate with a 32 KB window */
+#define COMPRESS_WINDOW_BITS (-15)
+#define COMPRESS_MEM_LEVEL 8
+/* Largest dictionary, only the last 32 KB are used anyway */
+#define COMPRESS_DICT_MAX (32 * 1024)
+
+/* Allocation header recording the size for accounting */
+union compress_block
+{
+	size_t size;
+	max_align_t align;
+};
+
+static voidpf compress_alloc(voidpf opaque, uInt items, uInt size)
+{
+	struct compress_pool *p = opaque;
+	union compress_block *b;
+	size_t n = (size_t)items * size;
+
+	b = malloc(sizeof(union compress_block) + n);
+	if (b == NULL)
+	{
+		return Z_NULL;
+	}
+
+	b->size = n;
+	p->bytes += n;
+	return b + 1;
+}
+
+static void compress_dealloc(voidpf opaque, voidpf address)
+{
+	struct compress_pool *p = opaque;
+	union compress_block *b = (union compress_block *)address - 1;
+
+	p->bytes -= b->size;
+	free(b);
+}
+
+static struct compress_ctx *compress_create(struct compress_pool *p,
+	int deflater, int level)
+{
+	struct compress_ctx *ctx;
+	int rc;
+
+	ctx = calloc(1, sizeof(struct compress_ctx));
+	if (ctx == NULL)
+	{
+		return NULL;
+	}
+
+	ctx->zs.zalloc = compress_alloc;
+	ctx->zs.zfree = compress_dealloc;
+	ctx->zs.opaque = p;
+
+	if (deflater)
+	{
+		rc = deflateInit2(&ctx->zs, level, Z_DEFLATED, COMPRESS_WINDOW_BITS,
+			COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	}
+	else
+	{
+		rc = inflateInit2(&ctx->zs, COMPRESS_WINDOW_BITS);
+	}
+
+	if (rc != Z_OK)
+	{
+		fprintf(stderr, "Failed to create compression context: %s\n",
+			ctx->zs.msg != NULL ? ctx->zs.msg : "out of memory");
+		free(ctx);
+		return NULL;
+	}
+
+	p->created++;
+	return ctx;
+}
+
+static void compress_destroy(struct compress_ctx *ctx, int deflater)
+{
+	if (deflater)
+	{
+		deflateEnd(&ctx->zs);
+	}
+	else
+	{
+		inflateEnd(&ctx->zs);
+	}
+
+	free(ctx);
+}
+
+int compress_init(struct compress_pool *p, const char *dictPath,
+	uint32_t idleMax)
+{
+	FILE *fp;
+	size_t n;
+
+	memset(p, 0, sizeof(struct compress_pool));
+	p->idleMax = idleMax;
+
+	if (dictPath == NULL)
+	{
+		return 0;
+	}
+
+	fp = fopen(dictPath, "rb");
+	if (fp == NULL)
+	{
+		perror(dictPath);
+		return -1;
+	}
+
+	p->dict = malloc(COMPRESS_DICT_MAX);
+	if (p->dict == NULL)
+	{
+		fclose(fp);
+		return -1;
+	}
+
+	/* Keep the tail of a long file, deflate prefers recent bytes */
+	if (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) > COMPRESS_DICT_MAX)
+	{
+		fseek(fp, -COMPRESS_DICT_MAX, SEEK_END);
+	}
+	else
+	{
+		rewind(fp);
+	}
+
+	n = fread(p->dict, 1, COMPRESS_DICT_MAX, fp);
+	fclose(fp);
+
+	if (n == 0)
+	{
+		fprintf(stderr, "Dictionary %s is empty.\n", dictPath);
+		free(p->dict);
+		p->dict = NULL;
+		return -1;
+	}
+
+	p->dictLen = (uint32_t)n;
+	return 0;
+}
+
+void compress_free(struct compress_pool *p)
+{
+	struct compress_ctx *ctx;
+
+	while ((ctx = p->freeDeflate) != NULL)
+	{
+		p->freeDeflate = ctx->next;
+		compress_destroy(ctx, 1);
+	}
+
+	while ((ctx = p->freeInflate) != NULL)
+	{
+		p->freeInflate = ctx->next;
+		compress_destroy(ctx, 0);
+	}
+
+	p->idleDeflate = 0;
+	p->idleInflate = 0;
+	free(p->dict);
+	p->dict = NULL;
+	p->dictLen = 0;
+}
+
+int compress_matchHello(const char *data, size_t len)
+{
+	size_t n = len < 4 ? len : 4;
+
+	if (memcmp(data, COMPRESS_MAGIC, n) != 0 ||
+		(len > 4 && (uint8_t)data[4] != COMPRESS_VERSION))
+	{
+		return -1;
+	}
+
+	return len >= COMPRESS_HELLO_SIZE ? 1 : 0;
+}
+
+void compress_accept(struct compress_pool *p, struct compress_conn *zc,
+	const char *data, struct compress_hello *reply)
+{
+	const struct compress_hello *hello = (const struct compress_hello *)data;
+
+	memset(zc, 0, sizeof(struct compress_conn));
+
+	/* The dictionary is only used if both sides have one */
+	zc->flags = hello->flags & COMPRESS_DICT;
+	if (p->dict == NULL)
+	{
+		zc->flags &= (uint8_t)~COMPRESS_DICT;
+	}
+
+	memset(reply, 0, sizeof(struct compress_hello));
+	memcpy(reply->magic, COMPRESS_MAGIC, 4);
+	reply->version = COMPRESS_VERSION;
+	reply->flags = zc->flags;
+	p->connections++;
+}
+
+struct compress_ctx *compress_deflater(struct compress_pool *p,
+	const struct compress_conn *zc, int level)
+{
+	struct compress_ctx *ctx = p->freeDeflate;
+
+	if (ctx != NULL)
+	{
+		p->freeDeflate = ctx->next;
+		p->idleDeflate--;
+		p->reused++;
+
+		/* Nothing is pending after a finished segment */
+		if (deflateReset(&ctx->zs) != Z_OK ||
+			deflateParams(&ctx->zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			compress_destroy(ctx, 1);
+			return NULL;
+		}
+	}
+	else
+	{
+		ctx = compress_create(p, 1, level);
+		if (ctx == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	if ((zc->flags & COMPRESS_DICT) &&
+		deflateSetDictionary(&ctx->zs, p->dict, p->dictLen) != Z_OK)
+	{
+		compress_destroy(ctx, 1);
+		return NULL;
+	}
+
+	p->busyDeflate++;
+	p->segmentsOut++;
+	return ctx;
+}
+
+struct compress_ctx *compress_inflater(struct compress_pool *p,
+	const struct compress_conn *zc)
+{
+	struct compress_ctx *ctx = p->freeInflate;
+
+	if (ctx != NULL)
+	{
+		p->freeInflate = ctx->next;
+		p->idleInflate--;
+		p->reused++;
+
+		if (inflateReset(&ctx->zs) != Z_OK)
+		{
+			compress_destroy(ctx, 0);
+			return NULL;
+		}
+	}
+	else
+	{
+		ctx = compress_create(p, 0, 0);
+		if (ctx == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	/* A raw stream takes the dictionary up front */
+	if ((zc->flags & COMPRESS_DICT) &&
+		inflateSetDictionary(&ctx->zs, p->dict, p->dictLen) != Z_OK)
+	{
+		compress_destroy(ctx, 0);
+		return NULL;
+	}
+
+	p->busyInflate++;
+	p->segmentsIn++;
+	return ctx;
+}
+
+void compress_put(struct compress_pool *p, struct compress_ctx *ctx,
+	int deflater)
+{
+	struct compress_ctx **head = deflater ? &p->freeDeflate : &p->freeInflate;
+	uint32_t *idle = deflater ? &p->idleDeflate : &p->idleInflate;
+
+	if (deflater)
+	{
+		p->busyDeflate--;
+	}
+	else
+	{
+		p->busyInflate--;
+	}
+
+	if (*idle >= p->idleMax)
+	{
+		compress_destroy(ctx, deflater);
+		return;
+	}
+
+	ctx->next = *head;
+	*head = ctx;
+	(*idle)++;
+}
+
+void compress_release(struct compress_pool *p, struct compress_conn *zc)
+{
+	if (zc->tx != NULL)
+	{
+		compress_put(p, zc->tx, 1);
+		zc->tx = NULL;
+	}
+
+	if (zc->rx != NULL)
+	{
+		compress_put(p, zc->rx, 0);
+		zc->rx = NULL;
+	}
+}
+
+int compress_level(uint32_t queued)
+{
+	if (queued >= 1024 * 1024)
+	{
+		return Z_BEST_COMPRESSION;
+	}
+	else if (queued >= 256 * 1024)
+	{
+		return 6;
+	}
+	else if (queued >= 16 * 1024)
+	{
+		return 3;
+	}
+
+	return Z_BEST_SPEED;
+}
+
+void compress_writeStats(const struct compress_pool *p, FILE *fp)
+{
+	fprintf(fp, "compress_connections %llu\n",
+		(unsigned long long)p->connections);
+	fprintf(fp, "compress_deflaters_busy %u\n", p->busyDeflate);
+	fprintf(fp, "compress_deflaters_idle %u\n", p->idleDeflate);
+	fprintf(fp, "compress_inflaters_busy %u\n", p->busyInflate);
+	fprintf(fp, "compress_inflaters_idle %u\n", p->idleInflate);
+	fprintf(fp, "compress_contexts_created %llu\n",
+		(unsigned long long)p->created);
+	fprintf(fp, "compress_contexts_reused %llu\n",
+		(unsigned long long)p->reused);
+	fprintf(fp, "compress_segments_out %llu\n",
+		(unsigned long long)p->segmentsOut);
+	fprintf(fp, "compress_segments_in %llu\n",
+		(unsigned long long)p->segmentsIn);
+	fprintf(fp, "compress_raw_in %llu\n", (unsigned long long)p->rawIn);
+	fprintf(fp, "compress_wire_in %llu\n", (unsigned long long)p->wireIn);
+	fprintf(fp, "compress_raw_out %llu\n", (unsigned long long)p->rawOut);
+	fprintf(fp, "compress_wire_out %llu\n", (unsigned long long)p->wireOut);
+	fprintf(fp, "compress_errors %llu\n", (unsigned long long)p->errors);
+}
@@ -0,0 +1,168 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+/*
+ * A client asks for compression by opening the connection with this hello.
+ * The server answers with a hello of its own carrying the accepted flags,
+ * after which both directions are raw deflate streams.
+ */
+#define COMPRESS_MAGIC "EPZ1"
+#define COMPRESS_HELLO_SIZE 8
+#define COMPRESS_VERSION 1
+/* Prime each segment with the server's dictionary */
+#define COMPRESS_DICT 0x01
+
+struct compress_hello
+{
+	char magic[4];
+	uint8_t version;
+	uint8_t flags;
+	uint8_t reserved[2];
+};
+
+/* Pooled deflate or inflate state */
+struct compress_ctx
+{
+	z_stream zs;
+	struct compress_ctx *next;
+};
+
+/*
+ * Compression state of a connection. A direction only holds a context
+ * while a segment is open: a segment is an independent raw deflate stream
+ * ending with a final block, and each one restarts from the dictionary.
+ */
+struct compress_conn
+{
+	/* Contexts of the open segments, NULL if none */
+	struct compress_ctx *tx;
+	struct compress_ctx *rx;
+	/* Negotiated COMPRESS_* flags */
+	uint8_t flags;
+	/* Output written since the last sync flush */
+	uint8_t dirty;
+	/* Position in the server's list of connections to flush */
+	uint32_t dirtyIndex;
+	/* Compressed input left over from a read, NULL if none */
+	char *backlog;
+	uint32_t backlogLen;
+	/* Input or inflate output waits to be dispatched before reading again */
+	uint8_t deferred;
+	/* On the server's list of connections to continue, and the position */
+	uint8_t listed;
+	uint32_t listIndex;
+	/* Monotonic time of the last write in ms */
+	uint64_t lastWriteMs;
+};
+
+/*
+ * Contexts of all connections. Idle connections give their contexts back,
+ * so the memory in use follows the number of busy connections.
+ */
+struct compress_pool
+{
+	struct compress_ctx *freeDeflate;
+	struct compress_ctx *freeInflate;
+	uint32_t idleDeflate;
+	uint32_t idleInflate;
+	uint32_t busyDeflate;
+	uint32_t busyInflate;
+	/* Idle contexts kept per direction, the rest is freed */
+	uint32_t idleMax;
+	/* Preset dictionary, NULL if none */
+	unsigned char *dict;
+	uint32_t dictLen;
+	/* Bytes allocated by zlib */
+	size_t bytes;
+	/* Statistics */
+	uint64_t connections;
+	uint64_t created;
+	uint64_t reused;
+	uint64_t segmentsOut;
+	uint64_t segmentsIn;
+	uint64_t rawIn;
+	uint64_t wireIn;
+	uint64_t rawOut;
+	uint64_t wireOut;
+	uint64_t errors;
+};
+
+/*
+ * Prepares the pool, loading a preset dictionary from dictPath if it is
+ * not NULL.
+ * Returns 0 on success, -1 on failure.
+ */
+int compress_init(struct compress_pool *p, const char *dictPath,
+	uint32_t idleMax);
+
+void compress_free(struct compress_pool *p);
+
+/*
+ * Returns 1 if data starts with a compression hello, 0 if data is too short
+ * to tell but may still become one, -1 if it is no hello.
+ */
+int compress_matchHello(const char *data, size_t len);
+
+/*
+ * Answers a client hello and fills in the connection.
+ */
+void compress_accept(struct compress_pool *p, struct compress_conn *zc,
+	const char *data, struct compress_hello *reply);
+
+/*
+ * Returns a deflate context starting a new segment, NULL if out of memory.
+ */
+struct compress_ctx *compress_deflater(struct compress_pool *p,
+	const struct compress_conn *zc, int level);
+
+/*
+ * Returns an inflate context starting a new segment, NULL if out of memory.
+ */
+struct compress_ctx *compress_inflater(struct compress_pool *p,
+	const struct compress_conn *zc);
+
+/*
+ * Returns a context to the pool.
+ */
+void compress_put(struct compress_pool *p, struct compress_ctx *ctx,
+	int deflater);
+
+/*
+ * Gives back the contexts of a connection that goes away.
+ */
+void compress_release(struct compress_pool *p, struct compress_conn *zc);
+
+/*
+ * Returns the compression level for a batch: cheap while the connection
+ * keeps up, stronger as its output queue grows.
+ */
+int compress_level(uint32_t queued);
+
+/*
+ * Writes compression statistics.
+ */
+void compress_writeStats(const struct compress_pool *p, FILE *fp);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hist.h"
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (h->count == 0)
+	{
+		return 0;
+	}
+
+	rank = (uint64_t)(h->count * p / 100.0);
+	if (rank >= h->count)
+	{
+		rank = h->count - 1;
+	}
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+	{
+		seen += h->buckets[i];
+		if (seen > rank)
+		{
+			break;
+		}
+	}
+
+	if (i == 0)
+	{
+		return 0;
+	}
+
+	/* Never report more than was actually seen */
+	if (i >= 64 || (1ull << i) - 1 > h->max)
+	{
+		return h->max;
+	}
+
+	return (1ull << i) - 1;
+}
+
+void hist_write(const struct hist *h, const char *prefix, FILE *fp)
+{
+	fprintf(fp, "%s_count %llu\n", prefix, (unsigned long long)h->count);
+	fprintf(fp, "%s_mean %.1f\n", prefix,
+		h->count > 0 ? (double)h->sum / h->count : 0.0);
+	fprintf(fp, "%s_p50 %llu\n", prefix,
+		(unsigned long long)hist_percentile(h, 50));
+	fprintf(fp, "%s_p90 %llu\n", prefix,
+		(unsigned long long)hist_percentile(h, 90));
+	fprintf(fp, "%s_p99 %llu\n", prefix,
+		(unsigned long long)hist_percentile(h, 99));
+	fprintf(fp, "%s_max %llu\n", prefix, (unsigned long long)h->max);
+}
@@ -0,0 +1,66 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Number of power of two buckets, enough for any 64 bit value */
+#define HIST_BUCKETS 65
+
+/*
+ * Histogram with power of two buckets. Bucket 0 counts zero values, bucket
+ * n counts values in [2^(n-1), 2^n).
+ */
+struct hist
+{
+	uint64_t buckets[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+/*
+ * Records a value.
+ */
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+	h->buckets[v == 0 ? 0 : 64 - __builtin_clzll(v)]++;
+	h->count++;
+	h->sum += v;
+
+	if (v > h->max)
+	{
+		h->max = v;
+	}
+}
+
+/*
+ * Returns the upper bound of the bucket holding the given percentile
+ * (0 - 100), 0 if the histogram is empty.
+ */
+uint64_t hist_percentile(const struct hist *h, double p);
+
+/*
+ * Writes count, mean, percentiles and maximum as "<prefix>_<name> value"
+ * statistics lines.
+ */
+void hist_write(const struct hist *h, const char *prefix, FILE *fp);
+
+#endif
@@ -0,0 +1,826 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "jsonl.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Grammar states of the second stage */
+#define ST_VALUE 0
+#define ST_KEY 1
+#define ST_COLON 2
+#define ST_NEXT 3
+
+/* Character classes of a 64 byte block, one bit per byte */
+struct jsonl_masks
+{
+	uint64_t quote;
+	uint64_t backslash;
+	/* Brackets, colons and commas */
+	uint64_t op;
+	/* Control characters below 0x20 */
+	uint64_t ctrl;
+	/* Bytes with the high bit set */
+	uint64_t high;
+};
+
+static void jsonl_classify(const char *p, struct jsonl_masks *m)
+{
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i brace = _mm_set1_epi8('{');
+	const __m128i close = _mm_set1_epi8('}');
+	const __m128i colon = _mm_set1_epi8(':');
+	const __m128i comma = _mm_set1_epi8(',');
+	uint64_t quotes = 0, backslashes = 0, ops = 0, ctrl = 0, high = 0;
+	int k;
+
+	/* Accumulate in registers, stores through m could alias the input */
+	for (k = 0; k < 4; ++k)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + k * 16));
+		/* Setting bit 5 maps [ and ] onto { and } */
+		__m128i folded = _mm_or_si128(v, lower);
+		__m128i op = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(folded, brace),
+				_mm_cmpeq_epi8(folded, close)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+		uint64_t h = (uint32_t)_mm_movemask_epi8(v);
+		int shift = k * 16;
+
+		quotes |= (uint64_t)(uint32_t)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, quote)) << shift;
+		backslashes |= (uint64_t)(uint32_t)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, backslash)) << shift;
+		ops |= (uint64_t)(uint32_t)_mm_movemask_epi8(op) << shift;
+		/* The signed compare also matches high bytes, mask them out */
+		ctrl |= ((uint64_t)(uint32_t)_mm_movemask_epi8(
+			_mm_cmplt_epi8(v, lower)) & ~h) << shift;
+		high |= h << shift;
+	}
+
+	m->quote = quotes;
+	m->backslash = backslashes;
+	m->op = ops;
+	m->ctrl = ctrl;
+	m->high = high;
+#else
+	int i;
+
+	memset(m, 0, sizeof(struct jsonl_masks));
+
+	for (i = 0; i < 64; ++i)
+	{
+		unsigned char ch = (unsigned char)p[i];
+		uint64_t bit = 1ull << i;
+
+		if (ch == '"')
+		{
+			m->quote |= bit;
+		}
+		else if (ch == '\\')
+		{
+			m->backslash |= bit;
+		}
+		else if (ch == '{' || ch == '}' || ch == '[' || ch == ']' ||
+			ch == ':' || ch == ',')
+		{
+			m->op |= bit;
+		}
+		else if (ch < 0x20)
+		{
+			m->ctrl |= bit;
+		}
+		else if (ch >= 0x80)
+		{
+			m->high |= bit;
+		}
+	}
+#endif
+}
+
+/*
+ * Returns the characters escaped by a backslash. A run of backslashes
+ * escapes the character after it if the run has odd length; carry holds a
+ * run continuing into the next block.
+ */
+static uint64_t jsonl_escaped(uint64_t backslash, uint64_t *carry)
+{
+	const uint64_t even = 0x5555555555555555ull;
+	uint64_t follows, oddStarts, evenStarts;
+
+	backslash &= ~*carry;
+	follows = backslash << 1 | *carry;
+	oddStarts = backslash & ~even & ~follows;
+	*carry = __builtin_add_overflow(oddStarts, backslash, &evenStarts);
+
+	return (even ^ (evenStarts << 1)) & follows;
+}
+
+/*
+ * Returns a mask with every bit set that has an odd number of bits set at or
+ * below it, which turns quote positions into string ranges.
+ */
+static uint64_t jsonl_prefixXor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+static int jsonl_isBlank(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+/*
+ * Returns 1 if the text between two tokens is whitespace only.
+ */
+static int jsonl_blank(const char *p, const char *end)
+{
+	for (; p < end; ++p)
+	{
+		if (!jsonl_isBlank(*p))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Checks a number or literal between two tokens and trims it.
+ * Returns 0 if valid, -1 if not.
+ */
+static int jsonl_scalar(const char **start, const char **stop, char *type)
+{
+	const char *p = *start;
+	const char *end = *stop;
+
+	while (p < end && jsonl_isBlank(*p))
+	{
+		++p;
+	}
+
+	while (end > p && jsonl_isBlank(end[-1]))
+	{
+		--end;
+	}
+
+	*start = p;
+	*stop = end;
+
+	switch (end - p)
+	{
+	case 4:
+		if (memcmp(p, "true", 4) == 0)
+		{
+			*type = JSONL_BOOL;
+			return 0;
+		}
+		else if (memcmp(p, "null", 4) == 0)
+		{
+			*type = JSONL_NULL;
+			return 0;
+		}
+		break;
+	case 5:
+		if (memcmp(p, "false", 5) == 0)
+		{
+			*type = JSONL_BOOL;
+			return 0;
+		}
+		break;
+	}
+
+	/* -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+	if (p < end && *p == '-')
+	{
+		++p;
+	}
+
+	if (p == end || *p < '0' || *p > '9')
+	{
+		return -1;
+	}
+
+	if (*p++ != '0')
+	{
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			++p;
+		}
+	}
+
+	if (p < end && *p == '.')
+	{
+		if (++p == end || *p < '0' || *p > '9')
+		{
+			return -1;
+		}
+
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			++p;
+		}
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		if (++p < end && (*p == '+' || *p == '-'))
+		{
+			++p;
+		}
+
+		if (p == end || *p < '0' || *p > '9')
+		{
+			return -1;
+		}
+
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			++p;
+		}
+	}
+
+	*type = JSONL_NUMBER;
+	return p == end ? 0 : -1;
+}
+
+static int jsonl_isHex(char ch)
+{
+	return (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f') ||
+		(ch >= 'A' && ch <= 'F');
+}
+
+/*
+ * Checks the escape sequences of a string.
+ * Returns 0 if valid, -1 if not.
+ */
+static int jsonl_escapes(const char *p, const char *end)
+{
+	while ((p = memchr(p, '\\', (size_t)(end - p))) != NULL)
+	{
+		if (++p == end)
+		{
+			return -1;
+		}
+
+		switch (*p)
+		{
+		case '"':
+		case '\\':
+		case '/':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			++p;
+			break;
+		case 'u':
+			if (end - p < 5 || !jsonl_isHex(p[1]) || !jsonl_isHex(p[2]) ||
+				!jsonl_isHex(p[3]) || !jsonl_isHex(p[4]))
+			{
+				return -1;
+			}
+
+			p += 5;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Checks for well-formed UTF-8 without overlong forms and surrogates.
+ * Returns 0 if valid, -1 if not.
+ */
+static int jsonl_utf8(const unsigned char *s, uint32_t len)
+{
+	uint32_t i = 0;
+
+	while (i < len)
+	{
+		unsigned char c = s[i];
+		unsigned char lo = 0x80, hi = 0xBF;
+		uint32_t n, k;
+
+		if (c < 0x80)
+		{
+			++i;
+			continue;
+		}
+
+		if (c >= 0xC2 && c <= 0xDF)
+		{
+			n = 1;
+		}
+		else if (c >= 0xE0 && c <= 0xEF)
+		{
+			n = 2;
+			lo = c == 0xE0 ? 0xA0 : 0x80;
+			hi = c == 0xED ? 0x9F : 0xBF;
+		}
+		else if (c >= 0xF0 && c <= 0xF4)
+		{
+			n = 3;
+			lo = c == 0xF0 ? 0x90 : 0x80;
+			hi = c == 0xF4 ? 0x8F : 0xBF;
+		}
+		else
+		{
+			return -1;
+		}
+
+		if (len - i <= n || s[i + 1] < lo || s[i + 1] > hi)
+		{
+			return -1;
+		}
+
+		for (k = 2; k <= n; ++k)
+		{
+			if ((s[i + k] & 0xC0) != 0x80)
+			{
+				return -1;
+			}
+		}
+
+		i += n + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the configured field a key names, -1 if none.
+ */
+static int jsonl_match(const struct jsonl *j, const char *key, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < j->count; ++i)
+	{
+		if (j->nameLens[i] == len && memcmp(j->names[i], key, len) == 0)
+		{
+			return (int)i;
+		}
+	}
+
+	return -1;
+}
+
+static void jsonl_setField(struct jsonl *j, int field, const char *value,
+	const char *end, char type)
+{
+	j->fields[field].value = value;
+	j->fields[field].len = (uint32_t)(end - value);
+	j->fields[field].type = type;
+}
+
+/*
+ * Second stage: checks the grammar by walking the structural index. Text
+ * between two indexed characters is either whitespace or a scalar.
+ * Returns 0 if valid, -1 if not.
+ */
+static int jsonl_validate(struct jsonl *j, const char *line, uint32_t len,
+	uint32_t n, int escapes)
+{
+	const uint32_t *idx = j->index;
+	char stack[JSONL_DEPTH_MAX];
+	uint32_t depth = 0, pos = 0, k, nestedStart = 0;
+	int state = ST_VALUE, empty = 0, field = -1, nested = -1;
+
+	for (k = 0; k < n; ++k)
+	{
+		uint32_t t = idx[k];
+		char ch = line[t];
+
+		if (state == ST_VALUE && ch != '{' && ch != '[' && ch != '"' &&
+			!(ch == ']' && empty && jsonl_blank(line + pos, line + t)))
+		{
+			/* A number or literal ends at this character */
+			const char *start = line + pos;
+			const char *stop = line + t;
+			char type;
+
+			if (jsonl_scalar(&start, &stop, &type) != 0)
+			{
+				return -1;
+			}
+
+			if (depth == 1 && field >= 0)
+			{
+				jsonl_setField(j, field, start, stop, type);
+			}
+
+			state = ST_NEXT;
+			empty = 0;
+		}
+		else if (!jsonl_blank(line + pos, line + t))
+		{
+			return -1;
+		}
+
+		switch (ch)
+		{
+		case '"':
+		{
+			/* Everything up to the closing quote was masked out */
+			uint32_t end = idx[++k];
+
+			if (escapes && jsonl_escapes(line + t + 1, line + end) != 0)
+			{
+				return -1;
+			}
+
+			if (state == ST_KEY)
+			{
+				field = (depth == 1 && stack[0] == '{') ?
+					jsonl_match(j, line + t + 1, end - t - 1) : -1;
+				state = ST_COLON;
+			}
+			else if (state == ST_VALUE)
+			{
+				if (depth == 1 && field >= 0)
+				{
+					jsonl_setField(j, field, line + t + 1, line + end,
+						JSONL_STRING);
+				}
+
+				state = ST_NEXT;
+			}
+			else
+			{
+				return -1;
+			}
+
+			pos = end + 1;
+			empty = 0;
+			continue;
+		}
+		case '{':
+		case '[':
+			if (state != ST_VALUE || depth == JSONL_DEPTH_MAX)
+			{
+				return -1;
+			}
+
+			if (depth == 1 && field >= 0)
+			{
+				nested = field;
+				nestedStart = t;
+			}
+
+			stack[depth++] = ch;
+			state = ch == '{' ? ST_KEY : ST_VALUE;
+			empty = 1;
+			break;
+		case '}':
+		case ']':
+			if (depth == 0 || stack[depth - 1] != (ch == '}' ? '{' : '[') ||
+				(state != ST_NEXT && !empty))
+			{
+				return -1;
+			}
+
+			if (--depth == 1 && nested >= 0)
+			{
+				jsonl_setField(j, nested, line + nestedStart, line + t + 1,
+					ch == '}' ? JSONL_OBJECT : JSONL_ARRAY);
+				nested = -1;
+			}
+
+			state = ST_NEXT;
+			empty = 0;
+			break;
+		case ':':
+			if (state != ST_COLON)
+			{
+				return -1;
+			}
+
+			state = ST_VALUE;
+			empty = 0;
+			break;
+		default:
+			if (state != ST_NEXT || depth == 0)
+			{
+				return -1;
+			}
+
+			state = stack[depth - 1] == '{' ? ST_KEY : ST_VALUE;
+			empty = 0;
+			break;
+		}
+
+		pos = t + 1;
+	}
+
+	if (depth != 0)
+	{
+		return -1;
+	}
+
+	/* The whole line is a single number or literal */
+	if (state == ST_VALUE)
+	{
+		const char *start = line;
+		const char *stop = line + len;
+		char type;
+
+		return jsonl_scalar(&start, &stop, &type);
+	}
+
+	return state == ST_NEXT && jsonl_blank(line + pos, line + len) ? 0 : -1;
+}
+
+int jsonl_parse(struct jsonl *j, const char *line, uint32_t len)
+{
+	uint64_t carry = 0, inPrev = 0, ctrl = 0, high = 0, backslash = 0;
+	uint32_t i, n = 0;
+	char tail[64];
+
+	/* First stage */
+	for (i = 0; i < len; i += 64)
+	{
+		const char *p = line + i;
+		struct jsonl_masks m;
+		uint64_t quote, in, structural;
+
+		if (len - i >= 64)
+		{
+			jsonl_classify(p, &m);
+		}
+		else if (len >= 64)
+		{
+			/*
+			 * Classify the last 64 bytes of the line and drop the part seen
+			 * already, copying the tail would stall store forwarding.
+			 */
+			int shift = 64 - (int)(len - i);
+
+			jsonl_classify(line + len - 64, &m);
+			m.quote >>= shift;
+			m.backslash >>= shift;
+			m.op >>= shift;
+			m.ctrl >>= shift;
+			m.high >>= shift;
+		}
+		else
+		{
+			/* Pad a short line with whitespace */
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, p, len - i);
+			jsonl_classify(tail, &m);
+		}
+
+		quote = m.quote & ~jsonl_escaped(m.backslash, &carry);
+		in = jsonl_prefixXor(quote) ^ inPrev;
+		inPrev = (uint64_t)((int64_t)in >> 63);
+		ctrl |= m.ctrl & in;
+		high |= m.high;
+		backslash |= m.backslash;
+
+		/* Quotes delimit strings, the rest only counts outside of them */
+		structural = (m.op & ~in) | quote;
+		while (structural != 0)
+		{
+			j->index[n++] = i + (uint32_t)__builtin_ctzll(structural);
+			structural &= structural - 1;
+		}
+	}
+
+	memset(j->fields, 0, sizeof(j->fields));
+
+	/* Unterminated string or raw control characters in a string */
+	if (inPrev != 0 || ctrl != 0)
+	{
+		j->badSyntax++;
+		return -1;
+	}
+
+	if (high != 0 && jsonl_utf8((const unsigned char *)line, len) != 0)
+	{
+		j->badUtf8++;
+		return -1;
+	}
+
+	if (jsonl_validate(j, line, len, n, backslash != 0) != 0)
+	{
+		j->badSyntax++;
+		return -1;
+	}
+
+	j->records++;
+	return 0;
+}
+
+/*
+ * Appends to a client's partial line.
+ * Returns 0 on success, -1 if the line is too long or out of memory.
+ */
+static int jsonl_append(struct jsonl_conn *c, const char *data, size_t len)
+{
+	if (c->len + len > JSONL_LINE_MAX)
+	{
+		return -1;
+	}
+
+	if (c->len + len > c->cap)
+	{
+		uint32_t cap = c->cap > 0 ? c->cap : 256;
+		char *line;
+
+		while (cap < c->len + len)
+		{
+			cap *= 2;
+		}
+
+		line = realloc(c->line, cap);
+		if (line == NULL)
+		{
+			return -1;
+		}
+
+		c->line = line;
+		c->cap = cap;
+	}
+
+	memcpy(c->line + c->len, data, len);
+	c->len += (uint32_t)len;
+	return 0;
+}
+
+int jsonl_next(struct jsonl *j, struct jsonl_conn *c, const char **data,
+	size_t *len, struct jsonl_record *rec)
+{
+	while (*len > 0)
+	{
+		const char *p = *data;
+		const char *nl = memchr(p, '\n', *len);
+		size_t n = nl != NULL ? (size_t)(nl - p) : *len;
+		const char *line;
+		size_t lineLen;
+
+		*data += nl != NULL ? n + 1 : n;
+		*len -= nl != NULL ? n + 1 : n;
+
+		if (c->len == 0 && !c->skipping && nl != NULL)
+		{
+			/* Complete lines are validated in the receive buffer */
+			line = p;
+			lineLen = n;
+		}
+		else
+		{
+			if (!c->skipping && jsonl_append(c, p, n) != 0)
+			{
+				c->skipping = 1;
+				c->len = 0;
+			}
+
+			if (nl == NULL)
+			{
+				return 0;
+			}
+
+			if (c->skipping)
+			{
+				c->skipping = 0;
+				j->lines++;
+				j->tooLong++;
+				continue;
+			}
+
+			line = c->line;
+			lineLen = c->len;
+			c->len = 0;
+		}
+
+		if (lineLen > 0 && line[lineLen - 1] == '\r')
+		{
+			lineLen--;
+		}
+
+		if (lineLen == 0)
+		{
+			continue;
+		}
+
+		j->lines++;
+
+		if (lineLen > JSONL_LINE_MAX)
+		{
+			j->tooLong++;
+			continue;
+		}
+
+		if (jsonl_parse(j, line, (uint32_t)lineLen) == 0)
+		{
+			rec->line = line;
+			rec->len = (uint32_t)lineLen;
+			rec->fields = j->fields;
+			rec->names = j->names;
+			rec->count = j->count;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void jsonl_connFree(struct jsonl_conn *c)
+{
+	free(c->line);
+	c->line = NULL;
+	c->len = 0;
+	c->cap = 0;
+}
+
+size_t jsonl_memSize(void)
+{
+	return (JSONL_LINE_MAX + 1) * sizeof(uint32_t);
+}
+
+int jsonl_init(struct jsonl *j, const char *fields)
+{
+	char *name, *save = NULL;
+
+	memset(j, 0, sizeof(struct jsonl));
+
+	j->spec = strdup(fields);
+	j->index = malloc(jsonl_memSize());
+	if (j->spec == NULL || j->index == NULL)
+	{
+		fprintf(stderr, "Failed to allocate JSON validator.\n");
+		goto on_error;
+	}
+
+	for (name = strtok_r(j->spec, ",", &save); name != NULL;
+		name = strtok_r(NULL, ",", &save))
+	{
+		if (j->count == JSONL_FIELDS_MAX)
+		{
+			fprintf(stderr, "At most %d JSON fields can be extracted.\n",
+				JSONL_FIELDS_MAX);
+			goto on_error;
+		}
+
+		j->names[j->count] = name;
+		j->nameLens[j->count] = (uint32_t)strlen(name);
+		j->count++;
+	}
+
+	return 0;
+
+on_error:
+	jsonl_free(j);
+	return -1;
+}
+
+void jsonl_free(struct jsonl *j)
+{
+	free(j->spec);
+	free(j->index);
+	j->spec = NULL;
+	j->index = NULL;
+	j->count = 0;
+}
+
+void jsonl_writeStats(const struct jsonl *j, FILE *fp)
+{
+	fprintf(fp, "json_lines %llu\n", (unsigned long long)j->lines);
+	fprintf(fp, "json_records %llu\n", (unsigned long long)j->records);
+	fprintf(fp, "json_invalid_syntax %llu\n",
+		(unsigned long long)j->badSyntax);
+	fprintf(fp, "json_invalid_utf8 %llu\n", (unsigned long long)j->badUtf8);
+	fprintf(fp, "json_too_long %llu\n", (unsigned long long)j->tooLong);
+}
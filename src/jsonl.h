@@ -0,0 +1,132 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef JSONL_H
+#define JSONL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Most top-level fields extracted per record */
+#define JSONL_FIELDS_MAX 16
+/* Longest line accepted */
+#define JSONL_LINE_MAX (256 * 1024)
+/* Deepest nesting of objects and arrays */
+#define JSONL_DEPTH_MAX 64
+
+/* Field value types, 0 if the field is missing */
+#define JSONL_STRING 's'
+#define JSONL_NUMBER 'n'
+#define JSONL_BOOL 'b'
+#define JSONL_NULL 'z'
+#define JSONL_OBJECT 'o'
+#define JSONL_ARRAY 'a'
+
+/*
+ * Span of an extracted field in the line. Strings exclude the quotes and
+ * are not unescaped, objects and arrays include their brackets.
+ */
+struct jsonl_field
+{
+	const char *value;
+	uint32_t len;
+	char type;
+};
+
+/* A validated line, valid until the next call to jsonl_next */
+struct jsonl_record
+{
+	const char *line;
+	uint32_t len;
+	/* Configured fields in the order given to jsonl_init */
+	const struct jsonl_field *fields;
+	const char *const *names;
+	uint32_t count;
+};
+
+/* Per-client framing state */
+struct jsonl_conn
+{
+	/* Partial line, grown on demand */
+	char *line;
+	uint32_t len;
+	uint32_t cap;
+	/* Discarding the rest of an overlong line */
+	int skipping;
+};
+
+/*
+ * Line validator. Validation runs in two stages like simdjson: a SIMD pass
+ * classifies 64 bytes at a time and produces an index of the structural
+ * characters outside of strings, then a scalar pass walks only the index to
+ * check the grammar and pick up the configured top-level fields.
+ */
+struct jsonl
+{
+	/* Copy of the field list, split in place */
+	char *spec;
+	const char *names[JSONL_FIELDS_MAX];
+	uint32_t nameLens[JSONL_FIELDS_MAX];
+	uint32_t count;
+	struct jsonl_field fields[JSONL_FIELDS_MAX];
+	/* Positions of structural characters of the current line */
+	uint32_t *index;
+	/* Statistics */
+	uint64_t lines;
+	uint64_t records;
+	uint64_t badSyntax;
+	uint64_t badUtf8;
+	uint64_t tooLong;
+};
+
+/*
+ * Prepares validation and extraction of the comma separated top-level
+ * fields, which may be empty.
+ * Returns 0 on success, -1 on failure.
+ */
+int jsonl_init(struct jsonl *j, const char *fields);
+
+void jsonl_free(struct jsonl *j);
+
+/*
+ * Bytes held by the validator.
+ */
+size_t jsonl_memSize(void);
+
+/*
+ * Validates a single line and extracts the fields.
+ * Returns 0 if valid, -1 if not.
+ */
+int jsonl_parse(struct jsonl *j, const char *line, uint32_t len);
+
+/*
+ * Consumes a client's stream up to the next valid record. Invalid lines are
+ * counted and skipped, partial lines are kept in c.
+ * Returns 1 if rec was filled in, 0 once data is used up.
+ */
+int jsonl_next(struct jsonl *j, struct jsonl_conn *c, const char **data,
+	size_t *len, struct jsonl_record *rec);
+
+void jsonl_connFree(struct jsonl_conn *c);
+
+/*
+ * Writes validation statistics.
+ */
+void jsonl_writeStats(const struct jsonl *j, FILE *fp);
+
+#endif
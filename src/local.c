@@ -0,0 +1,238 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "local.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+/*
+ * Sets up the ports of one side of a ring pair.
+ */
+static void local_initPorts(struct local_conn *lc, uint32_t rx, uint32_t tx)
+{
+	shm_portInit(&lc->rx, shm_ringAt(lc->base, rx));
+	shm_portInit(&lc->tx, shm_ringAt(lc->base, tx));
+
+	/* Leave room for the message header and wrap padding */
+	lc->chunkMax = (uint32_t)((lc->tx.mask + 1) / 4);
+	lc->wakeups = 0;
+}
+
+/*
+ * Signals an eventfd.
+ */
+static void local_signalFd(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+	{
+		perror("write");
+	}
+}
+
+/*
+ * Wakes the peer.
+ */
+static void local_signal(struct local_conn *lc)
+{
+	lc->wakeups++;
+	local_signalFd(lc->peerFd);
+}
+
+int local_setup(int sd, struct local_conn *lc, size_t ringSize)
+{
+	struct local_hello hello;
+	int fds[3];
+	int memFd;
+
+	memset(lc, 0, sizeof(struct local_conn));
+	lc->selfFd = -1;
+	lc->peerFd = -1;
+
+	memFd = shm_create(ringSize, 2, &lc->base, &lc->mapLen);
+	if (memFd == -1)
+	{
+		return -1;
+	}
+
+	lc->selfFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	lc->peerFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (lc->selfFd == -1 || lc->peerFd == -1)
+	{
+		perror("eventfd");
+		goto on_error;
+	}
+
+	/*
+	 * The server has nothing to do until the first request, so the client
+	 * must signal it right from the start.
+	 */
+	local_initPorts(lc, LOCAL_REQUESTS, LOCAL_REPLIES);
+	atomic_store(&lc->rx.ring->consumerWaiting, 1);
+
+	hello.magic = LOCAL_MAGIC;
+	hello.version = LOCAL_VERSION;
+	fds[0] = memFd;
+	fds[1] = lc->selfFd;
+	fds[2] = lc->peerFd;
+
+	if (shm_sendFds(sd, fds, 3, &hello, sizeof(hello)) != 0)
+	{
+		goto on_error;
+	}
+
+	/* The mapping keeps the memory alive */
+	close(memFd);
+	return 0;
+
+on_error:
+	close(memFd);
+	local_close(lc);
+	return -1;
+}
+
+int local_connect(const char *path, struct local_conn *lc)
+{
+	struct local_hello hello;
+	int fds[3];
+	int sd, n, i;
+
+	memset(lc, 0, sizeof(struct local_conn));
+	lc->selfFd = -1;
+	lc->peerFd = -1;
+
+	sd = shm_connect(path);
+	if (sd == -1)
+	{
+		return -1;
+	}
+
+	n = shm_recvFds(sd, fds, 3, &hello, sizeof(hello));
+	if (n != 3 || hello.magic != LOCAL_MAGIC ||
+		hello.version != LOCAL_VERSION)
+	{
+		fprintf(stderr, "Server did not hand over a ring pair.\n");
+		goto on_error;
+	}
+
+	if (shm_attach(fds[0], &lc->base, &lc->mapLen) != 0)
+	{
+		goto on_error;
+	}
+
+	close(fds[0]);
+
+	/* The server's eventfd comes first */
+	lc->peerFd = fds[1];
+	lc->selfFd = fds[2];
+	local_initPorts(lc, LOCAL_REPLIES, LOCAL_REQUESTS);
+	return sd;
+
+on_error:
+	for (i = 0; i < n; ++i)
+	{
+		close(fds[i]);
+	}
+
+	close(sd);
+	return -1;
+}
+
+void local_close(struct local_conn *lc)
+{
+	if (lc->base != NULL)
+	{
+		munmap(lc->base, lc->mapLen);
+		lc->base = NULL;
+	}
+
+	if (lc->selfFd > -1)
+	{
+		close(lc->selfFd);
+		lc->selfFd = -1;
+	}
+
+	if (lc->peerFd > -1)
+	{
+		close(lc->peerFd);
+		lc->peerFd = -1;
+	}
+}
+
+size_t local_send(struct local_conn *lc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t sent = 0;
+
+	while (sent < len)
+	{
+		uint32_t chunk = len - sent < lc->chunkMax ?
+			(uint32_t)(len - sent) : lc->chunkMax;
+		void *m = shm_reserve(&lc->tx, chunk);
+
+		if (m == NULL)
+		{
+			break;
+		}
+
+		memcpy(m, p + sent, chunk);
+		shm_commit(&lc->tx, LOCAL_DATA, chunk);
+		sent += chunk;
+	}
+
+	if (sent > 0 && shm_publish(&lc->tx))
+	{
+		local_signal(lc);
+	}
+
+	return sent;
+}
+
+void local_release(struct local_conn *lc)
+{
+	if (shm_release(&lc->rx))
+	{
+		local_signal(lc);
+	}
+}
+
+int local_waitSpace(struct local_conn *lc, size_t len)
+{
+	return shm_producerSleep(&lc->tx,
+		len < lc->chunkMax ? (uint32_t)len : lc->chunkMax);
+}
+
+void local_wakeSelf(struct local_conn *lc)
+{
+	local_signalFd(lc->selfFd);
+}
+
+void local_clearWakeup(struct local_conn *lc)
+{
+	uint64_t count;
+
+	/* EAGAIN only means that no wakeup was pending */
+	if (read(lc->selfFd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+	{
+		perror("read");
+	}
+}
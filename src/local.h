@@ -0,0 +1,113 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include "shmring.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOCAL_MAGIC 0x4c41434cu
+#define LOCAL_VERSION 1u
+
+/* Ring message carrying application bytes */
+#define LOCAL_DATA SHM_USER
+
+/* Rings of a connection, requests are written by the client */
+#define LOCAL_REQUESTS 0
+#define LOCAL_REPLIES 1
+
+/*
+ * Sent with the memfd and the eventfds of the server and the client when a
+ * client connects to the local socket.
+ */
+struct local_hello
+{
+	uint32_t magic;
+	uint32_t version;
+};
+
+/*
+ * Shared memory connection of a same-host client, as seen by either side.
+ * Each side sleeps on its own eventfd and is signalled by the peer only
+ * while it has announced that it sleeps.
+ */
+struct local_conn
+{
+	void *base;
+	size_t mapLen;
+	/* Eventfd this side sleeps on, and the one of the peer */
+	int selfFd;
+	int peerFd;
+	/* Ring read by this side and ring written by it */
+	struct shm_port rx;
+	struct shm_port tx;
+	/* Largest message payload */
+	uint32_t chunkMax;
+	/* Signals sent to the peer */
+	uint64_t wakeups;
+};
+
+/*
+ * Hands a new ring pair of ringSize bytes per direction to the client
+ * connected on sd.
+ * Returns 0 on success, -1 on failure.
+ */
+int local_setup(int sd, struct local_conn *lc, size_t ringSize);
+
+/*
+ * Connects to a server's local socket and attaches to the ring pair.
+ * Returns the socket, -1 on failure.
+ */
+int local_connect(const char *path, struct local_conn *lc);
+
+/*
+ * Unmaps the rings and closes the eventfds.
+ */
+void local_close(struct local_conn *lc);
+
+/*
+ * Writes as much of data as fits into the outgoing ring, publishes it and
+ * wakes the peer if it sleeps.
+ * Returns the number of bytes written.
+ */
+size_t local_send(struct local_conn *lc, const void *data, size_t len);
+
+/*
+ * Returns consumed messages to the peer and wakes it if it waits for space.
+ */
+void local_release(struct local_conn *lc);
+
+/*
+ * Announces that this side waits for space to send len more bytes.
+ * Returns 1 if it may wait for its eventfd, 0 if space is available.
+ */
+int local_waitSpace(struct local_conn *lc, size_t len);
+
+/*
+ * Signals this side's own eventfd, e.g. to continue in the next loop
+ * iteration.
+ */
+void local_wakeSelf(struct local_conn *lc);
+
+/*
+ * Clears pending wakeups of this side's eventfd.
+ */
+void local_clearWakeup(struct local_conn *lc);
+
+#endif
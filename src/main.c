@@ -16,6 +16,8 @@ along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "server.h"
+#include "jsonl.h"
+#include "rpc.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,20 +30,70 @@ struct config
 {
 	int port;
 	int eventQueue;
+	struct srv_options srv;
 };
 
 /* Server instance */
 static struct server *g_srv = NULL;
 
+/* RPC methods of the example application */
+enum
+{
+	METHOD_ECHO = 1,
+	METHOD_HOLD = 2,
+	METHOD_RELEASE = 3
+};
+
+#define HELD_MAX 64
+
+/* Calls of METHOD_HOLD waiting for METHOD_RELEASE */
+static uint64_t g_held[HELD_MAX];
+static int g_heldCount = 0;
+
 /*
  * Shows usage information.
  */
 static void printUsage(void)
 {
 	puts("Options:");
+	puts(" -a n  Enable the admin interface on 127.0.0.1 port n.");
+	puts(" -b n  Set the sink write batch size to n KB.");
+	puts(" -B    Reset handler scratch memory once per loop iteration.");
+	puts(" -c n  Set maximum number of clients.");
+	puts(" -C f  Record client traffic to capture file f.");
+	puts(" -d f  Persist length-prefixed messages in directory f (sink mode).");
+	puts(" -D n  Like -R, and warn about queueing delays above n us.");
 	puts(" -e n  Set event queue size.");
+	puts(" -g n  Commit sink batches at least every n ms.");
 	puts(" -h    Displays this help text.");
+	puts(" -H    Count cycles, instructions and misses per event type.");
+	puts(" -i    Send RPC responses in request order.");
+	puts(" -j f  Validate JSON lines and extract the comma separated fields f.");
+	puts(" -k f  Use file f as preset dictionary for compressed connections.");
+	puts(" -l f  Accept same-host clients using shared memory on Unix socket f.");
+	puts(" -L    Lock preallocated tables into memory.");
+	puts(" -m n  Pause reads from the biggest consumers above n MB.");
+	puts(" -M n  Disconnect the biggest consumers above n MB.");
+	puts(" -o f  Hand received data to a consumer on Unix socket f.");
+	puts(" -O    Write sink segments with O_DIRECT.");
 	puts(" -p n  Set port number.");
+	puts(" -P    Record payloads in the capture file, not only sizes.");
+	puts(" -q    Handle binary RPC requests.");
+	puts(" -Q n  Fail RPC requests without a response after at most n ms.");
+	puts(" -r n  Set the output ring size to n MB.");
+	puts(" -R    Measure how long received data waits in socket queues.");
+	puts(" -s f  Aggregate statsd metrics from TCP and UDP, write them to f.");
+	puts(" -f n  Write statsd aggregates every n seconds.");
+	puts(" -S    Track top source IPs and distinct IPs per minute.");
+	puts(" -t n  Disconnect clients idle for n seconds.");
+	puts(" -T n  Sample TCP_INFO of up to n clients per loop iteration.");
+	puts(" -w n  Report loop iterations taking longer than n ms.");
+	puts(" -W    Speak WebSocket to TCP and TLS clients.");
+	puts(" -x n  Accept TLS clients on port n.");
+	puts(" -X f  Load the TLS certificate chain and key from PEM file f.");
+	puts(" -y    Let clients multiplex streams over one connection.");
+	puts(" -z    Let clients negotiate compressed connections.");
+	puts(" -Z n  Set the capture file size to n MB.");
 }
 
 /*
@@ -57,11 +109,40 @@ static int parseArgs(int argc, char *argv[], struct config *cfg)
 	/* Set defaults */
 	cfg->port = 5033;
 	cfg->eventQueue = 64;
+	srv_defaultOptions(&cfg->srv);
 
-	while ((ch = getopt(argc, argv, "e:hp:")) != -1)
+	while ((ch = getopt(argc, argv, "a:b:Bc:C:d:D:e:f:g:hHij:k:l:Lm:M:o:Op:PqQ:r:Rs:St:T:w:Wx:X:yzZ:")) != -1)
 	{
 		switch (ch)
 		{
+		case 'a':
+			cfg->srv.adminPort = atoi(optarg);
+			break;
+		case 'b':
+			cfg->srv.sinkBatchKB = atoi(optarg);
+			break;
+		case 'B':
+			cfg->srv.scratchBatch = 1;
+			break;
+		case 'c':
+			cfg->srv.maxClients = atoi(optarg);
+			if (cfg->srv.maxClients < 1)
+			{
+				fprintf(stderr, "Invalid maximum number of clients: %d\n",
+					cfg->srv.maxClients);
+				return -1;
+			}
+			break;
+		case 'C':
+			cfg->srv.capturePath = optarg;
+			break;
+		case 'd':
+			cfg->srv.sinkDir = optarg;
+			break;
+		case 'D':
+			cfg->srv.rxTimestamps = 1;
+			cfg->srv.rxDelayAlertUs = atoi(optarg);
+			break;
 		case 'e':
 			cfg->eventQueue = atoi(optarg);
 			if (cfg->eventQueue < 1)
@@ -71,12 +152,102 @@ static int parseArgs(int argc, char *argv[], struct config *cfg)
 				return -1;
 			}
 			break;
+		case 'f':
+			cfg->srv.statsdFlushSec = atoi(optarg);
+			break;
+		case 'g':
+			cfg->srv.sinkCommitMs = atoi(optarg);
+			break;
 		case 'h':
 			printUsage();
 			return -1;
+		case 'H':
+			cfg->srv.hwCounters = 1;
+			break;
+		case 'i':
+			cfg->srv.rpcOrdered = 1;
+			break;
+		case 'j':
+			cfg->srv.jsonFields = optarg;
+			break;
+		case 'k':
+			cfg->srv.compressDict = optarg;
+			break;
+		case 'l':
+			cfg->srv.localPath = optarg;
+			break;
+		case 'L':
+			cfg->srv.lockMemory = 1;
+			break;
+		case 'm':
+			cfg->srv.memSoftLimit = atoi(optarg);
+			break;
+		case 'M':
+			cfg->srv.memHardLimit = atoi(optarg);
+			break;
+		case 'o':
+			cfg->srv.outputPath = optarg;
+			break;
+		case 'O':
+			cfg->srv.sinkDirect = 1;
+			break;
 		case 'p':
 			cfg->port = atoi(optarg);
 			break;
+		case 'P':
+			cfg->srv.capturePayload = 1;
+			break;
+		case 'q':
+			cfg->srv.rpc = 1;
+			break;
+		case 'Q':
+			cfg->srv.rpcTimeoutMs = atoi(optarg);
+			break;
+		case 'r':
+			cfg->srv.outputRingMB = atoi(optarg);
+			break;
+		case 'R':
+			cfg->srv.rxTimestamps = 1;
+			break;
+		case 's':
+			cfg->srv.statsdPath = optarg;
+			break;
+		case 'S':
+			cfg->srv.sketches = 1;
+			break;
+		case 't':
+			cfg->srv.idleTimeout = atoi(optarg);
+			if (cfg->srv.idleTimeout < 0)
+			{
+				fprintf(stderr, "Invalid idle timeout: %d\n",
+					cfg->srv.idleTimeout);
+				return -1;
+			}
+			break;
+		case 'T':
+			cfg->srv.tcpSweep = atoi(optarg);
+			break;
+		case 'w':
+			cfg->srv.watchdogMs = atoi(optarg);
+			break;
+		case 'W':
+			cfg->srv.websocket = 1;
+			break;
+		case 'x':
+			cfg->srv.tlsPort = atoi(optarg);
+			break;
+		case 'X':
+			cfg->srv.tlsCert = optarg;
+			break;
+		case 'y':
+			cfg->srv.mux = 1;
+			break;
+		case 'z':
+			cfg->srv.compress = 1;
+			break;
+		case 'Z':
+			cfg->srv.captureSize = atoi(optarg);
+			break;
 		default:
 			return -1;
 		}
@@ -107,15 +278,91 @@ static void onDisconnectHandler(const char *ip)
 
 static void onReceiveHandler(const char *ip, const char *buffer, int len)
 {
+	char *dump;
 	int i;
+
 	printf("Received %d bytes from %s:\n", len, ip);
 
-	for (i = 0; i < len - 1; ++i)
+	/* Empty WebSocket, stream and ring messages have nothing to dump */
+	if (len <= 0)
+	{
+		return;
+	}
+
+	/* Format the whole dump first, 5 characters per byte */
+	dump = srv_scratchAlloc(g_srv, (size_t)len * 5 + 1);
+	if (dump == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < len; ++i)
 	{
-		printf("0x%02X ", buffer[i]);
+		sprintf(dump + i * 5, "0x%02X ", (unsigned char)buffer[i]);
 	}
 
-	printf("0x%02X\n", buffer[len - 1]);
+	dump[len * 5 - 1] = '\0';
+	puts(dump);
+}
+
+static void onRecordHandler(const char *ip, const struct jsonl_record *rec)
+{
+	uint32_t i;
+
+	printf("Record from %s:", ip);
+
+	for (i = 0; i < rec->count; ++i)
+	{
+		const struct jsonl_field *f = &rec->fields[i];
+
+		if (f->type != 0)
+		{
+			printf(" %s=%.*s", rec->names[i], (int)f->len, f->value);
+		}
+	}
+
+	putchar('\n');
+}
+
+/*
+ * Answers with the request body.
+ */
+static void onEchoMethod(void *arg, const struct rpc_call *call)
+{
+	(void)arg;
+	srv_rpcRespond(g_srv, call->token, RPC_OK, call->body, call->len);
+}
+
+/*
+ * Answers only once METHOD_RELEASE is called, or fails on the deadline.
+ */
+static void onHoldMethod(void *arg, const struct rpc_call *call)
+{
+	(void)arg;
+
+	if (g_heldCount == HELD_MAX)
+	{
+		srv_rpcRespond(g_srv, call->token, RPC_BUSY, NULL, 0);
+		return;
+	}
+
+	g_held[g_heldCount++] = call->token;
+}
+
+/*
+ * Answers the held calls, newest first, then the release call itself.
+ */
+static void onReleaseMethod(void *arg, const struct rpc_call *call)
+{
+	(void)arg;
+
+	while (g_heldCount > 0)
+	{
+		/* Calls that expired meanwhile are skipped */
+		srv_rpcRespond(g_srv, g_held[--g_heldCount], RPC_OK, "released", 8);
+	}
+
+	srv_rpcRespond(g_srv, call->token, RPC_OK, NULL, 0);
 }
 
 /* Custom signal handler */
@@ -130,6 +377,18 @@ static void onSignal(int s)
 			srv_stop(g_srv);
 		}
 		break;
+	case SIGUSR1:
+		if (g_srv != NULL)
+		{
+			srv_requestStats(g_srv);
+		}
+		break;
+	case SIGUSR2:
+		if (g_srv != NULL)
+		{
+			srv_requestProfile(g_srv, 0);
+		}
+		break;
 	}
 }
 
@@ -161,6 +420,16 @@ static int registerSignalHandler(void)
 		goto on_error;
 	}
 
+	if (sigaction(SIGUSR1, &sa, NULL) != 0)
+	{
+		goto on_error;
+	}
+
+	if (sigaction(SIGUSR2, &sa, NULL) != 0)
+	{
+		goto on_error;
+	}
+
 	return 0;
 
 on_error:
@@ -192,6 +461,7 @@ int main(int argc, char *argv[])
 	handler.on_connect = onConnectHandler;
 	handler.on_disconnect = onDisconnectHandler;
 	handler.on_receive = onReceiveHandler;
+	handler.on_record = onRecordHandler;
 
 	g_srv = srv_create(&handler);
 	if (g_srv == NULL)
@@ -199,6 +469,22 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	if (srv_setOptions(g_srv, &cfg.srv) != 0)
+	{
+		srv_free(g_srv);
+		return 1;
+	}
+
+	if (cfg.srv.rpc && (srv_rpcRegister(g_srv, METHOD_ECHO, onEchoMethod,
+		NULL) != 0 || srv_rpcRegister(g_srv, METHOD_HOLD, onHoldMethod,
+		NULL) != 0 || srv_rpcRegister(g_srv, METHOD_RELEASE,
+		onReleaseMethod, NULL) != 0))
+	{
+		fprintf(stderr, "Failed to register RPC methods.\n");
+		srv_free(g_srv);
+		return 1;
+	}
+
 	rc = srv_run(g_srv, cfg.port, cfg.eventQueue);
 	srv_free(g_srv);
 
@@ -0,0 +1,39 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mem.h"
+
+const char *mem_categoryName(enum mem_category c)
+{
+	static const char *const names[MEM_CATEGORIES] =
+	{
+		"clients",
+		"output",
+		"scratch",
+		"handler",
+		"sink",
+		"statsd",
+		"compress"
+	};
+
+	if ((unsigned)c >= MEM_CATEGORIES)
+	{
+		return "unknown";
+	}
+
+	return names[c];
+}
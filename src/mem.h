@@ -0,0 +1,125 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+/* Memory accounting categories */
+enum mem_category
+{
+	/* Client table */
+	MEM_CLIENTS = 0,
+	/* Output buffer pool */
+	MEM_OUTPUT,
+	/* Handler scratch memory */
+	MEM_SCRATCH,
+	/* Memory reported by handlers */
+	MEM_HANDLER,
+	/* Ingest sink batches and partial messages */
+	MEM_SINK,
+	/* statsd aggregation maps */
+	MEM_STATSD,
+	/* Compression contexts */
+	MEM_COMPRESS,
+	MEM_CATEGORIES
+};
+
+/* Memory accountant */
+struct mem_account
+{
+	/* Bytes in use per category */
+	size_t used[MEM_CATEGORIES];
+	/* Sum over all categories */
+	size_t total;
+	/* Part of total preallocated on start, not subject to limits */
+	size_t fixed;
+	/* Highest total seen */
+	size_t peak;
+};
+
+/*
+ * Charges bytes to a category.
+ */
+static inline void mem_charge(struct mem_account *m, enum mem_category c,
+	size_t bytes)
+{
+	m->used[c] += bytes;
+	m->total += bytes;
+
+	if (m->total > m->peak)
+	{
+		m->peak = m->total;
+	}
+}
+
+/*
+ * Releases bytes previously charged to a category.
+ */
+static inline void mem_release(struct mem_account *m, enum mem_category c,
+	size_t bytes)
+{
+	if (bytes > m->used[c])
+	{
+		bytes = m->used[c];
+	}
+
+	m->used[c] -= bytes;
+	m->total -= bytes;
+}
+
+/*
+ * Charges preallocated memory to a category. It shows up in the statistics
+ * but doesn't count against the memory limits.
+ */
+static inline void mem_reserve(struct mem_account *m, enum mem_category c,
+	size_t bytes)
+{
+	mem_charge(m, c, bytes);
+	m->fixed += bytes;
+}
+
+/*
+ * Releases memory previously reserved in a category.
+ */
+static inline void mem_unreserve(struct mem_account *m, enum mem_category c,
+	size_t bytes)
+{
+	if (bytes > m->fixed)
+	{
+		bytes = m->fixed;
+	}
+
+	m->fixed -= bytes;
+	mem_release(m, c, bytes);
+}
+
+/*
+ * Returns the memory that varies with load, i.e. not preallocated.
+ */
+static inline size_t mem_variable(const struct mem_account *m)
+{
+	return m->total - m->fixed;
+}
+
+/*
+ * Returns the name of a category as used in statistics.
+ */
+const char *mem_categoryName(enum mem_category c);
+
+#endif
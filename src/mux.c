@@ -0,0 +1,350 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mux.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Entries of a stream table when the first stream is opened */
+#define MUX_TABLE_MIN 8
+
+static uint16_t mux_get16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t mux_get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		(uint32_t)p[2] << 8 | p[3];
+}
+
+void mux_encode(uint8_t *out, const struct mux_frame *f)
+{
+	out[0] = (uint8_t)(f->stream >> 24);
+	out[1] = (uint8_t)(f->stream >> 16);
+	out[2] = (uint8_t)(f->stream >> 8);
+	out[3] = (uint8_t)f->stream;
+	out[4] = f->type;
+	out[5] = 0;
+	out[6] = (uint8_t)(f->len >> 8);
+	out[7] = (uint8_t)f->len;
+}
+
+int mux_next(struct mux_conn *c, const char **data, size_t *len,
+	struct mux_frame *f, const char **payload)
+{
+	size_t n;
+
+	if (c->delivered)
+	{
+		c->bufLen = 0;
+		c->delivered = 0;
+	}
+
+	while (*len > 0)
+	{
+		if (c->hdrLen < MUX_HEADER_SIZE)
+		{
+			n = MUX_HEADER_SIZE - c->hdrLen;
+			if (n > *len)
+			{
+				n = *len;
+			}
+
+			memcpy(c->hdr + c->hdrLen, *data, n);
+			c->hdrLen += (uint8_t)n;
+			*data += n;
+			*len -= n;
+
+			if (c->hdrLen < MUX_HEADER_SIZE)
+			{
+				return 0;
+			}
+
+			if (c->hdr[5] != 0)
+			{
+				return -1;
+			}
+
+			c->cur.stream = mux_get32(c->hdr);
+			c->cur.type = c->hdr[4];
+			c->cur.len = mux_get16(c->hdr + 6);
+
+			/* A payload received in one piece is used in place */
+			if (*len >= c->cur.len)
+			{
+				*f = c->cur;
+				*payload = *data;
+				*data += c->cur.len;
+				*len -= c->cur.len;
+				c->hdrLen = 0;
+				return 1;
+			}
+
+			/* Frames are small, so the buffer is kept at full size */
+			if (c->buf == NULL)
+			{
+				c->buf = malloc(MUX_FRAME_MAX);
+				if (c->buf == NULL)
+				{
+					return -1;
+				}
+
+				c->memSize += MUX_FRAME_MAX;
+			}
+		}
+
+		n = c->cur.len - c->bufLen;
+		if (n > *len)
+		{
+			n = *len;
+		}
+
+		memcpy(c->buf + c->bufLen, *data, n);
+		c->bufLen += (uint32_t)n;
+		*data += n;
+		*len -= n;
+
+		if (c->bufLen < c->cur.len)
+		{
+			return 0;
+		}
+
+		*f = c->cur;
+		*payload = c->buf;
+		c->hdrLen = 0;
+		c->delivered = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+static uint32_t mux_hash(uint32_t id)
+{
+	return id * 0x9e3779b1u;
+}
+
+struct mux_stream *mux_find(const struct mux_conn *c, uint32_t id)
+{
+	uint32_t i;
+
+	if (c->streams == NULL || id == 0)
+	{
+		return NULL;
+	}
+
+	for (i = mux_hash(id) & c->mask; c->streams[i].id != 0;
+		i = (i + 1) & c->mask)
+	{
+		if (c->streams[i].id == id)
+		{
+			return &c->streams[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the free entry id would go to.
+ */
+static struct mux_stream *mux_slot(struct mux_stream *streams, uint32_t mask,
+	uint32_t id)
+{
+	uint32_t i = mux_hash(id) & mask;
+
+	while (streams[i].id != 0)
+	{
+		i = (i + 1) & mask;
+	}
+
+	return &streams[i];
+}
+
+/*
+ * Doubles the stream table, or creates it.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int mux_grow(struct mux_conn *c)
+{
+	uint32_t size = c->streams == NULL ? MUX_TABLE_MIN : (c->mask + 1) * 2;
+	struct mux_stream *streams;
+	uint32_t i;
+
+	streams = calloc(size, sizeof(struct mux_stream));
+	if (streams == NULL)
+	{
+		return -1;
+	}
+
+	if (c->streams != NULL)
+	{
+		for (i = 0; i <= c->mask; ++i)
+		{
+			if (c->streams[i].id != 0)
+			{
+				*mux_slot(streams, size - 1, c->streams[i].id) = c->streams[i];
+			}
+		}
+
+		free(c->streams);
+		c->memSize -= (size_t)(c->mask + 1) * sizeof(struct mux_stream);
+	}
+
+	c->streams = streams;
+	c->mask = size - 1;
+	c->memSize += (size_t)size * sizeof(struct mux_stream);
+	return 0;
+}
+
+struct mux_stream *mux_open(struct mux_conn *c, uint32_t id)
+{
+	struct mux_stream *s;
+
+	/* Keep the load at one half at most */
+	if ((c->streams == NULL || (c->count + 1) * 2 > c->mask + 1) &&
+		mux_grow(c) != 0)
+	{
+		return NULL;
+	}
+
+	s = mux_slot(c->streams, c->mask, id);
+	memset(s, 0, sizeof(*s));
+	s->id = id;
+	s->recvWindow = MUX_WINDOW;
+	s->sendWindow = MUX_WINDOW;
+	c->count++;
+	return s;
+}
+
+void mux_close(struct mux_conn *c, uint32_t id)
+{
+	struct mux_stream *s = mux_find(c, id);
+	uint32_t i;
+	uint32_t j;
+
+	if (s == NULL)
+	{
+		return;
+	}
+
+	free(s->pend);
+	c->memSize -= s->pendCap;
+	c->count--;
+
+	/* Shift later entries of the probe sequence into the gap */
+	i = (uint32_t)(s - c->streams);
+	j = i;
+
+	for (;;)
+	{
+		uint32_t home;
+
+		j = (j + 1) & c->mask;
+		if (c->streams[j].id == 0)
+		{
+			break;
+		}
+
+		home = mux_hash(c->streams[j].id) & c->mask;
+		if (((j - home) & c->mask) >= ((j - i) & c->mask))
+		{
+			c->streams[i] = c->streams[j];
+			i = j;
+		}
+	}
+
+	c->streams[i].id = 0;
+	c->streams[i].pend = NULL;
+}
+
+int mux_hold(struct mux_conn *c, struct mux_stream *s, const char *data,
+	size_t len)
+{
+	if (s->pendLen + len > s->pendCap)
+	{
+		uint32_t cap = s->pendCap > 0 ? s->pendCap : 1024;
+		char *pend;
+
+		while (cap < s->pendLen + len)
+		{
+			cap *= 2;
+		}
+
+		pend = realloc(s->pend, cap);
+		if (pend == NULL)
+		{
+			return -1;
+		}
+
+		c->memSize += cap - s->pendCap;
+		s->pend = pend;
+		s->pendCap = cap;
+	}
+
+	memcpy(s->pend + s->pendLen, data, len);
+	s->pendLen += (uint32_t)len;
+	return 0;
+}
+
+void mux_drain(struct mux_conn *c, struct mux_stream *s, uint32_t len)
+{
+	s->pendLen -= len;
+
+	if (s->pendLen > 0)
+	{
+		memmove(s->pend, s->pend + len, s->pendLen);
+		return;
+	}
+
+	/* Most streams never stall, don't keep buffers around for them */
+	free(s->pend);
+	c->memSize -= s->pendCap;
+	s->pend = NULL;
+	s->pendCap = 0;
+}
+
+void mux_connFree(struct mux_conn *c)
+{
+	uint32_t i;
+
+	if (c->streams != NULL)
+	{
+		for (i = 0; i <= c->mask; ++i)
+		{
+			free(c->streams[i].pend);
+		}
+
+		free(c->streams);
+	}
+
+	free(c->buf);
+	memset(c, 0, sizeof(*c));
+}
+
+void mux_writeStats(const struct mux_stats *s, FILE *fp)
+{
+	fprintf(fp, "mux_streams_active %llu\n", (unsigned long long)s->active);
+	fprintf(fp, "mux_streams_opened %llu\n", (unsigned long long)s->opened);
+	fprintf(fp, "mux_streams_refused %llu\n", (unsigned long long)s->refused);
+	fprintf(fp, "mux_frames_in %llu\n", (unsigned long long)s->framesIn);
+	fprintf(fp, "mux_frames_out %llu\n", (unsigned long long)s->framesOut);
+	fprintf(fp, "mux_window_stalls %llu\n", (unsigned long long)s->stalls);
+	fprintf(fp, "mux_protocol_errors %llu\n", (unsigned long long)s->errors);
+}
@@ -0,0 +1,148 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MUX_H
+#define MUX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Frame header, big endian: stream id (32 bits), type (8 bits), flags
+ * (8 bits, zero) and payload length (16 bits).
+ */
+#define MUX_HEADER_SIZE 8
+#define MUX_FRAME_MAX 65535
+/* Window of both directions when a stream is opened */
+#define MUX_WINDOW 65536
+/* Largest window a peer may grant */
+#define MUX_WINDOW_MAX 0x7fffffffu
+/* Open streams per connection */
+#define MUX_STREAMS_MAX 65536
+
+/* Frame types */
+#define MUX_DATA 0
+#define MUX_OPEN 1
+#define MUX_CLOSE 2
+/* Grants the 32 bit payload as additional window */
+#define MUX_WINDOW_UPDATE 3
+
+struct mux_frame
+{
+	uint32_t stream;
+	uint8_t type;
+	uint16_t len;
+};
+
+struct mux_stream
+{
+	/* 0 marks a free entry */
+	uint32_t id;
+	/* Bytes the client may still send */
+	uint32_t recvWindow;
+	/* Bytes the server may still send */
+	uint32_t sendWindow;
+	/* Received bytes passed on since the last window update */
+	uint32_t credit;
+	/* Output held back by the send window */
+	char *pend;
+	uint32_t pendLen;
+	uint32_t pendCap;
+	/* The client closed the stream, it ends once pend is sent */
+	uint8_t closing;
+};
+
+struct mux_conn
+{
+	uint8_t hdr[MUX_HEADER_SIZE];
+	uint8_t hdrLen;
+	/* The payload in buf has been handed out */
+	uint8_t delivered;
+	struct mux_frame cur;
+	/* Partial payload */
+	char *buf;
+	uint32_t bufLen;
+	/* Open addressing table of streams, mask + 1 entries */
+	struct mux_stream *streams;
+	uint32_t mask;
+	uint32_t count;
+	/* Heap memory held by the connection */
+	size_t memSize;
+};
+
+struct mux_stats
+{
+	uint64_t active;
+	uint64_t opened;
+	uint64_t refused;
+	uint64_t framesIn;
+	uint64_t framesOut;
+	/* Writes held back because the client's window was used up */
+	uint64_t stalls;
+	uint64_t errors;
+};
+
+void mux_encode(uint8_t *out, const struct mux_frame *f);
+
+/*
+ * Collects frames from data. A payload received in one piece is handed out
+ * in place, others are reassembled. Consumed bytes are taken off data.
+ * Returns 1 with the next frame in f and payload, 0 once data is used up
+ * or -1 on a malformed header or if out of memory.
+ */
+int mux_next(struct mux_conn *c, const char **data, size_t *len,
+	struct mux_frame *f, const char **payload);
+
+/*
+ * Returns the open stream with the given id, NULL if there is none. The
+ * pointer is valid until the next mux_open or mux_close.
+ */
+struct mux_stream *mux_find(const struct mux_conn *c, uint32_t id);
+
+/*
+ * Adds a stream with the initial windows.
+ * Returns the stream, NULL if out of memory.
+ */
+struct mux_stream *mux_open(struct mux_conn *c, uint32_t id);
+
+/*
+ * Removes a stream and frees its held output.
+ */
+void mux_close(struct mux_conn *c, uint32_t id);
+
+/*
+ * Appends to the output held back on a stream.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mux_hold(struct mux_conn *c, struct mux_stream *s, const char *data,
+	size_t len);
+
+/*
+ * Removes len sent bytes from the front of the held output, freeing it
+ * once empty.
+ */
+void mux_drain(struct mux_conn *c, struct mux_stream *s, uint32_t len);
+
+void mux_connFree(struct mux_conn *c);
+
+/*
+ * Writes stream multiplexing statistics.
+ */
+void mux_writeStats(const struct mux_stats *s, FILE *fp);
+
+#endif
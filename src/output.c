@@ -0,0 +1,224 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "output.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+int output_open(struct output *o, const char *path, size_t ringSize)
+{
+	memset(o, 0, sizeof(struct output));
+	o->consumerSd = -1;
+	o->memFd = -1;
+	o->wakeFd = -1;
+
+	o->listenSd = shm_listen(path);
+	if (o->listenSd == -1)
+	{
+		return -1;
+	}
+
+	o->path = path;
+	o->ringSize = ringSize;
+	return 0;
+}
+
+void output_close(struct output *o)
+{
+	if (o->path == NULL)
+	{
+		return;
+	}
+
+	output_detach(o);
+	close(o->listenSd);
+	o->listenSd = -1;
+	unlink(o->path);
+}
+
+int output_accept(struct output *o)
+{
+	struct output_hello hello;
+	int fds[2];
+	int sd;
+
+	sd = accept4(o->listenSd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sd == -1)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			perror("accept4");
+		}
+
+		return -1;
+	}
+
+	if (o->consumerSd > -1)
+	{
+		fprintf(stderr, "Output consumer already attached.\n");
+		close(sd);
+		return -1;
+	}
+
+	/* Every consumer starts with a fresh ring */
+	o->memFd = shm_create(o->ringSize, 1, &o->base, &o->mapLen);
+	if (o->memFd == -1)
+	{
+		close(sd);
+		return -1;
+	}
+
+	o->wakeFd = eventfd(0, EFD_CLOEXEC);
+	if (o->wakeFd == -1)
+	{
+		perror("eventfd");
+		goto on_error;
+	}
+
+	hello.magic = OUTPUT_MAGIC;
+	hello.version = OUTPUT_VERSION;
+	fds[0] = o->memFd;
+	fds[1] = o->wakeFd;
+
+	if (shm_sendFds(sd, fds, 2, &hello, sizeof(hello)) != 0)
+	{
+		goto on_error;
+	}
+
+	shm_portInit(&o->port, shm_ringAt(o->base, 0));
+	o->consumerSd = sd;
+	o->pending = 0;
+	o->consumers++;
+	return sd;
+
+on_error:
+	close(sd);
+	output_detach(o);
+	return -1;
+}
+
+void output_detach(struct output *o)
+{
+	if (o->consumerSd > -1)
+	{
+		close(o->consumerSd);
+		o->consumerSd = -1;
+	}
+
+	if (o->base != NULL)
+	{
+		munmap(o->base, o->mapLen);
+		o->base = NULL;
+	}
+
+	if (o->memFd > -1)
+	{
+		close(o->memFd);
+		o->memFd = -1;
+	}
+
+	if (o->wakeFd > -1)
+	{
+		close(o->wakeFd);
+		o->wakeFd = -1;
+	}
+
+	o->pending = 0;
+}
+
+void output_write(struct output *o, uint64_t conn, const void *data,
+	size_t len)
+{
+	/* Keep messages well below the ring size so they never wait for
+	 * a consumer that reads one message at a time */
+	size_t chunkMax = o->ringSize / 4 - sizeof(struct output_msg);
+	const uint8_t *p = data;
+
+	if (o->consumerSd == -1)
+	{
+		return;
+	}
+
+	while (len > 0)
+	{
+		size_t chunk = len < chunkMax ? len : chunkMax;
+		uint32_t size = (uint32_t)(sizeof(struct output_msg) + chunk);
+		struct output_msg *m = shm_reserve(&o->port, size);
+
+		/* Let the consumer catch up with what is committed so far */
+		if (m == NULL && o->pending > 0)
+		{
+			output_flush(o);
+			m = shm_reserve(&o->port, size);
+		}
+
+		if (m == NULL)
+		{
+			o->dropped += len;
+			return;
+		}
+
+		m->conn = conn;
+		memcpy(m + 1, p, chunk);
+		shm_commit(&o->port, OUTPUT_DATA, size);
+
+		o->pending++;
+		o->messages++;
+		o->bytes += chunk;
+		p += chunk;
+		len -= chunk;
+	}
+}
+
+void output_flush(struct output *o)
+{
+	uint64_t one = 1;
+
+	if (o->pending == 0)
+	{
+		return;
+	}
+
+	o->pending = 0;
+	o->publishes++;
+
+	if (shm_publish(&o->port))
+	{
+		o->wakeups++;
+		if (write(o->wakeFd, &one, sizeof(one)) != sizeof(one))
+		{
+			perror("write");
+		}
+	}
+}
+
+void output_writeStats(const struct output *o, FILE *fp)
+{
+	fprintf(fp, "output_consumer %d\n", o->consumerSd > -1);
+	fprintf(fp, "output_consumers %llu\n", (unsigned long long)o->consumers);
+	fprintf(fp, "output_messages %llu\n", (unsigned long long)o->messages);
+	fprintf(fp, "output_bytes %llu\n", (unsigned long long)o->bytes);
+	fprintf(fp, "output_dropped_bytes %llu\n", (unsigned long long)o->dropped);
+	fprintf(fp, "output_publishes %llu\n", (unsigned long long)o->publishes);
+	fprintf(fp, "output_wakeups %llu\n", (unsigned long long)o->wakeups);
+}
@@ -0,0 +1,117 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "shmring.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define OUTPUT_MAGIC 0x5455504fu
+#define OUTPUT_VERSION 1u
+
+/* Ring message carrying received bytes, payload is a struct output_msg */
+#define OUTPUT_DATA SHM_USER
+
+/*
+ * Sent with the ring memfd and the consumer's eventfd when a consumer
+ * connects.
+ */
+struct output_hello
+{
+	uint32_t magic;
+	uint32_t version;
+};
+
+/* Payload of OUTPUT_DATA, followed by the received bytes */
+struct output_msg
+{
+	/* Client id */
+	uint64_t conn;
+};
+
+/*
+ * Output stage handing received data to one local consumer through a
+ * shared memory ring. The consumer connects to a Unix socket and receives
+ * the ring memfd and an eventfd to sleep on.
+ */
+struct output
+{
+	/* Unix socket consumers connect to, path is NULL if disabled */
+	int listenSd;
+	const char *path;
+	/* Connected consumer, -1 if none */
+	int consumerSd;
+	int memFd;
+	int wakeFd;
+	void *base;
+	size_t mapLen;
+	size_t ringSize;
+	struct shm_port port;
+	/* Messages committed since the last publish */
+	uint32_t pending;
+	/* Statistics */
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t dropped;
+	uint64_t publishes;
+	uint64_t wakeups;
+	uint64_t consumers;
+};
+
+/*
+ * Listens for a consumer on the Unix socket path.
+ * Returns 0 on success, -1 on failure.
+ */
+int output_open(struct output *o, const char *path, size_t ringSize);
+
+/*
+ * Closes the consumer and the socket.
+ */
+void output_close(struct output *o);
+
+/*
+ * Accepts a consumer and hands it a new ring. Only one consumer is served,
+ * further ones are rejected.
+ * Returns the consumer socket, -1 if none was attached.
+ */
+int output_accept(struct output *o);
+
+/*
+ * Detaches the consumer, e.g. because it disconnected.
+ */
+void output_detach(struct output *o);
+
+/*
+ * Appends received bytes of a client. Data is dropped if the ring is full.
+ */
+void output_write(struct output *o, uint64_t conn, const void *data,
+	size_t len);
+
+/*
+ * Publishes appended messages and wakes the consumer if it sleeps.
+ */
+void output_flush(struct output *o);
+
+/*
+ * Writes output statistics.
+ */
+void output_writeStats(const struct output *o, FILE *fp);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pmu.h"
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Layout of a group read with PERF_FORMAT_GROUP */
+struct pmu_groupValues
+{
+	uint64_t nr;
+	uint64_t values[PMU_COUNTERS];
+};
+
+/*
+ * Open a hardware counter, disabled and optionally as part of a group.
+ * Returns the counter descriptor, -1 on failure.
+ */
+static int pmu_openMember(uint64_t config, int groupFd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.disabled = groupFd == -1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd,
+		PERF_FLAG_FD_CLOEXEC);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t pmu_rdpmc(uint32_t counter)
+{
+	uint32_t lo, hi;
+
+	__asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * Read a counter through its control page, see perf_event_open(2).
+ * Returns 0 on success, -1 if the counter is not currently scheduled.
+ */
+static int pmu_readPage(const struct perf_event_mmap_page *pc, uint64_t *v)
+{
+	uint32_t seq, idx;
+	uint64_t count;
+	int width;
+
+	do
+	{
+		seq = pc->lock;
+		__asm__ volatile("" ::: "memory");
+
+		idx = pc->index;
+		count = pc->offset;
+		if (!pc->cap_user_rdpmc || idx == 0)
+		{
+			return -1;
+		}
+
+		width = pc->pmc_width;
+		count += (int64_t)(pmu_rdpmc(idx - 1) << (64 - width)) >>
+			(64 - width);
+
+		__asm__ volatile("" ::: "memory");
+	}
+	while (pc->lock != seq);
+
+	*v = count;
+	return 0;
+}
+#else
+static int pmu_readPage(const struct perf_event_mmap_page *pc, uint64_t *v)
+{
+	(void)pc;
+	(void)v;
+
+	return -1;
+}
+#endif
+
+int pmu_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	/* Allowed without privileges up to perf_event_paranoid 2 */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+		PERF_FLAG_FD_CLOEXEC);
+}
+
+int pmu_openDtlbMisses(void)
+{
+	return pmu_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+}
+
+int pmu_read(int fd, uint64_t *value)
+{
+	if (fd < 0 || read(fd, value, sizeof(*value)) != sizeof(*value))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int pmu_groupOpen(struct pmu_group *g)
+{
+	static const uint64_t configs[PMU_COUNTERS] =
+	{
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+	long pageSize = sysconf(_SC_PAGESIZE);
+	int i;
+
+	memset(g, 0, sizeof(struct pmu_group));
+	for (i = 0; i < PMU_COUNTERS; ++i)
+	{
+		g->fd[i] = -1;
+	}
+
+	for (i = 0; i < PMU_COUNTERS; ++i)
+	{
+		g->fd[i] = pmu_openMember(configs[i], i == 0 ? -1 : g->fd[0]);
+		if (g->fd[i] == -1)
+		{
+			pmu_groupClose(g);
+			return -1;
+		}
+	}
+
+	/* rdpmc needs the control page of every counter */
+	g->rdpmc = 1;
+	for (i = 0; i < PMU_COUNTERS; ++i)
+	{
+		void *p = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, g->fd[i], 0);
+
+		if (p == MAP_FAILED)
+		{
+			g->rdpmc = 0;
+			continue;
+		}
+
+		g->page[i] = p;
+		if (!g->page[i]->cap_user_rdpmc)
+		{
+			g->rdpmc = 0;
+		}
+	}
+
+	g->open = 1;
+	ioctl(g->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	return 0;
+}
+
+void pmu_groupClose(struct pmu_group *g)
+{
+	long pageSize = sysconf(_SC_PAGESIZE);
+	int i;
+
+	for (i = PMU_COUNTERS - 1; i >= 0; --i)
+	{
+		if (g->page[i] != NULL)
+		{
+			munmap(g->page[i], pageSize);
+		}
+
+		if (g->fd[i] > -1)
+		{
+			close(g->fd[i]);
+		}
+
+		g->page[i] = NULL;
+		g->fd[i] = -1;
+	}
+
+	g->open = 0;
+	g->rdpmc = 0;
+}
+
+int pmu_groupRead(const struct pmu_group *g, uint64_t v[PMU_COUNTERS])
+{
+	struct pmu_groupValues gv;
+	int i;
+
+	if (g->rdpmc)
+	{
+		for (i = 0; i < PMU_COUNTERS; ++i)
+		{
+			if (pmu_readPage(g->page[i], &v[i]) != 0)
+			{
+				break;
+			}
+		}
+
+		if (i == PMU_COUNTERS)
+		{
+			return 0;
+		}
+	}
+
+	/* Counter not scheduled on a PMU right now or no rdpmc, ask the kernel */
+	if (read(g->fd[0], &gv, sizeof(gv)) != sizeof(gv))
+	{
+		return -1;
+	}
+
+	memcpy(v, gv.values, sizeof(gv.values));
+	return 0;
+}
+
+const char *pmu_counterName(enum pmu_counter c)
+{
+	static const char *const names[PMU_COUNTERS] =
+	{
+		"cycles",
+		"instructions",
+		"llc_misses",
+		"branch_misses"
+	};
+
+	if ((unsigned)c >= PMU_COUNTERS)
+	{
+		return "unknown";
+	}
+
+	return names[c];
+}
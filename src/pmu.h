@@ -0,0 +1,95 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PMU_H
+#define PMU_H
+
+#include <stdint.h>
+
+/* Counters of a pmu_group */
+enum pmu_counter
+{
+	PMU_CYCLES = 0,
+	PMU_INSTRUCTIONS,
+	PMU_LLC_MISSES,
+	PMU_BRANCH_MISSES,
+	PMU_COUNTERS
+};
+
+struct perf_event_mmap_page;
+
+/*
+ * Group of hardware counters of the calling thread. The counters are read
+ * in user space with rdpmc where the kernel allows it and with a single
+ * read() of the group otherwise.
+ */
+struct pmu_group
+{
+	int fd[PMU_COUNTERS];
+	/* Mapped control pages, used for rdpmc */
+	struct perf_event_mmap_page *page[PMU_COUNTERS];
+	/* Non-zero if all counters can be read with rdpmc */
+	int rdpmc;
+	/* Non-zero if the group is open */
+	int open;
+};
+
+/*
+ * Opens a user-space-only performance counter for the calling thread.
+ * The type and config are PERF_TYPE_* and PERF_COUNT_* values from
+ * linux/perf_event.h.
+ * Returns the counter descriptor, -1 on failure.
+ */
+int pmu_open(uint32_t type, uint64_t config);
+
+/*
+ * Opens a counter counting dTLB load misses of the calling thread.
+ * Returns the counter descriptor, -1 on failure.
+ */
+int pmu_openDtlbMisses(void);
+
+/*
+ * Reads the current value of a counter.
+ * Returns 0 on success, -1 on failure.
+ */
+int pmu_read(int fd, uint64_t *value);
+
+/*
+ * Opens the cycles, instructions, LLC miss and branch miss counters of the
+ * calling thread as one group.
+ * Returns 0 on success, -1 if the counters are not available.
+ */
+int pmu_groupOpen(struct pmu_group *g);
+
+/*
+ * Closes a counter group.
+ */
+void pmu_groupClose(struct pmu_group *g);
+
+/*
+ * Reads all counters of a group. Only the difference between two reads is
+ * meaningful.
+ * Returns 0 on success, -1 on failure, in which case v is undefined.
+ */
+int pmu_groupRead(const struct pmu_group *g, uint64_t v[PMU_COUNTERS]);
+
+/*
+ * Returns the statistics name of a counter.
+ */
+const char *pmu_counterName(enum pmu_counter c);
+
+#endif
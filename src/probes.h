@@ -0,0 +1,91 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints for bpftrace, perf and SystemTap. Each probe compiles
+ * to a single nop plus a note describing where its arguments live, so it is
+ * free until a tracer attaches. Requires <sys/sdt.h> (systemtap-sdt-dev);
+ * without it, or when built with SDT=0, the probes compile to nothing.
+ *
+ * Provider: epoll_server. Client ids are the ids used by the flight
+ * recorder (slot generation in the upper and slot in the lower 32 bits).
+ */
+
+#if !defined(SRV_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SRV_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef SRV_HAVE_SDT
+
+/* accept(fd, client) */
+#define PROBE_ACCEPT(fd, id) \
+	DTRACE_PROBE2(epoll_server, accept, fd, id)
+/* receive__entry(fd, client), fired before draining the socket */
+#define PROBE_RECEIVE_ENTRY(fd, id) \
+	DTRACE_PROBE2(epoll_server, receive__entry, fd, id)
+/* receive__return(fd, client, bytes), bytes read for this event */
+#define PROBE_RECEIVE_RETURN(fd, id, bytes) \
+	DTRACE_PROBE3(epoll_server, receive__return, fd, id, bytes)
+/* read(fd, client, bytes) */
+#define PROBE_READ(fd, id, bytes) \
+	DTRACE_PROBE3(epoll_server, read, fd, id, bytes)
+/* write(fd, client, bytes, queued), queued is the output left pending */
+#define PROBE_WRITE(fd, id, bytes, queued) \
+	DTRACE_PROBE4(epoll_server, write, fd, id, bytes, queued)
+/* close(fd, client, bytesIn, bytesOut) */
+#define PROBE_CLOSE(fd, id, in, out) \
+	DTRACE_PROBE4(epoll_server, close, fd, id, in, out)
+/* callback__entry(callback, client), see enum trace_callback */
+#define PROBE_CALLBACK_ENTRY(cb, id) \
+	DTRACE_PROBE2(epoll_server, callback__entry, cb, id)
+/* callback__return(callback, client, ticks), duration in TSC ticks */
+#define PROBE_CALLBACK_RETURN(cb, id, ticks) \
+	DTRACE_PROBE3(epoll_server, callback__return, cb, id, ticks)
+
+#else
+
+/* Arguments are referenced but never evaluated */
+#define PROBE_ARG(x) (void)sizeof(x)
+
+#define PROBE_ACCEPT(fd, id) \
+	do { PROBE_ARG(fd); PROBE_ARG(id); } while (0)
+#define PROBE_RECEIVE_ENTRY(fd, id) \
+	do { PROBE_ARG(fd); PROBE_ARG(id); } while (0)
+#define PROBE_RECEIVE_RETURN(fd, id, bytes) \
+	do { PROBE_ARG(fd); PROBE_ARG(id); PROBE_ARG(bytes); } while (0)
+#define PROBE_READ(fd, id, bytes) \
+	do { PROBE_ARG(fd); PROBE_ARG(id); PROBE_ARG(bytes); } while (0)
+#define PROBE_WRITE(fd, id, bytes, queued) \
+	do { PROBE_ARG(fd); PROBE_ARG(id); PROBE_ARG(bytes); \
+		PROBE_ARG(queued); } while (0)
+#define PROBE_CLOSE(fd, id, in, out) \
+	do { PROBE_ARG(fd); PROBE_ARG(id); PROBE_ARG(in); PROBE_ARG(out); } \
+	while (0)
+#define PROBE_CALLBACK_ENTRY(cb, id) \
+	do { PROBE_ARG(cb); PROBE_ARG(id); } while (0)
+#define PROBE_CALLBACK_RETURN(cb, id, ticks) \
+	do { PROBE_ARG(cb); PROBE_ARG(id); PROBE_ARG(ticks); } while (0)
+
+#endif
+
+#endif
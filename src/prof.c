@@ -0,0 +1,453 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "prof.h"
+#include "symtab.h"
+#include <assert.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+/* Data pages of the perf sample ring, must be a power of two */
+#define RING_PAGES 64
+/* Sample storage per second of profiling, in 64 bit words */
+#define WORDS_PER_SECOND (PROF_FREQUENCY * 16)
+/* Frames of the SIGPROF handler and the signal trampoline */
+#define SIGPROF_SKIP 2
+
+/* Profiler sampled by the SIGPROF handler */
+static struct prof *volatile g_sigprof = NULL;
+
+/*
+ * Append a sample record. Called from the loop thread or the SIGPROF
+ * handler, never both at the same time.
+ */
+static void prof_store(struct prof *p, const uint64_t *ips, size_t n)
+{
+	if (n == 0)
+	{
+		return;
+	}
+
+	if (n > PROF_MAX_DEPTH)
+	{
+		n = PROF_MAX_DEPTH;
+	}
+
+	if (p->used + n + 1 > p->capacity)
+	{
+		p->lost++;
+		return;
+	}
+
+	p->data[p->used] = n;
+	memcpy(&p->data[p->used + 1], ips, n * sizeof(uint64_t));
+	p->used += n + 1;
+	p->samples++;
+}
+
+static void prof_onSigprof(int s)
+{
+	struct prof *p = g_sigprof;
+	void *frames[PROF_MAX_DEPTH + SIGPROF_SKIP];
+	uint64_t ips[PROF_MAX_DEPTH + SIGPROF_SKIP];
+	int n, i;
+	int savedErrno = errno;
+
+	(void)s;
+
+	if (p == NULL)
+	{
+		return;
+	}
+
+	n = backtrace(frames, PROF_MAX_DEPTH + SIGPROF_SKIP);
+	for (i = SIGPROF_SKIP; i < n; ++i)
+	{
+		ips[i - SIGPROF_SKIP] = (uintptr_t)frames[i];
+	}
+
+	if (n > SIGPROF_SKIP)
+	{
+		prof_store(p, ips, n - SIGPROF_SKIP);
+	}
+
+	errno = savedErrno;
+}
+
+/*
+ * Start sampling with a perf_event software clock.
+ * Returns 0 on success, -1 on failure.
+ */
+static int prof_startPerf(struct prof *p)
+{
+	struct perf_event_attr attr;
+	long page = sysconf(_SC_PAGESIZE);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_CPU_CLOCK;
+	attr.freq = 1;
+	attr.sample_freq = PROF_FREQUENCY;
+	attr.sample_type = PERF_SAMPLE_CALLCHAIN;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.exclude_callchain_kernel = 1;
+	attr.disabled = 1;
+
+	p->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+		PERF_FLAG_FD_CLOEXEC);
+	if (p->fd == -1)
+	{
+		return -1;
+	}
+
+	p->ringSize = (RING_PAGES + 1) * page;
+	p->ring = mmap(NULL, p->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+		p->fd, 0);
+	if (p->ring == MAP_FAILED)
+	{
+		p->ring = NULL;
+		close(p->fd);
+		p->fd = -1;
+		return -1;
+	}
+
+	ioctl(p->fd, PERF_EVENT_IOC_ENABLE, 0);
+	p->backend = PROF_PERF;
+
+	return 0;
+}
+
+/*
+ * Start sampling with the profiling interval timer.
+ * Returns 0 on success, -1 on failure.
+ */
+static int prof_startSigprof(struct prof *p)
+{
+	struct sigaction sa;
+	struct itimerval it;
+	void *warmup[1];
+
+	/* The first backtrace call loads libgcc, do that outside the handler */
+	backtrace(warmup, 1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = prof_onSigprof;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	g_sigprof = p;
+	if (sigaction(SIGPROF, &sa, NULL) != 0)
+	{
+		perror("sigaction");
+		g_sigprof = NULL;
+		return -1;
+	}
+
+	memset(&it, 0, sizeof(it));
+	it.it_interval.tv_usec = 1000000 / PROF_FREQUENCY;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL) != 0)
+	{
+		perror("setitimer");
+		g_sigprof = NULL;
+		return -1;
+	}
+
+	p->backend = PROF_SIGPROF;
+
+	return 0;
+}
+
+int prof_start(struct prof *p, int seconds)
+{
+	assert(p != NULL);
+
+	if (seconds < 1)
+	{
+		seconds = 1;
+	}
+
+	memset(p, 0, sizeof(struct prof));
+	p->fd = -1;
+
+	p->capacity = (size_t)seconds * WORDS_PER_SECOND * 4;
+	p->data = malloc(p->capacity * sizeof(uint64_t));
+	if (p->data == NULL)
+	{
+		fprintf(stderr, "Failed to start profiler: out of memory.\n");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &p->deadline);
+	p->deadline.tv_sec += seconds;
+
+	if (prof_startPerf(p) != 0 && prof_startSigprof(p) != 0)
+	{
+		free(p->data);
+		p->data = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void prof_poll(struct prof *p)
+{
+	struct perf_event_mmap_page *meta;
+	const char *base;
+	size_t mask;
+	uint64_t head, tail;
+
+	assert(p != NULL);
+
+	if (p->backend != PROF_PERF)
+	{
+		return;
+	}
+
+	meta = (struct perf_event_mmap_page*)p->ring;
+	base = p->ring + meta->data_offset;
+	mask = meta->data_size - 1;
+
+	head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+	tail = meta->data_tail;
+
+	while (tail < head)
+	{
+		struct perf_event_header hdr;
+		uint64_t rec[PROF_MAX_DEPTH * 2 + 8];
+		size_t i, len, off;
+
+		/* Records may wrap around the end of the ring, copy them out */
+		for (i = 0; i < sizeof(hdr); ++i)
+		{
+			((char*)&hdr)[i] = base[(tail + i) & mask];
+		}
+
+		if (hdr.size == 0)
+		{
+			break;
+		}
+
+		len = hdr.size < sizeof(rec) ? hdr.size : sizeof(rec);
+		for (i = 0; i < len; ++i)
+		{
+			((char*)rec)[i] = base[(tail + i) & mask];
+		}
+
+		if (hdr.type == PERF_RECORD_SAMPLE && len >= 2 * sizeof(uint64_t))
+		{
+			uint64_t ips[PROF_MAX_DEPTH];
+			uint64_t nr = rec[1];
+			size_t n = 0;
+
+			/* Skip context markers such as PERF_CONTEXT_USER */
+			for (off = 0; off < nr && 2 + off < len / sizeof(uint64_t) &&
+				n < PROF_MAX_DEPTH; ++off)
+			{
+				if (rec[2 + off] < (uint64_t)PERF_CONTEXT_MAX)
+				{
+					ips[n++] = rec[2 + off];
+				}
+			}
+
+			prof_store(p, ips, n);
+		}
+		else if (hdr.type == PERF_RECORD_LOST)
+		{
+			p->lost += rec[2];
+		}
+
+		tail += hdr.size;
+	}
+
+	__atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+int prof_remainingMs(const struct prof *p)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (p->deadline.tv_sec - now.tv_sec) * 1000 +
+		(p->deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? (int)ms : 0;
+}
+
+/*
+ * Stop the sampling backend.
+ */
+static void prof_stop(struct prof *p)
+{
+	struct itimerval it;
+
+	if (p->backend == PROF_PERF)
+	{
+		ioctl(p->fd, PERF_EVENT_IOC_DISABLE, 0);
+		prof_poll(p);
+		munmap(p->ring, p->ringSize);
+		close(p->fd);
+		p->ring = NULL;
+		p->fd = -1;
+	}
+	else if (p->backend == PROF_SIGPROF)
+	{
+		memset(&it, 0, sizeof(it));
+		setitimer(ITIMER_PROF, &it, NULL);
+		signal(SIGPROF, SIG_IGN);
+		g_sigprof = NULL;
+	}
+
+	p->backend = PROF_NONE;
+}
+
+static int prof_compareLines(const void *a, const void *b)
+{
+	return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+/*
+ * Build the folded line of a sample record, root first.
+ * Returns a heap allocated string or NULL on failure.
+ */
+static char *prof_fold(const struct symtab *t, const uint64_t *ips, size_t n)
+{
+	char name[256];
+	char *line = NULL;
+	size_t len = 0, i;
+
+	for (i = n; i > 0; --i)
+	{
+		size_t l;
+		char *tmp;
+
+		/* Return addresses point behind the call, step back into it */
+		symtab_resolve(t, ips[i - 1] - (i > 1 ? 1 : 0), name, sizeof(name));
+		l = strlen(name);
+
+		tmp = realloc(line, len + l + 2);
+		if (tmp == NULL)
+		{
+			free(line);
+			return NULL;
+		}
+
+		line = tmp;
+		if (len > 0)
+		{
+			line[len++] = ';';
+		}
+
+		memcpy(line + len, name, l + 1);
+		len += l;
+	}
+
+	return line;
+}
+
+int prof_finish(struct prof *p, const char *path)
+{
+	struct symtab t;
+	char **lines = NULL;
+	size_t count = 0, off, i;
+	FILE *fp;
+	int rc = 0;
+
+	assert(p != NULL);
+
+	prof_stop(p);
+
+	if (symtab_load(&t) != 0)
+	{
+		memset(&t, 0, sizeof(t));
+	}
+
+	lines = calloc(p->samples > 0 ? p->samples : 1, sizeof(char*));
+	if (lines == NULL)
+	{
+		rc = -1;
+		goto on_exit;
+	}
+
+	for (off = 0; off < p->used && count < p->samples;
+		off += p->data[off] + 1)
+	{
+		lines[count] = prof_fold(&t, &p->data[off + 1], p->data[off]);
+		if (lines[count] != NULL)
+		{
+			count++;
+		}
+	}
+
+	/* Identical stacks end up adjacent and are merged into one line */
+	qsort(lines, count, sizeof(char*), prof_compareLines);
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+	{
+		perror("fopen");
+		rc = -1;
+		goto on_exit;
+	}
+
+	for (i = 0; i < count; )
+	{
+		size_t j = i + 1;
+
+		while (j < count && strcmp(lines[i], lines[j]) == 0)
+		{
+			++j;
+		}
+
+		fprintf(fp, "%s %zu\n", lines[i], j - i);
+		i = j;
+	}
+
+	if (fclose(fp) != 0)
+	{
+		perror("fclose");
+		rc = -1;
+	}
+
+on_exit:
+	for (i = 0; i < count; ++i)
+	{
+		free(lines[i]);
+	}
+
+	free(lines);
+	symtab_free(&t);
+	free(p->data);
+	p->data = NULL;
+	p->used = 0;
+
+	return rc;
+}
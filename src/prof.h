@@ -0,0 +1,96 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Sampling frequency in Hz */
+#define PROF_FREQUENCY 99
+/* Deepest stack recorded per sample */
+#define PROF_MAX_DEPTH 64
+
+/* Sampling backend */
+enum prof_backend
+{
+	PROF_NONE = 0,
+	/* perf_event_open software CPU clock of the loop thread */
+	PROF_PERF,
+	/* setitimer(ITIMER_PROF) with backtrace() from SIGPROF */
+	PROF_SIGPROF
+};
+
+/*
+ * On-demand stack sampling profiler. Samples are stored as a flat array of
+ * records, each a frame count followed by the frames, leaf first.
+ */
+struct prof
+{
+	enum prof_backend backend;
+	/* perf_event descriptor and its mapped sample ring */
+	int fd;
+	char *ring;
+	size_t ringSize;
+	/* Sample records */
+	uint64_t *data;
+	size_t used;
+	size_t capacity;
+	/* Samples taken and dropped */
+	uint64_t samples;
+	uint64_t lost;
+	/* CLOCK_MONOTONIC time at which sampling stops */
+	struct timespec deadline;
+};
+
+/*
+ * Starts sampling the calling thread for the given number of seconds. Uses
+ * perf_event_open if permitted and SIGPROF otherwise.
+ * Returns 0 on success, -1 on failure.
+ */
+int prof_start(struct prof *p, int seconds);
+
+/*
+ * Moves pending samples out of the kernel ring. Call regularly while the
+ * profiler is running.
+ */
+void prof_poll(struct prof *p);
+
+/*
+ * Returns the milliseconds left until the profiler should be finished,
+ * 0 if it is due.
+ */
+int prof_remainingMs(const struct prof *p);
+
+/*
+ * Stops sampling and writes the collected stacks in folded format (one
+ * "root;...;leaf count" line per distinct stack) to the given file.
+ * Returns 0 on success, -1 on failure.
+ */
+int prof_finish(struct prof *p, const char *path);
+
+/*
+ * Returns non-zero while the profiler is sampling.
+ */
+static inline int prof_active(const struct prof *p)
+{
+	return p->backend != PROF_NONE;
+}
+
+#endif
@@ -0,0 +1,141 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "reorder.h"
+#include "hist.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Slots of a ring when the first sequence number is handed out */
+#define REORDER_MIN 8
+
+/*
+ * Doubles the ring, or creates it.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int reorder_grow(struct reorder *r)
+{
+	uint32_t size = r->slots == NULL ? REORDER_MIN : (r->mask + 1) * 2;
+	struct reorder_slot *slots;
+	uint32_t seq;
+
+	slots = calloc(size, sizeof(struct reorder_slot));
+	if (slots == NULL)
+	{
+		return -1;
+	}
+
+	/* Slots move to their index in the larger ring */
+	for (seq = r->head; seq != r->tail; ++seq)
+	{
+		slots[seq & (size - 1)] = r->slots[seq & r->mask];
+	}
+
+	if (r->slots != NULL)
+	{
+		free(r->slots);
+		r->memSize -= (size_t)(r->mask + 1) * sizeof(struct reorder_slot);
+	}
+
+	r->slots = slots;
+	r->mask = size - 1;
+	r->memSize += (size_t)size * sizeof(struct reorder_slot);
+	return 0;
+}
+
+int reorder_next(struct reorder *r, uint32_t *seq)
+{
+	if ((r->slots == NULL || r->tail - r->head > r->mask) &&
+		reorder_grow(r) != 0)
+	{
+		return -1;
+	}
+
+	*seq = r->tail++;
+	return 0;
+}
+
+int reorder_put(struct reorder *r, uint32_t seq, const void *hdr,
+	size_t hdrLen, const void *body, size_t len, uint64_t nowUs)
+{
+	struct reorder_slot *s = &r->slots[seq & r->mask];
+
+	s->data = malloc(hdrLen + len);
+	if (s->data == NULL)
+	{
+		return -1;
+	}
+
+	memcpy(s->data, hdr, hdrLen);
+	if (len > 0)
+	{
+		memcpy(s->data + hdrLen, body, len);
+	}
+
+	s->len = (uint32_t)(hdrLen + len);
+	s->readyUs = nowUs;
+	r->memSize += s->len;
+	return 0;
+}
+
+int reorder_ready(const struct reorder *r, uint32_t seq, struct iovec *iov,
+	int max)
+{
+	int n = 0;
+
+	while (n < max && seq != r->tail && r->slots[seq & r->mask].data != NULL)
+	{
+		const struct reorder_slot *s = &r->slots[seq & r->mask];
+
+		iov[n].iov_base = s->data;
+		iov[n].iov_len = s->len;
+		n++;
+		seq++;
+	}
+
+	return n;
+}
+
+void reorder_pop(struct reorder *r, uint32_t count, uint64_t nowUs,
+	struct hist *hol)
+{
+	while (count-- > 0)
+	{
+		struct reorder_slot *s = &r->slots[r->head++ & r->mask];
+
+		if (s->data != NULL)
+		{
+			hist_add(hol, nowUs - s->readyUs);
+			r->memSize -= s->len;
+			free(s->data);
+			s->data = NULL;
+		}
+	}
+}
+
+void reorder_free(struct reorder *r)
+{
+	uint32_t seq;
+
+	for (seq = r->head; r->slots != NULL && seq != r->tail; ++seq)
+	{
+		free(r->slots[seq & r->mask].data);
+	}
+
+	free(r->slots);
+	memset(r, 0, sizeof(*r));
+}
@@ -0,0 +1,84 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct hist;
+
+struct reorder_slot
+{
+	/* Complete response, NULL while it is outstanding */
+	char *data;
+	uint32_t len;
+	/* Monotonic time in us the response was completed */
+	uint64_t readyUs;
+};
+
+/*
+ * Responses of one connection by sequence number. Requests take the next
+ * number as they arrive, responses completed out of order wait here until
+ * all earlier ones went out.
+ */
+struct reorder
+{
+	/* Ring of mask + 1 slots, indexed by sequence number */
+	struct reorder_slot *slots;
+	uint32_t mask;
+	/* Oldest outstanding sequence number */
+	uint32_t head;
+	/* Next sequence number handed out */
+	uint32_t tail;
+	/* Heap memory held */
+	size_t memSize;
+};
+
+/*
+ * Hands out the next sequence number in seq, growing the ring if needed.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int reorder_next(struct reorder *r, uint32_t *seq);
+
+/*
+ * Stores a copy of the response of seq, made of a header and a body.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int reorder_put(struct reorder *r, uint32_t seq, const void *hdr,
+	size_t hdrLen, const void *body, size_t len, uint64_t nowUs);
+
+/*
+ * Fills iov with the completed responses starting at seq, up to the first
+ * outstanding one.
+ * Returns the number of responses, at most max.
+ */
+int reorder_ready(const struct reorder *r, uint32_t seq, struct iovec *iov,
+	int max);
+
+/*
+ * Drops count responses from the front once they are sent and records how
+ * long the stored ones waited in hol.
+ */
+void reorder_pop(struct reorder *r, uint32_t count, uint64_t nowUs,
+	struct hist *hol);
+
+void reorder_free(struct reorder *r);
+
+#endif
@@ -0,0 +1,475 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rpc.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* End of the free list */
+#define RPC_NONE UINT32_MAX
+
+static uint16_t rpc_get16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t rpc_get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		(uint32_t)p[2] << 8 | p[3];
+}
+
+static void rpc_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = (uint8_t)(v >> 8);
+	p[1] = (uint8_t)v;
+}
+
+static void rpc_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+void rpc_encode(uint8_t *out, const struct rpc_header *h)
+{
+	out[0] = RPC_MAGIC;
+	out[1] = RPC_VERSION;
+	rpc_put16(out + 2, h->flags);
+	rpc_put32(out + 4, h->id);
+	rpc_put16(out + 8, h->method);
+	rpc_put16(out + 10, h->status);
+	rpc_put32(out + 12, h->timeoutMs);
+	rpc_put32(out + 16, h->len);
+}
+
+/*
+ * Returns 0 if the header is valid, -1 otherwise.
+ */
+static int rpc_decode(const uint8_t *in, struct rpc_header *h)
+{
+	if (in[0] != RPC_MAGIC || in[1] != RPC_VERSION)
+	{
+		return -1;
+	}
+
+	h->flags = rpc_get16(in + 2);
+	h->id = rpc_get32(in + 4);
+	h->method = rpc_get16(in + 8);
+	h->status = rpc_get16(in + 10);
+	h->timeoutMs = rpc_get32(in + 12);
+	h->len = rpc_get32(in + 16);
+
+	return h->len <= RPC_BODY_MAX ? 0 : -1;
+}
+
+int rpc_next(struct rpc_conn *c, const char **data, size_t *len,
+	struct rpc_header *h, const char **body)
+{
+	size_t n;
+
+	if (c->delivered)
+	{
+		c->bufLen = 0;
+		c->delivered = 0;
+	}
+
+	while (*len > 0)
+	{
+		if (c->hdrLen < RPC_HEADER_SIZE)
+		{
+			n = RPC_HEADER_SIZE - c->hdrLen;
+			if (n > *len)
+			{
+				n = *len;
+			}
+
+			memcpy(c->hdr + c->hdrLen, *data, n);
+			c->hdrLen += (uint8_t)n;
+			*data += n;
+			*len -= n;
+
+			if (c->hdrLen < RPC_HEADER_SIZE)
+			{
+				return 0;
+			}
+
+			if (rpc_decode(c->hdr, &c->cur) != 0)
+			{
+				return -1;
+			}
+
+			/* A body received in one piece is used in place */
+			if (*len >= c->cur.len)
+			{
+				*h = c->cur;
+				*body = *data;
+				*data += c->cur.len;
+				*len -= c->cur.len;
+				c->hdrLen = 0;
+				return 1;
+			}
+
+			if (c->cap < c->cur.len)
+			{
+				char *buf = realloc(c->buf, c->cur.len);
+
+				if (buf == NULL)
+				{
+					return -1;
+				}
+
+				c->buf = buf;
+				c->cap = c->cur.len;
+			}
+		}
+
+		n = c->cur.len - c->bufLen;
+		if (n > *len)
+		{
+			n = *len;
+		}
+
+		memcpy(c->buf + c->bufLen, *data, n);
+		c->bufLen += (uint32_t)n;
+		*data += n;
+		*len -= n;
+
+		if (c->bufLen < c->cur.len)
+		{
+			return 0;
+		}
+
+		*h = c->cur;
+		*body = c->buf;
+		c->hdrLen = 0;
+		c->delivered = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+void rpc_connFree(struct rpc_conn *c)
+{
+	free(c->buf);
+	c->buf = NULL;
+	c->bufLen = 0;
+	c->cap = 0;
+	reorder_free(&c->order);
+}
+
+int rpc_register(struct rpc *r, uint16_t method, rpc_method fn, void *arg)
+{
+	if (method >= r->methodCount)
+	{
+		uint32_t count = (uint32_t)method + 1;
+		rpc_method *methods;
+		void **args;
+
+		methods = realloc(r->methods, count * sizeof(rpc_method));
+		if (methods == NULL)
+		{
+			return -1;
+		}
+
+		r->methods = methods;
+
+		args = realloc(r->args, count * sizeof(void *));
+		if (args == NULL)
+		{
+			return -1;
+		}
+
+		r->args = args;
+		memset(r->methods + r->methodCount, 0,
+			(count - r->methodCount) * sizeof(rpc_method));
+		memset(r->args + r->methodCount, 0,
+			(count - r->methodCount) * sizeof(void *));
+		r->methodCount = count;
+	}
+
+	r->methods[method] = fn;
+	r->args[method] = arg;
+	return 0;
+}
+
+int rpc_init(struct rpc *r, uint32_t cap)
+{
+	uint32_t i;
+
+	r->calls = calloc(cap, sizeof(struct rpc_pending));
+	r->heap = malloc(cap * sizeof(uint32_t));
+	if (r->calls == NULL || r->heap == NULL)
+	{
+		rpc_free(r, 0);
+		return -1;
+	}
+
+	for (i = 0; i < cap; ++i)
+	{
+		r->calls[i].pos = i + 1 < cap ? i + 1 : RPC_NONE;
+	}
+
+	r->cap = cap;
+	r->pending = 0;
+	r->freeHead = cap > 0 ? 0 : RPC_NONE;
+	return 0;
+}
+
+void rpc_free(struct rpc *r, int methods)
+{
+	free(r->calls);
+	free(r->heap);
+	r->calls = NULL;
+	r->heap = NULL;
+	r->cap = 0;
+	r->pending = 0;
+	r->freeHead = RPC_NONE;
+
+	if (methods)
+	{
+		free(r->methods);
+		free(r->args);
+		r->methods = NULL;
+		r->args = NULL;
+		r->methodCount = 0;
+	}
+}
+
+static void rpc_heapSet(struct rpc *r, uint32_t pos, uint32_t idx)
+{
+	r->heap[pos] = idx;
+	r->calls[idx].pos = pos;
+}
+
+static void rpc_siftUp(struct rpc *r, uint32_t pos)
+{
+	uint32_t idx = r->heap[pos];
+	uint64_t deadline = r->calls[idx].deadlineMs;
+
+	while (pos > 0)
+	{
+		uint32_t parent = (pos - 1) / 2;
+
+		if (r->calls[r->heap[parent]].deadlineMs <= deadline)
+		{
+			break;
+		}
+
+		rpc_heapSet(r, pos, r->heap[parent]);
+		pos = parent;
+	}
+
+	rpc_heapSet(r, pos, idx);
+}
+
+static void rpc_siftDown(struct rpc *r, uint32_t pos)
+{
+	uint32_t idx = r->heap[pos];
+	uint64_t deadline = r->calls[idx].deadlineMs;
+
+	while (1)
+	{
+		uint32_t child = 2 * pos + 1;
+
+		if (child >= r->pending)
+		{
+			break;
+		}
+
+		if (child + 1 < r->pending && r->calls[r->heap[child + 1]].deadlineMs <
+			r->calls[r->heap[child]].deadlineMs)
+		{
+			child++;
+		}
+
+		if (deadline <= r->calls[r->heap[child]].deadlineMs)
+		{
+			break;
+		}
+
+		rpc_heapSet(r, pos, r->heap[child]);
+		pos = child;
+	}
+
+	rpc_heapSet(r, pos, idx);
+}
+
+/*
+ * Takes the request at idx off the heap and puts its entry on the free
+ * list.
+ */
+static void rpc_remove(struct rpc *r, uint32_t idx, struct rpc_pending *p)
+{
+	uint32_t pos = r->calls[idx].pos;
+
+	*p = r->calls[idx];
+	r->pending--;
+
+	if (p->prev != RPC_NONE)
+	{
+		r->calls[p->prev].next = p->next;
+	}
+	else
+	{
+		p->conn->pendingHead = p->next;
+	}
+
+	if (p->next != RPC_NONE)
+	{
+		r->calls[p->next].prev = p->prev;
+	}
+
+	p->conn->pending--;
+
+	/* The last entry fills the gap and moves to its place */
+	if (pos < r->pending)
+	{
+		uint32_t last = r->heap[r->pending];
+
+		rpc_heapSet(r, pos, last);
+		rpc_siftDown(r, pos);
+		rpc_siftUp(r, r->calls[last].pos);
+	}
+
+	r->calls[idx].used = 0;
+	r->calls[idx].pos = r->freeHead;
+	r->freeHead = idx;
+}
+
+uint64_t rpc_track(struct rpc *r, struct rpc_conn *conn, uint64_t client,
+	uint32_t id, uint32_t seq, uint16_t method, uint64_t deadlineMs)
+{
+	struct rpc_pending *p;
+	uint32_t idx = r->freeHead;
+
+	if (idx == RPC_NONE)
+	{
+		r->busy++;
+		return 0;
+	}
+
+	p = &r->calls[idx];
+	r->freeHead = p->pos;
+
+	/* Generation 0 never occurs, so no token is 0 */
+	if (++p->gen == 0)
+	{
+		p->gen = 1;
+	}
+
+	p->client = client;
+	p->deadlineMs = deadlineMs;
+	p->id = id;
+	p->seq = seq;
+	p->method = method;
+	p->used = 1;
+
+	p->conn = conn;
+	p->prev = RPC_NONE;
+	p->next = conn->pending > 0 ? conn->pendingHead : RPC_NONE;
+	if (p->next != RPC_NONE)
+	{
+		r->calls[p->next].prev = idx;
+	}
+
+	conn->pendingHead = idx;
+	conn->pending++;
+
+	r->heap[r->pending] = idx;
+	p->pos = r->pending++;
+	rpc_siftUp(r, p->pos);
+
+	return (uint64_t)p->gen << 32 | idx;
+}
+
+int rpc_complete(struct rpc *r, uint64_t token, struct rpc_pending *p)
+{
+	uint32_t idx = (uint32_t)token;
+
+	if (idx >= r->cap || !r->calls[idx].used ||
+		r->calls[idx].gen != (uint32_t)(token >> 32))
+	{
+		r->late++;
+		return -1;
+	}
+
+	rpc_remove(r, idx, p);
+	return 0;
+}
+
+int rpc_expire(struct rpc *r, uint64_t now, struct rpc_pending *p)
+{
+	if (r->pending == 0 || r->calls[r->heap[0]].deadlineMs > now)
+	{
+		return 0;
+	}
+
+	rpc_remove(r, r->heap[0], p);
+	r->expired++;
+	return 1;
+}
+
+void rpc_cancel(struct rpc *r, struct rpc_conn *conn)
+{
+	struct rpc_pending p;
+
+	while (conn->pending > 0)
+	{
+		rpc_remove(r, conn->pendingHead, &p);
+	}
+}
+
+int rpc_timeoutMs(const struct rpc *r, uint64_t now)
+{
+	uint64_t deadline;
+
+	if (r->pending == 0)
+	{
+		return -1;
+	}
+
+	deadline = r->calls[r->heap[0]].deadlineMs;
+	if (deadline <= now)
+	{
+		return 0;
+	}
+
+	return deadline - now < INT32_MAX ? (int)(deadline - now) : INT32_MAX;
+}
+
+size_t rpc_memSize(const struct rpc *r)
+{
+	return r->cap * (sizeof(struct rpc_pending) + sizeof(uint32_t));
+}
+
+void rpc_writeStats(const struct rpc *r, FILE *fp)
+{
+	fprintf(fp, "rpc_requests %llu\n", (unsigned long long)r->requests);
+	fprintf(fp, "rpc_responses %llu\n", (unsigned long long)r->responses);
+	fprintf(fp, "rpc_oneway %llu\n", (unsigned long long)r->oneway);
+	fprintf(fp, "rpc_pending %u\n", r->pending);
+	fprintf(fp, "rpc_unknown_method %llu\n", (unsigned long long)r->unknown);
+	fprintf(fp, "rpc_deadline_exceeded %llu\n",
+		(unsigned long long)r->expired);
+	fprintf(fp, "rpc_late_responses %llu\n", (unsigned long long)r->late);
+	fprintf(fp, "rpc_busy %llu\n", (unsigned long long)r->busy);
+	fprintf(fp, "rpc_protocol_errors %llu\n", (unsigned long long)r->errors);
+}
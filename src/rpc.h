@@ -0,0 +1,232 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RPC_H
+#define RPC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "reorder.h"
+
+/*
+ * Every message starts with a 20 byte header, all fields big endian:
+ *
+ *   0  magic 'R'         10  status
+ *   1  version            12  timeout in ms, 0 for the server default
+ *   2  flags              16  body length
+ *   4  request id
+ *   8  method id
+ */
+#define RPC_MAGIC 0x52
+#define RPC_VERSION 1
+#define RPC_HEADER_SIZE 20
+/* Largest body */
+#define RPC_BODY_MAX (1024 * 1024)
+
+/* Header flags */
+#define RPC_RESPONSE 0x0001
+/* The client expects no response */
+#define RPC_ONEWAY 0x0002
+
+/* Response status codes, methods may define their own from 16 on */
+#define RPC_OK 0
+#define RPC_NO_METHOD 1
+#define RPC_DEADLINE 2
+#define RPC_BUSY 3
+
+struct rpc_header
+{
+	uint16_t flags;
+	uint32_t id;
+	uint16_t method;
+	uint16_t status;
+	uint32_t timeoutMs;
+	uint32_t len;
+};
+
+/* A request handed to a method, valid during the call only */
+struct rpc_call
+{
+	/* Identifies the call in srv_rpcRespond, 0 for oneway requests */
+	uint64_t token;
+	/* Client address */
+	const char *ip;
+	uint32_t id;
+	uint16_t method;
+	uint16_t flags;
+	/* Monotonic time in ms after which the call fails */
+	uint64_t deadlineMs;
+	const char *body;
+	uint32_t len;
+};
+
+typedef void (*rpc_method)(void *arg, const struct rpc_call *call);
+
+/* Per-client framing state */
+struct rpc_conn
+{
+	uint8_t hdr[RPC_HEADER_SIZE];
+	uint8_t hdrLen;
+	/* The body in buf has been handed out */
+	uint8_t delivered;
+	struct rpc_header cur;
+	/* Partial body, grown on demand */
+	char *buf;
+	uint32_t bufLen;
+	uint32_t cap;
+	/* Responses waiting for earlier ones, if they go out in order */
+	struct reorder order;
+	/* Requests awaiting a response, linked through their entries */
+	uint32_t pending;
+	uint32_t pendingHead;
+};
+
+/* A request waiting for its response */
+struct rpc_pending
+{
+	uint64_t client;
+	struct rpc_conn *conn;
+	uint64_t deadlineMs;
+	uint32_t id;
+	/* Position of the response on its connection */
+	uint32_t seq;
+	/* Bumped on reuse so stale tokens don't match */
+	uint32_t gen;
+	/* Position in the deadline heap, or the next free entry */
+	uint32_t pos;
+	/* Neighbours among the requests of the same connection */
+	uint32_t prev;
+	uint32_t next;
+	uint16_t method;
+	uint8_t used;
+};
+
+/*
+ * Method dispatch table and requests in flight. Methods are indexed by id
+ * directly; pending requests sit in a min-heap ordered by deadline so the
+ * loop only looks at the earliest one.
+ */
+struct rpc
+{
+	rpc_method *methods;
+	void **args;
+	uint32_t methodCount;
+	struct rpc_pending *calls;
+	/* Indexes into calls */
+	uint32_t *heap;
+	uint32_t pending;
+	uint32_t cap;
+	uint32_t freeHead;
+	/* Statistics */
+	uint64_t requests;
+	uint64_t responses;
+	uint64_t oneway;
+	uint64_t unknown;
+	uint64_t expired;
+	uint64_t late;
+	uint64_t busy;
+	uint64_t errors;
+};
+
+void rpc_encode(uint8_t *out, const struct rpc_header *h);
+
+/*
+ * Collects requests from data. A body received in one piece is handed out
+ * in place, others are reassembled. Consumed bytes are taken off data.
+ * Returns 1 with the next request in h and body, 0 once data is used up or
+ * -1 on a malformed header.
+ */
+int rpc_next(struct rpc_conn *c, const char **data, size_t *len,
+	struct rpc_header *h, const char **body);
+
+void rpc_connFree(struct rpc_conn *c);
+
+/*
+ * Adds method to the dispatch table, replacing a previous one.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int rpc_register(struct rpc *r, uint16_t method, rpc_method fn, void *arg);
+
+/*
+ * Returns the function of method and sets arg, NULL if not registered.
+ */
+static inline rpc_method rpc_lookup(const struct rpc *r, uint16_t method,
+	void **arg)
+{
+	if (method >= r->methodCount || r->methods[method] == NULL)
+	{
+		return NULL;
+	}
+
+	*arg = r->args[method];
+	return r->methods[method];
+}
+
+/*
+ * Allocates room for up to cap pending requests. Registered methods are
+ * kept.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int rpc_init(struct rpc *r, uint32_t cap);
+
+/*
+ * Frees the pending requests, and the dispatch table too if methods is
+ * set.
+ */
+void rpc_free(struct rpc *r, int methods);
+
+/*
+ * Starts tracking a request of conn.
+ * Returns its token, 0 if too many requests are pending.
+ */
+uint64_t rpc_track(struct rpc *r, struct rpc_conn *conn, uint64_t client,
+	uint32_t id, uint32_t seq, uint16_t method, uint64_t deadlineMs);
+
+/*
+ * Stops tracking the request of token and fills in p.
+ * Returns 0 on success, -1 if it is no longer pending.
+ */
+int rpc_complete(struct rpc *r, uint64_t token, struct rpc_pending *p);
+
+/*
+ * Takes the earliest request whose deadline has passed at now.
+ * Returns 1 with the request in p, 0 if none has expired.
+ */
+int rpc_expire(struct rpc *r, uint64_t now, struct rpc_pending *p);
+
+/*
+ * Stops tracking the requests of a connection that goes away.
+ */
+void rpc_cancel(struct rpc *r, struct rpc_conn *conn);
+
+/*
+ * Returns the ms until the earliest deadline, -1 if nothing is pending.
+ */
+int rpc_timeoutMs(const struct rpc *r, uint64_t now);
+
+/*
+ * Returns the memory used by the pending request tables.
+ */
+size_t rpc_memSize(const struct rpc *r);
+
+/*
+ * Writes RPC statistics.
+ */
+void rpc_writeStats(const struct rpc *r, FILE *fp);
+
+#endif
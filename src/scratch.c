@@ -0,0 +1,117 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "scratch.h"
+#include <assert.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCRATCH_ALIGN alignof(max_align_t)
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* Size of the chunk header, keeping the payload aligned */
+#define CHUNK_HEADER ROUND_UP(sizeof(struct scratch_chunk), SCRATCH_ALIGN)
+
+int scratch_init(struct scratch *s, size_t size)
+{
+	assert(s != NULL);
+
+	memset(s, 0, sizeof(struct scratch));
+
+	if (size == 0)
+	{
+		return 0;
+	}
+
+	s->base = malloc(size);
+	if (s->base == NULL)
+	{
+		return -1;
+	}
+
+	s->size = size;
+
+	return 0;
+}
+
+void scratch_destroy(struct scratch *s)
+{
+	if (s == NULL)
+	{
+		return;
+	}
+
+	scratch_reset(s);
+	free(s->base);
+	memset(s, 0, sizeof(struct scratch));
+}
+
+void *scratch_alloc(struct scratch *s, size_t size)
+{
+	struct scratch_chunk *c;
+	void *p;
+	size_t off;
+
+	assert(s != NULL);
+
+	off = ROUND_UP(s->used, SCRATCH_ALIGN);
+	if (off <= s->size && size <= s->size - off)
+	{
+		p = s->base + off;
+		s->used = off + size;
+	}
+	else
+	{
+		/* Block exhausted, keep the allocation alive until the next reset */
+		c = malloc(CHUNK_HEADER + size);
+		if (c == NULL)
+		{
+			return NULL;
+		}
+
+		c->next = s->overflow;
+		s->overflow = c;
+		s->overflowBytes += CHUNK_HEADER + size;
+		p = (char*)c + CHUNK_HEADER;
+	}
+
+	s->current += size;
+	if (s->current > s->peak)
+	{
+		s->peak = s->current;
+	}
+
+	return p;
+}
+
+void scratch_reset(struct scratch *s)
+{
+	assert(s != NULL);
+
+	while (s->overflow != NULL)
+	{
+		struct scratch_chunk *next = s->overflow->next;
+
+		free(s->overflow);
+		s->overflow = next;
+	}
+
+	s->used = 0;
+	s->current = 0;
+	s->overflowBytes = 0;
+}
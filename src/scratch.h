@@ -0,0 +1,71 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+
+/* Oversized or overflow allocation, freed on reset */
+struct scratch_chunk
+{
+	struct scratch_chunk *next;
+};
+
+/*
+ * Bump allocator for short-lived handler allocations. Memory is released in
+ * bulk by scratch_reset; there is no per-allocation free.
+ */
+struct scratch
+{
+	char *base;
+	size_t size;
+	size_t used;
+	/* Allocations that did not fit into the block */
+	struct scratch_chunk *overflow;
+	/* High-water mark including overflow, in bytes */
+	size_t peak;
+	/* Bytes allocated since the last reset including overflow */
+	size_t current;
+	/* Heap memory held by the overflow allocations */
+	size_t overflowBytes;
+};
+
+/*
+ * Allocates the scratch block.
+ * Returns 0 on success, -1 on failure.
+ */
+int scratch_init(struct scratch *s, size_t size);
+
+/*
+ * Frees the scratch block and all overflow allocations.
+ */
+void scratch_destroy(struct scratch *s);
+
+/*
+ * Returns uninitialized memory aligned for any type, valid until the next
+ * reset. Falls back to the heap once the block is exhausted.
+ * Returns NULL on failure.
+ */
+void *scratch_alloc(struct scratch *s, size_t size);
+
+/*
+ * Releases everything allocated since the last reset.
+ */
+void scratch_reset(struct scratch *s);
+
+#endif
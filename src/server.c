@@ -15,429 +15,4387 @@ You should have received a copy of the GNU General Public License
 along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include "server.h"
+#include "arena.h"
+#include "buf.h"
+#include "capture.h"
+#include "client.h"
+#include "compress.h"
+#include "hist.h"
+#include "jsonl.h"
+#include "local.h"
+#include "mem.h"
+#include "mux.h"
+#include "output.h"
+#include "pmu.h"
+#include "probes.h"
+#include "prof.h"
+#include "rpc.h"
+#include "scratch.h"
+#include "sink.h"
+#include "sketch.h"
+#include "statsd.h"
+#include "tls.h"
+#include "trace.h"
+#include "tsc.h"
+#include "ws.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/tcp.h>
 
-#define CLIENT_BUF_SIZE 2048
+#define RECV_BUF_SIZE 16384
+/* Interval of giving idle output buffer slabs back */
+#define POOL_TRIM_MS 1000
+#define DEFAULT_MAX_CLIENTS 1024
+#define DEFAULT_SCRATCH_SIZE (64 * 1024)
+/* Maximum number of clients paused or disconnected per budget check */
+#define SHED_BATCH 16
+/* Longest admin command line */
+#define ADMIN_LINE_MAX 256
+/* Profiling duration if none is given */
+#define DEFAULT_PROFILE_SECONDS 10
+/* Capture ring size in MB if none is given */
+#define DEFAULT_CAPTURE_SIZE 64
+/* Sink defaults */
+#define DEFAULT_SINK_BATCH_KB 1024
+#define DEFAULT_SINK_SEGMENT_MB 256
+#define DEFAULT_SINK_COMMIT_MS 10
+/* Output ring size in MB if none is given */
+#define DEFAULT_OUTPUT_RING_MB 16
+/* Ring size per direction of local clients in KB if none is given */
+#define DEFAULT_LOCAL_RING_KB 1024
+/* Requests of a local client handled per loop iteration at most */
+#define LOCAL_BATCH 256
+/* Requests consumed before their ring space is handed back */
+#define LOCAL_RELEASE_BATCH 32
+/* Seconds between statsd flushes if none is given */
+#define DEFAULT_STATSD_FLUSH_SEC 10
+/* Datagrams received per recvmmsg call and calls per readiness event */
+#define UDP_BATCH 64
+#define UDP_ROUNDS 8
+/* Largest statsd datagram accepted, fits jumbo frames */
+#define UDP_DATAGRAM_MAX 9216
+/* Idle compression contexts kept per direction */
+#define COMPRESS_IDLE_CONTEXTS 16
+/* Compressed connections not written for this long end their segment */
+#define COMPRESS_IDLE_MS 1000
+/* Decompressed bytes dispatched per read, the rest waits a loop iteration */
+#define INFLATE_READ_MAX (4 * RECV_BUF_SIZE)
+/* RPC requests awaiting a response across all clients */
+#define RPC_PENDING_MAX 65536
+/* RPC requests awaiting a response per client */
+#define RPC_CONN_PENDING_MAX 4096
+/* Ordered RPC responses sent with one sendmsg */
+#define RPC_IOV_MAX 256
+/* Minimum time between two TCP_INFO samples of the same client */
+#define TCP_SAMPLE_INTERVAL_MS 100
+/* Queued bytes above which a growing queue marks a client as slow */
+#define TCP_SLOW_QUEUE (64 * 1024)
+/* Consecutive growing samples before a client is marked as slow */
+#define TCP_SLOW_SAMPLES 3
+/* Most clients listed by the cpu admin command */
+#define CPU_TOP_MAX 64
 
-/* Client instance */
-struct client
+/*
+ * Event source types. Every descriptor registered with epoll carries a tagged
+ * handle in epoll_event.data.u64 instead of a pointer:
+ *
+ *   63      56 55            32 31                  0
+ *  +----------+----------------+---------------------+
+ *  |   type   |   generation   |        slot         |
+ *  +----------+----------------+---------------------+
+ *
+ * The type selects the dispatch routine, the slot indexes the table owned by
+ * that type and the generation detects events for slots that were recycled
+ * while the event was still queued.
+ */
+enum ev_type
 {
-	/* Client buffer */
-	char buffer[CLIENT_BUF_SIZE];
-	/* Remote IP address */
-	char addr[INET_ADDRSTRLEN];
-	/* Server instance */
-	struct server *srv;
-	/* Socket */
-	int sd;
+	EV_NONE = 0,
+	EV_LISTEN,
+	EV_CLIENT,
+	EV_ADMIN_LISTEN,
+	/* Sink writer completions */
+	EV_SINK,
+	EV_OUTPUT_LISTEN,
+	EV_OUTPUT,
+	EV_LOCAL_LISTEN,
+	EV_LOCAL,
+	/* statsd datagrams */
+	EV_UDP,
+	EV_TLS_LISTEN
+};
+
+/* Event classes the hardware counters are attributed to */
+enum srv_cost
+{
+	COST_ACCEPT = 0,
+	COST_RECEIVE,
+	COST_WRITE,
+	COST_ERROR,
+	/* Periodic work at the end of each loop iteration */
+	COST_HOUSEKEEPING,
+	COST_CLASSES
+};
 
-	struct client *next;
-	struct client *prev;
+/* Accumulated hardware counter deltas of one event class */
+struct srv_cost_stats
+{
+	uint64_t events;
+	uint64_t counters[PMU_COUNTERS];
 };
 
+#define EV_GEN_MASK CL_GEN_MASK
+#define EV_HANDLE(type, gen, slot) \
+	(((uint64_t)(type) << 56) | ((uint64_t)((gen) & EV_GEN_MASK) << 32) | \
+	(uint64_t)(uint32_t)(slot))
+#define EV_TYPE(h) ((unsigned)((h) >> 56))
+#define EV_GEN(h) ((uint32_t)((h) >> 32) & EV_GEN_MASK)
+#define EV_SLOT(h) ((uint32_t)(h))
+
 /* Server instance */
 struct server
 {
 	/* Server event handler */
 	const struct srv_handler *handler;
-	/* Connected clients list */
-	struct client *clients;
+	/* Server options */
+	struct srv_options opts;
+	/* Client table */
+	struct cl_table clients;
+	/* Output queue buffers */
+	struct bufpool pool;
+	/* Heap slabs of the pool charged to the budget */
+	size_t poolCharged;
+	/* Next time idle slabs are given back */
+	uint64_t poolTrimMs;
+	/* Backing memory of the client table and the preallocated buffers */
+	struct arena arena;
+	/* Temporary memory for handler callbacks */
+	struct scratch scratch;
+	/* Scratch overflow charged to the budget */
+	size_t scratchCharged;
+	/* Memory accountant */
+	struct mem_account mem;
+	/* Clients with suspended reads */
+	uint32_t pausedCount;
+	/* Clients paused or disconnected because of the memory budget */
+	uint64_t pausedTotal;
+	uint64_t shedTotal;
+	/* Flight recorder of recent loop events */
+	struct trace_ring trace;
+	/* Loop heartbeat and stall detection */
+	struct watchdog watchdog;
+	/* tsc_now() when the running callback was entered */
+	uint64_t callbackStart;
+	/* Admin interface socket, -1 if disabled */
+	int adminSd;
+	/* Unix socket of shared memory clients, -1 if disabled */
+	int localSd;
+	/* TLS listening socket, -1 if disabled */
+	int tlsSd;
+	struct tls_server tls;
+	/* Decrypted data of user space TLS clients */
+	char tlsbuf[RECV_BUF_SIZE];
+	struct ws_stats ws;
+	/* RPC methods and requests in flight */
+	struct rpc rpc;
+	/* How long ordered RPC responses waited for earlier ones */
+	struct hist rpcHol;
+	struct mux_stats mux;
+	/* Name of the stream passed to the handler, "ip/id" */
+	char muxName[INET_ADDRSTRLEN + 11];
+	/* Connected shared memory clients */
+	uint32_t localCount;
+	/* Sampling profiler */
+	struct prof prof;
+	/* Output file of the running profile */
+	char profPath[64];
+	/* Seconds to profile, set asynchronously by srv_requestProfile */
+	volatile sig_atomic_t profileRequested;
 	/* Server socket */
 	int sd;
+	/* Epoll descriptor */
+	int efd;
+	/* dTLB load miss counter of the loop thread, -1 if unavailable */
+	int dtlbFd;
+	/* Hardware counter group of the loop thread */
+	struct pmu_group hw;
+	/* Counter values at the previous sample point */
+	uint64_t hwLast[PMU_COUNTERS];
+	/* Counter deltas per event class */
+	struct srv_cost_stats cost[COST_CLASSES];
+	/* Bytes read from all clients */
+	uint64_t bytesReceived;
+	/* Completed loop iterations */
+	uint64_t iterations;
+	/* iterations + 1 when the biggest consumers were last paused */
+	uint64_t pauseIteration;
+	/* Kernel receive to read delays in microseconds */
+	struct hist rxDelay;
+	/* Reads with a delay above the alert threshold */
+	uint64_t rxDelayAlerts;
+	/* Second of the last alert message and alerts suppressed since */
+	time_t rxAlertSec;
+	uint64_t rxAlertsSuppressed;
+	/* Next slot visited by the TCP_INFO sweep */
+	uint32_t tcpCursor;
+	/* TCP_INFO samples taken */
+	uint64_t tcpSamples;
+	/* Clients currently and ever marked as slow */
+	uint32_t slowCount;
+	uint64_t slowTotal;
+	/* Traffic sketches, NULL if disabled */
+	struct sketches *sketch;
+	/* Traffic capture, hdr is NULL if disabled */
+	struct capture capture;
+	/* Ingest sink, running is 0 if disabled */
+	struct sink sink;
+	/* Shared memory output stage, path is NULL if disabled */
+	struct output output;
+	/* statsd aggregation, running is 0 if disabled */
+	struct statsd statsd;
+	/* statsd UDP socket, -1 if disabled */
+	int udpSd;
+	/* Receive buffers of one recvmmsg batch */
+	char *udpBuf;
+	/* Datagrams received and dropped for exceeding UDP_DATAGRAM_MAX */
+	uint64_t udpDatagrams;
+	uint64_t udpTruncated;
+	/* JSON lines validator, index is NULL if disabled */
+	struct jsonl jsonl;
+	/* Compression contexts, used if opts.compress is set */
+	struct compress_pool zpool;
+	/* Compressed clients written to in this loop iteration */
+	uint32_t *zDirty;
+	uint32_t zDirtyCount;
+	/* Compressed clients with deferred input that are not paused */
+	uint32_t *zDeferred;
+	uint32_t zDeferredCount;
+	/* Next sweep for idle compressed clients */
+	uint64_t zSweepMs;
+	/* Compressor memory charged to the budget */
+	size_t zCharged;
+	/* Decompressed data of the client being read */
+	char zbuf[RECV_BUF_SIZE];
+	/* Seconds since the event loop started, used for idle deadlines */
+	uint32_t tick;
 	/* Stop server flag */
 	volatile sig_atomic_t shouldQuit;
+	/* Print statistics flag */
+	volatile sig_atomic_t statsRequested;
+	/* Receive buffer shared by all clients */
+	char rxbuf[RECV_BUF_SIZE];
 };
 
 /*
- * Remove a client from the clients list and free its resources.
+ * Returns the id of a client, unique for the lifetime of the server as long
+ * as the slot generation does not wrap.
  */
-static void cl_free(struct client *cl)
+static uint64_t cl_id(const struct server *srv, uint32_t slot)
 {
-	if (cl == NULL)
-	{
-		return;
-	}
+	return ((uint64_t)srv->clients.hot[slot].gen << 32) | slot;
+}
 
-	/* Remove client from the list */
-	if (cl != cl->next)
+/*
+ * Returns the monotonic time in ms.
+ */
+static uint64_t srv_nowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * Charge changes of the heap slabs held by the buffer pool. The
+ * preallocated buffers are reserved on start.
+ */
+static void srv_accountBuffers(struct server *srv)
+{
+	if (srv->pool.slabBytes > srv->poolCharged)
 	{
-		cl->next->prev = cl->prev;
-		cl->prev->next = cl->next;
+		mem_charge(&srv->mem, MEM_OUTPUT,
+			srv->pool.slabBytes - srv->poolCharged);
 	}
 	else
 	{
-		/* Last client removed */
-		cl->srv->clients = NULL;
-	}
-
-	/*
-	 * Close the socket if necessary. Closing the socket will also remove it
-	 * from the epoll list (see epoll manpage for details).
-	 */
-	if (cl->sd > -1)
-	{
-		if (shutdown(cl->sd, SHUT_RDWR) == -1)
-		{
-			perror("shutdown");
-		}
-
-		if (close(cl->sd) == -1)
-		{
-			perror("close");
-		}
+		mem_release(&srv->mem, MEM_OUTPUT,
+			srv->poolCharged - srv->pool.slabBytes);
 	}
 
-	free(cl);
+	srv->poolCharged = srv->pool.slabBytes;
 }
 
 /*
- * Create a new client instance and add it to the connected clients list.
+ * Take an output buffer from the pool, charging slabs the pool grows by.
  * Returns NULL on failure.
  */
-static struct client *cl_create(struct server *srv, int sd,
-	const struct sockaddr *addr)
+static struct buf *srv_getBuffer(struct server *srv)
 {
-	struct client *cl;
-
-	assert(srv != NULL);
-	assert(addr != NULL);
-
-	cl = malloc(sizeof(struct client));
-	if (cl == NULL)
-	{
-		fprintf(stderr, "Failed to create client instance: out of memory.\n");
-		return NULL;
-	}
-
-	memset(cl, 0, sizeof(struct client));
-	cl->srv = srv;
-	cl->sd = sd;
+	struct buf *b;
 
-	/* Get remote IP */
-	if (addr->sa_family == AF_INET)
-	{
-		inet_ntop(AF_INET, &((struct sockaddr_in*)addr)->sin_addr,
-			cl->addr, INET_ADDRSTRLEN);
-	}
-	else
-	{
-		cl->addr[0] = '\0';
-	}
-
-	/* Add client to clients list */
-	if (srv->clients != NULL)
-	{
-		cl->next = srv->clients;
-		cl->prev = srv->clients->prev;
-		srv->clients->prev->next = cl;
-		srv->clients->prev = cl;
-	}
-	else
+	b = buf_get(&srv->pool);
+	if (srv->pool.slabBytes != srv->poolCharged)
 	{
-		cl->next = cl->prev = cl;
-		srv->clients = cl;
+		srv_accountBuffers(srv);
 	}
 
-	return cl;
+	return b;
 }
 
 /*
- * Raise the server start event.
+ * Return an output buffer to the pool. Its slab stays charged until
+ * srv_trimBuffers frees it.
  */
-static void srv_onStart(struct server *srv)
+static void srv_putBuffer(struct server *srv, struct buf *b)
 {
-	const struct srv_handler *h;
+	buf_put(&srv->pool, b);
+}
 
-	assert(srv != NULL);
+/*
+ * Give heap slabs of the buffer pool without buffers in use back, at most
+ * once per POOL_TRIM_MS unless paused clients wait for memory.
+ */
+static void srv_trimBuffers(struct server *srv)
+{
+	uint64_t now = srv_nowMs();
 
-	h = srv->handler;
-	if (h != NULL && h->on_start != NULL)
+	if (now < srv->poolTrimMs && srv->pausedCount == 0)
 	{
-		h->on_start();
+		return;
 	}
+
+	bufpool_trim(&srv->pool);
+	srv_accountBuffers(srv);
+	srv->poolTrimMs = now + POOL_TRIM_MS;
 }
 
 /*
- * Raise the server stop event.
+ * Update the epoll registration of a client socket.
+ * Returns 0 on success, -1 on failure.
  */
-static void srv_onStop(struct server *srv)
+static int cl_setEvents(struct server *srv, uint32_t slot, int op,
+	uint32_t events)
 {
-	const struct srv_handler *h;
+	struct epoll_event eev;
+	const struct cl_hot *h;
 
 	assert(srv != NULL);
 
-	h = srv->handler;
-	if (h != NULL && h->on_stop != NULL)
+	h = &srv->clients.hot[slot];
+
+	memset(&eev, 0, sizeof(eev));
+	eev.data.u64 = EV_HANDLE(EV_CLIENT, h->gen, slot);
+	eev.events = events;
+
+	if (epoll_ctl(srv->efd, op, h->sd, &eev) == -1)
 	{
-		h->on_stop();
+		perror("epoll_ctl");
+		return -1;
 	}
+
+	return 0;
 }
 
 /*
- * Raise the client connect event.
+ * Take a compressed client off the list of clients to continue inflating.
  */
-static void srv_onConnect(struct client *cl)
+static void cl_unlistInflate(struct server *srv, uint32_t slot)
 {
-	const struct srv_handler *h;
+	struct compress_conn *zc = srv->clients.cold[slot].z;
+	uint32_t last;
 
-	assert(cl != NULL);
-
-	h = cl->srv->handler;
-	if (h != NULL && h->on_connect != NULL)
+	if (!zc->listed)
 	{
-		h->on_connect(cl->addr);
+		return;
 	}
+
+	last = srv->zDeferred[--srv->zDeferredCount];
+	srv->zDeferred[zc->listIndex] = last;
+	srv->clients.cold[last].z->listIndex = zc->listIndex;
+	zc->listed = 0;
 }
 
 /*
- * Raise the client disconnect event.
+ * Remove a client from the client table and free its resources.
  */
-static void srv_onDisconnect(struct client *cl)
+static void cl_free(struct server *srv, uint32_t slot)
 {
-	const struct srv_handler *h;
+	struct cl_hot *h;
+	struct cl_cold *c;
 
-	assert(cl != NULL);
+	assert(srv != NULL);
 
-	h = cl->srv->handler;
-	if (h != NULL && h->on_disconnect != NULL)
+	h = &srv->clients.hot[slot];
+	c = &srv->clients.cold[slot];
+
+	/* Drop pending output */
+	while (c->outHead != NULL)
 	{
-		h->on_disconnect(cl->addr);
+		struct buf *next = c->outHead->next;
+
+		srv_putBuffer(srv, c->outHead);
+		c->outHead = next;
 	}
-}
 
-/*
- * Raise the client data receive event.
- */
-static void srv_onReceive(struct client *cl, const char *buf, ssize_t len)
-{
-	const struct srv_handler *h;
+	c->outTail = NULL;
 
-	assert(cl != NULL);
+	if (h->flags & CL_PAUSED)
+	{
+		srv->pausedCount--;
+	}
 
-	/* Echo data back to client */
-	if (write(cl->sd, buf, len) != len)
+	if (h->flags & CL_SLOW)
 	{
-		fprintf(stderr, "Failed to write response data.\n");
+		srv->slowCount--;
 	}
 
-	h = cl->srv->handler;
-	if (h != NULL && h->on_receive != NULL)
+	if (h->flags & CL_ADMIN)
 	{
-		h->on_receive(cl->addr, buf, len);
+		free(c->ctx);
+		c->ctx = NULL;
 	}
-}
 
-/*
- * Set a socket descriptor to use non-blocking IO.
- * Returns 0 on success, -1 on failure.
- */
-static int srv_setNonBlocking(int sd)
-{
-	int flags;
+	if (h->flags & CL_SINK)
+	{
+		sink_connFree(&srv->sink, c->ctx);
+		free(c->ctx);
+		c->ctx = NULL;
+	}
 
-	flags = fcntl(sd, F_GETFL, 0);
-	if (flags == -1)
+	if (h->flags & CL_STATSD)
 	{
-		goto on_error;
+		free(c->ctx);
+		c->ctx = NULL;
 	}
 
-	flags |= O_NONBLOCK;
-	if (fcntl(sd, F_SETFL, flags) == -1)
+	if (c->z != NULL)
 	{
-		goto on_error;
+		/* Take the client off the flush list */
+		if (c->z->dirty)
+		{
+			uint32_t last = srv->zDirty[--srv->zDirtyCount];
+
+			srv->zDirty[c->z->dirtyIndex] = last;
+			srv->clients.cold[last].z->dirtyIndex = c->z->dirtyIndex;
+		}
+
+		cl_unlistInflate(srv, slot);
+
+		if (c->z->backlog != NULL)
+		{
+			mem_release(&srv->mem, MEM_CLIENTS, RECV_BUF_SIZE);
+			free(c->z->backlog);
+		}
+
+		compress_release(&srv->zpool, c->z);
+		mem_release(&srv->mem, MEM_CLIENTS, sizeof(struct compress_conn));
+		free(c->z);
+		c->z = NULL;
 	}
 
-	return 0;
+	if (c->tls != NULL)
+	{
+		tls_connFree(c->tls);
+		mem_release(&srv->mem, MEM_CLIENTS, sizeof(struct tls_conn));
+		c->tls = NULL;
+	}
 
-on_error:
-	perror("fcntl");
-	return -1;
-}
+	if (h->flags & CL_WS)
+	{
+		struct ws_conn *wc = c->ctx;
 
-/*
- * Create and bind a new TCP server socket on the given port.
- * Returns socket descriptor on success, -1 on failure.
- */
-static int srv_createAndBind(int port)
-{
-	int sd;
-	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof(addr);
+		mem_release(&srv->mem, MEM_CLIENTS,
+			sizeof(struct ws_conn) + wc->msgCap + wc->heldLen);
+		ws_connFree(wc);
+		free(wc);
+		c->ctx = NULL;
+	}
 
-	/* Create a TCP socket */
-	sd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sd == -1)
+	if (h->flags & CL_MUX)
 	{
-		perror("socket");
-		return -1;
+		struct mux_conn *mc = c->ctx;
+
+		srv->mux.active -= mc->count;
+		mem_release(&srv->mem, MEM_CLIENTS, sizeof(struct mux_conn) +
+			mc->memSize);
+		mux_connFree(mc);
+		free(mc);
+		c->ctx = NULL;
 	}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = INADDR_ANY;
-	addr.sin_port = htons(port);
+	if (h->flags & CL_RPC)
+	{
+		struct rpc_conn *rc = c->ctx;
 
-	if (bind(sd, (struct sockaddr*)&addr, addrlen) == -1)
+		mem_release(&srv->mem, MEM_CLIENTS, sizeof(struct rpc_conn) + rc->cap +
+			rc->order.memSize);
+		rpc_cancel(&srv->rpc, rc);
+		rpc_connFree(rc);
+		free(rc);
+		c->ctx = NULL;
+	}
+
+	if (h->flags & CL_JSON)
 	{
-		perror("bind");
-		close(sd);
-		return -1;
+		struct jsonl_conn *jc = c->ctx;
+
+		mem_release(&srv->mem, MEM_CLIENTS, jc->cap);
+		jsonl_connFree(jc);
+		free(jc);
+		c->ctx = NULL;
 	}
 
-	return sd;
-}
+	if ((h->flags & CL_LOCAL) && c->ctx != NULL)
+	{
+		struct local_conn *lc = c->ctx;
 
-/*
- * Remove all clients from the connected clients list.
- */
-static void srv_freeAllClients(struct server *srv)
-{
-	assert(srv != NULL);
+		/*
+		 * The client holds a copy of the eventfd, so closing ours does not
+		 * remove it from the epoll set.
+		 */
+		if (lc->base != NULL)
+		{
+			epoll_ctl(srv->efd, EPOLL_CTL_DEL, lc->selfFd, NULL);
+			mem_release(&srv->mem, MEM_CLIENTS, lc->mapLen);
+			srv->localCount--;
+		}
+
+		local_close(lc);
+		free(lc);
+		c->ctx = NULL;
+	}
 
-	while (srv->clients != NULL)
+	if (srv->capture.hdr != NULL && !(h->flags & CL_ADMIN))
 	{
-		cl_free(srv->clients);
+		cap_write(&srv->capture, CAP_CLOSE, cl_id(srv, slot), NULL, 0);
 	}
-}
 
-/*
- * Handle epoll error events.
- */
-static void srv_handleError(const struct epoll_event *ev)
-{
-	struct client *cl;
+	trace_record(&srv->trace, TR_CLOSE, cl_id(srv, slot), 0);
+	PROBE_CLOSE(h->sd, cl_id(srv, slot), c->stats.bytesIn, c->stats.bytesOut);
 
-	fprintf(stderr, "Connection lost or epoll error.\n");
+	/*
+	 * Close the socket if necessary. Closing the socket will also remove it
+	 * from the epoll list (see epoll manpage for details).
+	 */
+	if (h->sd > -1)
+	{
+		if (shutdown(h->sd, SHUT_RDWR) == -1)
+		{
+			perror("shutdown");
+		}
 
-	cl = ev->data.ptr;
+		if (close(h->sd) == -1)
+		{
+			perror("close");
+		}
+	}
 
-	srv_onDisconnect(cl);
-	cl_free(cl);
+	/*
+	 * Release the slot. This bumps the generation and thereby invalidates
+	 * events for this client that are still pending in the current batch.
+	 */
+	clt_release(&srv->clients, slot);
 }
 
 /*
- * Handle accept events.
+ * Create a new client instance and add it to the client table.
+ * Returns the client slot, CL_SLOT_NONE on failure.
  */
-static void srv_handleAccept(int efd, const struct epoll_event *ev)
+static uint32_t cl_create(struct server *srv, int sd,
+	const struct sockaddr *addr)
 {
-	struct epoll_event eev;
-	struct sockaddr addr;
-	socklen_t addrlen = sizeof(addr);
-	int sd;
-	struct server *srv;
-	struct client *cl = NULL;
+	struct cl_cold *c;
+	uint32_t slot;
 
-	srv = ev->data.ptr;
+	assert(srv != NULL);
+	assert(addr != NULL);
 
-	sd = accept(srv->sd, &addr, &addrlen);
-	if (sd == -1)
+	slot = clt_acquire(&srv->clients, sd);
+	if (slot == CL_SLOT_NONE)
 	{
-		perror("accept");
-		return;
+		fprintf(stderr, "Rejecting client: client table is full.\n");
+		return CL_SLOT_NONE;
 	}
 
-	if (srv_setNonBlocking(sd) != 0)
+	c = &srv->clients.cold[slot];
+
+	/* Get remote IP */
+	if (addr->sa_family == AF_INET)
 	{
-		goto on_error;
+		inet_ntop(AF_INET, &((struct sockaddr_in*)addr)->sin_addr,
+			c->addr, INET_ADDRSTRLEN);
+		c->ip = ((struct sockaddr_in*)addr)->sin_addr.s_addr;
 	}
-
-	cl = cl_create(srv, sd, &addr);
-	if (cl == NULL)
+	else
 	{
-		goto on_error;
+		c->addr[0] = '\0';
 	}
 
-	memset(&eev, 0, sizeof(eev));
-	eev.data.ptr = cl;
-	eev.events = EPOLLIN | EPOLLET;
+	return slot;
+}
 
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, sd, &eev) == -1)
+/*
+ * Arm the idle deadline of a client.
+ */
+static void cl_touch(struct server *srv, uint32_t slot)
+{
+	if (srv->opts.idleTimeout > 0)
 	{
-		perror("epoll_ctl");
-		goto on_error;
+		srv->clients.hot[slot].timer = srv->tick + srv->opts.idleTimeout;
 	}
-
-	srv_onConnect(cl);
-	return;
-
-on_error:
-	cl_free(cl);
-	close(sd);
 }
 
 /*
- * Handle data receive events.
+ * Write as much of the output queue of a local client as its reply ring
+ * accepts. If the ring is full, the client signals once it made room.
  */
-static void srv_handleReceive(const struct epoll_event *ev)
+static void cl_flushLocal(struct server *srv, uint32_t slot)
 {
-	struct client *cl;
-	int done = 0;
+	struct cl_hot *h = &srv->clients.hot[slot];
+	struct cl_cold *c = &srv->clients.cold[slot];
 
-	cl = ev->data.ptr;
-
-	/*
-	 * We're running in edge triggered mode, i.e. we get notified only once
-	 * when data is available. Therefore we must read all available data at
-	 * once.
-	 */
-	while (1)
+	while (c->outHead != NULL)
 	{
-		ssize_t len;
+		struct buf *b = c->outHead;
+		size_t n;
 
-		len = read(cl->sd, cl->buffer, CLIENT_BUF_SIZE);
-		if (len == -1)
+		n = local_send(c->ctx, b->data + b->off, b->len - b->off);
+		if (n > 0)
 		{
-			if (errno != EAGAIN)
-			{
-				perror("read");
-				done = 1;
-			}
+			trace_record(&srv->trace, TR_WRITE, cl_id(srv, slot), (uint32_t)n);
 
-			break;
+			b->off += n;
+			h->outLen -= n;
+			PROBE_WRITE(h->sd, cl_id(srv, slot), n, h->outLen);
+			c->stats.bytesOut += n;
+			c->stats.writes++;
 		}
-		else if (len == 0)
+
+		if (b->off < b->len)
 		{
-			done = 1;
-			break;
+			if (local_waitSpace(c->ctx, b->len - b->off))
+			{
+				break;
+			}
+
+			continue;
 		}
-		else
+
+		c->outHead = b->next;
+		if (c->outHead == NULL)
 		{
-			srv_onReceive(cl, cl->buffer, len);
+			c->outTail = NULL;
 		}
+
+		srv_putBuffer(srv, b);
 	}
+}
+
+/*
+ * Write as much of the output queue as the socket accepts.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_flush(struct server *srv, uint32_t slot)
+{
+	struct cl_hot *h;
+	struct cl_cold *c;
+
+	assert(srv != NULL);
+
+	h = &srv->clients.hot[slot];
+	c = &srv->clients.cold[slot];
+
+	if (h->flags & CL_LOCAL)
+	{
+		cl_flushLocal(srv, slot);
+		return 0;
+	}
+
+	while (c->outHead != NULL)
+	{
+		struct buf *b = c->outHead;
+		ssize_t n;
+
+		/* MSG_NOSIGNAL: a peer that went away must not raise SIGPIPE */
+		n = send(h->sd, b->data + b->off, b->len - b->off, MSG_NOSIGNAL);
+		if (n == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+
+			perror("send");
+			return -1;
+		}
+
+		trace_record(&srv->trace, TR_WRITE, cl_id(srv, slot), (uint32_t)n);
+
+		b->off += n;
+		h->outLen -= n;
+		PROBE_WRITE(h->sd, cl_id(srv, slot), n, h->outLen);
+		c->stats.bytesOut += n;
+		c->stats.writes++;
+
+		if (b->off < b->len)
+		{
+			/* Socket buffer is full */
+			break;
+		}
+
+		c->outHead = b->next;
+		if (c->outHead == NULL)
+		{
+			c->outTail = NULL;
+		}
+
+		srv_putBuffer(srv, b);
+	}
+
+	/* Wait for EPOLLOUT only while output is pending */
+	if (h->outLen > 0 && !(h->flags & CL_WANT_WRITE))
+	{
+		if (cl_setEvents(srv, slot, EPOLL_CTL_MOD,
+			EPOLLIN | EPOLLOUT | EPOLLET) != 0)
+		{
+			return -1;
+		}
+
+		h->flags |= CL_WANT_WRITE;
+	}
+	else if (h->outLen == 0 && (h->flags & CL_WANT_WRITE))
+	{
+		if (cl_setEvents(srv, slot, EPOLL_CTL_MOD, EPOLLIN | EPOLLET) != 0)
+		{
+			return -1;
+		}
+
+		h->flags &= ~CL_WANT_WRITE;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the last output buffer of a client if it has room left, or a new
+ * one appended to the queue. Returns NULL if out of memory.
+ */
+static struct buf *cl_tailBuffer(struct server *srv, uint32_t slot)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	struct buf *b = c->outTail;
+
+	if (b != NULL && b->len < BUF_CAPACITY)
+	{
+		return b;
+	}
+
+	b = srv_getBuffer(srv);
+	if (b == NULL)
+	{
+		fprintf(stderr, "Failed to queue output: out of memory.\n");
+		return NULL;
+	}
+
+	if (c->outTail != NULL)
+	{
+		c->outTail->next = b;
+	}
+	else
+	{
+		c->outHead = b;
+	}
+
+	c->outTail = b;
+	return b;
+}
+
+/*
+ * Run the compressor of a client, appending its output to the output
+ * queue.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_runDeflate(struct server *srv, uint32_t slot, const char *data,
+	size_t len, int flush)
+{
+	z_stream *zs = &srv->clients.cold[slot].z->tx->zs;
+	int rc;
+
+	zs->next_in = (Bytef *)data;
+	zs->avail_in = (uInt)len;
+
+	do
+	{
+		struct buf *b = cl_tailBuffer(srv, slot);
+		size_t n;
+
+		if (b == NULL)
+		{
+			return -1;
+		}
+
+		zs->next_out = (Bytef *)b->data + b->len;
+		zs->avail_out = (uInt)(BUF_CAPACITY - b->len);
+		rc = deflate(zs, flush);
+
+		n = (BUF_CAPACITY - b->len) - zs->avail_out;
+		b->len += n;
+		srv->clients.hot[slot].outLen += (uint32_t)n;
+		srv->zpool.wireOut += n;
+
+		if (rc == Z_STREAM_ERROR)
+		{
+			srv->zpool.errors++;
+			return -1;
+		}
+	}
+	while (zs->avail_out == 0);
+
+	return 0;
+}
+
+/*
+ * Compress data for a client. The first write after a flush opens a
+ * segment if needed and picks the level from the queue depth.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_deflate(struct server *srv, uint32_t slot, const char *data,
+	size_t len)
+{
+	struct compress_conn *zc = srv->clients.cold[slot].z;
+
+	if (!zc->dirty)
+	{
+		int level = compress_level(srv->clients.hot[slot].outLen);
+
+		if (zc->tx == NULL)
+		{
+			zc->tx = compress_deflater(&srv->zpool, zc, level);
+			if (zc->tx == NULL)
+			{
+				fprintf(stderr, "Failed to compress: out of memory.\n");
+				return -1;
+			}
+		}
+		else if (deflateParams(&zc->tx->zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			srv->zpool.errors++;
+			return -1;
+		}
+
+		zc->dirty = 1;
+		zc->dirtyIndex = srv->zDirtyCount;
+		srv->zDirty[srv->zDirtyCount++] = slot;
+	}
+
+	zc->lastWriteMs = srv_nowMs();
+	srv->zpool.rawOut += len;
+	return cl_runDeflate(srv, slot, data, len, Z_NO_FLUSH);
+}
+
+/*
+ * Queue the records OpenSSL has written for a client and try to send them
+ * right away.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_drainTls(struct server *srv, uint32_t slot)
+{
+	struct tls_conn *tc = srv->clients.cold[slot].tls;
+
+	while (tls_pending(tc) > 0)
+	{
+		struct buf *b = cl_tailBuffer(srv, slot);
+		size_t n;
+
+		if (b == NULL)
+		{
+			return -1;
+		}
+
+		n = tls_output(tc, b->data + b->len, BUF_CAPACITY - b->len);
+		b->len += n;
+		srv->clients.hot[slot].outLen += (uint32_t)n;
+	}
+
+	return cl_flush(srv, slot);
+}
+
+/*
+ * Queue bytes for a client below the application protocol and try to send
+ * them right away.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_write(struct server *srv, uint32_t slot, const char *data,
+	size_t len)
+{
+	struct cl_hot *h = &srv->clients.hot[slot];
+	struct cl_cold *c = &srv->clients.cold[slot];
+
+	/* Compressed output is flushed once per loop iteration */
+	if (c->z != NULL)
+	{
+		return cl_deflate(srv, slot, data, len);
+	}
+
+	/* Until the keys are in the kernel records are encrypted here */
+	if (c->tls != NULL)
+	{
+		if (tls_write(c->tls, data, len) != 0)
+		{
+			return -1;
+		}
+
+		return cl_drainTls(srv, slot);
+	}
+
+	while (len > 0)
+	{
+		struct buf *b = cl_tailBuffer(srv, slot);
+		size_t n;
+
+		if (b == NULL)
+		{
+			return -1;
+		}
+
+		n = BUF_CAPACITY - b->len;
+		if (n > len)
+		{
+			n = len;
+		}
+
+		memcpy(b->data + b->len, data, n);
+		b->len += n;
+		h->outLen += n;
+		data += n;
+		len -= n;
+	}
+
+	return cl_flush(srv, slot);
+}
+
+/*
+ * Send gathered buffers. If nothing is queued they go to the socket in one
+ * call straight from the caller's memory, and only what the socket didn't
+ * take is copied into the output queue.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_sendv(struct server *srv, uint32_t slot,
+	const struct iovec *iov, int count)
+{
+	struct cl_hot *h = &srv->clients.hot[slot];
+	struct cl_cold *c = &srv->clients.cold[slot];
+	size_t sent = 0;
+	int i;
+
+	if (c->outHead == NULL && c->z == NULL && c->tls == NULL &&
+		!(h->flags & CL_LOCAL))
+	{
+		struct msghdr mh;
+		ssize_t n;
+
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = (struct iovec *)iov;
+		mh.msg_iovlen = (size_t)count;
+
+		n = sendmsg(h->sd, &mh, MSG_NOSIGNAL);
+		if (n == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				perror("sendmsg");
+				return -1;
+			}
+		}
+		else
+		{
+			trace_record(&srv->trace, TR_WRITE, cl_id(srv, slot), (uint32_t)n);
+			PROBE_WRITE(h->sd, cl_id(srv, slot), n, h->outLen);
+			c->stats.bytesOut += n;
+			c->stats.writes++;
+			sent = (size_t)n;
+		}
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		if (sent >= iov[i].iov_len)
+		{
+			sent -= iov[i].iov_len;
+			continue;
+		}
+
+		if (cl_write(srv, slot, (const char *)iov[i].iov_base + sent,
+			iov[i].iov_len - sent) != 0)
+		{
+			return -1;
+		}
+
+		sent = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Send a WebSocket frame. Server frames are not masked, so the payload goes
+ * out unchanged.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_sendFrame(struct server *srv, uint32_t slot, uint8_t opcode,
+	const char *data, size_t len)
+{
+	uint8_t hdr[WS_HEADER_MAX];
+	struct iovec iov[2];
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = ws_header(hdr, opcode, len);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	return cl_sendv(srv, slot, iov, 2);
+}
+
+/*
+ * Queue data for a client and try to send it right away.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_send(struct server *srv, uint32_t slot, const char *data,
+	size_t len)
+{
+	struct cl_hot *h;
+	struct cl_cold *c;
+
+	assert(srv != NULL);
+
+	h = &srv->clients.hot[slot];
+	c = &srv->clients.cold[slot];
+
+	if (srv->capture.hdr != NULL && !(h->flags & CL_ADMIN))
+	{
+		cap_write(&srv->capture, CAP_OUT, cl_id(srv, slot), data,
+			(uint32_t)len);
+	}
+
+	/* Local clients get replies straight in their ring while it has room */
+	if ((h->flags & CL_LOCAL) && c->outHead == NULL)
+	{
+		size_t n = local_send(c->ctx, data, len);
+
+		if (n > 0)
+		{
+			trace_record(&srv->trace, TR_WRITE, cl_id(srv, slot), (uint32_t)n);
+			c->stats.bytesOut += n;
+			c->stats.writes++;
+			data += n;
+			len -= n;
+		}
+
+		if (len == 0)
+		{
+			return 0;
+		}
+	}
+
+	/* Each write to a WebSocket client is one message */
+	if (h->flags & CL_WS)
+	{
+		struct ws_conn *wc = c->ctx;
+
+		if (!wc->open)
+		{
+			fprintf(stderr, "Dropping output to %s: WebSocket upgrade "
+				"pending.\n", c->addr);
+			return -1;
+		}
+
+		srv->ws.messagesOut++;
+		return cl_sendFrame(srv, slot,
+			wc->lastOpcode != 0 ? wc->lastOpcode : WS_OP_TEXT, data, len);
+	}
+
+	return cl_write(srv, slot, data, len);
+}
+
+/*
+ * Answer a compression hello and switch the client to compressed data.
+ * Returns 0 on success, -1 on failure.
+ */
+static int cl_startCompression(struct server *srv, uint32_t slot,
+	const char *hello)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	struct compress_conn zc;
+	struct compress_hello reply;
+
+	compress_accept(&srv->zpool, &zc, hello, &reply);
+
+	/* The reply itself is not compressed */
+	if (cl_write(srv, slot, (const char *)&reply, sizeof(reply)) != 0)
+	{
+		return -1;
+	}
+
+	c->z = malloc(sizeof(struct compress_conn));
+	if (c->z == NULL)
+	{
+		fprintf(stderr, "Failed to start compression: out of memory.\n");
+		return -1;
+	}
+
+	*c->z = zc;
+	mem_charge(&srv->mem, MEM_CLIENTS, sizeof(struct compress_conn));
+	return 0;
+}
+
+/*
+ * Record the start of a handler callback.
+ */
+static void srv_beginCallback(struct server *srv, enum trace_callback cb,
+	uint64_t client)
+{
+	PROBE_CALLBACK_ENTRY(cb, client);
+	srv->callbackStart = trace_record(&srv->trace, TR_CB_ENTER, client, cb);
+	watchdog_setCallback(&srv->watchdog, cb, client);
+}
+
+/*
+ * Release the scratch memory and the overflow charged for it.
+ */
+static void srv_resetScratch(struct server *srv)
+{
+	scratch_reset(&srv->scratch);
+	mem_release(&srv->mem, MEM_SCRATCH, srv->scratchCharged);
+	srv->scratchCharged = 0;
+}
+
+/*
+ * Record the end of a handler callback and release the scratch memory it
+ * used. In batch mode the release is deferred to the end of the loop
+ * iteration.
+ */
+static void srv_endCallback(struct server *srv)
+{
+	uint32_t cb = srv->watchdog.callback;
+	uint64_t client = srv->watchdog.client;
+	uint64_t end;
+
+	end = trace_record(&srv->trace, TR_CB_EXIT, client, cb);
+	PROBE_CALLBACK_RETURN(cb, client, end - srv->callbackStart);
+	watchdog_setCallback(&srv->watchdog, TR_CB_NONE, 0);
+
+	if (!srv->opts.scratchBatch)
+	{
+		srv_resetScratch(srv);
+	}
+}
+
+/*
+ * Raise the server start event.
+ */
+static void srv_onStart(struct server *srv)
+{
+	const struct srv_handler *h;
+
+	assert(srv != NULL);
+
+	h = srv->handler;
+	if (h != NULL && h->on_start != NULL)
+	{
+		srv_beginCallback(srv, TR_CB_START, 0);
+		h->on_start();
+		srv_endCallback(srv);
+	}
+}
+
+/*
+ * Raise the server stop event.
+ */
+static void srv_onStop(struct server *srv)
+{
+	const struct srv_handler *h;
+
+	assert(srv != NULL);
+
+	h = srv->handler;
+	if (h != NULL && h->on_stop != NULL)
+	{
+		srv_beginCallback(srv, TR_CB_STOP, 0);
+		h->on_stop();
+		srv_endCallback(srv);
+	}
+}
+
+/*
+ * Raise a handler event of a multiplexed stream, named after the client
+ * address and the stream id.
+ */
+static void srv_onStream(struct server *srv, uint32_t slot, uint32_t id,
+	enum trace_callback cb, const char *data, size_t len)
+{
+	const struct srv_handler *h = srv->handler;
+
+	if (h == NULL)
+	{
+		return;
+	}
+
+	snprintf(srv->muxName, sizeof(srv->muxName), "%s/%u",
+		srv->clients.cold[slot].addr, id);
+
+	srv_beginCallback(srv, cb, cl_id(srv, slot));
+
+	if (cb == TR_CB_CONNECT && h->on_connect != NULL)
+	{
+		h->on_connect(srv->muxName);
+	}
+	else if (cb == TR_CB_DISCONNECT && h->on_disconnect != NULL)
+	{
+		h->on_disconnect(srv->muxName);
+	}
+	else if (cb == TR_CB_RECEIVE && h->on_receive != NULL)
+	{
+		h->on_receive(srv->muxName, data, (int)len);
+	}
+
+	srv_endCallback(srv);
+}
+
+/*
+ * Send a frame on a multiplexed connection.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_muxSend(struct server *srv, uint32_t slot, uint32_t id,
+	uint8_t type, const void *payload, size_t len)
+{
+	uint8_t hdr[MUX_HEADER_SIZE];
+	struct mux_frame f;
+	struct iovec iov[2];
+
+	f.stream = id;
+	f.type = type;
+	f.len = (uint16_t)len;
+	mux_encode(hdr, &f);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+
+	srv->mux.framesOut++;
+	return cl_sendv(srv, slot, iov, len > 0 ? 2 : 1);
+}
+
+/*
+ * Send len bytes as data frames as far as the client's window allows and
+ * give the client the same amount of window back. As every received byte
+ * is echoed, a stream never holds more than one window of output.
+ * Returns the number of bytes sent, -1 on failure.
+ */
+static ssize_t srv_muxData(struct server *srv, uint32_t slot,
+	struct mux_stream *s, const char *data, size_t len)
+{
+	size_t sent = 0;
+
+	while (sent < len && s->sendWindow > 0)
+	{
+		size_t n = len - sent;
+
+		if (n > s->sendWindow)
+		{
+			n = s->sendWindow;
+		}
+
+		if (n > MUX_FRAME_MAX)
+		{
+			n = MUX_FRAME_MAX;
+		}
+
+		if (srv_muxSend(srv, slot, s->id, MUX_DATA, data + sent, n) != 0)
+		{
+			return -1;
+		}
+
+		s->sendWindow -= (uint32_t)n;
+		s->credit += (uint32_t)n;
+		sent += n;
+	}
+
+	/* Batch window updates, one per half window */
+	if (s->credit >= MUX_WINDOW / 2)
+	{
+		uint32_t grant = htobe32(s->credit);
+
+		if (srv_muxSend(srv, slot, s->id, MUX_WINDOW_UPDATE, &grant,
+			sizeof(grant)) != 0)
+		{
+			return -1;
+		}
+
+		s->recvWindow += s->credit;
+		s->credit = 0;
+	}
+
+	return (ssize_t)sent;
+}
+
+/*
+ * Tell the client a stream it closed is done and drop it.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_muxFinish(struct server *srv, uint32_t slot, uint32_t id)
+{
+	struct mux_conn *mc = srv->clients.cold[slot].ctx;
+
+	srv_onStream(srv, slot, id, TR_CB_DISCONNECT, NULL, 0);
+	mux_close(mc, id);
+	srv->mux.active--;
+
+	return srv_muxSend(srv, slot, id, MUX_CLOSE, NULL, 0);
+}
+
+/*
+ * Handle a frame received on a multiplexed connection. Frames of streams
+ * that are gone already are dropped.
+ * Returns 0 on success, -1 if the client has to be disconnected.
+ */
+static int srv_muxFrame(struct server *srv, uint32_t slot,
+	const struct mux_frame *f, const char *payload)
+{
+	struct mux_conn *mc = srv->clients.cold[slot].ctx;
+	struct mux_stream *s = mux_find(mc, f->stream);
+	ssize_t sent;
+	uint32_t n;
+
+	switch (f->type)
+	{
+	case MUX_OPEN:
+		if (f->stream == 0 || f->len != 0 || s != NULL)
+		{
+			return -1;
+		}
+
+		if (mc->count >= MUX_STREAMS_MAX)
+		{
+			srv->mux.refused++;
+			return srv_muxSend(srv, slot, f->stream, MUX_CLOSE, NULL, 0);
+		}
+
+		if (mux_open(mc, f->stream) == NULL)
+		{
+			return -1;
+		}
+
+		srv->mux.opened++;
+		srv->mux.active++;
+		srv_onStream(srv, slot, f->stream, TR_CB_CONNECT, NULL, 0);
+		return 0;
+
+	case MUX_DATA:
+		if (s == NULL)
+		{
+			return 0;
+		}
+
+		if (s->closing || f->len > s->recvWindow)
+		{
+			return -1;
+		}
+
+		s->recvWindow -= f->len;
+
+		/* Echo, behind output that is held already */
+		sent = s->pendLen > 0 ? 0 : srv_muxData(srv, slot, s, payload, f->len);
+		if (sent < 0)
+		{
+			return -1;
+		}
+
+		if ((size_t)sent < f->len)
+		{
+			srv->mux.stalls++;
+			if (mux_hold(mc, s, payload + sent, f->len - (size_t)sent) != 0)
+			{
+				return -1;
+			}
+		}
+
+		srv_onStream(srv, slot, f->stream, TR_CB_RECEIVE, payload, f->len);
+		return 0;
+
+	case MUX_WINDOW_UPDATE:
+		if (f->len != sizeof(n))
+		{
+			return -1;
+		}
+
+		if (s == NULL)
+		{
+			return 0;
+		}
+
+		memcpy(&n, payload, sizeof(n));
+		n = be32toh(n);
+		if (n == 0 || n > MUX_WINDOW_MAX - s->sendWindow)
+		{
+			return -1;
+		}
+
+		s->sendWindow += n;
+
+		sent = srv_muxData(srv, slot, s, s->pend, s->pendLen);
+		if (sent < 0)
+		{
+			return -1;
+		}
+
+		if (sent > 0)
+		{
+			mux_drain(mc, s, (uint32_t)sent);
+		}
+
+		if (s->closing && s->pendLen == 0)
+		{
+			return srv_muxFinish(srv, slot, f->stream);
+		}
+
+		return 0;
+
+	case MUX_CLOSE:
+		if (f->len != 0)
+		{
+			return -1;
+		}
+
+		if (s == NULL || s->closing)
+		{
+			return 0;
+		}
+
+		/* Held output is still delivered */
+		s->closing = 1;
+		if (s->pendLen == 0)
+		{
+			return srv_muxFinish(srv, slot, f->stream);
+		}
+
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Handle the frames in data received on a multiplexed connection.
+ * Returns 0 on success, -1 if the client has to be disconnected.
+ */
+static int srv_receiveMux(struct server *srv, uint32_t slot,
+	const char *data, size_t len)
+{
+	struct mux_conn *mc = srv->clients.cold[slot].ctx;
+	size_t memSize = mc->memSize;
+	struct mux_frame f;
+	const char *payload;
+	int r;
+
+	while ((r = mux_next(mc, &data, &len, &f, &payload)) > 0)
+	{
+		srv->mux.framesIn++;
+
+		if (srv_muxFrame(srv, slot, &f, payload) != 0)
+		{
+			r = -1;
+			break;
+		}
+	}
+
+	if (mc->memSize > memSize)
+	{
+		mem_charge(&srv->mem, MEM_CLIENTS, mc->memSize - memSize);
+	}
+	else if (mc->memSize < memSize)
+	{
+		mem_release(&srv->mem, MEM_CLIENTS, memSize - mc->memSize);
+	}
+
+	if (r < 0)
+	{
+		srv->mux.errors++;
+		fprintf(stderr, "Invalid stream frame from %s.\n",
+			srv->clients.cold[slot].addr);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Raise the client connect event.
+ */
+static void srv_onConnect(struct server *srv, uint32_t slot)
+{
+	const struct srv_handler *h;
+
+	assert(srv != NULL);
+
+	/* Streams of multiplexed clients are reported as they are opened */
+	if (srv->clients.hot[slot].flags & (CL_ADMIN | CL_MUX))
+	{
+		return;
+	}
+
+	h = srv->handler;
+	if (h != NULL && h->on_connect != NULL)
+	{
+		srv_beginCallback(srv, TR_CB_CONNECT, cl_id(srv, slot));
+		h->on_connect(srv->clients.cold[slot].addr);
+		srv_endCallback(srv);
+	}
+}
+
+/*
+ * Raise the client disconnect event.
+ */
+static void srv_onDisconnect(struct server *srv, uint32_t slot)
+{
+	const struct srv_handler *h;
+
+	assert(srv != NULL);
+
+	if (srv->clients.hot[slot].flags & CL_ADMIN)
+	{
+		return;
+	}
+
+	if (srv->clients.hot[slot].flags & CL_MUX)
+	{
+		struct mux_conn *mc = srv->clients.cold[slot].ctx;
+		uint32_t i;
+
+		for (i = 0; mc->streams != NULL && i <= mc->mask; ++i)
+		{
+			if (mc->streams[i].id != 0)
+			{
+				srv_onStream(srv, slot, mc->streams[i].id, TR_CB_DISCONNECT,
+					NULL, 0);
+			}
+		}
+
+		return;
+	}
+
+	h = srv->handler;
+	if (h != NULL && h->on_disconnect != NULL)
+	{
+		srv_beginCallback(srv, TR_CB_DISCONNECT, cl_id(srv, slot));
+		h->on_disconnect(srv->clients.cold[slot].addr);
+		srv_endCallback(srv);
+	}
+}
+
+/*
+ * Raise the client data receive event.
+ * Returns 0 on success, -1 if the client should be disconnected.
+ */
+static int srv_onReceive(struct server *srv, uint32_t slot, const char *buf,
+	ssize_t len)
+{
+	const struct srv_handler *h;
+	int rc = 0;
+
+	assert(srv != NULL);
+
+	/* Echo data back to client */
+	if (cl_send(srv, slot, buf, len) != 0)
+	{
+		fprintf(stderr, "Failed to write response data.\n");
+		rc = -1;
+	}
+
+	h = srv->handler;
+	if (h != NULL && h->on_receive != NULL)
+	{
+		srv_beginCallback(srv, TR_CB_RECEIVE, cl_id(srv, slot));
+		h->on_receive(srv->clients.cold[slot].addr, buf, len);
+		srv_endCallback(srv);
+	}
+
+	return rc;
+}
+
+/*
+ * Raise the JSON record event.
+ */
+static void srv_onRecord(struct server *srv, uint32_t slot,
+	const struct jsonl_record *rec)
+{
+	const struct srv_handler *h;
+
+	assert(srv != NULL);
+
+	h = srv->handler;
+	if (h != NULL && h->on_record != NULL)
+	{
+		srv_beginCallback(srv, TR_CB_RECORD, cl_id(srv, slot));
+		h->on_record(srv->clients.cold[slot].addr, rec);
+		srv_endCallback(srv);
+	}
+}
+
+/*
+ * Returns the monotonic time in us.
+ */
+static uint64_t srv_nowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Hand out the position of the next response of a client in ordered mode.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int srv_rpcSequence(struct server *srv, uint32_t slot, uint32_t *seq)
+{
+	struct rpc_conn *rc = srv->clients.cold[slot].ctx;
+	size_t memSize = rc->order.memSize;
+
+	if (reorder_next(&rc->order, seq) != 0)
+	{
+		return -1;
+	}
+
+	mem_charge(&srv->mem, MEM_CLIENTS, rc->order.memSize - memSize);
+	return 0;
+}
+
+/*
+ * Send a response in request order. The response is held back while an
+ * earlier one is outstanding; otherwise it goes out together with all held
+ * responses it unblocks in a single sendmsg.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_rpcOrdered(struct server *srv, uint32_t slot, uint32_t seq,
+	const uint8_t *hdr, const char *body, size_t len)
+{
+	struct rpc_conn *conn = srv->clients.cold[slot].ctx;
+	struct reorder *r = &conn->order;
+	size_t memSize = r->memSize;
+	struct iovec iov[RPC_IOV_MAX];
+	uint64_t now = srv_nowUs();
+	int rc = 0;
+	int n;
+
+	if (seq != r->head)
+	{
+		if (reorder_put(r, seq, hdr, RPC_HEADER_SIZE, body, len, now) != 0)
+		{
+			return -1;
+		}
+
+		mem_charge(&srv->mem, MEM_CLIENTS, r->memSize - memSize);
+		return 0;
+	}
+
+	iov[0].iov_base = (void *)hdr;
+	iov[0].iov_len = RPC_HEADER_SIZE;
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = len;
+	n = reorder_ready(r, seq + 1, iov + 2, RPC_IOV_MAX - 2);
+
+	if (cl_sendv(srv, slot, iov, n + 2) != 0)
+	{
+		return -1;
+	}
+
+	reorder_pop(r, (uint32_t)n + 1, now, &srv->rpcHol);
+
+	/* Longer runs of completed responses take more than one call */
+	while (rc == 0 && (n = reorder_ready(r, r->head, iov, RPC_IOV_MAX)) > 0)
+	{
+		rc = cl_sendv(srv, slot, iov, n);
+		reorder_pop(r, (uint32_t)n, now, &srv->rpcHol);
+	}
+
+	mem_release(&srv->mem, MEM_CLIENTS, memSize - r->memSize);
+	return rc;
+}
+
+/*
+ * Send the response to an RPC request, header and body in one go. seq is
+ * its position on the connection if responses go out in request order.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_rpcReply(struct server *srv, uint32_t slot, uint32_t seq,
+	uint32_t id, uint16_t method, uint16_t status, const char *body,
+	size_t len)
+{
+	uint8_t hdr[RPC_HEADER_SIZE];
+	struct rpc_header h;
+	struct iovec iov[2];
+
+	memset(&h, 0, sizeof(h));
+	h.flags = RPC_RESPONSE;
+	h.id = id;
+	h.method = method;
+	h.status = status;
+	h.len = (uint32_t)len;
+	rpc_encode(hdr, &h);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = len;
+
+	srv->rpc.responses++;
+	if (srv->opts.rpcOrdered)
+	{
+		return srv_rpcOrdered(srv, slot, seq, hdr, body, len);
+	}
+
+	return cl_sendv(srv, slot, iov, 2);
+}
+
+/*
+ * Run the method of an RPC request. Requests that expect a response are
+ * tracked until the method answers or their deadline passes, which is at
+ * most the server's timeout away.
+ * Returns 0 on success, -1 if the client has to be disconnected.
+ */
+static int srv_rpcCall(struct server *srv, uint32_t slot,
+	const struct rpc_header *h, const char *body)
+{
+	struct rpc_conn *rc = srv->clients.cold[slot].ctx;
+	uint32_t timeoutMs = (uint32_t)srv->opts.rpcTimeoutMs;
+	struct rpc_call call;
+	rpc_method fn;
+	void *arg;
+	uint16_t status = RPC_OK;
+	uint32_t seq = 0;
+
+	srv->rpc.requests++;
+	memset(&call, 0, sizeof(call));
+
+	if (srv->opts.rpcOrdered && !(h->flags & RPC_ONEWAY) &&
+		srv_rpcSequence(srv, slot, &seq) != 0)
+	{
+		return -1;
+	}
+
+	fn = rpc_lookup(&srv->rpc, h->method, &arg);
+	if (fn == NULL)
+	{
+		srv->rpc.unknown++;
+		status = RPC_NO_METHOD;
+	}
+	else
+	{
+		if (h->timeoutMs > 0 && h->timeoutMs < timeoutMs)
+		{
+			timeoutMs = h->timeoutMs;
+		}
+
+		call.deadlineMs = srv_nowMs() + timeoutMs;
+
+		if (h->flags & RPC_ONEWAY)
+		{
+			srv->rpc.oneway++;
+		}
+		else if (rc->pending >= RPC_CONN_PENDING_MAX)
+		{
+			/* One client must not take all pending slots */
+			srv->rpc.busy++;
+			status = RPC_BUSY;
+		}
+		else
+		{
+			call.token = rpc_track(&srv->rpc, rc, cl_id(srv, slot), h->id, seq,
+				h->method, call.deadlineMs);
+			if (call.token == 0)
+			{
+				status = RPC_BUSY;
+			}
+		}
+	}
+
+	if (status != RPC_OK)
+	{
+		if (h->flags & RPC_ONEWAY)
+		{
+			return 0;
+		}
+
+		return srv_rpcReply(srv, slot, seq, h->id, h->method, status, NULL,
+			0);
+	}
+
+	call.ip = srv->clients.cold[slot].addr;
+	call.id = h->id;
+	call.method = h->method;
+	call.flags = h->flags;
+	call.body = body;
+	call.len = h->len;
+
+	srv_beginCallback(srv, TR_CB_RPC, cl_id(srv, slot));
+	fn(arg, &call);
+	srv_endCallback(srv);
+	return 0;
+}
+
+/*
+ * Handle the RPC requests in data received from a client.
+ * Returns 0 on success, -1 if the client has to be disconnected.
+ */
+static int srv_receiveRpc(struct server *srv, uint32_t slot,
+	const char *data, size_t len)
+{
+	struct rpc_conn *rc = srv->clients.cold[slot].ctx;
+	struct rpc_header h;
+	const char *body;
+	uint32_t cap = rc->cap;
+	int r;
+
+	while ((r = rpc_next(rc, &data, &len, &h, &body)) > 0)
+	{
+		/* Clients only send requests */
+		if ((h.flags & RPC_RESPONSE) || srv_rpcCall(srv, slot, &h, body) != 0)
+		{
+			r = -1;
+			break;
+		}
+	}
+
+	if (rc->cap != cap)
+	{
+		mem_charge(&srv->mem, MEM_CLIENTS, rc->cap - cap);
+	}
+
+	if (r < 0)
+	{
+		srv->rpc.errors++;
+		fprintf(stderr, "Invalid RPC request from %s.\n",
+			srv->clients.cold[slot].addr);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Hand the complete and valid JSON lines of a read to the handler. Partial
+ * lines are buffered per client and charged to the client table.
+ */
+static void srv_receiveJson(struct server *srv, uint32_t slot,
+	const char *data, size_t len)
+{
+	struct jsonl_conn *jc = srv->clients.cold[slot].ctx;
+	struct jsonl_record rec;
+	uint32_t cap = jc->cap;
+
+	while (jsonl_next(&srv->jsonl, jc, &data, &len, &rec))
+	{
+		srv_onRecord(srv, slot, &rec);
+	}
+
+	if (jc->cap != cap)
+	{
+		mem_charge(&srv->mem, MEM_CLIENTS, jc->cap - cap);
+	}
+}
+
+/*
+ * Set a socket descriptor to use non-blocking IO.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_setNonBlocking(int sd)
+{
+	int flags;
+
+	flags = fcntl(sd, F_GETFL, 0);
+	if (flags == -1)
+	{
+		goto on_error;
+	}
+
+	flags |= O_NONBLOCK;
+	if (fcntl(sd, F_SETFL, flags) == -1)
+	{
+		goto on_error;
+	}
+
+	return 0;
+
+on_error:
+	perror("fcntl");
+	return -1;
+}
+
+/*
+ * Create and bind a new TCP or UDP socket on the given address and port.
+ * Returns socket descriptor on success, -1 on failure.
+ */
+static int srv_createAndBind(in_addr_t ip, int port, int type)
+{
+	int sd;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	sd = socket(AF_INET, type, 0);
+	if (sd == -1)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(ip);
+	addr.sin_port = htons(port);
+
+	if (bind(sd, (struct sockaddr*)&addr, addrlen) == -1)
+	{
+		perror("bind");
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/*
+ * Create a non-blocking listening socket.
+ * Returns socket descriptor on success, -1 on failure.
+ */
+static int srv_listen(in_addr_t ip, int port)
+{
+	int sd;
+
+	sd = srv_createAndBind(ip, port, SOCK_STREAM);
+	if (sd == -1)
+	{
+		return -1;
+	}
+
+	if (srv_setNonBlocking(sd) != 0)
+	{
+		close(sd);
+		return -1;
+	}
+
+	if (listen(sd, SOMAXCONN) == -1)
+	{
+		perror("listen");
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/*
+ * Start statsd aggregation and open the UDP socket on the server port.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_openStatsd(struct server *srv, int port)
+{
+	int size = 4 << 20;
+
+	srv->udpBuf = malloc((size_t)UDP_BATCH * UDP_DATAGRAM_MAX);
+	if (srv->udpBuf == NULL)
+	{
+		fprintf(stderr, "Failed to allocate datagram buffers.\n");
+		return -1;
+	}
+
+	srv->udpSd = srv_createAndBind(INADDR_ANY, port, SOCK_DGRAM);
+	if (srv->udpSd == -1 || srv_setNonBlocking(srv->udpSd) != 0)
+	{
+		return -1;
+	}
+
+	/* Absorb bursts arriving while the loop is busy */
+	if (setsockopt(srv->udpSd, SOL_SOCKET, SO_RCVBUF, &size,
+		sizeof(size)) != 0)
+	{
+		perror("setsockopt SO_RCVBUF");
+	}
+
+	if (statsd_open(&srv->statsd, srv->opts.statsdPath,
+		srv->opts.statsdFlushSec, &srv->mem) != 0)
+	{
+		fprintf(stderr, "Failed to start statsd aggregation.\n");
+		return -1;
+	}
+
+	mem_reserve(&srv->mem, MEM_STATSD, (size_t)UDP_BATCH * UDP_DATAGRAM_MAX);
+	return 0;
+}
+
+/*
+ * Remove all clients from the client table.
+ */
+static void srv_freeAllClients(struct server *srv)
+{
+	uint32_t i;
+
+	assert(srv != NULL);
+
+	for (i = 0; i < srv->clients.capacity && srv->clients.count > 0; ++i)
+	{
+		if (srv->clients.hot[i].flags & CL_ACTIVE)
+		{
+			cl_free(srv, i);
+		}
+	}
+}
+
+/*
+ * Disconnect clients whose idle deadline has passed. This is a linear sweep
+ * over the hot client array, which is dense enough to be scanned once per
+ * tick even with a large number of clients.
+ */
+static void srv_sweepIdle(struct server *srv)
+{
+	uint32_t i;
+
+	assert(srv != NULL);
+
+	for (i = 0; i < srv->clients.capacity; ++i)
+	{
+		const struct cl_hot *h = &srv->clients.hot[i];
+
+		if ((h->flags & CL_ACTIVE) && h->timer != 0 && h->timer <= srv->tick)
+		{
+			srv_onDisconnect(srv, i);
+			cl_free(srv, i);
+		}
+	}
+}
+
+/*
+ * Handle epoll error events on a client socket.
+ */
+static void srv_handleError(struct server *srv, uint32_t slot)
+{
+	fprintf(stderr, "Connection lost or epoll error.\n");
+
+	srv_onDisconnect(srv, slot);
+	cl_free(srv, slot);
+}
+
+/*
+ * Hand a ring pair to a new local client and watch the server's eventfd.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_attachLocal(struct server *srv, uint32_t slot)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	struct local_conn *lc;
+	struct epoll_event eev;
+
+	lc = malloc(sizeof(struct local_conn));
+	if (lc == NULL)
+	{
+		return -1;
+	}
+
+	c->ctx = lc;
+	if (local_setup(srv->clients.hot[slot].sd, lc,
+		(size_t)srv->opts.localRingKB << 10) != 0)
+	{
+		return -1;
+	}
+
+	mem_charge(&srv->mem, MEM_CLIENTS, lc->mapLen);
+	srv->localCount++;
+	strcpy(c->addr, "local");
+
+	memset(&eev, 0, sizeof(eev));
+	eev.data.u64 = EV_HANDLE(EV_LOCAL, srv->clients.hot[slot].gen, slot);
+	eev.events = EPOLLIN;
+
+	if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, lc->selfFd, &eev) == -1)
+	{
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Accept a single pending connection.
+ * Returns 0 if a connection was taken from the queue, -1 if the queue is
+ * empty or accept failed.
+ */
+static int srv_acceptClient(struct server *srv, int lsd, uint32_t flags)
+{
+	struct sockaddr addr;
+	socklen_t addrlen = sizeof(addr);
+	uint64_t start;
+	int sd;
+	uint32_t slot;
+
+	sd = accept(lsd, &addr, &addrlen);
+	if (sd == -1)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			perror("accept");
+		}
+
+		return -1;
+	}
+
+	if (srv_setNonBlocking(sd) != 0)
+	{
+		goto on_error;
+	}
+
+	slot = cl_create(srv, sd, &addr);
+	if (slot == CL_SLOT_NONE)
+	{
+		goto on_error;
+	}
+
+	srv->clients.hot[slot].flags |= flags;
+
+	if ((flags & CL_LOCAL) && srv_attachLocal(srv, slot) != 0)
+	{
+		fprintf(stderr, "Rejecting local client: setup failed.\n");
+		cl_free(srv, slot);
+		return 0;
+	}
+
+	if (flags & CL_TLS)
+	{
+		srv->clients.cold[slot].tls = tls_accept(&srv->tls);
+		if (srv->clients.cold[slot].tls == NULL)
+		{
+			fprintf(stderr, "Rejecting TLS client: setup failed.\n");
+			cl_free(srv, slot);
+			return 0;
+		}
+
+		mem_charge(&srv->mem, MEM_CLIENTS, sizeof(struct tls_conn));
+	}
+
+	if (srv->sink.running && !(flags & (CL_ADMIN | CL_LOCAL)))
+	{
+		srv->clients.cold[slot].ctx = calloc(1, sizeof(struct sink_conn));
+		if (srv->clients.cold[slot].ctx == NULL)
+		{
+			fprintf(stderr, "Rejecting client: out of memory.\n");
+			cl_free(srv, slot);
+			return 0;
+		}
+
+		srv->clients.hot[slot].flags |= CL_SINK;
+	}
+
+	if (srv->statsd.running && !(flags & (CL_ADMIN | CL_LOCAL)))
+	{
+		srv->clients.cold[slot].ctx = calloc(1, sizeof(struct statsd_conn));
+		if (srv->clients.cold[slot].ctx == NULL)
+		{
+			fprintf(stderr, "Rejecting client: out of memory.\n");
+			cl_free(srv, slot);
+			return 0;
+		}
+
+		srv->clients.hot[slot].flags |= CL_STATSD;
+	}
+
+	if (srv->jsonl.index != NULL && !(flags & (CL_ADMIN | CL_LOCAL)))
+	{
+		srv->clients.cold[slot].ctx = calloc(1, sizeof(struct jsonl_conn));
+		if (srv->clients.cold[slot].ctx == NULL)
+		{
+			fprintf(stderr, "Rejecting client: out of memory.\n");
+			cl_free(srv, slot);
+			return 0;
+		}
+
+		srv->clients.hot[slot].flags |= CL_JSON;
+	}
+
+	if (srv->opts.websocket && !(flags & (CL_ADMIN | CL_LOCAL)))
+	{
+		srv->clients.cold[slot].ctx = calloc(1, sizeof(struct ws_conn));
+		if (srv->clients.cold[slot].ctx == NULL)
+		{
+			fprintf(stderr, "Rejecting client: out of memory.\n");
+			cl_free(srv, slot);
+			return 0;
+		}
+
+		srv->clients.hot[slot].flags |= CL_WS;
+		mem_charge(&srv->mem, MEM_CLIENTS, sizeof(struct ws_conn));
+	}
+
+	if (srv->opts.rpc && !(flags & (CL_ADMIN | CL_LOCAL)))
+	{
+		srv->clients.cold[slot].ctx = calloc(1, sizeof(struct rpc_conn));
+		if (srv->clients.cold[slot].ctx == NULL)
+		{
+			fprintf(stderr, "Rejecting client: out of memory.\n");
+			cl_free(srv, slot);
+			return 0;
+		}
+
+		srv->clients.hot[slot].flags |= CL_RPC;
+		mem_charge(&srv->mem, MEM_CLIENTS, sizeof(struct rpc_conn));
+	}
+
+	if (srv->opts.mux && !(flags & (CL_ADMIN | CL_LOCAL)))
+	{
+		srv->clients.cold[slot].ctx = calloc(1, sizeof(struct mux_conn));
+		if (srv->clients.cold[slot].ctx == NULL)
+		{
+			fprintf(stderr, "Rejecting client: out of memory.\n");
+			cl_free(srv, slot);
+			return 0;
+		}
+
+		srv->clients.hot[slot].flags |= CL_MUX;
+		mem_charge(&srv->mem, MEM_CLIENTS, sizeof(struct mux_conn));
+	}
+
+	/* Only the first bytes of a plain connection may ask for compression */
+	if (srv->opts.compress &&
+		!(srv->clients.hot[slot].flags & (CL_ADMIN | CL_LOCAL | CL_TLS | CL_WS)))
+	{
+		srv->clients.hot[slot].flags |= CL_HELLO;
+	}
+
+	if (srv->opts.rxTimestamps && !(flags & (CL_ADMIN | CL_LOCAL)))
+	{
+		int ts = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+		if (setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &ts, sizeof(ts)) != 0)
+		{
+			perror("setsockopt SO_TIMESTAMPING");
+		}
+	}
+
+	/* The socket of a local client only reports that the client is gone */
+	if (cl_setEvents(srv, slot, EPOLL_CTL_ADD,
+		(flags & CL_LOCAL) ? 0 : EPOLLIN | EPOLLET) != 0)
+	{
+		/* cl_free closes the socket */
+		cl_free(srv, slot);
+		return 0;
+	}
+
+	if (srv->sketch != NULL && !(flags & (CL_ADMIN | CL_LOCAL)))
+	{
+		sketch_connect(srv->sketch, srv->clients.cold[slot].ip);
+	}
+
+	if (srv->capture.hdr != NULL && !(flags & CL_ADMIN))
+	{
+		cap_write(&srv->capture, CAP_CONNECT, cl_id(srv, slot), NULL, 0);
+	}
+
+	start = trace_record(&srv->trace, TR_ACCEPT, cl_id(srv, slot), 0);
+	PROBE_ACCEPT(sd, cl_id(srv, slot));
+	cl_touch(srv, slot);
+	srv_onConnect(srv, slot);
+	srv->clients.cold[slot].stats.cycles += tsc_now() - start;
+	return 0;
+
+on_error:
+	close(sd);
+	return 0;
+}
+
+/*
+ * Handle accept events. The listener is edge triggered, so the accept queue
+ * must be drained completely.
+ */
+static void srv_handleAccept(struct server *srv, int lsd, uint32_t flags)
+{
+	while (srv_acceptClient(srv, lsd, flags) == 0)
+	{
+	}
+}
+
+/*
+ * Handle socket writable events.
+ */
+static void srv_handleWrite(struct server *srv, uint32_t slot)
+{
+	if (cl_flush(srv, slot) != 0)
+	{
+		srv_onDisconnect(srv, slot);
+		cl_free(srv, slot);
+	}
+}
+
+/*
+ * Start the sampling profiler, writing to a file named after the process
+ * and the start time.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_startProfile(struct server *srv, int seconds)
+{
+	if (prof_active(&srv->prof))
+	{
+		return -1;
+	}
+
+	snprintf(srv->profPath, sizeof(srv->profPath), "profile-%d-%ld.folded",
+		(int)getpid(), (long)time(NULL));
+
+	if (prof_start(&srv->prof, seconds) != 0)
+	{
+		fprintf(stderr, "Failed to start profiler.\n");
+		return -1;
+	}
+
+	fprintf(stderr, "Profiling for %d seconds (%s) into %s.\n", seconds,
+		srv->prof.backend == PROF_PERF ? "perf_event" : "SIGPROF",
+		srv->profPath);
+
+	return 0;
+}
+
+/*
+ * Collect profiler samples and write the result once the profile is due.
+ */
+static void srv_pollProfile(struct server *srv)
+{
+	prof_poll(&srv->prof);
+
+	if (prof_remainingMs(&srv->prof) == 0)
+	{
+		uint64_t samples = srv->prof.samples;
+
+		if (prof_finish(&srv->prof, srv->profPath) == 0)
+		{
+			fprintf(stderr, "Wrote %llu samples to %s.\n",
+				(unsigned long long)samples, srv->profPath);
+		}
+	}
+}
+
+/* Admin command handler, returns -1 to close the connection */
+typedef int (*admin_fn)(struct server *srv, const char *args, FILE *fp);
+
+/* Admin command */
+struct admin_cmd
+{
+	const char *name;
+	const char *help;
+	admin_fn fn;
+};
+
+/* Partially received admin command line */
+struct admin_conn
+{
+	size_t len;
+	char line[ADMIN_LINE_MAX];
+};
+
+static int srv_adminHelp(struct server *srv, const char *args, FILE *fp);
+
+static int srv_adminStats(struct server *srv, const char *args, FILE *fp)
+{
+	(void)args;
+
+	srv_writeStats(srv, fp);
+	return 0;
+}
+
+static int srv_adminProfile(struct server *srv, const char *args, FILE *fp)
+{
+	int seconds = atoi(args);
+
+	if (seconds <= 0)
+	{
+		seconds = DEFAULT_PROFILE_SECONDS;
+	}
+
+	if (srv_startProfile(srv, seconds) != 0)
+	{
+		fprintf(fp, "error: profiler busy or unavailable\n");
+	}
+	else
+	{
+		fprintf(fp, "profiling for %d seconds into %s\n", seconds,
+			srv->profPath);
+	}
+
+	return 0;
+}
+
+static int srv_adminQuit(struct server *srv, const char *args, FILE *fp)
+{
+	(void)srv;
+	(void)args;
+	(void)fp;
+
+	return -1;
+}
+
+static int srv_adminSlow(struct server *srv, const char *args, FILE *fp)
+{
+	uint32_t i;
+
+	(void)args;
+
+	if (srv->opts.tcpSweep <= 0)
+	{
+		fputs("TCP sampling is disabled\n", fp);
+		return 0;
+	}
+
+	for (i = 0; i < srv->clients.capacity; ++i)
+	{
+		const struct cl_tcp *t = &srv->clients.cold[i].tcp;
+
+		if (!(srv->clients.hot[i].flags & CL_SLOW))
+		{
+			continue;
+		}
+
+		fprintf(fp, "%llu %s rtt=%u rttvar=%u retrans=%u cwnd=%u "
+			"unacked=%u queued=%u growth=%d\n",
+			(unsigned long long)cl_id(srv, i), srv->clients.cold[i].addr,
+			t->rtt, t->rttvar, t->retrans, t->cwnd, t->unacked, t->queued,
+			t->growth);
+	}
+
+	return 0;
+}
+
+static int srv_adminTop(struct server *srv, const char *args, FILE *fp)
+{
+	struct heavy_hitters *hh;
+	char what[16] = "bytes";
+	char addr[INET_ADDRSTRLEN];
+	int n = 10;
+	uint32_t i;
+
+	if (srv->sketch == NULL)
+	{
+		fputs("Traffic sketches are disabled\n", fp);
+		return 0;
+	}
+
+	sscanf(args, "%15s %d", what, &n);
+	if (strcmp(what, "bytes") == 0)
+	{
+		hh = &srv->sketch->bytes;
+	}
+	else if (strcmp(what, "conns") == 0)
+	{
+		hh = &srv->sketch->conns;
+	}
+	else
+	{
+		fputs("Usage: top [bytes|conns] [n]\n", fp);
+		return 0;
+	}
+
+	sketch_tick(srv->sketch, time(NULL));
+	hh_sort(hh);
+
+	fprintf(fp, "total %llu\n", (unsigned long long)hh->total);
+	for (i = 0; i < hh->topCount && i < (uint32_t)n; ++i)
+	{
+		inet_ntop(AF_INET, &hh->top[i].key, addr, sizeof(addr));
+		fprintf(fp, "%s %llu +-%llu\n", addr,
+			(unsigned long long)hh->top[i].count,
+			(unsigned long long)hh->top[i].error);
+	}
+
+	return 0;
+}
+
+static int srv_adminDistinct(struct server *srv, const char *args, FILE *fp)
+{
+	int i;
+
+	(void)args;
+
+	if (srv->sketch == NULL)
+	{
+		fputs("Traffic sketches are disabled\n", fp);
+		return 0;
+	}
+
+	sketch_tick(srv->sketch, time(NULL));
+	fprintf(fp, "current %.0f\n", hll_estimate(&srv->sketch->distinct));
+
+	/* Newest minute first */
+	fputs("past", fp);
+	for (i = 0; i < SKETCH_MINUTES; ++i)
+	{
+		fprintf(fp, " %u", srv->sketch->history[i]);
+	}
+
+	fputc('\n', fp);
+
+	return 0;
+}
+
+static int srv_adminCpu(struct server *srv, const char *args, FILE *fp)
+{
+	uint32_t slots[CPU_TOP_MAX];
+	const struct cl_cold *cold = srv->clients.cold;
+	int max = 10, n = 0, i, j;
+	uint32_t s;
+
+	sscanf(args, "%d", &max);
+	if (max < 1 || max > CPU_TOP_MAX)
+	{
+		max = CPU_TOP_MAX;
+	}
+
+	for (s = 0; s < srv->clients.capacity; ++s)
+	{
+		if ((srv->clients.hot[s].flags & (CL_ACTIVE | CL_ADMIN)) != CL_ACTIVE)
+		{
+			continue;
+		}
+
+		if (n == max && cold[slots[n - 1]].stats.cycles >= cold[s].stats.cycles)
+		{
+			continue;
+		}
+
+		/* Insertion into the sorted candidate list */
+		j = (n < max) ? n++ : n - 1;
+		while (j > 0 && cold[slots[j - 1]].stats.cycles < cold[s].stats.cycles)
+		{
+			slots[j] = slots[j - 1];
+			--j;
+		}
+
+		slots[j] = s;
+	}
+
+	for (i = 0; i < n; ++i)
+	{
+		const struct cl_stats *st = &cold[slots[i]].stats;
+
+		fprintf(fp, "%llu %s cycles=%llu us=%llu bytes_in=%llu "
+			"cycles_per_byte=%.1f\n",
+			(unsigned long long)cl_id(srv, slots[i]), cold[slots[i]].addr,
+			(unsigned long long)st->cycles,
+			(unsigned long long)(tsc_toNs(st->cycles) / 1000),
+			(unsigned long long)st->bytesIn,
+			st->bytesIn > 0 ? (double)st->cycles / st->bytesIn : 0.0);
+	}
+
+	return 0;
+}
+
+static const struct admin_cmd g_adminCmds[] =
+{
+	{ "help", "List commands", srv_adminHelp },
+	{ "stats", "Print server statistics", srv_adminStats },
+	{ "slow", "List clients with a growing send queue", srv_adminSlow },
+	{ "cpu", "[n] Clients that used the most CPU time", srv_adminCpu },
+	{ "top", "[bytes|conns] [n] Top source IPs, halved every minute",
+		srv_adminTop },
+	{ "distinct", "Distinct source IPs this minute and the past hour",
+		srv_adminDistinct },
+	{ "profile", "[seconds] Write a folded-stack CPU profile",
+		srv_adminProfile },
+	{ "quit", "Close the admin connection", srv_adminQuit }
+};
+
+#define ADMIN_CMDS (sizeof(g_adminCmds) / sizeof(g_adminCmds[0]))
+
+static int srv_adminHelp(struct server *srv, const char *args, FILE *fp)
+{
+	size_t i;
+
+	(void)srv;
+	(void)args;
+
+	for (i = 0; i < ADMIN_CMDS; ++i)
+	{
+		fprintf(fp, "%-10s %s\n", g_adminCmds[i].name, g_adminCmds[i].help);
+	}
+
+	return 0;
+}
+
+/*
+ * Run an admin command line and send the output to the admin client.
+ * Returns 0 on success, -1 if the connection should be closed.
+ */
+static int srv_adminCommand(struct server *srv, uint32_t slot, char *line)
+{
+	char *out = NULL;
+	size_t outLen = 0, nameLen, i;
+	const char *args;
+	FILE *fp;
+	int rc = 0;
+
+	/* Split "name args" */
+	nameLen = strcspn(line, " \t");
+	args = line + nameLen + strspn(line + nameLen, " \t");
+
+	if (nameLen == 0)
+	{
+		return 0;
+	}
+
+	fp = open_memstream(&out, &outLen);
+	if (fp == NULL)
+	{
+		perror("open_memstream");
+		return -1;
+	}
+
+	for (i = 0; i < ADMIN_CMDS; ++i)
+	{
+		if (strlen(g_adminCmds[i].name) == nameLen &&
+			strncmp(g_adminCmds[i].name, line, nameLen) == 0)
+		{
+			rc = g_adminCmds[i].fn(srv, args, fp);
+			break;
+		}
+	}
+
+	if (i == ADMIN_CMDS)
+	{
+		fprintf(fp, "error: unknown command, try help\n");
+	}
+
+	fclose(fp);
+
+	if (rc == 0 && outLen > 0 && cl_send(srv, slot, out, outLen) != 0)
+	{
+		rc = -1;
+	}
+
+	free(out);
+
+	return rc;
+}
+
+/*
+ * Split data received on an admin connection into lines and run them.
+ * Returns 0 on success, -1 if the connection should be closed.
+ */
+static int srv_adminReceive(struct server *srv, uint32_t slot,
+	const char *buf, ssize_t len)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	struct admin_conn *a = c->ctx;
+	ssize_t i;
+
+	if (a == NULL)
+	{
+		a = calloc(1, sizeof(struct admin_conn));
+		if (a == NULL)
+		{
+			return -1;
+		}
+
+		c->ctx = a;
+	}
+
+	for (i = 0; i < len; ++i)
+	{
+		if (buf[i] != '\n')
+		{
+			/* Overlong lines are truncated */
+			if (a->len < ADMIN_LINE_MAX - 1)
+			{
+				a->line[a->len++] = buf[i];
+			}
+
+			continue;
+		}
+
+		if (a->len > 0 && a->line[a->len - 1] == '\r')
+		{
+			a->len--;
+		}
+
+		a->line[a->len] = '\0';
+		a->len = 0;
+
+		if (srv_adminCommand(srv, slot, a->line) != 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Check whether memory usage exceeds the soft limit. Preallocated tables
+ * don't count, only memory that grows with the load.
+ */
+static int srv_overSoftLimit(const struct server *srv)
+{
+	return srv->opts.memSoftLimit > 0 &&
+		mem_variable(&srv->mem) > (size_t)srv->opts.memSoftLimit << 20;
+}
+
+/*
+ * Find the clients holding the most output memory, largest first.
+ * Returns the number of slots stored.
+ */
+static int srv_findConsumers(struct server *srv, uint32_t *slots, int max,
+	int skipPaused)
+{
+	const struct cl_hot *hot = srv->clients.hot;
+	uint32_t i;
+	int n = 0;
+
+	for (i = 0; i < srv->clients.capacity; ++i)
+	{
+		int j;
+
+		if (!(hot[i].flags & CL_ACTIVE) || hot[i].outLen == 0 ||
+			(skipPaused && (hot[i].flags & CL_PAUSED)))
+		{
+			continue;
+		}
+
+		if (n == max && hot[i].outLen <= hot[slots[n - 1]].outLen)
+		{
+			continue;
+		}
+
+		/* Insertion into the sorted candidate list */
+		j = (n < max) ? n++ : n - 1;
+		while (j > 0 && hot[slots[j - 1]].outLen < hot[i].outLen)
+		{
+			slots[j] = slots[j - 1];
+			--j;
+		}
+
+		slots[j] = i;
+	}
+
+	return n;
+}
+
+/*
+ * Pause reads from the biggest consumers.
+ * Returns the number of clients paused.
+ */
+static int srv_pauseConsumers(struct server *srv)
+{
+	uint32_t slots[SHED_BATCH];
+	int n, i;
+
+	n = srv_findConsumers(srv, slots, SHED_BATCH, 1);
+	for (i = 0; i < n; ++i)
+	{
+		srv->clients.hot[slots[i]].flags |= CL_PAUSED;
+		srv->pausedCount++;
+		srv->pausedTotal++;
+	}
+
+	return n;
+}
+
+/*
+ * Pause the biggest consumers once the soft limit is exceeded, at most once
+ * per loop iteration. If no client holds output, the client being read is
+ * paused instead as it is the one adding memory.
+ * Returns 1 if the client is paused now, 0 otherwise.
+ */
+static int srv_checkSoftLimit(struct server *srv, uint32_t slot)
+{
+	struct cl_hot *h = &srv->clients.hot[slot];
+
+	if (!srv_overSoftLimit(srv))
+	{
+		return 0;
+	}
+
+	if (srv->pauseIteration != srv->iterations + 1)
+	{
+		srv->pauseIteration = srv->iterations + 1;
+		srv_pauseConsumers(srv);
+	}
+
+	if (!(h->flags & CL_PAUSED) && srv->pausedCount == 0)
+	{
+		h->flags |= CL_PAUSED;
+		srv->pausedCount++;
+		srv->pausedTotal++;
+	}
+
+	return (h->flags & CL_PAUSED) != 0;
+}
+
+/*
+ * Record the time received data spent queued in the kernel, given the
+ * software receive timestamp of the last segment read.
+ */
+static void srv_recordRxDelay(struct server *srv, uint32_t slot,
+	const struct timespec *stamp)
+{
+	struct timespec now;
+	int64_t us;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	us = (int64_t)(now.tv_sec - stamp->tv_sec) * 1000000 +
+		(now.tv_nsec - stamp->tv_nsec) / 1000;
+	if (us < 0)
+	{
+		us = 0;
+	}
+
+	hist_add(&srv->rxDelay, (uint64_t)us);
+
+	if (srv->opts.rxDelayAlertUs <= 0 || us <= srv->opts.rxDelayAlertUs)
+	{
+		return;
+	}
+
+	srv->rxDelayAlerts++;
+
+	/* At most one message per second, the loop is busy already */
+	if (now.tv_sec == srv->rxAlertSec)
+	{
+		srv->rxAlertsSuppressed++;
+		return;
+	}
+
+	fprintf(stderr, "Receive queueing delay of %lld us from %s exceeds %d us "
+		"(%llu more suppressed), event loop overloaded?\n", (long long)us,
+		srv->clients.cold[slot].addr, srv->opts.rxDelayAlertUs,
+		(unsigned long long)srv->rxAlertsSuppressed);
+	srv->rxAlertSec = now.tv_sec;
+	srv->rxAlertsSuppressed = 0;
+}
+
+/*
+ * Read from a client socket into the shared receive buffer. Picks up the
+ * kernel receive timestamp if timestamping is enabled.
+ * Returns the result of read().
+ */
+static ssize_t srv_read(struct server *srv, uint32_t slot, int sd)
+{
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	if (!srv->opts.rxTimestamps ||
+		(srv->clients.hot[slot].flags & CL_ADMIN))
+	{
+		return read(sd, srv->rxbuf, RECV_BUF_SIZE);
+	}
+
+	iov.iov_base = srv->rxbuf;
+	iov.iov_len = RECV_BUF_SIZE;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	len = recvmsg(sd, &msg, 0);
+	if (len <= 0)
+	{
+		return len;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_TIMESTAMPING)
+		{
+			const struct scm_timestamping *ts =
+				(const struct scm_timestamping *)CMSG_DATA(cmsg);
+
+			/* ts[0] holds the software timestamp */
+			if (ts->ts[0].tv_sec != 0)
+			{
+				srv_recordRxDelay(srv, slot, &ts->ts[0]);
+			}
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Hand received application data to the stage the client belongs to.
+ * Returns 0 to continue reading, 1 if the client was paused, -1 if it
+ * should be disconnected.
+ */
+static int srv_dispatch(struct server *srv, uint32_t slot, const char *data,
+	size_t len)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	uint32_t flags = srv->clients.hot[slot].flags;
+
+	if (srv->capture.hdr != NULL)
+	{
+		cap_write(&srv->capture, CAP_IN, cl_id(srv, slot), data,
+			(uint32_t)len);
+	}
+
+	if (srv->output.consumerSd > -1)
+	{
+		output_write(&srv->output, cl_id(srv, slot), data, len);
+	}
+
+	if (flags & CL_SINK)
+	{
+		if (sink_receive(&srv->sink, c->ctx, slot,
+			srv->clients.hot[slot].gen & CL_GEN_MASK, cl_id(srv, slot),
+			(const uint8_t *)data, len) != 0)
+		{
+			fprintf(stderr, "Invalid message from %s.\n", c->addr);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (flags & CL_STATSD)
+	{
+		statsd_receive(&srv->statsd, c->ctx, data, len);
+		return 0;
+	}
+
+	if (flags & CL_MUX)
+	{
+		if (srv_receiveMux(srv, slot, data, len) != 0)
+		{
+			return -1;
+		}
+	}
+	else if (flags & CL_RPC)
+	{
+		if (srv_receiveRpc(srv, slot, data, len) != 0)
+		{
+			return -1;
+		}
+	}
+	else if (flags & CL_JSON)
+	{
+		srv_receiveJson(srv, slot, data, len);
+	}
+	else if (srv_onReceive(srv, slot, data, (ssize_t)len) != 0)
+	{
+		return -1;
+	}
+
+	/* Stop producing output once the soft limit is exceeded */
+	if (srv_checkSoftLimit(srv, slot))
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Handle the requests a local client put into its ring. The handler reads
+ * each request in place.
+ */
+static void srv_receiveLocal(struct server *srv, uint32_t slot)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	struct local_conn *lc = c->ctx;
+	uint32_t count = 0;
+	int rc = 0;
+
+	cl_touch(srv, slot);
+
+	while (1)
+	{
+		const void *msg;
+		uint32_t type, len;
+		int n;
+
+		n = shm_peek(&lc->rx, &msg, &type, &len);
+		if (n < 0)
+		{
+			fprintf(stderr, "Invalid ring message from %s.\n", c->addr);
+			rc = -1;
+			break;
+		}
+
+		if (n == 0)
+		{
+			local_release(lc);
+
+			/* Sleep until the client signals new requests */
+			if (shm_consumerSleep(&lc->rx))
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		/* Other clients are waiting, continue in the next iteration */
+		if (count++ == LOCAL_BATCH)
+		{
+			local_wakeSelf(lc);
+			break;
+		}
+
+		if (type == LOCAL_DATA)
+		{
+			c->stats.bytesIn += len;
+			c->stats.reads++;
+			srv->bytesReceived += len;
+			trace_record(&srv->trace, TR_READ, cl_id(srv, slot), len);
+			PROBE_READ(srv->clients.hot[slot].sd, cl_id(srv, slot), len);
+
+			/* Stops on errors and once the soft limit is exceeded */
+			rc = srv_dispatch(srv, slot, msg, len);
+		}
+
+		shm_consume(&lc->rx);
+
+		if (rc != 0)
+		{
+			break;
+		}
+
+		/* Let a client blocked on a full ring continue early */
+		if (count % LOCAL_RELEASE_BATCH == 0)
+		{
+			local_release(lc);
+		}
+	}
+
+	local_release(lc);
+
+	if (rc < 0)
+	{
+		srv_onDisconnect(srv, slot);
+		cl_free(srv, slot);
+	}
+}
+
+/*
+ * Keep the compressed input left over from a read, and whatever the inflate
+ * state still holds, until the next loop iteration or until the client is
+ * resumed. data may point into the backlog itself.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int srv_deferInflate(struct server *srv, uint32_t slot,
+	const char *data, size_t len)
+{
+	struct compress_conn *zc = srv->clients.cold[slot].z;
+
+	if (len > 0)
+	{
+		if (zc->backlog == NULL)
+		{
+			zc->backlog = malloc(RECV_BUF_SIZE);
+			if (zc->backlog == NULL)
+			{
+				fprintf(stderr, "Failed to decompress: out of memory.\n");
+				return -1;
+			}
+
+			mem_charge(&srv->mem, MEM_CLIENTS, RECV_BUF_SIZE);
+		}
+
+		memmove(zc->backlog, data, len);
+	}
+
+	zc->backlogLen = (uint32_t)len;
+	zc->deferred = 1;
+
+	if (!zc->listed && !(srv->clients.hot[slot].flags & CL_PAUSED))
+	{
+		zc->listed = 1;
+		zc->listIndex = srv->zDeferredCount;
+		srv->zDeferred[srv->zDeferredCount++] = slot;
+	}
+
+	return 0;
+}
+
+/*
+ * Decompress data of a compressed client and dispatch the result. A read
+ * may end one segment and start the next one. Once the client is paused or
+ * INFLATE_READ_MAX bytes were dispatched the rest is deferred, so a small
+ * read cannot expand past the memory budget.
+ * Returns 0 to continue reading, 1 if the client was paused, -1 if it
+ * should be disconnected.
+ */
+static int srv_inflate(struct server *srv, uint32_t slot, const char *data,
+	size_t len)
+{
+	struct compress_conn *zc = srv->clients.cold[slot].z;
+	size_t dispatched = 0;
+	int full = zc->deferred, rc = 0;
+
+	zc->deferred = 0;
+
+	/* Output may be left in the inflate state even without input */
+	while (len > 0 || full)
+	{
+		z_stream *zs;
+		size_t n;
+		int zrc;
+
+		if (rc != 0 || dispatched >= INFLATE_READ_MAX)
+		{
+			return srv_deferInflate(srv, slot, data, len) != 0 ? -1 : rc;
+		}
+
+		if (zc->rx == NULL)
+		{
+			zc->rx = compress_inflater(&srv->zpool, zc);
+			if (zc->rx == NULL)
+			{
+				fprintf(stderr, "Failed to decompress: out of memory.\n");
+				return -1;
+			}
+		}
+
+		zs = &zc->rx->zs;
+		zs->next_in = (Bytef *)data;
+		zs->avail_in = (uInt)len;
+		zs->next_out = (Bytef *)srv->zbuf;
+		zs->avail_out = sizeof(srv->zbuf);
+
+		zrc = inflate(zs, Z_SYNC_FLUSH);
+		if (zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR)
+		{
+			fprintf(stderr, "Invalid compressed data from %s: %s\n",
+				srv->clients.cold[slot].addr,
+				zs->msg != NULL ? zs->msg : "inflate failed");
+			srv->zpool.errors++;
+			return -1;
+		}
+
+		srv->zpool.wireIn += len - zs->avail_in;
+		data += len - zs->avail_in;
+		len = zs->avail_in;
+		n = sizeof(srv->zbuf) - zs->avail_out;
+		full = zs->avail_out == 0;
+
+		/* The client closed the segment, its context can serve others */
+		if (zrc == Z_STREAM_END)
+		{
+			compress_put(&srv->zpool, zc->rx, 0);
+			zc->rx = NULL;
+			full = 0;
+		}
+
+		if (n > 0)
+		{
+			srv->zpool.rawIn += n;
+			dispatched += n;
+
+			rc = srv_dispatch(srv, slot, srv->zbuf, n);
+			if (rc < 0)
+			{
+				return -1;
+			}
+		}
+		else if (zrc == Z_BUF_ERROR)
+		{
+			break;
+		}
+	}
+
+	return rc;
+}
+
+/*
+ * Continue with the input deferred by srv_inflate. The backlog is freed
+ * once it is used up.
+ * Returns 0 if done, 1 if the client was paused, -1 if it should be
+ * disconnected. The client may still be deferred after returning 0.
+ */
+static int srv_inflateBacklog(struct server *srv, uint32_t slot)
+{
+	struct compress_conn *zc = srv->clients.cold[slot].z;
+	int rc;
+
+	cl_unlistInflate(srv, slot);
+	rc = srv_inflate(srv, slot, zc->backlog, zc->backlogLen);
+
+	if (rc >= 0 && !zc->deferred && zc->backlog != NULL)
+	{
+		mem_release(&srv->mem, MEM_CLIENTS, RECV_BUF_SIZE);
+		free(zc->backlog);
+		zc->backlog = NULL;
+		zc->backlogLen = 0;
+	}
+
+	return rc;
+}
+
+/*
+ * Handle data of a WebSocket client: the upgrade request first, then
+ * frames. Only complete messages reach the handler, pings are answered
+ * here. Once the client is paused the remaining frames are held until it
+ * is resumed.
+ * Returns 0 to continue reading, 1 if the client got paused or -1 if it has
+ * to be disconnected.
+ */
+static int srv_wsReceive(struct server *srv, uint32_t slot, char *data,
+	size_t len)
+{
+	struct ws_conn *wc = srv->clients.cold[slot].ctx;
+	size_t cap = wc->msgCap;
+	struct ws_frame f;
+	uint16_t code;
+	int rc = 0;
+	int r;
+
+	if (!wc->open)
+	{
+		char reply[WS_REPLY_MAX];
+		size_t replyLen;
+
+		r = ws_handshake(wc, &data, &len, reply, &replyLen);
+		if (r == WS_ERROR)
+		{
+			srv->ws.rejected++;
+			cl_write(srv, slot, reply, replyLen);
+			rc = -1;
+		}
+		else if (r == WS_DONE)
+		{
+			srv->ws.handshakes++;
+			rc = cl_write(srv, slot, reply, replyLen);
+		}
+	}
+
+	while (rc == 0 && wc->open &&
+		(r = ws_next(wc, &data, &len, &f)) != WS_MORE)
+	{
+		switch (r)
+		{
+		case WS_MESSAGE:
+			srv->ws.messagesIn++;
+			rc = srv_dispatch(srv, slot, f.data, f.len);
+			break;
+		case WS_PING:
+			srv->ws.pings++;
+			if (cl_sendFrame(srv, slot, WS_OP_PONG, f.data, f.len) != 0)
+			{
+				rc = -1;
+			}
+
+			break;
+		case WS_PONG:
+			break;
+		case WS_CLOSE:
+			/* Echo the status code and hang up */
+			cl_sendFrame(srv, slot, WS_OP_CLOSE, f.data, f.len < 2 ? f.len : 2);
+			rc = -1;
+			break;
+		default:
+			srv->ws.errors++;
+			code = htons(f.code);
+			cl_sendFrame(srv, slot, WS_OP_CLOSE, (const char *)&code,
+				sizeof(code));
+			rc = -1;
+			break;
+		}
+	}
+
+	if (wc->msgCap != cap)
+	{
+		mem_charge(&srv->mem, MEM_CLIENTS, wc->msgCap - cap);
+	}
+
+	/* data may be the shared receive buffer, so the rest is copied */
+	if (rc > 0 && len > 0)
+	{
+		wc->held = malloc(len);
+		if (wc->held == NULL)
+		{
+			fprintf(stderr, "Failed to hold WebSocket frames: out of "
+				"memory.\n");
+			return -1;
+		}
+
+		memcpy(wc->held, data, len);
+		wc->heldLen = len;
+		mem_charge(&srv->mem, MEM_CLIENTS, len);
+		srv->clients.hot[slot].flags |= CL_HELD;
+	}
+
+	return rc;
+}
+
+/*
+ * Hand decoded bytes of a client to the application protocol.
+ * Returns 0 to continue reading, 1 if the client got paused or -1 if it has
+ * to be disconnected.
+ */
+static int srv_consume(struct server *srv, uint32_t slot, char *data,
+	size_t len)
+{
+	if (srv->clients.hot[slot].flags & CL_WS)
+	{
+		return srv_wsReceive(srv, slot, data, len);
+	}
+
+	return srv_dispatch(srv, slot, data, len);
+}
+
+/*
+ * Handle records of a TLS client whose keys are not in the kernel. Runs the
+ * handshake first and tries to hand the connection to kernel TLS once it is
+ * done. Records are left with OpenSSL once the client is paused.
+ * Returns 0 to continue reading, 1 if the client got paused or -1 if it has
+ * to be disconnected.
+ */
+static int srv_tlsReceive(struct server *srv, uint32_t slot, const char *data,
+	size_t len)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	int rc = 0;
+
+	if (len > 0 && tls_feed(c->tls, data, len) != 0)
+	{
+		return -1;
+	}
+
+	if (!c->tls->established)
+	{
+		int hs = tls_handshake(&srv->tls, c->tls);
+
+		/* Sends alerts of failed handshakes, too */
+		if (cl_drainTls(srv, slot) != 0 || hs == TLS_FAILED)
+		{
+			return -1;
+		}
+		else if (hs == TLS_AGAIN)
+		{
+			return 0;
+		}
+
+		/* Queued records must not pass through the kernel's encryption */
+		if (srv->clients.hot[slot].outLen == 0)
+		{
+			hs = tls_offload(&srv->tls, c->tls, srv->clients.hot[slot].sd);
+			if (hs == TLS_FAILED)
+			{
+				return -1;
+			}
+			else if (hs == TLS_DONE)
+			{
+				tls_connFree(c->tls);
+				mem_release(&srv->mem, MEM_CLIENTS, sizeof(struct tls_conn));
+				c->tls = NULL;
+				return 0;
+			}
+		}
+		else
+		{
+			srv->tls.userspace++;
+		}
+	}
+
+	while (rc == 0)
+	{
+		ssize_t n = tls_read(c->tls, srv->tlsbuf, RECV_BUF_SIZE);
+
+		if (n < 0)
+		{
+			return -1;
+		}
+		else if (n == 0)
+		{
+			break;
+		}
+
+		rc = srv_consume(srv, slot, srv->tlsbuf, (size_t)n);
+		if (rc < 0)
+		{
+			return -1;
+		}
+	}
+
+	if (rc > 0)
+	{
+		srv->clients.hot[slot].flags |= CL_HELD;
+	}
+
+	/* Reading may have produced records, e.g. key update responses */
+	if (tls_pending(c->tls) > 0 && cl_drainTls(srv, slot) != 0)
+	{
+		return -1;
+	}
+
+	return rc;
+}
+
+/*
+ * Collect the first bytes of a connection until they are a compression hello
+ * or clearly not one, then start compression or hand the bytes on as data.
+ * Received counts the bytes of data already waiting in the hello buffer.
+ * Returns 0 to continue reading, 1 if the client got paused or -1 if it has
+ * to be disconnected.
+ */
+static int srv_receiveHello(struct server *srv, uint32_t slot, size_t received,
+	const char *data, size_t len)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	size_t n = COMPRESS_HELLO_SIZE - received;
+	int match;
+	int rc;
+
+	if (n > len)
+	{
+		n = len;
+	}
+
+	memcpy(c->hello + received, data, n);
+	match = compress_matchHello(c->hello, received + n);
+	if (match == 0)
+	{
+		return 0;
+	}
+
+	srv->clients.hot[slot].flags &= ~CL_HELLO;
+
+	if (match > 0)
+	{
+		if (cl_startCompression(srv, slot, c->hello) != 0)
+		{
+			return -1;
+		}
+
+		return srv_inflate(srv, slot, data + n, len - n);
+	}
+
+	/* The bytes held back go first, like a single read both parts get through
+	 * even if the first one pauses the client */
+	rc = received > 0 ? srv_dispatch(srv, slot, c->hello, received) : 0;
+	if (rc < 0)
+	{
+		return -1;
+	}
+
+	if (len > 0)
+	{
+		int next = srv_dispatch(srv, slot, data, len);
+
+		rc = next != 0 ? next : rc;
+	}
+
+	return rc;
+}
+
+/*
+ * Continue with the input held when the client got paused: WebSocket frames
+ * first, then the records OpenSSL still buffers.
+ * Returns 0 to continue reading, 1 if the client got paused again or -1 if
+ * it has to be disconnected.
+ */
+static int srv_receiveHeld(struct server *srv, uint32_t slot)
+{
+	struct cl_cold *c = &srv->clients.cold[slot];
+	int rc = 0;
+
+	srv->clients.hot[slot].flags &= ~CL_HELD;
+
+	if (srv->clients.hot[slot].flags & CL_WS)
+	{
+		struct ws_conn *wc = c->ctx;
+		char *held = wc->held;
+		size_t len = wc->heldLen;
+
+		if (held != NULL)
+		{
+			wc->held = NULL;
+			wc->heldLen = 0;
+			rc = srv_wsReceive(srv, slot, held, len);
+			mem_release(&srv->mem, MEM_CLIENTS, len);
+			free(held);
+		}
+	}
+
+	if (rc == 0 && c->tls != NULL && c->tls->established)
+	{
+		rc = srv_tlsReceive(srv, slot, NULL, 0);
+	}
+
+	return rc;
+}
+
+/*
+ * Handle data receive events.
+ */
+static void srv_handleReceive(struct server *srv, uint32_t slot)
+{
+	struct cl_cold *c;
+	uint64_t bytesIn;
+	int sd;
+	int done = 0;
+	int rc = 0;
+
+	assert(srv != NULL);
+
+	if (srv->clients.hot[slot].flags & CL_LOCAL)
+	{
+		srv_receiveLocal(srv, slot);
+		return;
+	}
+
+	sd = srv->clients.hot[slot].sd;
+	c = &srv->clients.cold[slot];
+	bytesIn = c->stats.bytesIn;
+	cl_touch(srv, slot);
+	PROBE_RECEIVE_ENTRY(sd, cl_id(srv, slot));
+
+	/* Data deferred or held by the last read comes before anything new */
+	if (c->z != NULL && c->z->deferred)
+	{
+		done = srv_inflateBacklog(srv, slot) < 0;
+	}
+	else if (srv->clients.hot[slot].flags & CL_HELD)
+	{
+		rc = srv_receiveHeld(srv, slot);
+		done = rc < 0;
+	}
+
+	/*
+	 * We're running in edge triggered mode, i.e. we get notified only once
+	 * when data is available. Therefore we must read all available data at
+	 * once. Deferred clients come back in the next loop iteration.
+	 */
+	while (!done && rc == 0 && !(c->z != NULL && c->z->deferred))
+	{
+		ssize_t len;
+
+		len = srv_read(srv, slot, sd);
+		if (len == -1)
+		{
+			if (errno == EIO && (srv->clients.hot[slot].flags & CL_TLS))
+			{
+				/* Kernel TLS got an alert, mostly close_notify */
+				done = 1;
+			}
+			else if (errno != EAGAIN)
+			{
+				perror("read");
+				done = 1;
+			}
+
+			break;
+		}
+		else if (len == 0)
+		{
+			/* A hello cut short was data after all */
+			if (srv->clients.hot[slot].flags & CL_HELLO)
+			{
+				srv->clients.hot[slot].flags &= ~CL_HELLO;
+				if (c->stats.bytesIn > 0)
+				{
+					srv_dispatch(srv, slot, c->hello, (size_t)c->stats.bytesIn);
+				}
+			}
+
+			done = 1;
+			break;
+		}
+		else
+		{
+			c->stats.bytesIn += len;
+			c->stats.reads++;
+			srv->bytesReceived += len;
+			trace_record(&srv->trace, TR_READ, cl_id(srv, slot), (uint32_t)len);
+			PROBE_READ(sd, cl_id(srv, slot), len);
+
+			if (srv->clients.hot[slot].flags & CL_ADMIN)
+			{
+				if (srv_adminReceive(srv, slot, srv->rxbuf, len) != 0)
+				{
+					done = 1;
+					break;
+				}
+
+				continue;
+			}
+
+			if (srv->sketch != NULL)
+			{
+				sketch_receive(srv->sketch, c->ip, (uint64_t)len);
+			}
+
+			if (srv->clients.hot[slot].flags & CL_HELLO)
+			{
+				rc = srv_receiveHello(srv, slot,
+					(size_t)(c->stats.bytesIn - len), srv->rxbuf, (size_t)len);
+			}
+			else if (c->z != NULL)
+			{
+				rc = srv_inflate(srv, slot, srv->rxbuf, (size_t)len);
+			}
+			else if (c->tls != NULL)
+			{
+				rc = srv_tlsReceive(srv, slot, srv->rxbuf, (size_t)len);
+			}
+			else
+			{
+				rc = srv_consume(srv, slot, srv->rxbuf, (size_t)len);
+			}
+
+			if (rc < 0)
+			{
+				done = 1;
+				break;
+			}
+			else if (rc > 0)
+			{
+				/* Paused */
+				break;
+			}
+		}
+	}
+
+	PROBE_RECEIVE_RETURN(sd, cl_id(srv, slot), c->stats.bytesIn - bytesIn);
 
 	if (done != 0)
 	{
-		/* Remove client */
-		srv_onDisconnect(cl);
-		cl_free(cl);
+		/* Remove client */
+		srv_onDisconnect(srv, slot);
+		cl_free(srv, slot);
+	}
+}
+
+/*
+ * Acknowledge messages of a client that are durable now. The ack is the
+ * number of the client's messages persisted so far as a 64 bit big endian
+ * integer. Clients whose messages could not be written are disconnected,
+ * they never get an ack for them.
+ */
+static void srv_sinkAck(void *arg, uint32_t slot, uint32_t gen,
+	uint32_t count, int failed)
+{
+	struct server *srv = arg;
+	struct sink_conn *sc;
+	uint64_t ack;
+
+	/* The client may be gone by now */
+	if (clt_lookup(&srv->clients, slot, gen) == NULL)
+	{
+		return;
+	}
+
+	/* Same as below, the client is freed on the error event */
+	if (failed)
+	{
+		fprintf(stderr, "Failed to persist messages of %s, disconnecting.\n",
+			srv->clients.cold[slot].addr);
+		shutdown(srv->clients.hot[slot].sd, SHUT_RDWR);
+		return;
+	}
+
+	sc = srv->clients.cold[slot].ctx;
+	sc->acked += count;
+	ack = htobe64(sc->acked);
+
+	/*
+	 * May run while another event of this client is being handled, so leave
+	 * freeing the client to the error event the shutdown causes.
+	 */
+	if (cl_send(srv, slot, (const char *)&ack, sizeof(ack)) != 0)
+	{
+		shutdown(srv->clients.hot[slot].sd, SHUT_RDWR);
+	}
+}
+
+/*
+ * Accept an output consumer and watch its socket for the disconnect.
+ */
+static void srv_attachOutput(struct server *srv)
+{
+	struct epoll_event eev;
+	int sd;
+
+	sd = output_accept(&srv->output);
+	if (sd == -1)
+	{
+		return;
+	}
+
+	memset(&eev, 0, sizeof(eev));
+	eev.data.u64 = EV_HANDLE(EV_OUTPUT, 0, 0);
+	eev.events = EPOLLIN | EPOLLRDHUP;
+
+	if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, sd, &eev) == -1)
+	{
+		perror("epoll_ctl");
+		output_detach(&srv->output);
+		return;
+	}
+
+	puts("Output consumer attached");
+}
+
+/*
+ * Handle an event on the output consumer socket. Consumers never send
+ * anything, so any event other than stray data means it is gone.
+ */
+static void srv_checkOutput(struct server *srv)
+{
+	char buf[64];
+	ssize_t n;
+
+	n = recv(srv->output.consumerSd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n > 0 || (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+	{
+		return;
+	}
+
+	output_detach(&srv->output);
+	puts("Output consumer detached");
+}
+
+/*
+ * Handle an event on a client socket.
+ */
+static void srv_handleClient(struct server *srv, uint64_t h, uint32_t events)
+{
+	uint32_t slot = EV_SLOT(h);
+	uint64_t start;
+
+	/* Drop stale events for clients freed earlier in this batch */
+	if (clt_lookup(&srv->clients, slot, EV_GEN(h)) == NULL)
+	{
+		return;
+	}
+
+	if (events & (EPOLLERR | EPOLLHUP))
+	{
+		srv_handleError(srv, slot);
+		return;
+	}
+
+	/* Bill the reads, writes and callbacks to the client */
+	start = tsc_now();
+
+	if (events & EPOLLOUT)
+	{
+		srv_handleWrite(srv, slot);
+
+		if (clt_lookup(&srv->clients, slot, EV_GEN(h)) == NULL)
+		{
+			return;
+		}
+	}
+
+	/* Paused clients are read again once memory is available */
+	if ((events & EPOLLIN) && !(srv->clients.hot[slot].flags & CL_PAUSED))
+	{
+		srv_handleReceive(srv, slot);
+	}
+
+	/* The client may have disconnected while handling the event */
+	if (clt_lookup(&srv->clients, slot, EV_GEN(h)) != NULL)
+	{
+		srv->clients.cold[slot].stats.cycles += tsc_now() - start;
+	}
+}
+
+/*
+ * Handle a wakeup from a local client: new requests or room for replies.
+ */
+static void srv_handleLocal(struct server *srv, uint64_t h)
+{
+	uint32_t slot = EV_SLOT(h);
+	uint64_t start;
+
+	if (clt_lookup(&srv->clients, slot, EV_GEN(h)) == NULL)
+	{
+		return;
+	}
+
+	start = tsc_now();
+	local_clearWakeup(srv->clients.cold[slot].ctx);
+
+	if (srv->clients.hot[slot].outLen > 0)
+	{
+		cl_flushLocal(srv, slot);
+	}
+
+	if (!(srv->clients.hot[slot].flags & CL_PAUSED))
+	{
+		srv_receiveLocal(srv, slot);
+	}
+
+	if (clt_lookup(&srv->clients, slot, EV_GEN(h)) != NULL)
+	{
+		srv->clients.cold[slot].stats.cycles += tsc_now() - start;
+	}
+}
+
+/*
+ * Receive statsd datagrams in batches. The socket is level triggered, so
+ * a flood only takes UDP_ROUNDS batches per loop iteration.
+ */
+static void srv_handleUdp(struct server *srv)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	int i, n, round;
+
+	for (i = 0; i < UDP_BATCH; ++i)
+	{
+		iov[i].iov_base = srv->udpBuf + (size_t)i * UDP_DATAGRAM_MAX;
+		iov[i].iov_len = UDP_DATAGRAM_MAX;
+	}
+
+	for (round = 0; round < UDP_ROUNDS; ++round)
+	{
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < UDP_BATCH; ++i)
+		{
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = recvmmsg(srv->udpSd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				perror("recvmmsg");
+			}
+
+			return;
+		}
+
+		for (i = 0; i < n; ++i)
+		{
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			{
+				srv->udpTruncated++;
+				continue;
+			}
+
+			srv->bytesReceived += msgs[i].msg_len;
+			statsd_datagram(&srv->statsd, iov[i].iov_base, msgs[i].msg_len);
+		}
+
+		srv->udpDatagrams += (uint64_t)n;
+
+		if (n < UDP_BATCH)
+		{
+			return;
+		}
+	}
+}
+
+/*
+ * Continue reading from compressed clients whose last read was deferred.
+ * Clients that got paused meanwhile wait until they are resumed.
+ */
+static void srv_continueInflate(struct server *srv)
+{
+	uint32_t i = srv->zDeferredCount;
+
+	/* Clients listed again while walking down are not visited twice */
+	while (i-- > 0)
+	{
+		uint32_t slot;
+
+		if (i >= srv->zDeferredCount)
+		{
+			continue;
+		}
+
+		slot = srv->zDeferred[i];
+
+		if (srv->clients.hot[slot].flags & CL_PAUSED)
+		{
+			cl_unlistInflate(srv, slot);
+			continue;
+		}
+
+		srv_handleReceive(srv, slot);
+	}
+}
+
+/*
+ * Push the output compressed in this loop iteration to the clients. A sync
+ * flush ends on a byte boundary, so the peer can decompress everything sent
+ * so far.
+ */
+static void srv_flushCompressed(struct server *srv)
+{
+	while (srv->zDirtyCount > 0)
+	{
+		uint32_t slot = srv->zDirty[--srv->zDirtyCount];
+
+		srv->clients.cold[slot].z->dirty = 0;
+
+		if (cl_runDeflate(srv, slot, NULL, 0, Z_SYNC_FLUSH) != 0 ||
+			cl_flush(srv, slot) != 0)
+		{
+			srv_onDisconnect(srv, slot);
+			cl_free(srv, slot);
+		}
+	}
+}
+
+/*
+ * End the output segments of compressed clients that stopped writing, so
+ * that their contexts go back to the pool.
+ */
+static void srv_sweepCompressed(struct server *srv, uint64_t now)
+{
+	uint32_t i;
+
+	for (i = 0; i < srv->clients.capacity; ++i)
+	{
+		struct compress_conn *zc;
+
+		if (!(srv->clients.hot[i].flags & CL_ACTIVE))
+		{
+			continue;
+		}
+
+		zc = srv->clients.cold[i].z;
+		if (zc == NULL || zc->tx == NULL ||
+			now - zc->lastWriteMs < COMPRESS_IDLE_MS)
+		{
+			continue;
+		}
+
+		/* The final block tells the peer to start over with the next one */
+		if (cl_runDeflate(srv, i, NULL, 0, Z_FINISH) != 0 ||
+			cl_flush(srv, i) != 0)
+		{
+			srv_onDisconnect(srv, i);
+			cl_free(srv, i);
+			continue;
+		}
+
+		compress_put(&srv->zpool, zc->tx, 1);
+		zc->tx = NULL;
+	}
+}
+
+/*
+ * Charge changes of the memory held by compression contexts.
+ */
+static void srv_accountCompression(struct server *srv)
+{
+	if (srv->zpool.bytes > srv->zCharged)
+	{
+		mem_charge(&srv->mem, MEM_COMPRESS, srv->zpool.bytes - srv->zCharged);
+	}
+	else
+	{
+		mem_release(&srv->mem, MEM_COMPRESS, srv->zCharged - srv->zpool.bytes);
+	}
+
+	srv->zCharged = srv->zpool.bytes;
+}
+
+/*
+ * Fail the RPC requests whose deadline has passed.
+ */
+static void srv_expireCalls(struct server *srv)
+{
+	uint64_t now = srv_nowMs();
+	struct rpc_pending p;
+
+	while (rpc_expire(&srv->rpc, now, &p))
+	{
+		uint32_t slot = (uint32_t)p.client;
+
+		if (clt_lookup(&srv->clients, slot,
+			(uint32_t)(p.client >> 32) & CL_GEN_MASK) == NULL)
+		{
+			continue;
+		}
+
+		if (srv_rpcReply(srv, slot, p.seq, p.id, p.method, RPC_DEADLINE, NULL,
+			0) != 0)
+		{
+			srv_onDisconnect(srv, slot);
+			cl_free(srv, slot);
+		}
+	}
+}
+
+/*
+ * Resume reading from all paused clients.
+ */
+static void srv_resumeClients(struct server *srv)
+{
+	uint32_t i;
+
+	for (i = 0; i < srv->clients.capacity && srv->pausedCount > 0; ++i)
+	{
+		struct cl_hot *h = &srv->clients.hot[i];
+
+		if ((h->flags & (CL_ACTIVE | CL_PAUSED)) == (CL_ACTIVE | CL_PAUSED))
+		{
+			h->flags &= ~CL_PAUSED;
+			srv->pausedCount--;
+
+			/* Edge triggered, so data may have arrived in the meantime */
+			srv_handleReceive(srv, i);
+		}
+	}
+}
+
+/*
+ * Apply the memory budget. Above the soft limit reads from the biggest
+ * consumers are paused, above the hard limit they are disconnected.
+ */
+static void srv_enforceBudget(struct server *srv)
+{
+	size_t soft = (size_t)srv->opts.memSoftLimit << 20;
+	size_t hard = (size_t)srv->opts.memHardLimit << 20;
+	uint32_t slots[SHED_BATCH];
+	int n, i;
+
+	if (hard > 0 && mem_variable(&srv->mem) > hard)
+	{
+		n = srv_findConsumers(srv, slots, SHED_BATCH, 0);
+		for (i = 0; i < n && mem_variable(&srv->mem) > hard; ++i)
+		{
+			fprintf(stderr, "Memory limit exceeded, disconnecting %s.\n",
+				srv->clients.cold[slots[i]].addr);
+			srv_onDisconnect(srv, slots[i]);
+			cl_free(srv, slots[i]);
+			srv->shedTotal++;
+		}
+	}
+	else if (soft > 0 && mem_variable(&srv->mem) > soft)
+	{
+		srv_pauseConsumers(srv);
+	}
+	else if (srv->pausedCount > 0 &&
+		mem_variable(&srv->mem) <= soft - soft / 10)
+	{
+		srv_resumeClients(srv);
+	}
+}
+
+/*
+ * Advance the loop tick and run the idle sweep once per second.
+ */
+static void srv_updateTick(struct server *srv, time_t start)
+{
+	struct timespec ts;
+	uint32_t tick;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tick = (uint32_t)(ts.tv_sec - start) + 1;
+
+	if (tick != srv->tick)
+	{
+		srv->tick = tick;
+		srv_sweepIdle(srv);
+	}
+}
+
+/*
+ * Exponentially weighted moving average with a weight of 1/8 for new samples.
+ */
+static int64_t srv_smooth(int64_t avg, int64_t sample)
+{
+	return avg + (sample - avg) / 8;
+}
+
+/*
+ * Take a TCP_INFO sample of a client and update its smoothed metrics and
+ * slow client state.
+ */
+static void srv_sampleTcp(struct server *srv, uint32_t slot, uint64_t nowMs)
+{
+	struct cl_hot *h = &srv->clients.hot[slot];
+	struct cl_tcp *t = &srv->clients.cold[slot].tcp;
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	uint64_t elapsed;
+	uint32_t queued;
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(h->sd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0)
+	{
+		return;
+	}
+
+	srv->tcpSamples++;
+	queued = h->outLen + ti.tcpi_notsent_bytes;
+	elapsed = nowMs - t->sampledMs;
+
+	if (t->sampledMs == 0)
+	{
+		t->rtt = ti.tcpi_rtt;
+		t->rttvar = ti.tcpi_rttvar;
+	}
+	else
+	{
+		int64_t rate = ((int64_t)queued - t->queued) * 1000 / (int64_t)elapsed;
+
+		t->rtt = srv_smooth(t->rtt, ti.tcpi_rtt);
+		t->rttvar = srv_smooth(t->rttvar, ti.tcpi_rttvar);
+		t->growth = srv_smooth(t->growth, rate);
+		t->growing = (queued > t->queued) ? t->growing + 1 : 0;
+	}
+
+	t->retrans = ti.tcpi_total_retrans;
+	t->cwnd = ti.tcpi_snd_cwnd;
+	t->unacked = ti.tcpi_unacked;
+	t->queued = queued;
+	t->sampledMs = nowMs;
+
+	if (!(h->flags & CL_SLOW))
+	{
+		if (queued > TCP_SLOW_QUEUE && t->growing >= TCP_SLOW_SAMPLES &&
+			t->growth > 0)
+		{
+			h->flags |= CL_SLOW;
+			srv->slowCount++;
+			srv->slowTotal++;
+		}
+	}
+	else if (queued < TCP_SLOW_QUEUE / 2 || t->growth < 0)
+	{
+		h->flags &= ~CL_SLOW;
+		srv->slowCount--;
+	}
+}
+
+/*
+ * Visit the next opts.tcpSweep client slots and sample the connected clients
+ * not sampled recently, so the cost per iteration is bounded regardless of
+ * the number of clients.
+ */
+static void srv_sweepTcp(struct server *srv)
+{
+	struct timespec ts;
+	uint64_t nowMs;
+	uint32_t i, slot;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	nowMs = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	for (i = 0; i < (uint32_t)srv->opts.tcpSweep; ++i)
+	{
+		struct cl_hot *h;
+
+		slot = srv->tcpCursor++;
+		if (srv->tcpCursor >= srv->clients.capacity)
+		{
+			srv->tcpCursor = 0;
+		}
+
+		h = &srv->clients.hot[slot];
+		if ((h->flags & (CL_ACTIVE | CL_ADMIN)) != CL_ACTIVE ||
+			nowMs - srv->clients.cold[slot].tcp.sampledMs <
+				TCP_SAMPLE_INTERVAL_MS)
+		{
+			continue;
+		}
+
+		srv_sampleTcp(srv, slot, nowMs);
+	}
+}
+
+/*
+ * Write distributions of the smoothed TCP metrics over all sampled clients.
+ */
+static void srv_writeTcpStats(const struct server *srv, FILE *fp)
+{
+	struct hist rtt, rttvar, cwnd, retrans;
+	uint32_t i;
+
+	memset(&rtt, 0, sizeof(rtt));
+	memset(&rttvar, 0, sizeof(rttvar));
+	memset(&cwnd, 0, sizeof(cwnd));
+	memset(&retrans, 0, sizeof(retrans));
+
+	for (i = 0; i < srv->clients.capacity; ++i)
+	{
+		const struct cl_tcp *t = &srv->clients.cold[i].tcp;
+
+		if (!(srv->clients.hot[i].flags & CL_ACTIVE) || t->sampledMs == 0)
+		{
+			continue;
+		}
+
+		hist_add(&rtt, t->rtt);
+		hist_add(&rttvar, t->rttvar);
+		hist_add(&cwnd, t->cwnd);
+		hist_add(&retrans, t->retrans);
+	}
+
+	fprintf(fp, "tcp_samples %llu\n", (unsigned long long)srv->tcpSamples);
+	fprintf(fp, "tcp_slow_clients %u\n", srv->slowCount);
+	fprintf(fp, "tcp_slow_total %llu\n", (unsigned long long)srv->slowTotal);
+	hist_write(&rtt, "tcp_rtt_us", fp);
+	hist_write(&rttvar, "tcp_rttvar_us", fp);
+	hist_write(&cwnd, "tcp_cwnd", fp);
+	hist_write(&retrans, "tcp_retrans", fp);
+}
+
+/*
+ * Returns the class a queued event is accounted to.
+ */
+static enum srv_cost srv_eventClass(uint64_t h, uint32_t events)
+{
+	if (EV_TYPE(h) == EV_LOCAL || EV_TYPE(h) == EV_UDP)
+	{
+		return COST_RECEIVE;
+	}
+
+	if (EV_TYPE(h) != EV_CLIENT)
+	{
+		return COST_ACCEPT;
+	}
+
+	if (events & (EPOLLERR | EPOLLHUP))
+	{
+		return COST_ERROR;
+	}
+
+	return (events & EPOLLIN) ? COST_RECEIVE : COST_WRITE;
+}
+
+/*
+ * Read the hardware counters and charge the work since the previous sample
+ * point to an event class, or discard it if cls is COST_CLASSES. A failed
+ * read is skipped, the work is charged with the next sample.
+ */
+static void srv_hwSample(struct server *srv, enum srv_cost cls)
+{
+	uint64_t now[PMU_COUNTERS];
+	int i;
+
+	if (pmu_groupRead(&srv->hw, now) != 0)
+	{
+		return;
+	}
+
+	if (cls < COST_CLASSES)
+	{
+		struct srv_cost_stats *cs = &srv->cost[cls];
+
+		cs->events++;
+		for (i = 0; i < PMU_COUNTERS; ++i)
+		{
+			cs->counters[i] += now[i] - srv->hwLast[i];
+		}
+	}
+
+	memcpy(srv->hwLast, now, sizeof(now));
+}
+
+/*
+ * Compute the epoll_wait timeout from the pending periodic work.
+ * Returns the timeout in milliseconds, -1 to wait indefinitely.
+ */
+static int srv_waitTimeout(struct server *srv)
+{
+	int timeout = srv->opts.idleTimeout > 0 ? 1000 : -1;
+
+	if (srv->sink.running)
+	{
+		int ms = sink_timeoutMs(&srv->sink);
+
+		if (ms != -1 && (timeout == -1 || ms < timeout))
+		{
+			timeout = ms;
+		}
+	}
+
+	if (srv->rpc.pending > 0)
+	{
+		int ms = rpc_timeoutMs(&srv->rpc, srv_nowMs());
+
+		if (timeout == -1 || ms < timeout)
+		{
+			timeout = ms;
+		}
+	}
+
+	/* Idle compressed clients are swept once per second */
+	if (srv->zpool.busyDeflate > 0 && (timeout == -1 || timeout > 1000))
+	{
+		timeout = 1000;
+	}
+
+	if (srv->zDeferredCount > 0)
+	{
+		timeout = 0;
+	}
+
+	if (srv->statsd.running)
+	{
+		int ms = statsd_timeoutMs(&srv->statsd);
+
+		if (timeout == -1 || ms < timeout)
+		{
+			timeout = ms;
+		}
+	}
+
+	if (prof_active(&srv->prof))
+	{
+		int ms = prof_remainingMs(&srv->prof);
+
+		if (timeout == -1 || ms < timeout)
+		{
+			timeout = ms;
+		}
 	}
+
+	return timeout;
 }
 
 static void srv_eventLoop(struct server *srv, int queueSize)
 {
 	struct epoll_event eev;
 	struct epoll_event *events = NULL;
-	int efd;
+	struct timespec ts;
 
 	assert(srv != NULL);
 
 	/* Create epoll file descriptor */
-	efd = epoll_create1(0);
-	if (efd == -1)
+	srv->efd = epoll_create1(0);
+	if (srv->efd == -1)
 	{
 		perror("epoll_create1");
 		return;
@@ -445,15 +4403,92 @@ static void srv_eventLoop(struct server *srv, int queueSize)
 
 	/* Register server socket */
 	memset(&eev, 0, sizeof(eev));
-	eev.data.ptr = srv;
+	eev.data.u64 = EV_HANDLE(EV_LISTEN, 0, 0);
 	eev.events = EPOLLIN | EPOLLET;
 
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, srv->sd, &eev) == -1)
+	if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, srv->sd, &eev) == -1)
 	{
 		perror("epoll_ctl");
 		goto on_exit;
 	}
 
+	/* Register admin socket */
+	if (srv->adminSd > -1)
+	{
+		eev.data.u64 = EV_HANDLE(EV_ADMIN_LISTEN, 0, 0);
+
+		if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, srv->adminSd, &eev) == -1)
+		{
+			perror("epoll_ctl");
+			goto on_exit;
+		}
+	}
+
+	/* Register sink writer completions */
+	if (srv->sink.running)
+	{
+		eev.data.u64 = EV_HANDLE(EV_SINK, 0, 0);
+		eev.events = EPOLLIN;
+
+		if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, srv->sink.efd, &eev) == -1)
+		{
+			perror("epoll_ctl");
+			goto on_exit;
+		}
+	}
+
+	/* Register local client connections */
+	if (srv->localSd > -1)
+	{
+		eev.data.u64 = EV_HANDLE(EV_LOCAL_LISTEN, 0, 0);
+		eev.events = EPOLLIN;
+
+		if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, srv->localSd, &eev) == -1)
+		{
+			perror("epoll_ctl");
+			goto on_exit;
+		}
+	}
+
+	/* Register TLS client connections */
+	if (srv->tlsSd > -1)
+	{
+		eev.data.u64 = EV_HANDLE(EV_TLS_LISTEN, 0, 0);
+		eev.events = EPOLLIN | EPOLLET;
+
+		if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, srv->tlsSd, &eev) == -1)
+		{
+			perror("epoll_ctl");
+			goto on_exit;
+		}
+	}
+
+	/* Register statsd datagrams */
+	if (srv->udpSd > -1)
+	{
+		eev.data.u64 = EV_HANDLE(EV_UDP, 0, 0);
+		eev.events = EPOLLIN;
+
+		if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, srv->udpSd, &eev) == -1)
+		{
+			perror("epoll_ctl");
+			goto on_exit;
+		}
+	}
+
+	/* Register output consumer connections */
+	if (srv->output.path != NULL)
+	{
+		eev.data.u64 = EV_HANDLE(EV_OUTPUT_LISTEN, 0, 0);
+		eev.events = EPOLLIN;
+
+		if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, srv->output.listenSd, &eev) == -1)
+		{
+			perror("epoll_ctl");
+			goto on_exit;
+		}
+	}
+
 	/* Create event queue */
 	events = calloc(queueSize, sizeof(struct epoll_event));
 	if (events == NULL)
@@ -464,13 +4499,38 @@ static void srv_eventLoop(struct server *srv, int queueSize)
 
 	srv->shouldQuit = 0;
 
+	/* Counts for the loop thread only, so open it from here */
+	srv->dtlbFd = pmu_openDtlbMisses();
+
+	if (srv->opts.hwCounters && pmu_groupOpen(&srv->hw) != 0)
+	{
+		fprintf(stderr, "Hardware counters not available.\n");
+	}
+
+	if (srv->opts.watchdogMs > 0 &&
+		watchdog_start(&srv->watchdog, &srv->trace, srv->opts.watchdogMs) != 0)
+	{
+		goto on_exit;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	srv->tick = 1;
+
 	/* Event loop */
 	while (srv->shouldQuit == 0)
 	{
 		int n, i;
 
 		/* Wait for epoll events */
-		n = epoll_wait(efd, events, queueSize, -1);
+		watchdog_idle(&srv->watchdog);
+		n = epoll_wait(srv->efd, events, queueSize, srv_waitTimeout(srv));
+		watchdog_beat(&srv->watchdog);
+
+		/* Time spent blocked in epoll_wait is not charged to anything */
+		if (srv->hw.open)
+		{
+			srv_hwSample(srv, COST_CLASSES);
+		}
 
 		/* Alternative: check if interrupted */
 		/*
@@ -483,29 +4543,324 @@ static void srv_eventLoop(struct server *srv, int queueSize)
 		/* Process events */
 		for (i = 0; i < n; ++i)
 		{
-			struct epoll_event *ev = &events[i];
+			const struct epoll_event *ev = &events[i];
+			uint64_t h = ev->data.u64;
+
+			switch (EV_TYPE(h))
+			{
+			case EV_LISTEN:
+				srv_handleAccept(srv, srv->sd, 0);
+				break;
+			case EV_ADMIN_LISTEN:
+				srv_handleAccept(srv, srv->adminSd, CL_ADMIN);
+				break;
+			case EV_CLIENT:
+				srv_handleClient(srv, h, ev->events);
+				break;
+			case EV_SINK:
+				sink_complete(&srv->sink);
+				break;
+			case EV_LOCAL_LISTEN:
+				srv_handleAccept(srv, srv->localSd, CL_LOCAL);
+				break;
+			case EV_LOCAL:
+				srv_handleLocal(srv, h);
+				break;
+			case EV_OUTPUT_LISTEN:
+				srv_attachOutput(srv);
+				break;
+			case EV_OUTPUT:
+				srv_checkOutput(srv);
+				break;
+			case EV_UDP:
+				srv_handleUdp(srv);
+				break;
+			case EV_TLS_LISTEN:
+				srv_handleAccept(srv, srv->tlsSd, CL_TLS);
+				break;
+			default:
+				fprintf(stderr, "Unknown event source type %u.\n",
+					EV_TYPE(h));
+				break;
+			}
+
+			if (srv->hw.open)
+			{
+				srv_hwSample(srv, srv_eventClass(h, ev->events));
+			}
+		}
+
+		if (srv->rpc.pending > 0)
+		{
+			srv_expireCalls(srv);
+		}
+
+		/* Make everything received in this iteration visible at once */
+		if (srv->output.consumerSd > -1)
+		{
+			output_flush(&srv->output);
+		}
+
+		if (srv->opts.compress)
+		{
+			uint64_t now = srv_nowMs();
+
+			if (srv->zDeferredCount > 0)
+			{
+				srv_continueInflate(srv);
+			}
+
+			srv_flushCompressed(srv);
+
+			if (srv->zpool.busyDeflate > 0 && now >= srv->zSweepMs)
+			{
+				srv_sweepCompressed(srv, now);
+				srv->zSweepMs = now + COMPRESS_IDLE_MS;
+			}
+
+			srv_accountCompression(srv);
+		}
+
+		if (srv->opts.idleTimeout > 0)
+		{
+			srv_updateTick(srv, ts.tv_sec);
+		}
+
+		if (srv->opts.scratchBatch)
+		{
+			srv_resetScratch(srv);
+		}
+
+		if (srv->pool.slabBytes > 0)
+		{
+			srv_trimBuffers(srv);
+		}
+
+		if (srv->opts.tcpSweep > 0)
+		{
+			srv_sweepTcp(srv);
+		}
+
+		if (srv->sketch != NULL)
+		{
+			sketch_tick(srv->sketch, time(NULL));
+		}
+
+		if (srv->sink.running)
+		{
+			sink_poll(&srv->sink);
+		}
+
+		if (srv->statsd.running)
+		{
+			statsd_poll(&srv->statsd);
+		}
+
+		if (srv->opts.memSoftLimit > 0 || srv->opts.memHardLimit > 0)
+		{
+			srv_enforceBudget(srv);
+		}
+
+		if (srv->statsRequested != 0)
+		{
+			srv->statsRequested = 0;
+			srv_writeStats(srv, stdout);
+			fflush(stdout);
+		}
+
+		if (srv->profileRequested != 0)
+		{
+			srv_startProfile(srv, srv->profileRequested);
+			srv->profileRequested = 0;
+		}
+
+		if (prof_active(&srv->prof))
+		{
+			srv_pollProfile(srv);
+		}
+
+		if (srv->hw.open)
+		{
+			srv_hwSample(srv, COST_HOUSEKEEPING);
+		}
+
+		srv->iterations++;
+	}
+
+	/* Write out a profile cut short by shutdown */
+	if (prof_active(&srv->prof))
+	{
+		prof_finish(&srv->prof, srv->profPath);
+	}
+
+on_exit:
+	/* Cleanup */
+	watchdog_stop(&srv->watchdog);
+	free(events);
+	close(srv->efd);
+	srv->efd = -1;
+
+	if (srv->dtlbFd > -1)
+	{
+		close(srv->dtlbFd);
+		srv->dtlbFd = -1;
+	}
+
+	if (srv->hw.open)
+	{
+		pmu_groupClose(&srv->hw);
+	}
+}
+
+/*
+ * Allocate the client table and the preallocated output buffers, from a
+ * hugepage arena if possible.
+ * Returns 0 on success, -1 on failure.
+ */
+static int srv_allocTables(struct server *srv)
+{
+	struct arena *a = &srv->arena;
+	size_t buffers = srv->opts.maxClients / 8;
+	size_t size;
+	int flags = 0;
+
+	size = clt_memSize(srv->opts.maxClients) + (buffers + 1) * BUF_SIZE;
+
+	if (srv->opts.hugePages)
+	{
+		flags |= ARENA_HUGEPAGES;
+	}
+
+	if (srv->opts.lockMemory)
+	{
+		flags |= ARENA_LOCK;
+	}
+
+	/* Fall back to heap allocations if the mapping fails */
+	if (arena_init(a, size, flags) != 0)
+	{
+		a = NULL;
+	}
+
+	if (clt_init(&srv->clients, srv->opts.maxClients, a) != 0 ||
+		bufpool_init(&srv->pool, buffers, a) != 0)
+	{
+		clt_destroy(&srv->clients);
+		arena_destroy(&srv->arena);
+		return -1;
+	}
+
+	mem_reserve(&srv->mem, MEM_CLIENTS, clt_memSize(srv->opts.maxClients));
+	mem_reserve(&srv->mem, MEM_OUTPUT, buffers * BUF_SIZE);
+
+	return 0;
+}
+
+void srv_defaultOptions(struct srv_options *opts)
+{
+	assert(opts != NULL);
+
+	memset(opts, 0, sizeof(struct srv_options));
+	opts->maxClients = DEFAULT_MAX_CLIENTS;
+	opts->idleTimeout = 0;
+	opts->hugePages = 1;
+	opts->lockMemory = 0;
+	opts->scratchSize = DEFAULT_SCRATCH_SIZE;
+	opts->scratchBatch = 0;
+	opts->memSoftLimit = 0;
+	opts->memHardLimit = 0;
+	opts->watchdogMs = 0;
+	opts->adminPort = 0;
+	opts->hwCounters = 0;
+	opts->rxTimestamps = 0;
+	opts->rxDelayAlertUs = 0;
+	opts->tcpSweep = 0;
+	opts->sketches = 0;
+	opts->capturePath = NULL;
+	opts->captureSize = DEFAULT_CAPTURE_SIZE;
+	opts->capturePayload = 0;
+	opts->sinkDir = NULL;
+	opts->sinkBatchKB = DEFAULT_SINK_BATCH_KB;
+	opts->sinkSegmentMB = DEFAULT_SINK_SEGMENT_MB;
+	opts->sinkCommitMs = DEFAULT_SINK_COMMIT_MS;
+	opts->sinkDirect = 0;
+	opts->outputPath = NULL;
+	opts->outputRingMB = DEFAULT_OUTPUT_RING_MB;
+	opts->localPath = NULL;
+	opts->localRingKB = DEFAULT_LOCAL_RING_KB;
+	opts->statsdPath = NULL;
+	opts->statsdFlushSec = DEFAULT_STATSD_FLUSH_SEC;
+	opts->jsonFields = NULL;
+	opts->compress = 0;
+	opts->compressDict = NULL;
+	opts->tlsPort = 0;
+	opts->tlsCert = NULL;
+	opts->websocket = 0;
+	opts->rpc = 0;
+	opts->rpcTimeoutMs = 30000;
+	opts->rpcOrdered = 0;
+	opts->mux = 0;
+}
+
+int srv_setOptions(struct server *srv, const struct srv_options *opts)
+{
+	if (srv == NULL || opts == NULL || srv->sd > -1)
+	{
+		return -1;
+	}
+
+	if (opts->maxClients < 1 || opts->idleTimeout < 0 ||
+		opts->scratchSize < 0 || opts->memSoftLimit < 0 ||
+		opts->memHardLimit < 0 || opts->watchdogMs < 0 ||
+		opts->adminPort < 0 || opts->rxDelayAlertUs < 0 ||
+		opts->tcpSweep < 0 || opts->captureSize < 1 ||
+		opts->sinkBatchKB < 1 || opts->sinkSegmentMB < 1 ||
+		opts->sinkCommitMs < 0 || opts->outputRingMB < 1 ||
+		opts->outputRingMB > 1024 || opts->localRingKB < 4 ||
+		opts->localRingKB > 1 << 20 || opts->statsdFlushSec < 1 ||
+		opts->tlsPort < 0 || opts->rpcTimeoutMs < 1)
+	{
+		fprintf(stderr, "Invalid server options.\n");
+		return -1;
+	}
+
+	if (opts->memSoftLimit > 0 && opts->memHardLimit > 0 &&
+		opts->memHardLimit < opts->memSoftLimit)
+	{
+		fprintf(stderr, "The hard memory limit is below the soft limit.\n");
+		return -1;
+	}
+
+	/* Each of them consumes everything clients send */
+	if ((opts->sinkDir != NULL) + (opts->statsdPath != NULL) +
+		(opts->jsonFields != NULL) + (opts->websocket != 0) +
+		(opts->rpc != 0) + (opts->mux != 0) > 1)
+	{
+		fprintf(stderr, "Sink, statsd, JSON lines, WebSocket, RPC and "
+			"stream mode cannot be combined.\n");
+		return -1;
+	}
+
+	if ((opts->tlsPort > 0) != (opts->tlsCert != NULL))
+	{
+		fprintf(stderr, "TLS needs both a port and a certificate.\n");
+		return -1;
+	}
+
+	if (opts->compressDict != NULL && !opts->compress)
+	{
+		fprintf(stderr, "A compression dictionary requires compression.\n");
+		return -1;
+	}
 
-			if ((ev->events & EPOLLERR) ||
-				(ev->events & EPOLLHUP) ||
-				!(ev->events & EPOLLIN))
-			{
-				srv_handleError(ev);
-			}
-			else if (ev->data.ptr == srv)
-			{
-				srv_handleAccept(efd, ev);
-			}
-			else
-			{
-				srv_handleReceive(ev);
-			}
-		}
+	if (opts->rpcOrdered && !opts->rpc)
+	{
+		fprintf(stderr, "Ordered responses require RPC mode.\n");
+		return -1;
 	}
 
-on_exit:
-	/* Cleanup */
-	free(events);
-	close(efd);
+	srv->opts = *opts;
+	return 0;
 }
 
 int srv_setHandler(struct server *srv, const struct srv_handler *h)
@@ -534,8 +4889,14 @@ struct server *srv_create(const struct srv_handler *h)
 
 	memset(srv, 0, sizeof(struct server));
 	srv->handler = h;
-	srv->clients = NULL;
+	srv_defaultOptions(&srv->opts);
 	srv->sd = -1;
+	srv->efd = -1;
+	srv->dtlbFd = -1;
+	srv->adminSd = -1;
+	srv->localSd = -1;
+	srv->udpSd = -1;
+	srv->tlsSd = -1;
 
 	return srv;
 }
@@ -548,6 +4909,10 @@ void srv_free(struct server *srv)
 	}
 
 	srv_freeAllClients(srv);
+	clt_destroy(&srv->clients);
+	bufpool_destroy(&srv->pool);
+	arena_destroy(&srv->arena);
+	rpc_free(&srv->rpc, 1);
 
 	if (srv->sd > -1)
 	{
@@ -567,38 +4932,529 @@ int srv_run(struct server *srv, int port, int queueSize)
 		return -1;
 	}
 
-	/* Create server socket */
-	srv->sd = srv_createAndBind(port);
-	if (srv->sd == -1)
+	/* Preallocate the client table and output buffers */
+	if (srv_allocTables(srv) != 0)
 	{
+		fprintf(stderr, "Failed to allocate client table: out of memory.\n");
 		return -1;
 	}
 
-	rc = srv_setNonBlocking(srv->sd);
-	if (rc == -1)
+	if (scratch_init(&srv->scratch, srv->opts.scratchSize) != 0)
 	{
+		fprintf(stderr, "Failed to allocate scratch memory.\n");
+		rc = -1;
 		goto on_exit;
 	}
 
-	rc = listen(srv->sd, 5);
-	if (rc == -1)
+	mem_reserve(&srv->mem, MEM_SCRATCH, srv->scratch.size);
+
+	if (srv->opts.sketches)
 	{
-		perror("listen");
+		srv->sketch = malloc(sizeof(struct sketches));
+		if (srv->sketch == NULL)
+		{
+			fprintf(stderr, "Failed to allocate traffic sketches.\n");
+			rc = -1;
+			goto on_exit;
+		}
+
+		sketch_init(srv->sketch, time(NULL));
+		mem_reserve(&srv->mem, MEM_SCRATCH, sizeof(struct sketches));
+	}
+
+	if (srv->opts.capturePath != NULL &&
+		cap_open(&srv->capture, srv->opts.capturePath,
+			(size_t)srv->opts.captureSize << 20, srv->opts.capturePayload) != 0)
+	{
+		fprintf(stderr, "Failed to create capture file %s.\n",
+			srv->opts.capturePath);
+		rc = -1;
+		goto on_exit;
+	}
+
+	if (srv->opts.sinkDir != NULL &&
+		sink_open(&srv->sink, srv->opts.sinkDir,
+			(size_t)srv->opts.sinkBatchKB << 10,
+			(size_t)srv->opts.sinkSegmentMB << 20, srv->opts.sinkCommitMs,
+			srv->opts.sinkDirect, srv_sinkAck, srv, &srv->mem) != 0)
+	{
+		fprintf(stderr, "Failed to open sink in %s.\n", srv->opts.sinkDir);
+		rc = -1;
+		goto on_exit;
+	}
+
+	if (srv->opts.outputPath != NULL &&
+		output_open(&srv->output, srv->opts.outputPath,
+			(size_t)srv->opts.outputRingMB << 20) != 0)
+	{
+		fprintf(stderr, "Failed to open output socket %s.\n",
+			srv->opts.outputPath);
+		rc = -1;
+		goto on_exit;
+	}
+
+	/* Create server socket */
+	srv->sd = srv_listen(INADDR_ANY, port);
+	if (srv->sd == -1)
+	{
+		rc = -1;
+		goto on_exit;
+	}
+
+	if (srv->opts.compress)
+	{
+		if (compress_init(&srv->zpool, srv->opts.compressDict,
+			COMPRESS_IDLE_CONTEXTS) != 0)
+		{
+			fprintf(stderr, "Failed to set up compression.\n");
+			rc = -1;
+			goto on_exit;
+		}
+
+		srv->zDirty = malloc(srv->opts.maxClients * sizeof(uint32_t));
+		srv->zDeferred = malloc(srv->opts.maxClients * sizeof(uint32_t));
+		if (srv->zDirty == NULL || srv->zDeferred == NULL)
+		{
+			fprintf(stderr, "Failed to set up compression: out of memory.\n");
+			rc = -1;
+			goto on_exit;
+		}
+	}
+
+	if (srv->opts.rpc)
+	{
+		if (rpc_init(&srv->rpc, RPC_PENDING_MAX) != 0)
+		{
+			fprintf(stderr, "Failed to set up RPC: out of memory.\n");
+			rc = -1;
+			goto on_exit;
+		}
+
+		mem_reserve(&srv->mem, MEM_CLIENTS, rpc_memSize(&srv->rpc));
+	}
+
+	if (srv->opts.jsonFields != NULL)
+	{
+		if (jsonl_init(&srv->jsonl, srv->opts.jsonFields) != 0)
+		{
+			rc = -1;
+			goto on_exit;
+		}
+
+		mem_reserve(&srv->mem, MEM_SCRATCH, jsonl_memSize());
+	}
+
+	if (srv->opts.statsdPath != NULL && srv_openStatsd(srv, port) != 0)
+	{
+		rc = -1;
 		goto on_exit;
 	}
 
+	/* The admin interface is only reachable from the local host */
+	if (srv->opts.adminPort > 0)
+	{
+		srv->adminSd = srv_listen(INADDR_LOOPBACK, srv->opts.adminPort);
+		if (srv->adminSd == -1)
+		{
+			rc = -1;
+			goto on_exit;
+		}
+	}
+
+	if (srv->opts.localPath != NULL)
+	{
+		srv->localSd = shm_listen(srv->opts.localPath);
+		if (srv->localSd == -1)
+		{
+			rc = -1;
+			goto on_exit;
+		}
+	}
+
+	if (srv->opts.tlsPort > 0)
+	{
+		if (tls_init(&srv->tls, srv->opts.tlsCert) != 0)
+		{
+			rc = -1;
+			goto on_exit;
+		}
+
+		srv->tlsSd = srv_listen(INADDR_ANY, srv->opts.tlsPort);
+		if (srv->tlsSd == -1)
+		{
+			rc = -1;
+			goto on_exit;
+		}
+	}
+
+	/* Spins for a few milliseconds, so not while clients are served */
+	tsc_calibrate();
+
 	srv_onStart(srv);
 	srv_eventLoop(srv, queueSize);
 	srv_onStop(srv);
 
 on_exit:
+	/* Write out the last batch, clients are not acknowledged anymore */
+	sink_close(&srv->sink);
 	srv_freeAllClients(srv);
-	close(srv->sd);
-	srv->sd = -1;
+	clt_destroy(&srv->clients);
+	bufpool_destroy(&srv->pool);
+	arena_destroy(&srv->arena);
+	scratch_destroy(&srv->scratch);
+	free(srv->sketch);
+	srv->sketch = NULL;
+	cap_close(&srv->capture);
+	output_close(&srv->output);
+	statsd_close(&srv->statsd);
+	jsonl_free(&srv->jsonl);
+	compress_free(&srv->zpool);
+	mem_unreserve(&srv->mem, MEM_CLIENTS, rpc_memSize(&srv->rpc));
+	rpc_free(&srv->rpc, 0);
+	free(srv->zDirty);
+	srv->zDirty = NULL;
+	srv->zDirtyCount = 0;
+	free(srv->zDeferred);
+	srv->zDeferred = NULL;
+	srv->zDeferredCount = 0;
+	srv->zCharged = 0;
+	free(srv->udpBuf);
+	srv->udpBuf = NULL;
+	memset(&srv->mem, 0, sizeof(struct mem_account));
+	srv->pausedCount = 0;
+
+	if (srv->sd > -1)
+	{
+		close(srv->sd);
+		srv->sd = -1;
+	}
+
+	if (srv->adminSd > -1)
+	{
+		close(srv->adminSd);
+		srv->adminSd = -1;
+	}
+
+	if (srv->udpSd > -1)
+	{
+		close(srv->udpSd);
+		srv->udpSd = -1;
+	}
+
+	if (srv->localSd > -1)
+	{
+		close(srv->localSd);
+		unlink(srv->opts.localPath);
+		srv->localSd = -1;
+	}
+
+	if (srv->tlsSd > -1)
+	{
+		close(srv->tlsSd);
+		srv->tlsSd = -1;
+	}
 
+	tls_free(&srv->tls);
 	return rc;
 }
 
+void *srv_scratchAlloc(struct server *srv, size_t size)
+{
+	void *p;
+
+	if (srv == NULL)
+	{
+		return NULL;
+	}
+
+	/* Overflow beyond the preallocated block is charged until the reset */
+	p = scratch_alloc(&srv->scratch, size);
+	if (srv->scratch.overflowBytes > srv->scratchCharged)
+	{
+		mem_charge(&srv->mem, MEM_SCRATCH,
+			srv->scratch.overflowBytes - srv->scratchCharged);
+		srv->scratchCharged = srv->scratch.overflowBytes;
+	}
+
+	return p;
+}
+
+void srv_chargeMemory(struct server *srv, long bytes)
+{
+	if (srv == NULL)
+	{
+		return;
+	}
+
+	if (bytes >= 0)
+	{
+		mem_charge(&srv->mem, MEM_HANDLER, (size_t)bytes);
+	}
+	else
+	{
+		mem_release(&srv->mem, MEM_HANDLER, (size_t)-bytes);
+	}
+}
+
+/*
+ * Write the hardware counter totals and derived per-event costs.
+ */
+static void srv_writeCostStats(const struct server *srv, FILE *fp)
+{
+	static const char *const names[COST_CLASSES] =
+	{
+		"accept", "receive", "write", "error", "housekeeping"
+	};
+	uint64_t total[PMU_COUNTERS] = { 0 };
+	const struct srv_cost_stats *rx = &srv->cost[COST_RECEIVE];
+	int i, j;
+
+	fprintf(fp, "hw_read_method %s\n", srv->hw.rdpmc ? "rdpmc" : "read");
+
+	for (i = 0; i < COST_CLASSES; ++i)
+	{
+		const struct srv_cost_stats *cs = &srv->cost[i];
+
+		fprintf(fp, "hw_%s_events %llu\n", names[i],
+			(unsigned long long)cs->events);
+
+		for (j = 0; j < PMU_COUNTERS; ++j)
+		{
+			fprintf(fp, "hw_%s_%s %llu\n", names[i], pmu_counterName(j),
+				(unsigned long long)cs->counters[j]);
+			total[j] += cs->counters[j];
+		}
+
+		if (cs->events > 0)
+		{
+			fprintf(fp, "hw_%s_cycles_per_event %.1f\n", names[i],
+				(double)cs->counters[PMU_CYCLES] / cs->events);
+		}
+	}
+
+	if (srv->bytesReceived > 0)
+	{
+		fprintf(fp, "hw_receive_cycles_per_byte %.2f\n",
+			(double)rx->counters[PMU_CYCLES] / srv->bytesReceived);
+	}
+
+	if (total[PMU_CYCLES] > 0)
+	{
+		fprintf(fp, "hw_ipc %.2f\n",
+			(double)total[PMU_INSTRUCTIONS] / total[PMU_CYCLES]);
+	}
+
+	if (srv->iterations > 0)
+	{
+		fprintf(fp, "hw_cycles_per_iteration %.1f\n",
+			(double)total[PMU_CYCLES] / srv->iterations);
+	}
+}
+
+void srv_writeStats(struct server *srv, FILE *fp)
+{
+	uint64_t misses;
+	int i;
+
+	if (srv == NULL || fp == NULL)
+	{
+		return;
+	}
+
+	fprintf(fp, "clients_connected %u\n", srv->clients.count);
+	fprintf(fp, "clients_capacity %u\n", srv->clients.capacity);
+	fprintf(fp, "buffers_used %zu\n", srv->pool.used);
+	fprintf(fp, "buffers_total %zu\n", srv->pool.total);
+	fprintf(fp, "arena_backing %s\n", arena_backingName(srv->arena.backing));
+	fprintf(fp, "arena_bytes %zu\n", srv->arena.size);
+	fprintf(fp, "arena_used %zu\n", srv->arena.used);
+	fprintf(fp, "arena_locked %d\n", srv->arena.locked);
+	fprintf(fp, "scratch_bytes %zu\n", srv->scratch.size);
+	fprintf(fp, "scratch_peak %zu\n", srv->scratch.peak);
+
+	for (i = 0; i < MEM_CATEGORIES; ++i)
+	{
+		fprintf(fp, "mem_%s %zu\n", mem_categoryName(i), srv->mem.used[i]);
+	}
+
+	fprintf(fp, "mem_total %zu\n", srv->mem.total);
+	fprintf(fp, "mem_fixed %zu\n", srv->mem.fixed);
+	fprintf(fp, "mem_peak %zu\n", srv->mem.peak);
+	fprintf(fp, "mem_soft_limit %zu\n", (size_t)srv->opts.memSoftLimit << 20);
+	fprintf(fp, "mem_hard_limit %zu\n", (size_t)srv->opts.memHardLimit << 20);
+	fprintf(fp, "mem_paused_clients %u\n", srv->pausedCount);
+	fprintf(fp, "mem_paused_total %llu\n",
+		(unsigned long long)srv->pausedTotal);
+	fprintf(fp, "mem_shed_total %llu\n", (unsigned long long)srv->shedTotal);
+	fprintf(fp, "loop_stalls %llu\n",
+		(unsigned long long)srv->watchdog.stalls);
+
+	if (pmu_read(srv->dtlbFd, &misses) == 0)
+	{
+		fprintf(fp, "dtlb_load_misses %llu\n", (unsigned long long)misses);
+	}
+
+	fprintf(fp, "loop_iterations %llu\n", (unsigned long long)srv->iterations);
+	fprintf(fp, "bytes_received %llu\n",
+		(unsigned long long)srv->bytesReceived);
+
+	if (srv->opts.tcpSweep > 0)
+	{
+		srv_writeTcpStats(srv, fp);
+	}
+
+	if (srv->sink.running)
+	{
+		sink_writeStats(&srv->sink, fp);
+	}
+
+	if (srv->localSd > -1)
+	{
+		fprintf(fp, "local_clients %u\n", srv->localCount);
+	}
+
+	if (srv->output.path != NULL)
+	{
+		output_writeStats(&srv->output, fp);
+	}
+
+	if (srv->jsonl.index != NULL)
+	{
+		jsonl_writeStats(&srv->jsonl, fp);
+	}
+
+	if (srv->opts.compress)
+	{
+		compress_writeStats(&srv->zpool, fp);
+	}
+
+	if (srv->opts.tlsPort > 0)
+	{
+		tls_writeStats(&srv->tls, fp);
+	}
+
+	if (srv->opts.websocket)
+	{
+		ws_writeStats(&srv->ws, fp);
+	}
+
+	if (srv->opts.rpc)
+	{
+		rpc_writeStats(&srv->rpc, fp);
+	}
+
+	if (srv->opts.rpcOrdered)
+	{
+		hist_write(&srv->rpcHol, "rpc_hol_wait_us", fp);
+	}
+
+	if (srv->opts.mux)
+	{
+		mux_writeStats(&srv->mux, fp);
+	}
+
+	if (srv->statsd.running)
+	{
+		fprintf(fp, "statsd_datagrams %llu\n",
+			(unsigned long long)srv->udpDatagrams);
+		fprintf(fp, "statsd_datagrams_truncated %llu\n",
+			(unsigned long long)srv->udpTruncated);
+		statsd_writeStats(&srv->statsd, fp);
+	}
+
+	if (srv->capture.hdr != NULL)
+	{
+		fprintf(fp, "capture_records %llu\n",
+			(unsigned long long)srv->capture.hdr->records);
+		fprintf(fp, "capture_dropped %llu\n",
+			(unsigned long long)srv->capture.hdr->dropped);
+	}
+
+	if (srv->sketch != NULL)
+	{
+		fprintf(fp, "distinct_ips_minute %.0f\n",
+			hll_estimate(&srv->sketch->distinct));
+	}
+
+	if (srv->opts.rxTimestamps)
+	{
+		hist_write(&srv->rxDelay, "rx_queue_delay_us", fp);
+		fprintf(fp, "rx_queue_delay_alerts %llu\n",
+			(unsigned long long)srv->rxDelayAlerts);
+	}
+
+	if (srv->hw.open)
+	{
+		srv_writeCostStats(srv, fp);
+	}
+}
+
+void srv_requestStats(struct server *srv)
+{
+	if (srv != NULL)
+	{
+		srv->statsRequested = 1;
+	}
+}
+
+void srv_requestProfile(struct server *srv, int seconds)
+{
+	if (srv != NULL)
+	{
+		srv->profileRequested = seconds > 0 ? seconds :
+			DEFAULT_PROFILE_SECONDS;
+	}
+}
+
+int srv_rpcRegister(struct server *srv, uint16_t method,
+	void (*fn)(void *arg, const struct rpc_call *call), void *arg)
+{
+	if (srv == NULL || fn == NULL)
+	{
+		return -1;
+	}
+
+	return rpc_register(&srv->rpc, method, fn, arg);
+}
+
+int srv_rpcRespond(struct server *srv, uint64_t token, uint16_t status,
+	const char *body, size_t len)
+{
+	struct rpc_pending p;
+	uint32_t slot;
+	struct cl_hot *h;
+
+	/* Oneway requests take no response */
+	if (srv == NULL || token == 0 || len > RPC_BODY_MAX)
+	{
+		return -1;
+	}
+
+	/* Expired already and the client has been told, or it is gone */
+	if (rpc_complete(&srv->rpc, token, &p) != 0)
+	{
+		return -1;
+	}
+
+	slot = (uint32_t)p.client;
+	h = clt_lookup(&srv->clients, slot,
+		(uint32_t)(p.client >> 32) & CL_GEN_MASK);
+	if (h == NULL)
+	{
+		return 0;
+	}
+
+	if (srv_rpcReply(srv, slot, p.seq, p.id, p.method, status, body,
+		len) != 0)
+	{
+		/* May run within an event of the client, leave freeing to it */
+		shutdown(h->sd, SHUT_RDWR);
+		return -1;
+	}
+
+	return 0;
+}
+
 void srv_stop(struct server *srv)
 {
 	if (srv != NULL)
@@ -18,6 +18,12 @@ along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct jsonl_record;
+struct rpc_call;
 struct server;
 
 /* Server event handler interface */
@@ -28,8 +34,114 @@ struct srv_handler
 	void (*on_connect)(const char *ip);
 	void (*on_disconnect)(const char *ip);
 	void (*on_receive)(const char *ip, const char *buffer, int len);
+	/* Validated JSON line, replaces on_receive in JSON lines mode */
+	void (*on_record)(const char *ip, const struct jsonl_record *rec);
+};
+
+/* Server options, see srv_defaultOptions for defaults */
+struct srv_options
+{
+	/* Maximum number of connected clients, preallocated on start */
+	int maxClients;
+	/* Disconnect clients idle for this many seconds, 0 disables */
+	int idleTimeout;
+	/* Back preallocated tables with hugepages if available */
+	int hugePages;
+	/* Lock preallocated tables into memory */
+	int lockMemory;
+	/* Size of the handler scratch block in bytes */
+	int scratchSize;
+	/* Reset scratch memory per loop iteration instead of per callback */
+	int scratchBatch;
+	/* Pause reads from the biggest consumers above this many MB, not
+	 * counting preallocated tables, 0 disables */
+	int memSoftLimit;
+	/* Disconnect the biggest consumers above this many MB, not counting
+	 * preallocated tables, 0 disables */
+	int memHardLimit;
+	/* Report loop iterations longer than this many ms, 0 disables */
+	int watchdogMs;
+	/* Port of the admin interface on 127.0.0.1, 0 disables */
+	int adminPort;
+	/* Attribute hardware counters of the loop thread to event types */
+	int hwCounters;
+	/* Measure how long received data waited in the socket queue */
+	int rxTimestamps;
+	/* Report queueing delays above this many microseconds, 0 disables */
+	int rxDelayAlertUs;
+	/* Client slots checked for TCP_INFO per loop iteration, 0 disables */
+	int tcpSweep;
+	/* Track heavy hitters and distinct source IPs */
+	int sketches;
+	/* Record client traffic to this file, NULL disables */
+	const char *capturePath;
+	/* Size of the capture ring in MB */
+	int captureSize;
+	/* Record payloads, not only byte counts */
+	int capturePayload;
+	/* Persist length-prefixed messages to segment files in this directory
+	 * instead of echoing, NULL disables */
+	const char *sinkDir;
+	/* Size of a sink write batch in KB */
+	int sinkBatchKB;
+	/* Size at which sink segment files are rolled over in MB */
+	int sinkSegmentMB;
+	/* Commit partially filled batches after this many ms */
+	int sinkCommitMs;
+	/* Write sink segments with O_DIRECT */
+	int sinkDirect;
+	/* Hand received data to a consumer connecting to this Unix socket,
+	 * NULL disables */
+	const char *outputPath;
+	/* Size of the output ring in MB */
+	int outputRingMB;
+	/* Accept same-host clients using shared memory rings on this Unix
+	 * socket, NULL disables */
+	const char *localPath;
+	/* Ring size per direction of local clients in KB */
+	int localRingKB;
+	/* Aggregate statsd lines from clients and UDP datagrams on the server
+	 * port, writing the aggregates to this file ("-" for stdout), NULL
+	 * disables */
+	const char *statsdPath;
+	/* Seconds between two statsd flushes */
+	int statsdFlushSec;
+	/* Validate newline-delimited JSON from clients and hand the records
+	 * with these comma separated top-level fields to on_record, NULL
+	 * disables */
+	const char *jsonFields;
+	/* Let clients negotiate compressed connections */
+	int compress;
+	/* Preset dictionary file for compressed connections, NULL for none */
+	const char *compressDict;
+	/* Port of the TLS listener, 0 if disabled */
+	int tlsPort;
+	/* PEM file with the TLS certificate chain and private key */
+	const char *tlsCert;
+	/* Clients speak WebSocket after an HTTP upgrade */
+	int websocket;
+	/* Clients send binary RPC requests to registered methods */
+	int rpc;
+	/* Deadline of RPC requests in ms, also the longest one they may ask for */
+	int rpcTimeoutMs;
+	/* Send RPC responses in request order instead of completion order */
+	int rpcOrdered;
+	/* Clients multiplex streams over their connection, each stream is
+	 * passed to the handler as a connection of its own */
+	int mux;
 };
 
+/*
+ * Fills in the default server options.
+ */
+void srv_defaultOptions(struct srv_options *opts);
+
+/*
+ * Sets the server options. Must be called before the server is started.
+ * Returns 0 on success, -1 on failure.
+ */
+int srv_setOptions(struct server *srv, const struct srv_options *opts);
+
 /*
  * Sets the server event handler.
  * Returns 0 on success, -1 on failure.
@@ -58,4 +170,55 @@ int srv_run(struct server *srv, int port, int queueSize);
  */
 void srv_stop(struct server *srv);
 
+/*
+ * Allocates temporary memory for use inside a handler callback. The memory
+ * is released when the callback returns, or at the end of the current loop
+ * iteration if scratchBatch is set, and must not be freed.
+ * Returns NULL on failure.
+ */
+void *srv_scratchAlloc(struct server *srv, size_t size);
+
+/*
+ * Accounts memory held by handlers against the server memory budget. Pass a
+ * negative value to release memory charged earlier.
+ */
+void srv_chargeMemory(struct server *srv, long bytes);
+
+/*
+ * Writes server statistics as "name value" lines. Must be called from the
+ * thread running the server or while the server is stopped.
+ */
+void srv_writeStats(struct server *srv, FILE *fp);
+
+/*
+ * Asks the event loop to write statistics to stdout. Safe to call from a
+ * signal handler.
+ */
+void srv_requestStats(struct server *srv);
+
+/*
+ * Asks the event loop to sample its own stacks for the given number of
+ * seconds (0 for the default) and write them to profile-<pid>-<time>.folded
+ * in folded-stack format. Safe to call from a signal handler.
+ */
+void srv_requestProfile(struct server *srv, int seconds);
+
+/*
+ * Registers fn as the handler of an RPC method. Method ids index a table
+ * directly, so they should be small and dense.
+ * Returns 0 on success, -1 on failure.
+ */
+int srv_rpcRegister(struct server *srv, uint16_t method,
+	void (*fn)(void *arg, const struct rpc_call *call), void *arg);
+
+/*
+ * Answers an RPC call, from within the method or at any later point in the
+ * event loop thread. Responses go out in completion order, clients match
+ * them by request id, unless rpcOrdered is set.
+ * Returns 0 on success, -1 if the call is no longer pending, e.g. because
+ * its deadline passed.
+ */
+int srv_rpcRespond(struct server *srv, uint64_t token, uint16_t status,
+	const char *body, size_t len);
+
 #endif
@@ -0,0 +1,303 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "shmring.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Returns the bytes of one ring including its header.
+ */
+static size_t shm_ringBytes(uint64_t size)
+{
+	return sizeof(struct shm_ring) + size;
+}
+
+int shm_create(size_t size, uint32_t count, void **base, size_t *mapLen)
+{
+	uint64_t ringSize = 4096;
+	uint32_t i;
+	int fd;
+
+	while (ringSize < size)
+	{
+		ringSize <<= 1;
+	}
+
+	fd = memfd_create("epoll-server-ring", MFD_CLOEXEC);
+	if (fd == -1)
+	{
+		perror("memfd_create");
+		return -1;
+	}
+
+	*mapLen = shm_ringBytes(ringSize) * count;
+	if (ftruncate(fd, *mapLen) != 0)
+	{
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	*base = mmap(NULL, *mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*base == MAP_FAILED)
+	{
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		struct shm_ring *r =
+			(struct shm_ring *)((uint8_t *)*base + i * shm_ringBytes(ringSize));
+
+		r->magic = SHM_MAGIC;
+		r->count = count;
+		r->size = ringSize;
+	}
+
+	return fd;
+}
+
+int shm_attach(int fd, void **base, size_t *mapLen)
+{
+	const struct shm_ring *r;
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shm_ring))
+	{
+		fprintf(stderr, "Invalid ring descriptor.\n");
+		return -1;
+	}
+
+	*mapLen = st.st_size;
+	*base = mmap(NULL, *mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*base == MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+
+	r = *base;
+	if (r->magic != SHM_MAGIC || (r->size & (r->size - 1)) != 0 ||
+		shm_ringBytes(r->size) * r->count != *mapLen)
+	{
+		fprintf(stderr, "Invalid ring header.\n");
+		munmap(*base, *mapLen);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct shm_ring *shm_ringAt(void *base, uint32_t index)
+{
+	const struct shm_ring *first = base;
+
+	if (index >= first->count)
+	{
+		return NULL;
+	}
+
+	return (struct shm_ring *)((uint8_t *)base +
+		index * shm_ringBytes(first->size));
+}
+
+void shm_portInit(struct shm_port *p, struct shm_ring *r)
+{
+	p->ring = r;
+	p->data = (uint8_t *)(r + 1);
+	p->mask = r->size - 1;
+	p->pos = atomic_load(&r->tail);
+	p->cached = atomic_load(&r->head);
+}
+
+/*
+ * Fills in a Unix socket address.
+ * Returns 0 on success, -1 if the path is too long.
+ */
+static int shm_address(struct sockaddr_un *addr, const char *path)
+{
+	if (strlen(path) >= sizeof(addr->sun_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int shm_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int sd;
+
+	if (shm_address(&addr, path) != 0)
+	{
+		return -1;
+	}
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	unlink(path);
+
+	if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		perror("bind");
+		goto on_error;
+	}
+
+	if (listen(sd, 16) != 0)
+	{
+		perror("listen");
+		goto on_error;
+	}
+
+	return sd;
+
+on_error:
+	close(sd);
+	return -1;
+}
+
+int shm_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int sd;
+
+	if (shm_address(&addr, path) != 0)
+	{
+		return -1;
+	}
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		perror(path);
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+int shm_sendFds(int sd, const int *fds, int count, const void *msg,
+	size_t len)
+{
+	union
+	{
+		char buf[CMSG_SPACE(4 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	if (count > 4)
+	{
+		return -1;
+	}
+
+	iov.iov_base = (void *)msg;
+	iov.iov_len = len;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(&control, 0, sizeof(control));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+	if (sendmsg(sd, &mh, MSG_NOSIGNAL) != (ssize_t)len)
+	{
+		perror("sendmsg");
+		return -1;
+	}
+
+	return 0;
+}
+
+int shm_recvFds(int sd, int *fds, int max, void *msg, size_t len)
+{
+	union
+	{
+		char buf[CMSG_SPACE(4 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int count = 0;
+
+	iov.iov_base = msg;
+	iov.iov_len = len;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+
+	if (recvmsg(sd, &mh, MSG_CMSG_CLOEXEC) != (ssize_t)len)
+	{
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(&mh, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (count > max)
+			{
+				count = max;
+			}
+
+			memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+		}
+	}
+
+	return count;
+}
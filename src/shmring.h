@@ -0,0 +1,319 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_MAGIC 0x474e4952u
+#define SHM_CACHELINE 64
+
+/* Message types, applications define their own from SHM_USER on */
+#define SHM_PAD 0u
+#define SHM_USER 1u
+
+/* Round a message size up to the ring alignment */
+#define SHM_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+/*
+ * Single producer, single consumer ring of variable sized messages in
+ * shared memory. head and tail are byte positions that only grow; each is
+ * written by one side only and sits on its own cache line. A side that is
+ * about to sleep sets its waiting flag, and the other side signals an
+ * eventfd only if it finds the flag set, so a busy pair makes no system
+ * calls.
+ */
+struct shm_ring
+{
+	/* Written by the consumer */
+	_Alignas(SHM_CACHELINE) _Atomic uint64_t head;
+	_Atomic uint32_t consumerWaiting;
+	/* Written by the producer */
+	_Alignas(SHM_CACHELINE) _Atomic uint64_t tail;
+	_Atomic uint32_t producerWaiting;
+	/* Constant after creation */
+	_Alignas(SHM_CACHELINE) uint32_t magic;
+	uint32_t count;
+	/* Size of the data area of each ring, a power of two */
+	uint64_t size;
+};
+
+/* Message header, followed by len bytes and padded to 8 bytes */
+struct shm_msg
+{
+	uint32_t len;
+	uint32_t type;
+};
+
+/* One side's view of a ring */
+struct shm_port
+{
+	struct shm_ring *ring;
+	uint8_t *data;
+	uint64_t mask;
+	/* Unpublished tail of the producer, unreleased head of the consumer */
+	uint64_t pos;
+	/* Last seen head of the producer, last seen tail of the consumer */
+	uint64_t cached;
+	/* Length of the message returned by shm_peek */
+	uint32_t peekLen;
+};
+
+/*
+ * Creates a memfd holding count rings of the given data size (rounded up to
+ * a power of two) and maps it.
+ * Returns the memfd, -1 on failure.
+ */
+int shm_create(size_t size, uint32_t count, void **base, size_t *mapLen);
+
+/*
+ * Maps rings created by shm_create, e.g. in another process.
+ * Returns 0 on success, -1 on failure.
+ */
+int shm_attach(int fd, void **base, size_t *mapLen);
+
+/*
+ * Returns a ring of a mapping, NULL if index is out of range.
+ */
+struct shm_ring *shm_ringAt(void *base, uint32_t index);
+
+/*
+ * Initializes a port for one side of a ring.
+ */
+void shm_portInit(struct shm_port *p, struct shm_ring *r);
+
+/*
+ * Creates a non-blocking Unix stream socket listening on path. A socket
+ * file left over from a previous run is replaced.
+ * Returns the socket, -1 on failure.
+ */
+int shm_listen(const char *path);
+
+/*
+ * Connects a blocking Unix stream socket to path.
+ * Returns the socket, -1 on failure.
+ */
+int shm_connect(const char *path);
+
+/*
+ * Sends descriptors and a message over a Unix socket.
+ * Returns 0 on success, -1 on failure.
+ */
+int shm_sendFds(int sd, const int *fds, int count, const void *msg,
+	size_t len);
+
+/*
+ * Receives descriptors and a message sent with shm_sendFds.
+ * Returns the number of descriptors received, -1 on failure.
+ */
+int shm_recvFds(int sd, int *fds, int max, void *msg, size_t len);
+
+/*
+ * Reserves room for a message of len bytes. Nothing is visible to the
+ * consumer before shm_commit and shm_publish.
+ * Returns the payload pointer, NULL if the ring is full.
+ */
+static inline void *shm_reserve(struct shm_port *p, uint32_t len)
+{
+	uint64_t size = p->mask + 1;
+	uint64_t need = SHM_ALIGN(sizeof(struct shm_msg) + len);
+	uint64_t off = p->pos & p->mask;
+	uint64_t pad = (size - off < need) ? size - off : 0;
+	struct shm_msg *m;
+
+	if (need > size / 2)
+	{
+		return NULL;
+	}
+
+	if (p->pos + pad + need - p->cached > size)
+	{
+		p->cached = atomic_load_explicit(&p->ring->head, memory_order_acquire);
+		if (p->pos + pad + need - p->cached > size)
+		{
+			return NULL;
+		}
+	}
+
+	/* Messages are contiguous, skip the rest of the data area */
+	if (pad > 0)
+	{
+		m = (struct shm_msg *)(p->data + off);
+		m->len = (uint32_t)(pad - sizeof(struct shm_msg));
+		m->type = SHM_PAD;
+		p->pos += pad;
+	}
+
+	m = (struct shm_msg *)(p->data + (p->pos & p->mask));
+	m->len = len;
+
+	return m + 1;
+}
+
+/*
+ * Completes the message reserved last. len may be smaller than reserved.
+ */
+static inline void shm_commit(struct shm_port *p, uint32_t type, uint32_t len)
+{
+	struct shm_msg *m = (struct shm_msg *)(p->data + (p->pos & p->mask));
+
+	m->len = len;
+	m->type = type;
+	p->pos += SHM_ALIGN(sizeof(struct shm_msg) + len);
+}
+
+/*
+ * Makes all committed messages visible to the consumer.
+ * Returns 1 if the consumer is sleeping and must be woken up.
+ */
+static inline int shm_publish(struct shm_port *p)
+{
+	atomic_store_explicit(&p->ring->tail, p->pos, memory_order_release);
+
+	/* Pairs with the fence in shm_consumerSleep */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return atomic_load_explicit(&p->ring->consumerWaiting,
+		memory_order_relaxed) &&
+		atomic_exchange(&p->ring->consumerWaiting, 0);
+}
+
+/*
+ * Takes the next message without consuming it. The producer may be another
+ * process, so its tail and message headers are checked before use and the
+ * header is read only once.
+ * Returns 1 with the payload in msg, 0 if the ring is empty, -1 if the
+ * producer wrote an invalid tail or header.
+ */
+static inline int shm_peek(struct shm_port *p, const void **msg,
+	uint32_t *type, uint32_t *len)
+{
+	const volatile struct shm_msg *m;
+	uint64_t room;
+
+	while (1)
+	{
+		if (p->pos == p->cached)
+		{
+			p->cached = atomic_load_explicit(&p->ring->tail,
+				memory_order_acquire);
+			if (p->pos == p->cached)
+			{
+				return 0;
+			}
+
+			if (p->cached - p->pos > p->mask + 1)
+			{
+				return -1;
+			}
+		}
+
+		m = (const volatile struct shm_msg *)(p->data + (p->pos & p->mask));
+		*type = m->type;
+		*len = m->len;
+
+		/* Messages are contiguous and published completely */
+		room = p->mask + 1 - (p->pos & p->mask);
+		if (sizeof(struct shm_msg) + (uint64_t)*len > room ||
+			SHM_ALIGN(sizeof(struct shm_msg) + *len) > p->cached - p->pos)
+		{
+			return -1;
+		}
+
+		if (*type != SHM_PAD)
+		{
+			break;
+		}
+
+		/* Padding always fills the rest of the data area */
+		if (sizeof(struct shm_msg) + *len != room)
+		{
+			return -1;
+		}
+
+		p->pos += room;
+	}
+
+	p->peekLen = *len;
+	*msg = (const void *)(m + 1);
+	return 1;
+}
+
+/*
+ * Consumes the message returned by shm_peek. Its memory stays valid until
+ * shm_release.
+ */
+static inline void shm_consume(struct shm_port *p)
+{
+	p->pos += SHM_ALIGN(sizeof(struct shm_msg) + p->peekLen);
+}
+
+/*
+ * Returns the memory of consumed messages to the producer.
+ * Returns 1 if the producer waits for space and must be woken up.
+ */
+static inline int shm_release(struct shm_port *p)
+{
+	atomic_store_explicit(&p->ring->head, p->pos, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return atomic_load_explicit(&p->ring->producerWaiting,
+		memory_order_relaxed) &&
+		atomic_exchange(&p->ring->producerWaiting, 0);
+}
+
+/*
+ * Announces that the consumer is going to sleep on its eventfd.
+ * Returns 1 if it may sleep, 0 if messages arrived in the meantime.
+ */
+static inline int shm_consumerSleep(struct shm_port *p)
+{
+	atomic_store(&p->ring->consumerWaiting, 1);
+
+	if (atomic_load_explicit(&p->ring->tail, memory_order_acquire) != p->pos)
+	{
+		atomic_store(&p->ring->consumerWaiting, 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Announces that the producer waits for space on its eventfd.
+ * Returns 1 if it may sleep, 0 if space was released in the meantime.
+ */
+static inline int shm_producerSleep(struct shm_port *p, uint32_t len)
+{
+	uint64_t need = SHM_ALIGN(sizeof(struct shm_msg) + len) * 2;
+
+	atomic_store(&p->ring->producerWaiting, 1);
+
+	if (p->pos + need - atomic_load_explicit(&p->ring->head,
+		memory_order_acquire) <= p->mask + 1)
+	{
+		atomic_store(&p->ring->producerWaiting, 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+#endif
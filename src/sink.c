@@ -0,0 +1,751 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "sink.h"
+#include "mem.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+/* Initial number of ack entries per batch */
+#define SINK_ACKS 64
+
+static uint64_t sink_nowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns the bytes at the end of a batch kept free for the padding record.
+ */
+static size_t sink_reserve(const struct sink *s)
+{
+	return s->direct ? SINK_ALIGN + sizeof(struct sink_record) : 0;
+}
+
+/*
+ * Create the next segment file.
+ * Returns 0 on success, -1 on failure.
+ */
+static int sink_openSegment(struct sink *s)
+{
+	char name[32];
+	int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+	int fd;
+
+	if (s->direct)
+	{
+		flags |= O_DIRECT;
+	}
+
+	/* Never overwrite segments of an earlier run */
+	while (1)
+	{
+		snprintf(name, sizeof(name), "segment-%08u.log", s->segment);
+
+		fd = openat(s->dirFd, name, flags, 0644);
+		if (fd != -1)
+		{
+			break;
+		}
+
+		if (errno != EEXIST)
+		{
+			perror(name);
+			return -1;
+		}
+
+		s->segment++;
+	}
+
+	/* The new directory entry must survive a crash as well */
+	if (fsync(s->dirFd) != 0)
+	{
+		perror("fsync");
+	}
+
+	s->fd = fd;
+	s->segmentBytes = 0;
+	s->syncedBytes = 0;
+	s->segments++;
+
+	return 0;
+}
+
+/*
+ * Write a batch to the current segment, rolling over to a new segment first
+ * if the batch does not fit.
+ * Returns 0 on success, -1 on failure.
+ */
+static int sink_writeBatch(struct sink *s, struct sink_batch *b)
+{
+	size_t off = 0;
+
+	if (s->segmentBytes > 0 && s->segmentBytes + b->len > s->segmentSize)
+	{
+		/* The batches of the old segment are synced with this group */
+		if (fdatasync(s->fd) != 0)
+		{
+			perror("fdatasync");
+			return -1;
+		}
+
+		close(s->fd);
+		s->fd = -1;
+		s->segment++;
+
+		if (sink_openSegment(s) != 0)
+		{
+			return -1;
+		}
+	}
+
+	while (off < b->len)
+	{
+		ssize_t n = write(s->fd, b->data + off, b->len - off);
+
+		if (n == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			perror("write");
+			return -1;
+		}
+
+		off += n;
+	}
+
+	s->segmentBytes += b->len;
+	return 0;
+}
+
+/*
+ * Drop what was written to the segment since the last sync and continue in
+ * a new segment, so no later batch follows a torn record.
+ */
+static void sink_discard(struct sink *s)
+{
+	if (s->fd == -1)
+	{
+		return;
+	}
+
+	if (ftruncate(s->fd, (off_t)s->syncedBytes) != 0)
+	{
+		perror("ftruncate");
+	}
+
+	close(s->fd);
+	s->fd = -1;
+	s->segment++;
+}
+
+/*
+ * Writer thread. Takes all sealed batches, writes them and commits them with
+ * a single fdatasync, so batches sealed while a sync runs share the next one.
+ */
+static void *sink_run(void *arg)
+{
+	struct sink *s = arg;
+	struct sink_batch *list, *b, *last = NULL;
+	uint64_t written, count, one = 1, now;
+	int failed;
+
+	pthread_mutex_lock(&s->lock);
+
+	while (1)
+	{
+		while (s->fullHead == NULL && !s->stop)
+		{
+			pthread_cond_wait(&s->wake, &s->lock);
+		}
+
+		if (s->fullHead == NULL)
+		{
+			break;
+		}
+
+		list = s->fullHead;
+		s->fullHead = NULL;
+		s->fullTail = NULL;
+		pthread_mutex_unlock(&s->lock);
+
+		written = 0;
+		count = 0;
+		/* After a failure writing continues in a new segment */
+		failed = s->fd == -1 && sink_openSegment(s) != 0;
+
+		for (b = list; b != NULL && !failed; b = b->next)
+		{
+			failed = sink_writeBatch(s, b) != 0;
+			written += b->len;
+		}
+
+		if (!failed && fdatasync(s->fd) != 0)
+		{
+			perror("fdatasync");
+			failed = 1;
+		}
+
+		if (failed)
+		{
+			sink_discard(s);
+		}
+		else
+		{
+			s->syncedBytes = s->segmentBytes;
+		}
+
+		now = sink_nowUs();
+		for (b = list; b != NULL; b = b->next)
+		{
+			b->durableUs = now;
+			b->failed = failed;
+			last = b;
+			count++;
+		}
+
+		pthread_mutex_lock(&s->lock);
+
+		if (s->doneTail != NULL)
+		{
+			s->doneTail->next = list;
+		}
+		else
+		{
+			s->doneHead = list;
+		}
+
+		s->doneTail = last;
+		s->batchesWritten += count;
+		s->bytesWritten += written;
+		s->syncs++;
+		s->errors += failed;
+
+		pthread_cond_signal(&s->done);
+		pthread_mutex_unlock(&s->lock);
+
+		if (write(s->efd, &one, sizeof(one)) != sizeof(one))
+		{
+			perror("write eventfd");
+		}
+
+		pthread_mutex_lock(&s->lock);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+int sink_open(struct sink *s, const char *dir, size_t batchSize,
+	size_t segmentSize, int commitMs, int direct, sink_ack_fn ack, void *arg,
+	struct mem_account *mem)
+{
+	int i, rc;
+
+	memset(s, 0, sizeof(struct sink));
+	s->fd = -1;
+	s->efd = -1;
+	s->dirFd = -1;
+	s->batchSize = (batchSize + SINK_ALIGN - 1) & ~(size_t)(SINK_ALIGN - 1);
+	s->segmentSize = segmentSize;
+	s->commitMs = commitMs;
+	s->direct = direct;
+	s->ack = ack;
+	s->ackArg = arg;
+	s->mem = mem;
+	s->nextSeq = 1;
+
+	if (s->batchSize < 2 * SINK_ALIGN)
+	{
+		s->batchSize = 2 * SINK_ALIGN;
+	}
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+	{
+		perror(dir);
+		return -1;
+	}
+
+	s->dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (s->dirFd == -1)
+	{
+		perror(dir);
+		return -1;
+	}
+
+	s->batches = calloc(SINK_BATCHES, sizeof(struct sink_batch));
+	if (s->batches == NULL)
+	{
+		goto on_error;
+	}
+
+	for (i = 0; i < SINK_BATCHES; ++i)
+	{
+		struct sink_batch *b = &s->batches[i];
+
+		/* O_DIRECT needs aligned buffers */
+		if (posix_memalign((void **)&b->data, SINK_ALIGN, s->batchSize) != 0)
+		{
+			b->data = NULL;
+			goto on_error;
+		}
+
+		b->next = s->free;
+		s->free = b;
+	}
+
+	mem_reserve(mem, MEM_SINK, SINK_BATCHES * s->batchSize);
+
+	s->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->efd == -1)
+	{
+		perror("eventfd");
+		goto on_error;
+	}
+
+	if (sink_openSegment(s) != 0)
+	{
+		if (direct && errno == EINVAL)
+		{
+			fprintf(stderr, "O_DIRECT is not supported in %s.\n", dir);
+		}
+
+		goto on_error;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->wake, NULL);
+	pthread_cond_init(&s->done, NULL);
+
+	rc = pthread_create(&s->thread, NULL, sink_run, s);
+	if (rc != 0)
+	{
+		fprintf(stderr, "Failed to start sink writer: %s\n", strerror(rc));
+		pthread_cond_destroy(&s->done);
+		pthread_cond_destroy(&s->wake);
+		pthread_mutex_destroy(&s->lock);
+		goto on_error;
+	}
+
+	s->running = 1;
+	return 0;
+
+on_error:
+	s->running = 1;
+	s->stop = 1;
+	sink_close(s);
+	return -1;
+}
+
+/*
+ * Pass the active batch to the writer.
+ */
+static void sink_seal(struct sink *s)
+{
+	struct sink_batch *b = s->active;
+
+	if (b == NULL || b->len == 0)
+	{
+		return;
+	}
+
+	/* Pad to the alignment O_DIRECT requires */
+	if (s->direct)
+	{
+		struct sink_record *r = (struct sink_record *)(b->data + b->len);
+		size_t end = (b->len + sizeof(struct sink_record) + SINK_ALIGN - 1) &
+			~(size_t)(SINK_ALIGN - 1);
+
+		r->len = (uint32_t)(end - b->len - sizeof(struct sink_record));
+		r->type = SINK_PAD;
+		r->conn = 0;
+		memset(r + 1, 0, r->len);
+		b->len = end;
+	}
+
+	b->sealedUs = sink_nowUs();
+	b->next = NULL;
+	s->active = NULL;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->fullTail != NULL)
+	{
+		s->fullTail->next = b;
+	}
+	else
+	{
+		s->fullHead = b;
+	}
+
+	s->fullTail = b;
+	pthread_cond_signal(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Make a batch active, waiting for the writer if all batches are in flight.
+ * That stalls the loop, which is the backpressure for clients that send
+ * faster than the disk writes.
+ */
+static void sink_activate(struct sink *s)
+{
+	struct sink_batch *b;
+
+	if (s->free == NULL)
+	{
+		s->stalls++;
+
+		pthread_mutex_lock(&s->lock);
+		while (s->doneHead == NULL)
+		{
+			pthread_cond_wait(&s->done, &s->lock);
+		}
+
+		pthread_mutex_unlock(&s->lock);
+		sink_complete(s);
+	}
+
+	b = s->free;
+	s->free = b->next;
+
+	b->next = NULL;
+	b->seq = s->nextSeq++;
+	b->len = 0;
+	b->ackCount = 0;
+	b->failed = 0;
+	b->openedUs = sink_nowUs();
+	s->active = b;
+}
+
+/*
+ * Append a complete message to the active batch.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int sink_append(struct sink *s, struct sink_conn *c, uint32_t slot,
+	uint32_t gen, uint64_t id, const uint8_t *msg, uint32_t len)
+{
+	size_t need = sizeof(struct sink_record) + len;
+	struct sink_record *r;
+	struct sink_batch *b;
+
+	if (s->active != NULL &&
+		s->active->len + need > s->batchSize - sink_reserve(s))
+	{
+		sink_seal(s);
+	}
+
+	if (s->active == NULL)
+	{
+		sink_activate(s);
+	}
+
+	b = s->active;
+
+	/* One ack entry per client and batch */
+	if (c->batchSeq == b->seq)
+	{
+		b->acks[c->ackIndex].count++;
+	}
+	else
+	{
+		if (b->ackCount == b->ackCapacity)
+		{
+			uint32_t n = b->ackCapacity ? b->ackCapacity * 2 : SINK_ACKS;
+			struct sink_ack *acks = realloc(b->acks, n * sizeof(*acks));
+
+			if (acks == NULL)
+			{
+				return -1;
+			}
+
+			b->acks = acks;
+			b->ackCapacity = n;
+		}
+
+		c->batchSeq = b->seq;
+		c->ackIndex = b->ackCount++;
+		b->acks[c->ackIndex].slot = slot;
+		b->acks[c->ackIndex].gen = gen;
+		b->acks[c->ackIndex].count = 1;
+	}
+
+	r = (struct sink_record *)(b->data + b->len);
+	r->len = len;
+	r->type = SINK_DATA;
+	r->conn = id;
+	memcpy(r + 1, msg, len);
+	b->len += need;
+
+	c->received++;
+	s->messages++;
+	s->bytes += len;
+
+	/* Nothing else fits, no need to wait for the commit interval */
+	if (b->len + sizeof(struct sink_record) > s->batchSize - sink_reserve(s))
+	{
+		sink_seal(s);
+	}
+
+	return 0;
+}
+
+int sink_receive(struct sink *s, struct sink_conn *c, uint32_t slot,
+	uint32_t gen, uint64_t id, const uint8_t *data, size_t len)
+{
+	size_t maxLen = s->batchSize - sink_reserve(s) -
+		sizeof(struct sink_record);
+
+	while (len > 0)
+	{
+		size_t n;
+
+		if (c->msg == NULL)
+		{
+			uint32_t msgLen;
+
+			n = sizeof(c->hdr) - c->hdrLen;
+			if (n > len)
+			{
+				n = len;
+			}
+
+			memcpy(c->hdr + c->hdrLen, data, n);
+			c->hdrLen += n;
+			data += n;
+			len -= n;
+
+			if (c->hdrLen < sizeof(c->hdr))
+			{
+				break;
+			}
+
+			memcpy(&msgLen, c->hdr, sizeof(msgLen));
+			msgLen = ntohl(msgLen);
+			c->hdrLen = 0;
+
+			if (msgLen > maxLen)
+			{
+				return -1;
+			}
+
+			/* Complete messages are copied straight into the batch */
+			if (len >= msgLen)
+			{
+				if (sink_append(s, c, slot, gen, id, data, msgLen) != 0)
+				{
+					return -1;
+				}
+
+				data += msgLen;
+				len -= msgLen;
+				continue;
+			}
+
+			c->msg = malloc(msgLen);
+			if (c->msg == NULL)
+			{
+				return -1;
+			}
+
+			c->msgLen = 0;
+			c->msgSize = msgLen;
+			mem_charge(s->mem, MEM_SINK, msgLen);
+		}
+
+		n = c->msgSize - c->msgLen;
+		if (n > len)
+		{
+			n = len;
+		}
+
+		memcpy(c->msg + c->msgLen, data, n);
+		c->msgLen += n;
+		data += n;
+		len -= n;
+
+		if (c->msgLen == c->msgSize)
+		{
+			int rc = sink_append(s, c, slot, gen, id, c->msg, c->msgSize);
+
+			sink_connFree(s, c);
+			if (rc != 0)
+			{
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void sink_connFree(struct sink *s, struct sink_conn *c)
+{
+	if (c->msg != NULL)
+	{
+		mem_release(s->mem, MEM_SINK, c->msgSize);
+		free(c->msg);
+		c->msg = NULL;
+	}
+}
+
+void sink_poll(struct sink *s)
+{
+	if (s->active != NULL && s->active->len > 0 &&
+		sink_nowUs() - s->active->openedUs >= (uint64_t)s->commitMs * 1000)
+	{
+		sink_seal(s);
+	}
+}
+
+int sink_timeoutMs(const struct sink *s)
+{
+	uint64_t elapsed;
+
+	if (s->active == NULL || s->active->len == 0)
+	{
+		return -1;
+	}
+
+	elapsed = (sink_nowUs() - s->active->openedUs) / 1000;
+	return elapsed >= (uint64_t)s->commitMs ? 0 : s->commitMs - (int)elapsed;
+}
+
+void sink_complete(struct sink *s)
+{
+	struct sink_batch *list, *b;
+	uint64_t v;
+	uint32_t i;
+
+	/* Reset the eventfd before taking the list so no wakeup is lost */
+	if (read(s->efd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+	{
+		perror("read eventfd");
+	}
+
+	pthread_mutex_lock(&s->lock);
+	list = s->doneHead;
+	s->doneHead = NULL;
+	s->doneTail = NULL;
+	pthread_mutex_unlock(&s->lock);
+
+	while (list != NULL)
+	{
+		b = list;
+		list = b->next;
+
+		for (i = 0; i < b->ackCount; ++i)
+		{
+			s->ack(s->ackArg, b->acks[i].slot, b->acks[i].gen,
+				b->acks[i].count, b->failed);
+		}
+
+		hist_add(&s->commitUs, b->durableUs - b->sealedUs);
+		b->next = s->free;
+		s->free = b;
+	}
+}
+
+void sink_close(struct sink *s)
+{
+	int i;
+
+	if (!s->running)
+	{
+		return;
+	}
+
+	if (!s->stop)
+	{
+		sink_seal(s);
+
+		pthread_mutex_lock(&s->lock);
+		s->stop = 1;
+		pthread_cond_signal(&s->wake);
+		pthread_mutex_unlock(&s->lock);
+
+		pthread_join(s->thread, NULL);
+		pthread_cond_destroy(&s->done);
+		pthread_cond_destroy(&s->wake);
+		pthread_mutex_destroy(&s->lock);
+	}
+
+	if (s->batches != NULL)
+	{
+		for (i = 0; i < SINK_BATCHES; ++i)
+		{
+			free(s->batches[i].data);
+			free(s->batches[i].acks);
+		}
+
+		free(s->batches);
+		s->batches = NULL;
+		mem_unreserve(s->mem, MEM_SINK, SINK_BATCHES * s->batchSize);
+	}
+
+	if (s->fd > -1)
+	{
+		close(s->fd);
+		s->fd = -1;
+	}
+
+	if (s->efd > -1)
+	{
+		close(s->efd);
+		s->efd = -1;
+	}
+
+	if (s->dirFd > -1)
+	{
+		close(s->dirFd);
+		s->dirFd = -1;
+	}
+
+	s->running = 0;
+}
+
+void sink_writeStats(struct sink *s, FILE *fp)
+{
+	pthread_mutex_lock(&s->lock);
+	fprintf(fp, "sink_messages %llu\n", (unsigned long long)s->messages);
+	fprintf(fp, "sink_bytes %llu\n", (unsigned long long)s->bytes);
+	fprintf(fp, "sink_batches_written %llu\n",
+		(unsigned long long)s->batchesWritten);
+	fprintf(fp, "sink_bytes_written %llu\n",
+		(unsigned long long)s->bytesWritten);
+	fprintf(fp, "sink_syncs %llu\n", (unsigned long long)s->syncs);
+	fprintf(fp, "sink_segments %llu\n", (unsigned long long)s->segments);
+	fprintf(fp, "sink_stalls %llu\n", (unsigned long long)s->stalls);
+	fprintf(fp, "sink_errors %llu\n", (unsigned long long)s->errors);
+	pthread_mutex_unlock(&s->lock);
+
+	hist_write(&s->commitUs, "sink_commit_us", fp);
+}
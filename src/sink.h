@@ -0,0 +1,206 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SINK_H
+#define SINK_H
+
+#include "hist.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Number of batches, one is filled while the others are written */
+#define SINK_BATCHES 4
+/* Alignment of writes with O_DIRECT */
+#define SINK_ALIGN 4096
+
+/* Segment record types */
+#define SINK_DATA 1u
+/* Filler up to the next aligned offset, written with O_DIRECT only */
+#define SINK_PAD 2u
+
+struct mem_account;
+
+/*
+ * Record header in segment files, followed by len bytes. All fields are in
+ * host byte order.
+ */
+struct sink_record
+{
+	uint32_t len;
+	uint32_t type;
+	/* Client id */
+	uint64_t conn;
+};
+
+/* Messages of one client in a batch, acknowledged once the batch is durable */
+struct sink_ack
+{
+	uint32_t slot;
+	uint32_t gen;
+	uint32_t count;
+};
+
+/* Batch of records written with a single write */
+struct sink_batch
+{
+	struct sink_batch *next;
+	/* Sequence number, identifies the batch in sink_conn */
+	uint64_t seq;
+	uint8_t *data;
+	size_t len;
+	struct sink_ack *acks;
+	uint32_t ackCount;
+	uint32_t ackCapacity;
+	/* Monotonic times of the first record, the hand-off to the writer and
+	 * the completed sync in microseconds */
+	uint64_t openedUs;
+	uint64_t sealedUs;
+	uint64_t durableUs;
+	/* Non-zero if writing or syncing the batch failed */
+	int failed;
+};
+
+/* Per-client framing state */
+struct sink_conn
+{
+	/* Length prefix being received */
+	uint8_t hdr[4];
+	uint32_t hdrLen;
+	/* Message being received, NULL while reading the prefix */
+	uint8_t *msg;
+	/* Bytes received and length of the message */
+	uint32_t msgLen;
+	uint32_t msgSize;
+	/* Messages received and acknowledged */
+	uint64_t received;
+	uint64_t acked;
+	/* Batch holding the last message and its ack entry */
+	uint64_t batchSeq;
+	uint32_t ackIndex;
+};
+
+/*
+ * Called for every client of a completed batch with the number of its
+ * messages that became durable, or with failed set if they could not be
+ * written.
+ */
+typedef void (*sink_ack_fn)(void *arg, uint32_t slot, uint32_t gen,
+	uint32_t count, int failed);
+
+/* Ingest sink */
+struct sink
+{
+	/* Batch being filled by the loop thread, NULL if none */
+	struct sink_batch *active;
+	struct sink_batch *batches;
+	/* Batches ready for filling, used by the loop thread only */
+	struct sink_batch *free;
+	/* Lists protected by lock */
+	struct sink_batch *fullHead, *fullTail;
+	struct sink_batch *doneHead, *doneTail;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	pthread_t thread;
+	int running;
+	int stop;
+	/* Eventfd signalled when batches become durable */
+	int efd;
+	/* Segment directory, current segment and its size */
+	int dirFd;
+	int fd;
+	uint32_t segment;
+	uint64_t segmentBytes;
+	/* Bytes of the current segment committed by a successful sync */
+	uint64_t syncedBytes;
+	/* Settings */
+	size_t batchSize;
+	size_t segmentSize;
+	int commitMs;
+	int direct;
+	/* Acknowledgement callback */
+	sink_ack_fn ack;
+	void *ackArg;
+	struct mem_account *mem;
+	uint64_t nextSeq;
+	/* Statistics, the writer's are updated under lock */
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t batchesWritten;
+	uint64_t bytesWritten;
+	uint64_t syncs;
+	uint64_t segments;
+	uint64_t stalls;
+	uint64_t errors;
+	/* Seal to durable latency in microseconds */
+	struct hist commitUs;
+};
+
+/*
+ * Opens the sink: creates the first segment in dir and starts the writer
+ * thread. Batches are sealed when full or commitMs after their first
+ * message, segments are rolled at segmentSize bytes.
+ * Returns 0 on success, -1 on failure.
+ */
+int sink_open(struct sink *s, const char *dir, size_t batchSize,
+	size_t segmentSize, int commitMs, int direct, sink_ack_fn ack, void *arg,
+	struct mem_account *mem);
+
+/*
+ * Writes out pending batches, stops the writer and closes the segment.
+ * Pending acknowledgements are dropped.
+ */
+void sink_close(struct sink *s);
+
+/*
+ * Feeds received bytes of a client through the length-prefixed framing and
+ * appends complete messages. May block until a batch is free.
+ * Returns 0 on success, -1 if the client sent an oversized message.
+ */
+int sink_receive(struct sink *s, struct sink_conn *c, uint32_t slot,
+	uint32_t gen, uint64_t id, const uint8_t *data, size_t len);
+
+/*
+ * Frees the framing state of a client.
+ */
+void sink_connFree(struct sink *s, struct sink_conn *c);
+
+/*
+ * Seals the active batch if its commit interval has passed.
+ */
+void sink_poll(struct sink *s);
+
+/*
+ * Returns the milliseconds until the active batch must be sealed, -1 if
+ * there is nothing to commit.
+ */
+int sink_timeoutMs(const struct sink *s);
+
+/*
+ * Runs the acknowledgement callback for all durable batches and recycles
+ * them. Called when the eventfd becomes readable.
+ */
+void sink_complete(struct sink *s);
+
+/*
+ * Writes sink statistics.
+ */
+void sink_writeStats(struct sink *s, FILE *fp);
+
+#endif
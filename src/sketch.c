@@ -0,0 +1,237 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sketch.h"
+#include <math.h>
+#include <string.h>
+
+/*
+ * 64 bit finalizer of MurmurHash3, spreads IPv4 addresses over all bits.
+ */
+static uint64_t sketch_hash(uint32_t key)
+{
+	uint64_t h = key;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/*
+ * Returns the column of a key in a count-min row. The rows use the double
+ * hashing scheme h1 + i * h2.
+ */
+static inline uint32_t hh_column(uint64_t h, int row)
+{
+	uint32_t h1 = (uint32_t)h;
+	uint32_t h2 = (uint32_t)(h >> 32) | 1;
+
+	return (h1 + (uint32_t)row * h2) % CMS_WIDTH;
+}
+
+void hh_add(struct heavy_hitters *hh, uint32_t key, uint64_t n)
+{
+	uint64_t h = sketch_hash(key);
+	uint64_t est = UINT64_MAX;
+	uint32_t i, min = 0;
+	int row;
+
+	for (row = 0; row < CMS_DEPTH; ++row)
+	{
+		uint64_t *c = &hh->counts[row][hh_column(h, row)];
+
+		*c += n;
+		if (*c < est)
+		{
+			est = *c;
+		}
+	}
+
+	hh->total += n;
+
+	/* Space saving: update a tracked key or replace the smallest one */
+	for (i = 0; i < hh->topCount; ++i)
+	{
+		if (hh->top[i].key == key)
+		{
+			hh->top[i].count = est;
+			return;
+		}
+
+		if (hh->top[i].count < hh->top[min].count)
+		{
+			min = i;
+		}
+	}
+
+	if (hh->topCount < TOPK_SIZE)
+	{
+		min = hh->topCount++;
+		hh->top[min].error = 0;
+	}
+	else if (est > hh->top[min].count)
+	{
+		hh->top[min].error = hh->top[min].count;
+	}
+	else
+	{
+		return;
+	}
+
+	hh->top[min].key = key;
+	hh->top[min].count = est;
+}
+
+uint64_t hh_estimate(const struct heavy_hitters *hh, uint32_t key)
+{
+	uint64_t h = sketch_hash(key);
+	uint64_t est = UINT64_MAX;
+	int row;
+
+	for (row = 0; row < CMS_DEPTH; ++row)
+	{
+		uint64_t c = hh->counts[row][hh_column(h, row)];
+
+		if (c < est)
+		{
+			est = c;
+		}
+	}
+
+	return est;
+}
+
+void hh_sort(struct heavy_hitters *hh)
+{
+	uint32_t i, j;
+
+	for (i = 1; i < hh->topCount; ++i)
+	{
+		struct topk_entry e = hh->top[i];
+
+		for (j = i; j > 0 && hh->top[j - 1].count < e.count; --j)
+		{
+			hh->top[j] = hh->top[j - 1];
+		}
+
+		hh->top[j] = e;
+	}
+}
+
+/*
+ * Halve all counts so that old traffic fades out.
+ */
+static void hh_decay(struct heavy_hitters *hh)
+{
+	uint32_t i;
+	int row;
+
+	for (row = 0; row < CMS_DEPTH; ++row)
+	{
+		for (i = 0; i < CMS_WIDTH; ++i)
+		{
+			hh->counts[row][i] >>= 1;
+		}
+	}
+
+	hh->total >>= 1;
+
+	for (i = 0; i < hh->topCount; ++i)
+	{
+		hh->top[i].count >>= 1;
+		hh->top[i].error >>= 1;
+	}
+}
+
+void hll_add(struct hll *h, uint32_t key)
+{
+	uint64_t hash = sketch_hash(key);
+	uint32_t idx = hash >> (64 - HLL_BITS);
+	/* Position of the first set bit in the remaining bits */
+	uint64_t rest = (hash << HLL_BITS) | (1ull << (HLL_BITS - 1));
+	uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+
+	if (rank > h->reg[idx])
+	{
+		h->reg[idx] = rank;
+	}
+}
+
+double hll_estimate(const struct hll *h)
+{
+	const double m = HLL_REGISTERS;
+	double sum = 0.0, est;
+	int zeros = 0;
+	int i;
+
+	for (i = 0; i < HLL_REGISTERS; ++i)
+	{
+		sum += ldexp(1.0, -h->reg[i]);
+		zeros += h->reg[i] == 0;
+	}
+
+	est = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+
+	/* Linear counting is more accurate for small cardinalities */
+	if (est <= 2.5 * m && zeros > 0)
+	{
+		est = m * log(m / zeros);
+	}
+
+	return est;
+}
+
+void sketch_init(struct sketches *s, time_t now)
+{
+	memset(s, 0, sizeof(struct sketches));
+	s->minute = now / 60;
+}
+
+void sketch_tick(struct sketches *s, time_t now)
+{
+	time_t minute = now / 60;
+	uint32_t estimate;
+
+	if (minute == s->minute)
+	{
+		return;
+	}
+
+	/* Minutes without any traffic count as zero */
+	estimate = (uint32_t)(hll_estimate(&s->distinct) + 0.5);
+	while (s->minute < minute)
+	{
+		memmove(&s->history[1], &s->history[0],
+			(SKETCH_MINUTES - 1) * sizeof(uint32_t));
+		s->history[0] = estimate;
+		estimate = 0;
+		s->minute++;
+
+		if (minute - s->minute > SKETCH_MINUTES)
+		{
+			s->minute = minute - SKETCH_MINUTES;
+		}
+	}
+
+	memset(&s->distinct, 0, sizeof(struct hll));
+	hh_decay(&s->bytes);
+	hh_decay(&s->conns);
+}
@@ -0,0 +1,134 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Count-min sketch dimensions */
+#define CMS_DEPTH 4
+#define CMS_WIDTH 2048
+/* Number of heavy hitters tracked */
+#define TOPK_SIZE 32
+/* HyperLogLog precision, 2^HLL_BITS registers */
+#define HLL_BITS 10
+#define HLL_REGISTERS (1 << HLL_BITS)
+/* Minutes of distinct IP history */
+#define SKETCH_MINUTES 60
+
+/* Candidate in a top-K list */
+struct topk_entry
+{
+	/* IPv4 address in network byte order */
+	uint32_t key;
+	/* Estimated count, may overestimate by at most error */
+	uint64_t count;
+	uint64_t error;
+};
+
+/*
+ * Heavy hitters: a count-min sketch estimates the count of every key and a
+ * space-saving list keeps the K keys with the largest estimates.
+ */
+struct heavy_hitters
+{
+	uint64_t counts[CMS_DEPTH][CMS_WIDTH];
+	uint64_t total;
+	struct topk_entry top[TOPK_SIZE];
+	uint32_t topCount;
+};
+
+/* HyperLogLog distinct counter */
+struct hll
+{
+	uint8_t reg[HLL_REGISTERS];
+};
+
+/* Traffic sketches of the server */
+struct sketches
+{
+	/* Source IPs by received bytes and by accepted connections */
+	struct heavy_hitters bytes;
+	struct heavy_hitters conns;
+	/* Distinct IPs seen in the current minute */
+	struct hll distinct;
+	/* Current minute since the epoch */
+	time_t minute;
+	/* Distinct IP estimates of past minutes, newest at history[0] */
+	uint32_t history[SKETCH_MINUTES];
+};
+
+/*
+ * Initializes empty sketches.
+ */
+void sketch_init(struct sketches *s, time_t now);
+
+/*
+ * Closes the current minute if it is over. Past minutes are folded into
+ * the heavy hitters by halving their counts, so the lists favor recent
+ * traffic.
+ */
+void sketch_tick(struct sketches *s, time_t now);
+
+/*
+ * Adds a count for a key. Constant time.
+ */
+void hh_add(struct heavy_hitters *hh, uint32_t key, uint64_t n);
+
+/*
+ * Returns the count-min estimate of a key.
+ */
+uint64_t hh_estimate(const struct heavy_hitters *hh, uint32_t key);
+
+/*
+ * Sorts the heavy hitter list by count, largest first.
+ */
+void hh_sort(struct heavy_hitters *hh);
+
+/*
+ * Adds a key to a distinct counter.
+ */
+void hll_add(struct hll *h, uint32_t key);
+
+/*
+ * Returns the estimated number of distinct keys added.
+ */
+double hll_estimate(const struct hll *h);
+
+/*
+ * Accounts a new connection from an IP.
+ */
+static inline void sketch_connect(struct sketches *s, uint32_t ip)
+{
+	hh_add(&s->conns, ip, 1);
+	hll_add(&s->distinct, ip);
+}
+
+/*
+ * Accounts bytes received from an IP.
+ */
+static inline void sketch_receive(struct sketches *s, uint32_t ip,
+	uint64_t bytes)
+{
+	hh_add(&s->bytes, ip, bytes);
+	hll_add(&s->distinct, ip);
+}
+
+#endif
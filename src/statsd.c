@@ -0,0 +1,1038 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "statsd.h"
+#include "mem.h"
+#include "tdigest.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Initial number of map slots, a power of two */
+#define STATSD_MAP_INITIAL 1024
+/* Flushes without updates after which a metric is dropped */
+#define STATSD_IDLE_FLUSHES 5
+/* Flushes without updates for which a gauge is still written */
+#define STATSD_GAUGE_IDLE_FLUSHES 60
+/* Structural characters of the largest buffer plus its end */
+#define STATSD_INDEX_MAX (STATSD_DATAGRAM_MAX + 1)
+/* Longest number parsed without strtod */
+#define STATSD_DIGITS_MAX 18
+
+/* Line parser states */
+#define PARSE_NAME 0
+#define PARSE_VALUE 1
+#define PARSE_TYPE 2
+#define PARSE_EXTRA 3
+
+static const double g_pow10[STATSD_DIGITS_MAX + 1] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+	1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+static uint64_t statsd_nowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t statsd_hash(const char *name, uint32_t len, uint32_t type)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ type;
+	uint32_t i;
+
+	for (i = 0; i < len; ++i)
+	{
+		h ^= (uint8_t)name[i];
+		h *= 0x100000001b3ull;
+	}
+
+	return h;
+}
+
+static int statsd_mapInit(struct statsd_map *m, uint32_t capacity)
+{
+	m->slots = calloc(capacity, sizeof(struct statsd_metric));
+	if (m->slots == NULL)
+	{
+		return -1;
+	}
+
+	m->mask = capacity - 1;
+	m->used = 0;
+	m->bytes = capacity * sizeof(struct statsd_metric);
+	return 0;
+}
+
+/*
+ * Frees a metric's name and digest.
+ */
+static void statsd_metricFree(struct statsd_map *m, struct statsd_metric *e)
+{
+	m->bytes -= e->nameLen + 1;
+	free(e->name);
+	e->name = NULL;
+
+	if (e->digest != NULL)
+	{
+		m->bytes -= sizeof(struct tdigest);
+		free(e->digest);
+		e->digest = NULL;
+	}
+}
+
+static void statsd_mapFree(struct statsd_map *m)
+{
+	uint32_t i;
+
+	if (m->slots == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i <= m->mask; ++i)
+	{
+		if (m->slots[i].name != NULL)
+		{
+			statsd_metricFree(m, &m->slots[i]);
+		}
+	}
+
+	free(m->slots);
+	m->slots = NULL;
+	m->bytes = 0;
+}
+
+/*
+ * Returns the slot of a metric, or the empty slot where it belongs.
+ */
+static struct statsd_metric *statsd_probe(struct statsd_map *m, uint64_t hash,
+	const char *name, uint32_t len, uint32_t type)
+{
+	uint32_t i = (uint32_t)hash & m->mask;
+
+	while (1)
+	{
+		struct statsd_metric *e = &m->slots[i];
+
+		if (e->name == NULL || (e->hash == hash && e->type == type &&
+			e->nameLen == len && memcmp(e->name, name, len) == 0))
+		{
+			return e;
+		}
+
+		i = (i + 1) & m->mask;
+	}
+}
+
+/*
+ * Moves all metrics to a new table, dropping those idle for idleMax flushes
+ * unless idleMax is 0.
+ * Returns 0 on success, -1 on failure.
+ */
+static int statsd_rehash(struct statsd_map *m, uint32_t capacity,
+	uint32_t idleMax)
+{
+	struct statsd_metric *old = m->slots;
+	uint32_t oldCapacity = m->mask + 1;
+	uint32_t i;
+
+	m->slots = calloc(capacity, sizeof(struct statsd_metric));
+	if (m->slots == NULL)
+	{
+		m->slots = old;
+		return -1;
+	}
+
+	m->mask = capacity - 1;
+	m->used = 0;
+	m->bytes += ((size_t)capacity - oldCapacity) * sizeof(struct statsd_metric);
+
+	for (i = 0; i < oldCapacity; ++i)
+	{
+		struct statsd_metric *e = &old[i];
+
+		if (e->name == NULL)
+		{
+			continue;
+		}
+
+		if (idleMax > 0 && e->idle >= idleMax)
+		{
+			statsd_metricFree(m, e);
+			continue;
+		}
+
+		*statsd_probe(m, e->hash, e->name, e->nameLen, e->type) = *e;
+		m->used++;
+	}
+
+	free(old);
+	return 0;
+}
+
+/*
+ * Returns the aggregate of a metric, creating it if necessary.
+ * Returns NULL if out of memory.
+ */
+static struct statsd_metric *statsd_lookup(struct statsd_map *m,
+	const char *name, uint32_t len, uint32_t type)
+{
+	uint64_t hash = statsd_hash(name, len, type);
+	struct statsd_metric *e;
+
+	e = statsd_probe(m, hash, name, len, type);
+	if (e->name != NULL)
+	{
+		return e;
+	}
+
+	/* Keep the load factor below 3/4 */
+	if ((m->used + 1) * 4 > (m->mask + 1) * 3)
+	{
+		if (statsd_rehash(m, (m->mask + 1) * 2, 0) != 0)
+		{
+			return NULL;
+		}
+
+		e = statsd_probe(m, hash, name, len, type);
+	}
+
+	if (type == STATSD_TIMER)
+	{
+		e->digest = malloc(sizeof(struct tdigest));
+		if (e->digest == NULL)
+		{
+			return NULL;
+		}
+
+		tdigest_reset(e->digest);
+		m->bytes += sizeof(struct tdigest);
+	}
+
+	e->name = malloc(len + 1);
+	if (e->name == NULL)
+	{
+		free(e->digest);
+		e->digest = NULL;
+		m->bytes -= type == STATSD_TIMER ? sizeof(struct tdigest) : 0;
+		return NULL;
+	}
+
+	memcpy(e->name, name, len);
+	e->name[len] = '\0';
+	e->hash = hash;
+	e->nameLen = len;
+	e->type = (uint8_t)type;
+	e->idle = 0;
+	e->updates = 0;
+	e->value = 0;
+	m->bytes += len + 1;
+	m->used++;
+
+	return e;
+}
+
+/*
+ * Parses a decimal number.
+ * Returns 0 on success, -1 if the text is not a number.
+ */
+static int statsd_parseValue(const char *p, const char *end, double *value)
+{
+	const char *start = p;
+	uint64_t mantissa = 0;
+	int digits = 0, fraction = 0, neg = 0;
+
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		neg = *p == '-';
+		++p;
+	}
+
+	for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+	{
+		mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+	}
+
+	if (p < end && *p == '.')
+	{
+		for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits, ++fraction)
+		{
+			mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+		}
+	}
+
+	/* Exponents and very long numbers are rare, leave them to strtod */
+	if ((p < end && (*p == 'e' || *p == 'E')) || digits > STATSD_DIGITS_MAX)
+	{
+		char tmp[64];
+		char *tail;
+		size_t n = (size_t)(end - start);
+
+		if (n >= sizeof(tmp))
+		{
+			return -1;
+		}
+
+		memcpy(tmp, start, n);
+		tmp[n] = '\0';
+		*value = strtod(tmp, &tail);
+		return tail == tmp + n ? 0 : -1;
+	}
+
+	if (p != end || digits == 0)
+	{
+		return -1;
+	}
+
+	*value = (double)mantissa / g_pow10[fraction];
+	if (neg)
+	{
+		*value = -*value;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the metric type, 0 for sets (not supported), -1 if invalid.
+ */
+static int statsd_parseType(const char *p, const char *end)
+{
+	if (end - p == 1)
+	{
+		switch (*p)
+		{
+		case 'c':
+			return STATSD_COUNTER;
+		case 'g':
+			return STATSD_GAUGE;
+		case 'h':
+		case 'd':
+			return STATSD_TIMER;
+		case 's':
+			return 0;
+		}
+	}
+	else if (end - p == 2 && p[0] == 'm' && p[1] == 's')
+	{
+		return STATSD_TIMER;
+	}
+
+	return -1;
+}
+
+/*
+ * Finds the newlines, colons and pipes of a buffer.
+ * Returns the number of positions stored.
+ */
+static uint32_t statsd_index(const char *buf, uint32_t len, uint32_t *index)
+{
+	uint32_t i = 0, n = 0;
+
+#ifdef __AVX2__
+	const __m256i nl32 = _mm256_set1_epi8('\n');
+	const __m256i colon32 = _mm256_set1_epi8(':');
+	const __m256i pipe32 = _mm256_set1_epi8('|');
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, nl32),
+				_mm256_cmpeq_epi8(v, colon32)),
+			_mm256_cmpeq_epi8(v, pipe32)));
+
+		while (mask != 0)
+		{
+			index[n++] = i + (uint32_t)__builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i colon = _mm_set1_epi8(':');
+	const __m128i pipe = _mm_set1_epi8('|');
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, colon)),
+			_mm_cmpeq_epi8(v, pipe)));
+
+		while (mask != 0)
+		{
+			index[n++] = i + (uint32_t)__builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i < len; ++i)
+	{
+		if (buf[i] == '\n' || buf[i] == ':' || buf[i] == '|')
+		{
+			index[n++] = i;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Adds a parsed sample to the active map.
+ */
+static void statsd_record(struct statsd *s, const char *name, uint32_t len,
+	int type, const char *value, const char *valueEnd, double rate)
+{
+	struct statsd_metric *e;
+	double v;
+
+	if (statsd_parseValue(value, valueEnd, &v) != 0)
+	{
+		s->badLines++;
+		return;
+	}
+
+	e = statsd_lookup(type == STATSD_GAUGE ? &s->gauges : s->active, name,
+		len, (uint32_t)type);
+	if (e == NULL)
+	{
+		s->badLines++;
+		return;
+	}
+
+	e->updates++;
+
+	switch (type)
+	{
+	case STATSD_COUNTER:
+		e->value += v / rate;
+		break;
+	case STATSD_GAUGE:
+		/* A sign makes the update relative */
+		e->value = (*value == '+' || *value == '-') ? e->value + v : v;
+		e->idle = 0;
+		break;
+	case STATSD_TIMER:
+		tdigest_add(e->digest, v, 1 / rate);
+		break;
+	}
+}
+
+/*
+ * Parses the sample rate or tags following the type.
+ * Returns 0 on success, -1 if invalid.
+ */
+static int statsd_parseExtra(const char *p, const char *end, double *rate)
+{
+	if (p < end && *p == '@')
+	{
+		if (statsd_parseValue(p + 1, end, rate) != 0 || *rate <= 0 ||
+			*rate > 1)
+		{
+			return -1;
+		}
+	}
+
+	/* Tags (#) and unknown extensions are ignored */
+	return 0;
+}
+
+/*
+ * Parses lines in buf. Lines are separated by newlines, the last one ends
+ * at len.
+ */
+static void statsd_parseLines(struct statsd *s, const char *buf, uint32_t len)
+{
+	uint32_t n, k, start = 0, nameEnd = 0, valueEnd = 0, typeEnd = 0;
+	uint32_t extra = 0;
+	double rate = 1;
+	int state = PARSE_NAME, bad = 0;
+
+	n = statsd_index(buf, len, s->index);
+	s->index[n++] = len;
+
+	for (k = 0; k < n; ++k)
+	{
+		uint32_t p = s->index[k];
+		uint32_t end;
+		int type;
+
+		if (p < len && buf[p] != '\n')
+		{
+			switch (state)
+			{
+			case PARSE_NAME:
+				bad |= buf[p] != ':';
+				nameEnd = p;
+				state = PARSE_VALUE;
+				break;
+			case PARSE_VALUE:
+				/* Several values per line are not supported */
+				bad |= buf[p] != '|';
+				valueEnd = p;
+				state = PARSE_TYPE;
+				break;
+			case PARSE_TYPE:
+				if (buf[p] == '|')
+				{
+					typeEnd = p;
+					extra = p + 1;
+					state = PARSE_EXTRA;
+				}
+				break;
+			default:
+				if (buf[p] == '|')
+				{
+					bad |= statsd_parseExtra(buf + extra, buf + p, &rate) != 0;
+					extra = p + 1;
+				}
+				break;
+			}
+
+			continue;
+		}
+
+		/* End of line */
+		end = (p > start && buf[p - 1] == '\r') ? p - 1 : p;
+
+		if (state == PARSE_TYPE)
+		{
+			typeEnd = end;
+		}
+		else if (state == PARSE_EXTRA)
+		{
+			bad |= statsd_parseExtra(buf + extra, buf + end, &rate) != 0;
+		}
+
+		if (state == PARSE_NAME && end == start)
+		{
+			/* Empty line */
+		}
+		else if (bad || state < PARSE_TYPE || nameEnd == start)
+		{
+			s->lines++;
+			s->badLines++;
+		}
+		else
+		{
+			s->lines++;
+			type = statsd_parseType(buf + valueEnd + 1, buf + typeEnd);
+
+			if (type > 0)
+			{
+				statsd_record(s, buf + start, nameEnd - start, type,
+					buf + nameEnd + 1, buf + valueEnd, rate);
+			}
+			else if (type == 0)
+			{
+				s->unsupported++;
+			}
+			else
+			{
+				s->badLines++;
+			}
+		}
+
+		start = p + 1;
+		state = PARSE_NAME;
+		rate = 1;
+		bad = 0;
+	}
+}
+
+/*
+ * Parses lines in pieces the index can hold.
+ */
+static void statsd_parse(struct statsd *s, const char *buf, size_t len)
+{
+	while (len > STATSD_DATAGRAM_MAX)
+	{
+		const char *nl = memrchr(buf, '\n', STATSD_DATAGRAM_MAX);
+		size_t n = nl != NULL ? (size_t)(nl - buf) : STATSD_DATAGRAM_MAX;
+
+		statsd_parseLines(s, buf, (uint32_t)n);
+		buf += n + 1;
+		len -= n + 1;
+	}
+
+	statsd_parseLines(s, buf, (uint32_t)len);
+}
+
+void statsd_receive(struct statsd *s, struct statsd_conn *c, const char *data,
+	size_t len)
+{
+	const char *end = data + len;
+	const char *nl;
+
+	/* Complete the line left over from the previous read */
+	if (c->len > 0)
+	{
+		size_t n;
+
+		nl = memchr(data, '\n', len);
+		n = nl != NULL ? (size_t)(nl - data) : len;
+
+		if (c->len != UINT32_MAX && c->len + n <= STATSD_LINE_MAX)
+		{
+			memcpy(c->line + c->len, data, n);
+			c->len += (uint32_t)n;
+		}
+		else
+		{
+			c->len = UINT32_MAX;
+		}
+
+		if (nl == NULL)
+		{
+			return;
+		}
+
+		if (c->len == UINT32_MAX)
+		{
+			s->lines++;
+			s->badLines++;
+		}
+		else
+		{
+			statsd_parseLines(s, c->line, c->len);
+		}
+
+		c->len = 0;
+		data = nl + 1;
+		len = (size_t)(end - data);
+	}
+
+	nl = memrchr(data, '\n', len);
+	if (nl != NULL)
+	{
+		statsd_parse(s, data, (size_t)(nl - data));
+		data = nl + 1;
+		len = (size_t)(end - data);
+	}
+
+	if (len > STATSD_LINE_MAX)
+	{
+		c->len = UINT32_MAX;
+	}
+	else if (len > 0)
+	{
+		memcpy(c->line, data, len);
+		c->len = (uint32_t)len;
+	}
+}
+
+void statsd_datagram(struct statsd *s, const char *data, size_t len)
+{
+	if (len > 0 && data[len - 1] == '\n')
+	{
+		len--;
+	}
+
+	statsd_parse(s, data, len);
+}
+
+/*
+ * Writes the aggregates of a map and empties it. Runs on the flusher
+ * thread, or on the loop thread once the flusher has stopped.
+ */
+static void statsd_flushMap(struct statsd *s, struct statsd_map *m)
+{
+	uint64_t start = statsd_nowUs();
+	long long ts = (long long)time(NULL);
+	double seconds = (m->elapsedMs > 0 ? m->elapsedMs : s->intervalMs) / 1e3;
+	uint64_t flushed = 0;
+	uint32_t i, idle = 0;
+
+	for (i = 0; i <= m->mask; ++i)
+	{
+		struct statsd_metric *e = &m->slots[i];
+		struct tdigest *d = e->digest;
+
+		if (e->name == NULL)
+		{
+			continue;
+		}
+
+		if (e->updates == 0)
+		{
+			if (e->idle < STATSD_IDLE_FLUSHES)
+			{
+				e->idle++;
+			}
+
+			idle += e->idle == STATSD_IDLE_FLUSHES;
+			continue;
+		}
+
+		switch (e->type)
+		{
+		case STATSD_COUNTER:
+			fprintf(s->out, "%s.count %.15g %lld\n", e->name, e->value, ts);
+			fprintf(s->out, "%s.rate %.15g %lld\n", e->name, e->value / seconds,
+				ts);
+			break;
+		case STATSD_GAUGE:
+			fprintf(s->out, "%s %.15g %lld\n", e->name, e->value, ts);
+			break;
+		case STATSD_TIMER:
+			fprintf(s->out, "%s.count %.15g %lld\n", e->name, d->weight, ts);
+			fprintf(s->out, "%s.mean %.15g %lld\n", e->name, d->sum / d->weight,
+				ts);
+			fprintf(s->out, "%s.min %.15g %lld\n", e->name, d->min, ts);
+			fprintf(s->out, "%s.max %.15g %lld\n", e->name, d->max, ts);
+			fprintf(s->out, "%s.p50 %.15g %lld\n", e->name,
+				tdigest_quantile(d, 0.5), ts);
+			fprintf(s->out, "%s.p90 %.15g %lld\n", e->name,
+				tdigest_quantile(d, 0.9), ts);
+			fprintf(s->out, "%s.p99 %.15g %lld\n", e->name,
+				tdigest_quantile(d, 0.99), ts);
+			tdigest_reset(d);
+			break;
+		}
+
+		e->idle = 0;
+		e->updates = 0;
+		e->value = 0;
+		flushed++;
+	}
+
+	fflush(s->out);
+
+	/* Idle metrics keep their slots until enough of them piled up */
+	if (idle > 0 && idle * 8 >= m->used)
+	{
+		statsd_rehash(m, m->mask + 1, STATSD_IDLE_FLUSHES);
+	}
+
+	atomic_fetch_add(&s->flushedMetrics, flushed);
+	atomic_store(&s->flushUs, statsd_nowUs() - start);
+}
+
+/*
+ * Copies the gauges into the map of the ending interval, so they are written
+ * with or without updates. Gauges idle for too long are dropped.
+ */
+static void statsd_carryGauges(struct statsd *s, struct statsd_map *m)
+{
+	struct statsd_map *g = &s->gauges;
+	uint32_t i, idle = 0;
+
+	for (i = 0; i <= g->mask; ++i)
+	{
+		struct statsd_metric *e = &g->slots[i];
+		struct statsd_metric *out;
+
+		if (e->name == NULL)
+		{
+			continue;
+		}
+
+		if (e->updates == 0 && e->idle < STATSD_GAUGE_IDLE_FLUSHES)
+		{
+			e->idle++;
+		}
+
+		if (e->idle == STATSD_GAUGE_IDLE_FLUSHES)
+		{
+			idle++;
+			continue;
+		}
+
+		/* Out of memory, the gauge is written again next interval */
+		out = statsd_lookup(m, e->name, e->nameLen, STATSD_GAUGE);
+		if (out == NULL)
+		{
+			continue;
+		}
+
+		out->value = e->value;
+		out->updates = e->updates > 0 ? e->updates : 1;
+		e->updates = 0;
+	}
+
+	if (idle > 0 && idle * 8 >= g->used)
+	{
+		statsd_rehash(g, g->mask + 1, STATSD_GAUGE_IDLE_FLUSHES);
+	}
+}
+
+static void *statsd_run(void *arg)
+{
+	struct statsd *s = arg;
+	struct statsd_map *m;
+	uint64_t count;
+
+	while (1)
+	{
+		if (read(s->efd, &count, sizeof(count)) == -1 && errno != EINTR)
+		{
+			perror("read eventfd");
+			break;
+		}
+
+		m = atomic_exchange(&s->pending, NULL);
+		if (m != NULL)
+		{
+			statsd_flushMap(s, m);
+			atomic_store(&s->done, m);
+		}
+
+		if (atomic_load(&s->stop))
+		{
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Charges changes of the memory held by the maps.
+ */
+static void statsd_account(struct statsd *s)
+{
+	size_t bytes = s->active->bytes + s->gauges.bytes +
+		STATSD_INDEX_MAX * sizeof(uint32_t);
+
+	bytes += s->spare != NULL ? s->spare->bytes : s->flushingBytes;
+
+	if (bytes > s->charged)
+	{
+		mem_charge(s->mem, MEM_STATSD, bytes - s->charged);
+	}
+	else
+	{
+		mem_release(s->mem, MEM_STATSD, s->charged - bytes);
+	}
+
+	s->charged = bytes;
+}
+
+/*
+ * Frees everything but the flusher thread.
+ */
+static void statsd_free(struct statsd *s)
+{
+	statsd_mapFree(&s->maps[0]);
+	statsd_mapFree(&s->maps[1]);
+	statsd_mapFree(&s->gauges);
+	free(s->index);
+	s->index = NULL;
+
+	if (s->efd > -1)
+	{
+		close(s->efd);
+		s->efd = -1;
+	}
+
+	if (s->out != NULL && s->out != stdout)
+	{
+		fclose(s->out);
+	}
+
+	s->out = NULL;
+
+	if (s->mem != NULL)
+	{
+		mem_release(s->mem, MEM_STATSD, s->charged);
+		s->charged = 0;
+	}
+}
+
+int statsd_open(struct statsd *s, const char *path, int intervalSec,
+	struct mem_account *mem)
+{
+	memset(s, 0, sizeof(struct statsd));
+	s->efd = -1;
+
+	s->out = strcmp(path, "-") == 0 ? stdout : fopen(path, "a");
+	if (s->out == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	if (statsd_mapInit(&s->maps[0], STATSD_MAP_INITIAL) != 0 ||
+		statsd_mapInit(&s->maps[1], STATSD_MAP_INITIAL) != 0 ||
+		statsd_mapInit(&s->gauges, STATSD_MAP_INITIAL) != 0)
+	{
+		fprintf(stderr, "Failed to allocate statsd maps.\n");
+		goto on_error;
+	}
+
+	s->index = malloc(STATSD_INDEX_MAX * sizeof(uint32_t));
+	if (s->index == NULL)
+	{
+		fprintf(stderr, "Failed to allocate statsd index.\n");
+		goto on_error;
+	}
+
+	s->efd = eventfd(0, EFD_CLOEXEC);
+	if (s->efd == -1)
+	{
+		perror("eventfd");
+		goto on_error;
+	}
+
+	s->active = &s->maps[0];
+	s->spare = &s->maps[1];
+	atomic_init(&s->pending, NULL);
+	atomic_init(&s->done, NULL);
+	atomic_init(&s->stop, 0);
+	s->intervalMs = (uint64_t)intervalSec * 1000;
+	s->active->startMs = statsd_nowUs() / 1000;
+	s->deadlineMs = s->active->startMs + s->intervalMs;
+	s->mem = mem;
+
+	if (pthread_create(&s->thread, NULL, statsd_run, s) != 0)
+	{
+		fprintf(stderr, "Failed to start the statsd flusher.\n");
+		goto on_error;
+	}
+
+	s->running = 1;
+	statsd_account(s);
+	return 0;
+
+on_error:
+	s->mem = NULL;
+	statsd_free(s);
+	return -1;
+}
+
+void statsd_close(struct statsd *s)
+{
+	uint64_t one = 1;
+
+	if (!s->running)
+	{
+		return;
+	}
+
+	atomic_store(&s->stop, 1);
+	if (write(s->efd, &one, sizeof(one)) != sizeof(one))
+	{
+		perror("write eventfd");
+	}
+
+	pthread_join(s->thread, NULL);
+	s->running = 0;
+
+	/* Both maps belong to this thread again, flush the last interval */
+	s->active->elapsedMs = statsd_nowUs() / 1000 - s->active->startMs;
+	statsd_carryGauges(s, s->active);
+	statsd_flushMap(s, s->active);
+	statsd_free(s);
+}
+
+void statsd_poll(struct statsd *s)
+{
+	struct statsd_map *full;
+	uint64_t now, one = 1;
+
+	if (s->spare == NULL)
+	{
+		s->spare = atomic_exchange(&s->done, NULL);
+	}
+
+	statsd_account(s);
+
+	now = statsd_nowUs() / 1000;
+	if (now < s->deadlineMs)
+	{
+		return;
+	}
+
+	/* The flusher still works on the previous interval */
+	if (s->spare == NULL)
+	{
+		if (!s->late)
+		{
+			s->late = 1;
+			s->lateFlushes++;
+		}
+
+		return;
+	}
+
+	full = s->active;
+	full->elapsedMs = now - full->startMs;
+	statsd_carryGauges(s, full);
+	s->active = s->spare;
+	s->active->startMs = now;
+	s->spare = NULL;
+	s->flushingBytes = full->bytes;
+	s->late = 0;
+
+	atomic_store(&s->pending, full);
+	if (write(s->efd, &one, sizeof(one)) != sizeof(one))
+	{
+		perror("write eventfd");
+	}
+
+	s->flushes++;
+	s->deadlineMs += s->intervalMs;
+	if (s->deadlineMs <= now)
+	{
+		s->deadlineMs = now + s->intervalMs;
+	}
+}
+
+int statsd_timeoutMs(const struct statsd *s)
+{
+	uint64_t now = statsd_nowUs() / 1000;
+
+	if (now < s->deadlineMs)
+	{
+		return (int)(s->deadlineMs - now);
+	}
+
+	/* Overdue, check again soon whether the flusher is done */
+	return s->spare != NULL ? 0 : 10;
+}
+
+void statsd_writeStats(const struct statsd *s, FILE *fp)
+{
+	fprintf(fp, "statsd_lines %llu\n", (unsigned long long)s->lines);
+	fprintf(fp, "statsd_bad_lines %llu\n", (unsigned long long)s->badLines);
+	fprintf(fp, "statsd_unsupported_lines %llu\n",
+		(unsigned long long)s->unsupported);
+	fprintf(fp, "statsd_metrics %u\n", s->active->used);
+	fprintf(fp, "statsd_gauges %u\n", s->gauges.used);
+	fprintf(fp, "statsd_flushes %llu\n", (unsigned long long)s->flushes);
+	fprintf(fp, "statsd_flushes_late %llu\n",
+		(unsigned long long)s->lateFlushes);
+	fprintf(fp, "statsd_metrics_flushed %llu\n",
+		(unsigned long long)atomic_load(&s->flushedMetrics));
+	fprintf(fp, "statsd_last_flush_us %llu\n",
+		(unsigned long long)atomic_load(&s->flushUs));
+}
@@ -0,0 +1,163 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATSD_H
+#define STATSD_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Longest line accepted from a TCP client */
+#define STATSD_LINE_MAX 1024
+/* Largest UDP datagram */
+#define STATSD_DATAGRAM_MAX 65536
+
+/* Metric types */
+#define STATSD_COUNTER 1u
+#define STATSD_GAUGE 2u
+#define STATSD_TIMER 3u
+
+struct mem_account;
+struct tdigest;
+
+/* Aggregate of one metric over a flush interval */
+struct statsd_metric
+{
+	uint64_t hash;
+	/* Name, NULL if the slot is empty */
+	char *name;
+	uint32_t nameLen;
+	uint8_t type;
+	/* Flushes without updates, idle metrics are eventually dropped */
+	uint8_t idle;
+	/* Updates in this interval */
+	uint64_t updates;
+	/* Counter sum or gauge value */
+	double value;
+	/* Timer values, NULL for other types */
+	struct tdigest *digest;
+};
+
+/* Open addressing map of aggregates, owned by one thread at a time */
+struct statsd_map
+{
+	struct statsd_metric *slots;
+	uint32_t mask;
+	uint32_t used;
+	/* Memory held by slots, names and digests */
+	size_t bytes;
+	/* Monotonic start and length of the interval in ms */
+	uint64_t startMs;
+	uint64_t elapsedMs;
+};
+
+/* Per-client framing state */
+struct statsd_conn
+{
+	/* Bytes of the partial line, UINT32_MAX while skipping a long line */
+	uint32_t len;
+	char line[STATSD_LINE_MAX];
+};
+
+/*
+ * statsd aggregation. The event loop aggregates into the active map. Each
+ * interval the map is swapped with the spare one and handed to a flusher
+ * thread, which writes the aggregates and hands the emptied map back. The
+ * hand-offs are single atomic pointer exchanges. Gauges keep their value
+ * across intervals in a table of their own and are copied into the map
+ * when it is handed over.
+ */
+struct statsd
+{
+	struct statsd_map maps[2];
+	/* Current gauge values, owned by the event loop */
+	struct statsd_map gauges;
+	/* Maps of the event loop, spare is NULL while being flushed */
+	struct statsd_map *active;
+	struct statsd_map *spare;
+	/* Map handed to the flusher and map handed back */
+	_Atomic(struct statsd_map *) pending;
+	_Atomic(struct statsd_map *) done;
+	/* Size of the map being flushed when it was handed over */
+	size_t flushingBytes;
+	pthread_t thread;
+	int running;
+	atomic_int stop;
+	/* Eventfd waking the flusher */
+	int efd;
+	FILE *out;
+	uint64_t intervalMs;
+	uint64_t deadlineMs;
+	int late;
+	/* Positions of structural characters of the buffer being parsed */
+	uint32_t *index;
+	struct mem_account *mem;
+	size_t charged;
+	/* Statistics of the event loop */
+	uint64_t lines;
+	uint64_t badLines;
+	uint64_t unsupported;
+	uint64_t flushes;
+	uint64_t lateFlushes;
+	/* Statistics of the flusher */
+	_Atomic uint64_t flushedMetrics;
+	_Atomic uint64_t flushUs;
+};
+
+/*
+ * Starts aggregation. Aggregates are written to path ("-" for stdout) in
+ * graphite plaintext format every intervalSec seconds.
+ * Returns 0 on success, -1 on failure.
+ */
+int statsd_open(struct statsd *s, const char *path, int intervalSec,
+	struct mem_account *mem);
+
+/*
+ * Stops the flusher and flushes the current interval.
+ */
+void statsd_close(struct statsd *s);
+
+/*
+ * Feeds a client's stream through the line framing.
+ */
+void statsd_receive(struct statsd *s, struct statsd_conn *c, const char *data,
+	size_t len);
+
+/*
+ * Parses a datagram, the last line needs no newline.
+ */
+void statsd_datagram(struct statsd *s, const char *data, size_t len);
+
+/*
+ * Hands the active map to the flusher once the interval is over.
+ */
+void statsd_poll(struct statsd *s);
+
+/*
+ * Returns the milliseconds until the next flush.
+ */
+int statsd_timeoutMs(const struct statsd *s);
+
+/*
+ * Writes statsd statistics.
+ */
+void statsd_writeStats(const struct statsd *s, FILE *fp);
+
+#endif
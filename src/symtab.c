@@ -0,0 +1,229 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "symtab.h"
+#include <assert.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * dl_iterate_phdr callback, the first object is the executable itself.
+ */
+static int symtab_findBase(struct dl_phdr_info *info, size_t size, void *arg)
+{
+	(void)size;
+
+	*(uintptr_t*)arg = info->dlpi_addr;
+	return 1;
+}
+
+static int symtab_compare(const void *a, const void *b)
+{
+	const struct sym *x = a;
+	const struct sym *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/*
+ * Copy the function symbols of a symbol table section.
+ * Returns 0 on success, -1 on failure.
+ */
+static int symtab_read(struct symtab *t, const char *image,
+	const Elf64_Shdr *symSec, const Elf64_Shdr *strSec, uintptr_t base)
+{
+	const Elf64_Sym *syms = (const Elf64_Sym*)(image + symSec->sh_offset);
+	size_t n = symSec->sh_size / sizeof(Elf64_Sym);
+	size_t i;
+
+	t->strings = malloc(strSec->sh_size);
+	t->syms = calloc(n, sizeof(struct sym));
+	if (t->strings == NULL || t->syms == NULL)
+	{
+		return -1;
+	}
+
+	memcpy(t->strings, image + strSec->sh_offset, strSec->sh_size);
+
+	for (i = 0; i < n; ++i)
+	{
+		if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC ||
+			syms[i].st_value == 0 || syms[i].st_name >= strSec->sh_size)
+		{
+			continue;
+		}
+
+		t->syms[t->count].addr = base + syms[i].st_value;
+		t->syms[t->count].size = syms[i].st_size;
+		t->syms[t->count].name = t->strings + syms[i].st_name;
+		t->count++;
+	}
+
+	qsort(t->syms, t->count, sizeof(struct sym), symtab_compare);
+
+	return 0;
+}
+
+int symtab_load(struct symtab *t)
+{
+	const Elf64_Ehdr *eh;
+	const Elf64_Shdr *sh, *symSec = NULL;
+	struct stat st;
+	uintptr_t base = 0;
+	char *image;
+	int fd, i, rc = -1;
+
+	assert(t != NULL);
+
+	memset(t, 0, sizeof(struct symtab));
+
+	fd = open("/proc/self/exe", O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Elf64_Ehdr))
+	{
+		close(fd);
+		return -1;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	eh = (const Elf64_Ehdr*)image;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+		eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+		eh->e_shoff + (size_t)eh->e_shnum * sizeof(Elf64_Shdr) >
+		(size_t)st.st_size)
+	{
+		goto on_exit;
+	}
+
+	/* Prefer the full symbol table, fall back to dynamic symbols */
+	sh = (const Elf64_Shdr*)(image + eh->e_shoff);
+	for (i = 0; i < eh->e_shnum; ++i)
+	{
+		if (sh[i].sh_type == SHT_SYMTAB ||
+			(sh[i].sh_type == SHT_DYNSYM && symSec == NULL))
+		{
+			symSec = &sh[i];
+		}
+	}
+
+	if (symSec == NULL || symSec->sh_link >= eh->e_shnum)
+	{
+		goto on_exit;
+	}
+
+	/* Position independent executables are relocated by the load base */
+	if (eh->e_type == ET_DYN)
+	{
+		dl_iterate_phdr(symtab_findBase, &base);
+	}
+
+	rc = symtab_read(t, image, symSec, &sh[symSec->sh_link], base);
+	if (rc != 0)
+	{
+		symtab_free(t);
+	}
+
+on_exit:
+	munmap(image, st.st_size);
+	return rc;
+}
+
+void symtab_free(struct symtab *t)
+{
+	if (t == NULL)
+	{
+		return;
+	}
+
+	free(t->syms);
+	free(t->strings);
+	memset(t, 0, sizeof(struct symtab));
+}
+
+void symtab_resolve(const struct symtab *t, uintptr_t addr, char *buf,
+	size_t size)
+{
+	Dl_info info;
+	size_t lo = 0, hi = t != NULL ? t->count : 0;
+
+	/* Last symbol starting at or below the address */
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (t->syms[mid].addr <= addr)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	if (lo > 0)
+	{
+		const struct sym *s = &t->syms[lo - 1];
+
+		if (addr < s->addr + (s->size > 0 ? s->size : 1))
+		{
+			snprintf(buf, size, "%s", s->name);
+			return;
+		}
+	}
+
+	if (dladdr((void*)addr, &info) != 0)
+	{
+		const char *module = info.dli_fname;
+
+		if (info.dli_sname != NULL)
+		{
+			snprintf(buf, size, "%s", info.dli_sname);
+			return;
+		}
+
+		if (module != NULL && strrchr(module, '/') != NULL)
+		{
+			module = strrchr(module, '/') + 1;
+		}
+
+		snprintf(buf, size, "%s+0x%lx", module != NULL ? module : "?",
+			(unsigned long)(addr - (uintptr_t)info.dli_fbase));
+		return;
+	}
+
+	snprintf(buf, size, "0x%lx", (unsigned long)addr);
+}
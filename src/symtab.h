@@ -0,0 +1,61 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Function symbol of the running executable */
+struct sym
+{
+	uintptr_t addr;
+	size_t size;
+	const char *name;
+};
+
+/* Function symbols of the running executable, sorted by address */
+struct symtab
+{
+	struct sym *syms;
+	size_t count;
+	/* String table the names point into */
+	char *strings;
+};
+
+/*
+ * Loads the function symbols of the running executable, including static
+ * functions if the binary is not stripped.
+ * Returns 0 on success, -1 on failure.
+ */
+int symtab_load(struct symtab *t);
+
+/*
+ * Frees a symbol table.
+ */
+void symtab_free(struct symtab *t);
+
+/*
+ * Writes the name of the function containing an address to buf. Falls back
+ * to the dynamic linker for shared objects and to "module+0xoffset" or the
+ * raw address if no symbol is found.
+ */
+void symtab_resolve(const struct symtab *t, uintptr_t addr, char *buf,
+	size_t size);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tdigest.h"
+#include <math.h>
+#include <stdlib.h>
+
+#define TDIGEST_PI 3.14159265358979323846
+
+void tdigest_reset(struct tdigest *d)
+{
+	d->weight = 0;
+	d->sum = 0;
+	d->min = 0;
+	d->max = 0;
+	d->merged = 0;
+	d->buffered = 0;
+}
+
+static double tdigest_scale(double q)
+{
+	return TDIGEST_COMPRESSION / (2 * TDIGEST_PI) * asin(2 * q - 1);
+}
+
+static int tdigest_compare(const void *a, const void *b)
+{
+	double x = ((const struct tdigest_centroid *)a)->mean;
+	double y = ((const struct tdigest_centroid *)b)->mean;
+
+	return (x > y) - (x < y);
+}
+
+void tdigest_compress(struct tdigest *d)
+{
+	struct tdigest_centroid sorted[TDIGEST_CAPACITY + TDIGEST_BUFFER];
+	struct tdigest_centroid *buf = &d->c[d->merged];
+	struct tdigest_centroid cur;
+	uint32_t n = d->merged + d->buffered;
+	uint32_t i = 0, j = 0, k = 0, out = 0;
+	double done = 0, kLow;
+
+	if (d->buffered == 0)
+	{
+		return;
+	}
+
+	/* The centroids are sorted already, only the buffer needs sorting */
+	qsort(buf, d->buffered, sizeof(struct tdigest_centroid), tdigest_compare);
+
+	while (i < d->merged || j < d->buffered)
+	{
+		if (j == d->buffered || (i < d->merged && d->c[i].mean <= buf[j].mean))
+		{
+			sorted[k++] = d->c[i++];
+		}
+		else
+		{
+			sorted[k++] = buf[j++];
+		}
+	}
+
+	/*
+	 * Merge neighbours while a centroid spans at most one unit of the scale
+	 * k(q) = compression / (2 pi) * asin(2q - 1), which is steep at the
+	 * tails and keeps the centroids there small.
+	 */
+	cur = sorted[0];
+	kLow = tdigest_scale(0);
+	for (i = 1; i < n; ++i)
+	{
+		double proposed = cur.weight + sorted[i].weight;
+		double q = (done + proposed) / d->weight;
+
+		if (tdigest_scale(q < 1 ? q : 1) - kLow <= 1 ||
+			out == TDIGEST_CAPACITY - 1)
+		{
+			cur.mean += (sorted[i].mean - cur.mean) * sorted[i].weight / proposed;
+			cur.weight = proposed;
+		}
+		else
+		{
+			done += cur.weight;
+			kLow = tdigest_scale(done / d->weight);
+			d->c[out++] = cur;
+			cur = sorted[i];
+		}
+	}
+
+	d->c[out++] = cur;
+	d->merged = out;
+	d->buffered = 0;
+}
+
+double tdigest_quantile(struct tdigest *d, double q)
+{
+	const struct tdigest_centroid *c = d->c;
+	double index, cum;
+	uint32_t i, n;
+
+	if (d->weight == 0)
+	{
+		return 0;
+	}
+
+	tdigest_compress(d);
+	n = d->merged;
+	index = q * d->weight;
+
+	/* Interpolate between the extremes and the outer centroid centers */
+	if (index < c[0].weight / 2)
+	{
+		return d->min + (c[0].mean - d->min) * index / (c[0].weight / 2);
+	}
+
+	cum = c[0].weight / 2;
+	for (i = 0; i + 1 < n; ++i)
+	{
+		double gap = (c[i].weight + c[i + 1].weight) / 2;
+
+		if (index < cum + gap)
+		{
+			return c[i].mean + (c[i + 1].mean - c[i].mean) * (index - cum) / gap;
+		}
+
+		cum += gap;
+	}
+
+	if (index >= d->weight)
+	{
+		return d->max;
+	}
+
+	return c[n - 1].mean + (d->max - c[n - 1].mean) * (index - cum) /
+		(d->weight - cum);
+}
@@ -0,0 +1,97 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TDIGEST_H
+#define TDIGEST_H
+
+#include <stdint.h>
+
+/* Compression, higher values give more accurate quantiles */
+#define TDIGEST_COMPRESSION 100
+#define TDIGEST_CAPACITY (2 * TDIGEST_COMPRESSION)
+/* Values collected before they are merged into the centroids */
+#define TDIGEST_BUFFER 128
+
+struct tdigest_centroid
+{
+	double mean;
+	double weight;
+};
+
+/*
+ * Merging t-digest: values are buffered and merged into a sorted list of
+ * centroids whose size limit shrinks towards the tails, which keeps
+ * extreme quantiles accurate in constant space.
+ */
+struct tdigest
+{
+	/* Total weight, sum, minimum and maximum of all values */
+	double weight;
+	double sum;
+	double min;
+	double max;
+	/* Merged centroids, followed by buffered values */
+	uint32_t merged;
+	uint32_t buffered;
+	struct tdigest_centroid c[TDIGEST_CAPACITY + TDIGEST_BUFFER];
+};
+
+/*
+ * Empties a digest.
+ */
+void tdigest_reset(struct tdigest *d);
+
+/*
+ * Merges the buffered values into the centroids.
+ */
+void tdigest_compress(struct tdigest *d);
+
+/*
+ * Returns the estimated value at quantile q (0 to 1), 0 if empty.
+ */
+double tdigest_quantile(struct tdigest *d, double q);
+
+/*
+ * Adds a value with the given weight.
+ */
+static inline void tdigest_add(struct tdigest *d, double x, double w)
+{
+	struct tdigest_centroid *c;
+
+	if (d->buffered == TDIGEST_BUFFER)
+	{
+		tdigest_compress(d);
+	}
+
+	if (d->weight == 0 || x < d->min)
+	{
+		d->min = x;
+	}
+
+	if (d->weight == 0 || x > d->max)
+	{
+		d->max = x;
+	}
+
+	c = &d->c[d->merged + d->buffered++];
+	c->mean = x;
+	c->weight = w;
+	d->weight += w;
+	d->sum += x * w;
+}
+
+#endif
@@ -0,0 +1,478 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tls.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+/* Key log labels of the first application traffic secrets */
+#define TLS_LOG_TX "SERVER_TRAFFIC_SECRET_0 "
+#define TLS_LOG_RX "CLIENT_TRAFFIC_SECRET_0 "
+
+/* Kernel parameters of the ciphers it can take over */
+union tls_kernelInfo
+{
+	struct tls_crypto_info info;
+	struct tls12_crypto_info_aes_gcm_128 aes128;
+	struct tls12_crypto_info_aes_gcm_256 aes256;
+	struct tls12_crypto_info_chacha20_poly1305 chacha;
+};
+
+static int tls_hexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	else if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	else if (c >= 'A' && c <= 'F')
+	{
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+/*
+ * Keeps the application traffic secrets OpenSSL reports in key log format.
+ * They are the only way to get at the keys the kernel needs.
+ */
+static void tls_keylog(const SSL *ssl, const char *line)
+{
+	struct tls_conn *tc = SSL_get_app_data(ssl);
+	unsigned char secret[TLS_SECRET_MAX];
+	const char *hex;
+	size_t n = 0;
+	uint8_t flag;
+
+	if (strncmp(line, TLS_LOG_TX, sizeof(TLS_LOG_TX) - 1) == 0)
+	{
+		flag = TLS_SECRET_TX;
+	}
+	else if (strncmp(line, TLS_LOG_RX, sizeof(TLS_LOG_RX) - 1) == 0)
+	{
+		flag = TLS_SECRET_RX;
+	}
+	else
+	{
+		return;
+	}
+
+	/* Skip the client random */
+	hex = strchr(line + sizeof(TLS_LOG_TX) - 1, ' ');
+	if (hex == NULL)
+	{
+		return;
+	}
+
+	for (++hex; hex[0] != '\0' && hex[1] != '\0'; hex += 2)
+	{
+		int hi = tls_hexValue(hex[0]);
+		int lo = tls_hexValue(hex[1]);
+
+		if (hi < 0 || lo < 0 || n == TLS_SECRET_MAX)
+		{
+			return;
+		}
+
+		secret[n++] = (unsigned char)(hi << 4 | lo);
+	}
+
+	memcpy(flag == TLS_SECRET_TX ? tc->txSecret : tc->rxSecret, secret, n);
+	OPENSSL_cleanse(secret, sizeof(secret));
+	tc->secretLen = (uint8_t)n;
+	tc->secrets |= flag;
+}
+
+/*
+ * HKDF-Expand-Label of TLS 1.3 with an empty context (RFC 8446 7.1).
+ * Returns 0 on success, -1 on failure.
+ */
+static int tls_expandLabel(const EVP_MD *md, const unsigned char *secret,
+	size_t secretLen, const char *label, unsigned char *out, size_t outLen)
+{
+	unsigned char info[32];
+	size_t labelLen = strlen(label);
+	size_t infoLen = 0;
+	EVP_PKEY_CTX *pctx;
+	int rc = -1;
+
+	info[infoLen++] = (unsigned char)(outLen >> 8);
+	info[infoLen++] = (unsigned char)outLen;
+	info[infoLen++] = (unsigned char)(6 + labelLen);
+	memcpy(info + infoLen, "tls13 ", 6);
+	infoLen += 6;
+	memcpy(info + infoLen, label, labelLen);
+	infoLen += labelLen;
+	info[infoLen++] = 0;
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	if (pctx != NULL && EVP_PKEY_derive_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+		EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+		EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, (int)secretLen) > 0 &&
+		EVP_PKEY_CTX_add1_hkdf_info(pctx, info, (int)infoLen) > 0 &&
+		EVP_PKEY_derive(pctx, out, &outLen) > 0)
+	{
+		rc = 0;
+	}
+
+	EVP_PKEY_CTX_free(pctx);
+	return rc;
+}
+
+/*
+ * Fills in the kernel parameters for one direction. Record sequence
+ * numbers start at zero with the application keys.
+ * Returns the size of the parameters, 0 if the kernel can't take them.
+ */
+static socklen_t tls_kernelParams(const struct tls_conn *tc,
+	const unsigned char *secret, union tls_kernelInfo *ki)
+{
+	const SSL_CIPHER *cipher = SSL_get_current_cipher(tc->ssl);
+	const EVP_MD *md;
+	unsigned char key[32];
+	unsigned char iv[12];
+	size_t keyLen;
+	socklen_t size;
+
+	if (cipher == NULL)
+	{
+		return 0;
+	}
+
+	memset(ki, 0, sizeof(*ki));
+	ki->info.version = TLS_1_3_VERSION;
+
+	switch (SSL_CIPHER_get_id(cipher))
+	{
+	case TLS1_3_CK_AES_128_GCM_SHA256:
+		ki->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		keyLen = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+		size = sizeof(ki->aes128);
+		break;
+	case TLS1_3_CK_AES_256_GCM_SHA384:
+		ki->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		keyLen = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+		size = sizeof(ki->aes256);
+		break;
+	case TLS1_3_CK_CHACHA20_POLY1305_SHA256:
+		ki->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		keyLen = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+		size = sizeof(ki->chacha);
+		break;
+	default:
+		return 0;
+	}
+
+	md = SSL_CIPHER_get_handshake_digest(cipher);
+	if (md == NULL ||
+		tls_expandLabel(md, secret, tc->secretLen, "key", key, keyLen) != 0 ||
+		tls_expandLabel(md, secret, tc->secretLen, "iv", iv, sizeof(iv)) != 0)
+	{
+		size = 0;
+		goto on_exit;
+	}
+
+	/* The GCM nonce is split into a salt and an explicit part */
+	switch (ki->info.cipher_type)
+	{
+	case TLS_CIPHER_AES_GCM_128:
+		memcpy(ki->aes128.key, key, keyLen);
+		memcpy(ki->aes128.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(ki->aes128.iv, iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+			TLS_CIPHER_AES_GCM_128_IV_SIZE);
+		break;
+	case TLS_CIPHER_AES_GCM_256:
+		memcpy(ki->aes256.key, key, keyLen);
+		memcpy(ki->aes256.salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+		memcpy(ki->aes256.iv, iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE,
+			TLS_CIPHER_AES_GCM_256_IV_SIZE);
+		break;
+	default:
+		memcpy(ki->chacha.key, key, keyLen);
+		memcpy(ki->chacha.iv, iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+		break;
+	}
+
+on_exit:
+	OPENSSL_cleanse(key, sizeof(key));
+	OPENSSL_cleanse(iv, sizeof(iv));
+	return size;
+}
+
+int tls_init(struct tls_server *t, const char *certPath)
+{
+	memset(t, 0, sizeof(struct tls_server));
+
+	t->ctx = SSL_CTX_new(TLS_server_method());
+	if (t->ctx == NULL)
+	{
+		goto on_error;
+	}
+
+	SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+	/* Idle user space connections don't keep record buffers */
+	SSL_CTX_set_mode(t->ctx, SSL_MODE_RELEASE_BUFFERS);
+	/*
+	 * Session tickets would be sent with the application keys after the
+	 * handshake, so the kernel could no longer start at sequence number 0.
+	 */
+	SSL_CTX_set_num_tickets(t->ctx, 0);
+	SSL_CTX_set_keylog_callback(t->ctx, tls_keylog);
+
+	if (SSL_CTX_use_certificate_chain_file(t->ctx, certPath) != 1 ||
+		SSL_CTX_use_PrivateKey_file(t->ctx, certPath, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(t->ctx) != 1)
+	{
+		goto on_error;
+	}
+
+	return 0;
+
+on_error:
+	fprintf(stderr, "Failed to load TLS certificate from %s:\n", certPath);
+	ERR_print_errors_fp(stderr);
+	tls_free(t);
+	return -1;
+}
+
+void tls_free(struct tls_server *t)
+{
+	SSL_CTX_free(t->ctx);
+	t->ctx = NULL;
+}
+
+struct tls_conn *tls_accept(struct tls_server *t)
+{
+	struct tls_conn *tc;
+	BIO *rbio = NULL;
+	BIO *wbio = NULL;
+
+	tc = calloc(1, sizeof(struct tls_conn));
+	if (tc == NULL)
+	{
+		return NULL;
+	}
+
+	tc->ssl = SSL_new(t->ctx);
+	rbio = BIO_new(BIO_s_mem());
+	wbio = BIO_new(BIO_s_mem());
+	if (tc->ssl == NULL || rbio == NULL || wbio == NULL)
+	{
+		goto on_error;
+	}
+
+	/* An empty BIO asks to retry instead of signalling end of file */
+	BIO_set_mem_eof_return(rbio, -1);
+	BIO_set_mem_eof_return(wbio, -1);
+
+	/* The SSL object owns the BIOs from here on */
+	SSL_set_bio(tc->ssl, rbio, wbio);
+	tc->rbio = rbio;
+	tc->wbio = wbio;
+
+	SSL_set_app_data(tc->ssl, tc);
+	SSL_set_accept_state(tc->ssl);
+	return tc;
+
+on_error:
+	BIO_free(rbio);
+	BIO_free(wbio);
+	SSL_free(tc->ssl);
+	free(tc);
+	ERR_clear_error();
+	return NULL;
+}
+
+void tls_connFree(struct tls_conn *tc)
+{
+	if (tc != NULL)
+	{
+		OPENSSL_cleanse(tc->txSecret, sizeof(tc->txSecret));
+		OPENSSL_cleanse(tc->rxSecret, sizeof(tc->rxSecret));
+		SSL_free(tc->ssl);
+		free(tc);
+	}
+}
+
+int tls_feed(struct tls_conn *tc, const char *data, size_t len)
+{
+	if (len > 0 && BIO_write(tc->rbio, data, (int)len) != (int)len)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int tls_handshake(struct tls_server *t, struct tls_conn *tc)
+{
+	int rc;
+
+	rc = SSL_do_handshake(tc->ssl);
+	if (rc == 1)
+	{
+		tc->established = 1;
+		t->handshakes++;
+		return TLS_DONE;
+	}
+
+	switch (SSL_get_error(tc->ssl, rc))
+	{
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return TLS_AGAIN;
+	default:
+		/* Failed handshakes are common enough that they are only counted */
+		ERR_clear_error();
+		t->failures++;
+		return TLS_FAILED;
+	}
+}
+
+int tls_offload(struct tls_server *t, struct tls_conn *tc, int sd)
+{
+	union tls_kernelInfo tx;
+	union tls_kernelInfo rx;
+	socklen_t size;
+	int rc = TLS_AGAIN;
+
+	if (t->noKtls || SSL_version(tc->ssl) != TLS1_3_VERSION ||
+		tc->secrets != (TLS_SECRET_TX | TLS_SECRET_RX) ||
+		BIO_ctrl_pending(tc->rbio) > 0 || SSL_has_pending(tc->ssl) ||
+		tls_pending(tc) > 0)
+	{
+		goto on_exit;
+	}
+
+	size = tls_kernelParams(tc, tc->txSecret, &tx);
+	if (size == 0 || tls_kernelParams(tc, tc->rxSecret, &rx) != size)
+	{
+		goto on_exit;
+	}
+
+	if (setsockopt(sd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) != 0)
+	{
+		/* The kernel lacks TLS support, don't ask again */
+		if (errno == ENOENT || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+		{
+			t->noKtls = 1;
+		}
+
+		goto on_exit;
+	}
+
+	/* Without any keys the socket still passes records through */
+	if (setsockopt(sd, SOL_TLS, TLS_TX, &tx, size) != 0)
+	{
+		goto on_exit;
+	}
+
+	/* Transmit is in the kernel already, so there is no way back */
+	if (setsockopt(sd, SOL_TLS, TLS_RX, &rx, size) != 0)
+	{
+		perror("setsockopt TLS_RX");
+		rc = TLS_FAILED;
+		goto on_exit;
+	}
+
+	t->ktls++;
+	rc = TLS_DONE;
+
+on_exit:
+	if (rc == TLS_AGAIN)
+	{
+		t->userspace++;
+	}
+
+	OPENSSL_cleanse(&tx, sizeof(tx));
+	OPENSSL_cleanse(&rx, sizeof(rx));
+	OPENSSL_cleanse(tc->txSecret, sizeof(tc->txSecret));
+	OPENSSL_cleanse(tc->rxSecret, sizeof(tc->rxSecret));
+	tc->secrets = 0;
+	return rc;
+}
+
+ssize_t tls_read(struct tls_conn *tc, char *buf, size_t size)
+{
+	int n;
+
+	n = SSL_read(tc->ssl, buf, (int)size);
+	if (n > 0)
+	{
+		return n;
+	}
+
+	switch (SSL_get_error(tc->ssl, n))
+	{
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return 0;
+	default:
+		/* Includes the peer's close_notify */
+		ERR_clear_error();
+		return -1;
+	}
+}
+
+int tls_write(struct tls_conn *tc, const char *data, size_t len)
+{
+	if (len > 0 && SSL_write(tc->ssl, data, (int)len) != (int)len)
+	{
+		ERR_clear_error();
+		return -1;
+	}
+
+	return 0;
+}
+
+size_t tls_output(struct tls_conn *tc, char *buf, size_t size)
+{
+	int n;
+
+	n = BIO_read(tc->wbio, buf, (int)size);
+	return n > 0 ? (size_t)n : 0;
+}
+
+size_t tls_pending(const struct tls_conn *tc)
+{
+	return BIO_ctrl_pending(tc->wbio);
+}
+
+void tls_writeStats(const struct tls_server *t, FILE *fp)
+{
+	fprintf(fp, "tls_handshakes %llu\n", (unsigned long long)t->handshakes);
+	fprintf(fp, "tls_handshake_failures %llu\n",
+		(unsigned long long)t->failures);
+	fprintf(fp, "tls_kernel %llu\n", (unsigned long long)t->ktls);
+	fprintf(fp, "tls_userspace %llu\n", (unsigned long long)t->userspace);
+}
@@ -0,0 +1,141 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+/* Largest TLS 1.3 traffic secret (SHA-384) */
+#define TLS_SECRET_MAX 48
+
+/* Results of tls_handshake() and tls_offload() */
+#define TLS_AGAIN 0
+#define TLS_DONE 1
+#define TLS_FAILED (-1)
+
+/* Traffic secrets of a connection that have been logged */
+#define TLS_SECRET_TX 0x01
+#define TLS_SECRET_RX 0x02
+
+/*
+ * TLS state of a connection. The handshake runs on memory BIOs fed from the
+ * event loop. Once it is done the keys move into the kernel where possible
+ * and the state is freed; otherwise records stay in user space.
+ */
+struct tls_conn
+{
+	SSL *ssl;
+	/* Records received from the network, read by OpenSSL */
+	BIO *rbio;
+	/* Records written by OpenSSL, to be sent */
+	BIO *wbio;
+	/* Handshake finished */
+	uint8_t established;
+	/* TLS_SECRET_* flags */
+	uint8_t secrets;
+	uint8_t secretLen;
+	/* Application traffic secrets, kept until the keys are installed */
+	unsigned char txSecret[TLS_SECRET_MAX];
+	unsigned char rxSecret[TLS_SECRET_MAX];
+};
+
+struct tls_server
+{
+	SSL_CTX *ctx;
+	/* Kernel TLS turned out to be unavailable */
+	int noKtls;
+	/* Statistics */
+	uint64_t handshakes;
+	uint64_t failures;
+	uint64_t ktls;
+	uint64_t userspace;
+};
+
+/*
+ * Loads the certificate chain and the private key from the PEM file
+ * certPath.
+ * Returns 0 on success, -1 on failure.
+ */
+int tls_init(struct tls_server *t, const char *certPath);
+
+void tls_free(struct tls_server *t);
+
+/*
+ * Returns the state of a new server side connection, NULL on failure.
+ */
+struct tls_conn *tls_accept(struct tls_server *t);
+
+void tls_connFree(struct tls_conn *tc);
+
+/*
+ * Hands records received from the network to OpenSSL.
+ * Returns 0 on success, -1 on failure.
+ */
+int tls_feed(struct tls_conn *tc, const char *data, size_t len);
+
+/*
+ * Advances the handshake with the records fed so far.
+ * Returns TLS_DONE once it is finished, TLS_AGAIN if it needs more data or
+ * TLS_FAILED.
+ */
+int tls_handshake(struct tls_server *t, struct tls_conn *tc);
+
+/*
+ * Moves the traffic keys of an established connection into the kernel,
+ * so reads and writes on sd carry plain data from now on. Only possible
+ * for TLS 1.3 with AES-GCM or ChaCha20-Poly1305 and if nothing beyond the
+ * handshake has been fed yet.
+ * Returns TLS_DONE if the keys were installed, TLS_AGAIN if the connection
+ * stays in user space or TLS_FAILED if sd is no longer usable.
+ */
+int tls_offload(struct tls_server *t, struct tls_conn *tc, int sd);
+
+/*
+ * Decrypts received records into buf.
+ * Returns the number of bytes, 0 if more records are needed or -1 on
+ * failure or when the peer closed the connection.
+ */
+ssize_t tls_read(struct tls_conn *tc, char *buf, size_t size);
+
+/*
+ * Encrypts data into records waiting to be sent.
+ * Returns 0 on success, -1 on failure.
+ */
+int tls_write(struct tls_conn *tc, const char *data, size_t len);
+
+/*
+ * Moves up to size bytes of records waiting to be sent into buf.
+ * Returns the number of bytes moved.
+ */
+size_t tls_output(struct tls_conn *tc, char *buf, size_t size);
+
+/*
+ * Returns the number of bytes of records waiting to be sent.
+ */
+size_t tls_pending(const struct tls_conn *tc);
+
+/*
+ * Writes TLS statistics.
+ */
+void tls_writeStats(const struct tls_server *t, FILE *fp);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trace.h"
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+static const char *const g_typeNames[TR_TYPES] =
+{
+	"accept",
+	"read",
+	"write",
+	"close",
+	"enter",
+	"exit"
+};
+
+static const char *const g_callbackNames[TR_CALLBACKS] =
+{
+	"none",
+	"on_start",
+	"on_stop",
+	"on_connect",
+	"on_disconnect",
+	"on_receive",
+	"on_record",
+	"rpc_method"
+};
+
+const char *trace_callbackName(enum trace_callback cb)
+{
+	if ((unsigned)cb >= TR_CALLBACKS)
+	{
+		return "unknown";
+	}
+
+	return g_callbackNames[cb];
+}
+
+void trace_dump(const struct trace_ring *r, FILE *fp)
+{
+	uint64_t head, i, first, last;
+
+	assert(r != NULL);
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+	if (head == 0)
+	{
+		return;
+	}
+
+	last = r->events[(head - 1) & (TRACE_EVENTS - 1)].tsc;
+
+	for (i = first; i < head; ++i)
+	{
+		const struct trace_event *e = &r->events[i & (TRACE_EVENTS - 1)];
+		long long ago = (long long)tsc_toNs(last - e->tsc) / 1000;
+
+		if ((unsigned)e->type >= TR_TYPES)
+		{
+			continue;
+		}
+
+		if (e->type == TR_CB_ENTER || e->type == TR_CB_EXIT)
+		{
+			fprintf(fp, "  -%lldus %-6s client %llx %s\n", ago,
+				g_typeNames[e->type], (unsigned long long)e->client,
+				trace_callbackName(e->arg));
+		}
+		else if (e->type == TR_READ || e->type == TR_WRITE)
+		{
+			fprintf(fp, "  -%lldus %-6s client %llx %u bytes\n", ago,
+				g_typeNames[e->type], (unsigned long long)e->client, e->arg);
+		}
+		else
+		{
+			fprintf(fp, "  -%lldus %-6s client %llx\n", ago,
+				g_typeNames[e->type], (unsigned long long)e->client);
+		}
+	}
+}
+
+/*
+ * Watchdog thread, polls the heartbeat a few times per threshold.
+ */
+static void *watchdog_run(void *arg)
+{
+	struct watchdog *w = arg;
+	uint64_t reported = 0;
+	struct timespec ts;
+
+	ts.tv_sec = w->thresholdMs / 4000;
+	ts.tv_nsec = (long)(w->thresholdMs % 4000) * 250000L;
+	if (ts.tv_sec == 0 && ts.tv_nsec == 0)
+	{
+		ts.tv_nsec = 250000L;
+	}
+
+	while (!w->stop)
+	{
+		uint64_t since, now;
+
+		nanosleep(&ts, NULL);
+
+		since = __atomic_load_n(&w->busySince, __ATOMIC_RELAXED);
+		if (since == 0 || since == reported)
+		{
+			continue;
+		}
+
+		now = tsc_now();
+		if (now > since && tsc_toNs(now - since) / 1000000 >=
+			(uint64_t)w->thresholdMs)
+		{
+			uint32_t cb = __atomic_load_n(&w->callback, __ATOMIC_RELAXED);
+			uint64_t client = __atomic_load_n(&w->client, __ATOMIC_RELAXED);
+
+			/* Report each stalled iteration once */
+			reported = since;
+			w->stalls++;
+
+			fprintf(stderr, "Event loop stalled for %llu ms in %s "
+				"(client %llx), recent events:\n",
+				(unsigned long long)(tsc_toNs(now - since) / 1000000),
+				trace_callbackName(cb), (unsigned long long)client);
+			trace_dump(w->ring, stderr);
+		}
+	}
+
+	return NULL;
+}
+
+int watchdog_start(struct watchdog *w, struct trace_ring *ring,
+	int thresholdMs)
+{
+	int rc;
+
+	assert(w != NULL);
+	assert(ring != NULL);
+
+	memset(w, 0, sizeof(struct watchdog));
+	w->ring = ring;
+	w->thresholdMs = thresholdMs;
+
+	tsc_calibrate();
+
+	rc = pthread_create(&w->thread, NULL, watchdog_run, w);
+	if (rc != 0)
+	{
+		fprintf(stderr, "Failed to start watchdog: %s\n", strerror(rc));
+		return -1;
+	}
+
+	w->running = 1;
+
+	return 0;
+}
+
+void watchdog_stop(struct watchdog *w)
+{
+	if (w == NULL || !w->running)
+	{
+		return;
+	}
+
+	w->stop = 1;
+	pthread_join(w->thread, NULL);
+	w->running = 0;
+}
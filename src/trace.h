@@ -0,0 +1,168 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "tsc.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Number of events kept by the flight recorder, must be a power of two */
+#define TRACE_EVENTS 4096
+
+/* Recorded event types */
+enum trace_type
+{
+	TR_ACCEPT = 0,
+	TR_READ,
+	TR_WRITE,
+	TR_CLOSE,
+	TR_CB_ENTER,
+	TR_CB_EXIT,
+	TR_TYPES
+};
+
+/* Handler callbacks, recorded as the argument of TR_CB_* events */
+enum trace_callback
+{
+	TR_CB_NONE = 0,
+	TR_CB_START,
+	TR_CB_STOP,
+	TR_CB_CONNECT,
+	TR_CB_DISCONNECT,
+	TR_CB_RECEIVE,
+	TR_CB_RECORD,
+	TR_CB_RPC,
+	TR_CALLBACKS
+};
+
+/* Flight recorder entry */
+struct trace_event
+{
+	/* tsc_now() at the time of the event */
+	uint64_t tsc;
+	/* Client id, see cl_id */
+	uint64_t client;
+	enum trace_type type;
+	/* Byte count or callback */
+	uint32_t arg;
+};
+
+/*
+ * Ring of the most recent loop events. Written by the loop thread only; the
+ * watchdog reads it without synchronization when dumping, which may show a
+ * few torn entries at the write position.
+ */
+struct trace_ring
+{
+	struct trace_event events[TRACE_EVENTS];
+	uint64_t head;
+};
+
+/*
+ * Loop heartbeat and watchdog thread. The loop publishes the start of the
+ * current iteration and the running callback; the watchdog dumps the
+ * recorder when an iteration runs longer than the threshold.
+ */
+struct watchdog
+{
+	struct trace_ring *ring;
+	/* tsc_now() when the current iteration started, 0 while waiting */
+	uint64_t busySince;
+	/* Callback currently running, TR_CB_NONE if none */
+	uint32_t callback;
+	/* Client the callback runs for */
+	uint64_t client;
+	/* Stall threshold in milliseconds */
+	int thresholdMs;
+	/* Number of stalls reported */
+	uint64_t stalls;
+	volatile int stop;
+	int running;
+	pthread_t thread;
+};
+
+/*
+ * Appends an event to the ring. Costs a handful of stores.
+ * Returns the timestamp of the event.
+ */
+static inline uint64_t trace_record(struct trace_ring *r,
+	enum trace_type type, uint64_t client, uint32_t arg)
+{
+	struct trace_event *e = &r->events[r->head & (TRACE_EVENTS - 1)];
+	uint64_t tsc = tsc_now();
+
+	e->tsc = tsc;
+	e->client = client;
+	e->type = type;
+	e->arg = arg;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+
+	return tsc;
+}
+
+/*
+ * Marks the start of a loop iteration.
+ */
+static inline void watchdog_beat(struct watchdog *w)
+{
+	__atomic_store_n(&w->busySince, tsc_now(), __ATOMIC_RELAXED);
+}
+
+/*
+ * Marks the loop as waiting for events.
+ */
+static inline void watchdog_idle(struct watchdog *w)
+{
+	__atomic_store_n(&w->busySince, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Publishes the callback currently running, TR_CB_NONE when it returned.
+ */
+static inline void watchdog_setCallback(struct watchdog *w,
+	enum trace_callback cb, uint64_t client)
+{
+	__atomic_store_n(&w->client, client, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->callback, cb, __ATOMIC_RELAXED);
+}
+
+/*
+ * Starts the watchdog thread.
+ * Returns 0 on success, -1 on failure.
+ */
+int watchdog_start(struct watchdog *w, struct trace_ring *ring,
+	int thresholdMs);
+
+/*
+ * Stops the watchdog thread if it is running.
+ */
+void watchdog_stop(struct watchdog *w);
+
+/*
+ * Writes the recorder contents, oldest event first.
+ */
+void trace_dump(const struct trace_ring *r, FILE *fp);
+
+/*
+ * Returns the name of a callback.
+ */
+const char *trace_callbackName(enum trace_callback cb);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tsc.h"
+
+/* Calibration interval in nanoseconds */
+#define CALIBRATE_NS 10000000ull
+
+static double g_ticksPerNs = 0.0;
+
+static uint64_t clockNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void tsc_calibrate(void)
+{
+	uint64_t t0, c0, t1, c1;
+
+	if (g_ticksPerNs > 0.0)
+	{
+		return;
+	}
+
+	t0 = clockNs();
+	c0 = tsc_now();
+
+	do
+	{
+		t1 = clockNs();
+	}
+	while (t1 - t0 < CALIBRATE_NS);
+
+	c1 = tsc_now();
+	g_ticksPerNs = (double)(c1 - c0) / (double)(t1 - t0);
+
+	if (g_ticksPerNs <= 0.0)
+	{
+		g_ticksPerNs = 1.0;
+	}
+}
+
+uint64_t tsc_toNs(uint64_t ticks)
+{
+	return (uint64_t)((double)ticks / g_ticksPerNs);
+}
+
+double tsc_ticksPerUs(void)
+{
+	return g_ticksPerNs * 1000.0;
+}
@@ -0,0 +1,61 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Returns a cheap, monotonic cycle count. Uses the time stamp counter on x86
+ * and the monotonic clock in nanoseconds elsewhere.
+ */
+static inline uint64_t tsc_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Measures the counter frequency. Blocks for a few milliseconds on the
+ * first call.
+ */
+void tsc_calibrate(void);
+
+/*
+ * Converts a counter delta to nanoseconds. tsc_calibrate must have been
+ * called before.
+ */
+uint64_t tsc_toNs(uint64_t ticks);
+
+/*
+ * Returns the number of counter ticks per microsecond.
+ */
+double tsc_ticksPerUs(void);
+
+#endif
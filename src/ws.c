@@ -0,0 +1,714 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ws.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Appended to the client's key to prove the server speaks WebSocket */
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+/* Length of a base64 encoded 16 byte key */
+#define WS_KEY_LEN 24
+
+#define WS_FIN 0x80
+#define WS_RSV 0x70
+#define WS_MASKED 0x80
+
+static const char g_wsRejected[] =
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Connection: close\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"Content-Length: 0\r\n\r\n";
+
+/*
+ * Grows the message buffer to hold at least need bytes.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int ws_reserve(struct ws_conn *wc, size_t need)
+{
+	size_t cap = wc->msgCap > 0 ? wc->msgCap : 1024;
+	char *msg;
+
+	if (need <= wc->msgCap)
+	{
+		return 0;
+	}
+
+	while (cap < need)
+	{
+		cap *= 2;
+	}
+
+	msg = realloc(wc->msg, cap);
+	if (msg == NULL)
+	{
+		return -1;
+	}
+
+	wc->msg = msg;
+	wc->msgCap = cap;
+	return 0;
+}
+
+/*
+ * Returns 1 if the comma separated header value contains token, ignoring
+ * case.
+ */
+static int ws_hasToken(const char *value, size_t len, const char *token)
+{
+	size_t tokenLen = strlen(token);
+	size_t i = 0;
+
+	while (i < len)
+	{
+		size_t end = i;
+		size_t n;
+
+		while (end < len && value[end] != ',')
+		{
+			end++;
+		}
+
+		while (i < end && (value[i] == ' ' || value[i] == '\t'))
+		{
+			i++;
+		}
+
+		n = end - i;
+		while (n > 0 && (value[i + n - 1] == ' ' || value[i + n - 1] == '\t'))
+		{
+			n--;
+		}
+
+		if (n == tokenLen && strncasecmp(value + i, token, n) == 0)
+		{
+			return 1;
+		}
+
+		i = end + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Checks an upgrade request and computes the accept key from the client's
+ * key.
+ * Returns 0 if the request is acceptable, -1 otherwise.
+ */
+static int ws_checkRequest(const char *req, size_t len, char *accept)
+{
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	char keyGuid[WS_KEY_LEN + sizeof(WS_GUID)];
+	const char *line = req;
+	const char *end = req + len;
+	int upgrade = 0;
+	int connection = 0;
+	int version = 0;
+	int key = 0;
+
+	if (len < 4 || memcmp(req, "GET ", 4) != 0)
+	{
+		return -1;
+	}
+
+	/* Headers start after the request line, the request ends with a blank line */
+	while (line < end)
+	{
+		const char *eol = memchr(line, '\n', (size_t)(end - line));
+		const char *colon;
+		const char *value;
+		size_t valueLen;
+		size_t nameLen;
+
+		if (eol == NULL)
+		{
+			break;
+		}
+
+		if (line == req)
+		{
+			line = eol + 1;
+			continue;
+		}
+
+		colon = memchr(line, ':', (size_t)(eol - line));
+		if (colon == NULL)
+		{
+			line = eol + 1;
+			continue;
+		}
+
+		nameLen = (size_t)(colon - line);
+		value = colon + 1;
+		while (value < eol && (*value == ' ' || *value == '\t'))
+		{
+			value++;
+		}
+
+		valueLen = (size_t)(eol - value);
+		while (valueLen > 0 && (value[valueLen - 1] == '\r' ||
+			value[valueLen - 1] == ' ' || value[valueLen - 1] == '\t'))
+		{
+			valueLen--;
+		}
+
+		if (nameLen == 7 && strncasecmp(line, "Upgrade", 7) == 0)
+		{
+			upgrade = ws_hasToken(value, valueLen, "websocket");
+		}
+		else if (nameLen == 10 && strncasecmp(line, "Connection", 10) == 0)
+		{
+			connection = ws_hasToken(value, valueLen, "upgrade");
+		}
+		else if (nameLen == 21 &&
+			strncasecmp(line, "Sec-WebSocket-Version", 21) == 0)
+		{
+			version = valueLen == 2 && memcmp(value, "13", 2) == 0;
+		}
+		else if (nameLen == 17 &&
+			strncasecmp(line, "Sec-WebSocket-Key", 17) == 0 &&
+			valueLen == WS_KEY_LEN)
+		{
+			memcpy(keyGuid, value, WS_KEY_LEN);
+			key = 1;
+		}
+
+		line = eol + 1;
+	}
+
+	if (!upgrade || !connection || !version || !key)
+	{
+		return -1;
+	}
+
+	memcpy(keyGuid + WS_KEY_LEN, WS_GUID, sizeof(WS_GUID) - 1);
+	SHA1((const unsigned char *)keyGuid, WS_KEY_LEN + sizeof(WS_GUID) - 1,
+		digest);
+	EVP_EncodeBlock((unsigned char *)accept, digest, SHA_DIGEST_LENGTH);
+	return 0;
+}
+
+int ws_handshake(struct ws_conn *wc, char **data, size_t *len, char *reply,
+	size_t *replyLen)
+{
+	char accept[32];
+	size_t from;
+	size_t take;
+	const char *end = NULL;
+
+	take = *len;
+	if (take > WS_REQUEST_MAX - wc->msgLen)
+	{
+		take = WS_REQUEST_MAX - wc->msgLen;
+	}
+
+	if (ws_reserve(wc, wc->msgLen + take) != 0)
+	{
+		goto on_error;
+	}
+
+	/* The blank line may straddle two reads */
+	from = wc->msgLen > 3 ? wc->msgLen - 3 : 0;
+	memcpy(wc->msg + wc->msgLen, *data, take);
+	wc->msgLen += take;
+
+	while (from + 4 <= wc->msgLen)
+	{
+		const char *p = memchr(wc->msg + from, '\r', wc->msgLen - from - 3);
+
+		if (p == NULL)
+		{
+			break;
+		}
+
+		if (memcmp(p, "\r\n\r\n", 4) == 0)
+		{
+			end = p + 4;
+			break;
+		}
+
+		from = (size_t)(p - wc->msg) + 1;
+	}
+
+	if (end == NULL)
+	{
+		if (wc->msgLen == WS_REQUEST_MAX)
+		{
+			goto on_error;
+		}
+
+		*data += take;
+		*len -= take;
+		return WS_MORE;
+	}
+
+	/* Bytes behind the request are already frames */
+	take -= wc->msgLen - (size_t)(end - wc->msg);
+	*data += take;
+	*len -= take;
+
+	if (ws_checkRequest(wc->msg, (size_t)(end - wc->msg), accept) != 0)
+	{
+		goto on_error;
+	}
+
+	*replyLen = (size_t)snprintf(reply, WS_REPLY_MAX,
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+
+	wc->open = 1;
+	wc->msgLen = 0;
+	wc->hdrNeed = 2;
+	return WS_DONE;
+
+on_error:
+	memcpy(reply, g_wsRejected, sizeof(g_wsRejected) - 1);
+	*replyLen = sizeof(g_wsRejected) - 1;
+	return WS_ERROR;
+}
+
+void ws_unmask(char *data, size_t len, uint32_t mask)
+{
+	size_t i = 0;
+
+	/* Blocks are multiples of 4 bytes, so the mask stays aligned */
+#ifdef __AVX2__
+	__m256i m256 = _mm256_set1_epi32((int)mask);
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+
+		_mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, m256));
+	}
+#endif
+
+#ifdef __SSE2__
+	{
+		__m128i m128 = _mm_set1_epi32((int)mask);
+
+		for (; i + 16 <= len; i += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+
+			_mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, m128));
+		}
+	}
+#endif
+
+	for (; i + 4 <= len; i += 4)
+	{
+		uint32_t v;
+
+		memcpy(&v, data + i, 4);
+		v ^= mask;
+		memcpy(data + i, &v, 4);
+	}
+
+	for (; i < len; ++i)
+	{
+		data[i] ^= (char)(mask >> (8 * (i & 3)));
+	}
+}
+
+/*
+ * Checks a complete frame header and sets up the payload.
+ * Returns 0 on success or the close code for a protocol violation.
+ */
+static uint16_t ws_startFrame(struct ws_conn *wc)
+{
+	const uint8_t *hdr = wc->hdr;
+	uint64_t len = hdr[1] & 0x7f;
+	uint32_t mask;
+	int i;
+
+	if (len == 126)
+	{
+		len = (uint64_t)hdr[2] << 8 | hdr[3];
+	}
+	else if (len == 127)
+	{
+		len = 0;
+		for (i = 0; i < 8; ++i)
+		{
+			len = len << 8 | hdr[2 + i];
+		}
+
+		/* The most significant bit must be 0 */
+		if (len >> 63)
+		{
+			return WS_CLOSE_PROTOCOL;
+		}
+	}
+
+	memcpy(&mask, hdr + wc->hdrNeed - 4, 4);
+	wc->mask = mask;
+	wc->fin = hdr[0] & WS_FIN;
+	wc->opcode = hdr[0] & 0x0f;
+	wc->remaining = len;
+
+	/* No extensions are negotiated, so the reserved bits stay clear */
+	if (hdr[0] & WS_RSV)
+	{
+		return WS_CLOSE_PROTOCOL;
+	}
+
+	switch (wc->opcode)
+	{
+	case WS_OP_CONTINUATION:
+		if (wc->msgOpcode == 0)
+		{
+			return WS_CLOSE_PROTOCOL;
+		}
+
+		break;
+	case WS_OP_TEXT:
+	case WS_OP_BINARY:
+		if (wc->msgOpcode != 0)
+		{
+			return WS_CLOSE_PROTOCOL;
+		}
+
+		/* A new message, text is validated across its fragments */
+		wc->utf8Need = 0;
+		break;
+	case WS_OP_CLOSE:
+	case WS_OP_PING:
+	case WS_OP_PONG:
+		/* Control frames may come between fragments, but not fragmented */
+		if (!wc->fin || len > WS_CONTROL_MAX)
+		{
+			return WS_CLOSE_PROTOCOL;
+		}
+
+		/* Their payload is not text, the state of the message stays */
+		wc->ctlLen = 0;
+		wc->text = 0;
+		return 0;
+	default:
+		return WS_CLOSE_PROTOCOL;
+	}
+
+	if (len > WS_MESSAGE_MAX - wc->msgLen)
+	{
+		return WS_CLOSE_TOO_BIG;
+	}
+
+	wc->text = wc->opcode == WS_OP_TEXT ||
+		(wc->opcode == WS_OP_CONTINUATION && wc->msgOpcode == WS_OP_TEXT);
+	return 0;
+}
+
+/*
+ * Validates the next part of a text message as UTF-8. A character may be
+ * split across parts, the state in wc carries over.
+ * Returns 0 if valid so far, -1 otherwise.
+ */
+static int ws_checkUtf8(struct ws_conn *wc, const uint8_t *p, size_t len)
+{
+	uint8_t need = wc->utf8Need, lo = wc->utf8Lo, hi = wc->utf8Hi;
+	size_t i = 0;
+
+	while (i < len)
+	{
+		uint8_t c = p[i];
+		uint64_t v;
+
+		/* Skip ASCII eight bytes at a time */
+		if (need == 0 && i + 8 <= len)
+		{
+			memcpy(&v, p + i, 8);
+			if ((v & 0x8080808080808080ull) == 0)
+			{
+				i += 8;
+				continue;
+			}
+		}
+
+		i++;
+
+		if (need > 0)
+		{
+			if (c < lo || c > hi)
+			{
+				return -1;
+			}
+
+			need--;
+			lo = 0x80;
+			hi = 0xbf;
+			continue;
+		}
+
+		if (c < 0x80)
+		{
+			continue;
+		}
+
+		/* Overlong forms, surrogates and code points above 0x10ffff fail */
+		lo = 0x80;
+		hi = 0xbf;
+
+		if (c >= 0xc2 && c <= 0xdf)
+		{
+			need = 1;
+		}
+		else if (c >= 0xe0 && c <= 0xef)
+		{
+			need = 2;
+			lo = c == 0xe0 ? 0xa0 : 0x80;
+			hi = c == 0xed ? 0x9f : 0xbf;
+		}
+		else if (c >= 0xf0 && c <= 0xf4)
+		{
+			need = 3;
+			lo = c == 0xf0 ? 0x90 : 0x80;
+			hi = c == 0xf4 ? 0x8f : 0xbf;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+
+	wc->utf8Need = need;
+	wc->utf8Lo = lo;
+	wc->utf8Hi = hi;
+	return 0;
+}
+
+/*
+ * Fills in a finished control frame.
+ */
+static int ws_control(struct ws_conn *wc, struct ws_frame *f)
+{
+	f->opcode = wc->opcode;
+	f->data = wc->ctl;
+	f->len = wc->ctlLen;
+
+	switch (wc->opcode)
+	{
+	case WS_OP_PING:
+		return WS_PING;
+	case WS_OP_PONG:
+		return WS_PONG;
+	default:
+		return WS_CLOSE;
+	}
+}
+
+int ws_next(struct ws_conn *wc, char **data, size_t *len, struct ws_frame *f)
+{
+	if (wc->delivered)
+	{
+		wc->msgLen = 0;
+		wc->delivered = 0;
+	}
+
+	while (*len > 0)
+	{
+		size_t n;
+
+		if (wc->hdrLen < wc->hdrNeed)
+		{
+			const uint8_t *p = (const uint8_t *)*data;
+
+			n = wc->hdrNeed - wc->hdrLen;
+			if (n > *len)
+			{
+				n = *len;
+			}
+
+			memcpy(wc->hdr + wc->hdrLen, p, n);
+			wc->hdrLen += (uint8_t)n;
+			*data += n;
+			*len -= n;
+
+			/* The second byte tells the size of the rest of the header */
+			if (wc->hdrLen == 2)
+			{
+				uint8_t lenCode = wc->hdr[1] & 0x7f;
+
+				if (!(wc->hdr[1] & WS_MASKED))
+				{
+					f->code = WS_CLOSE_PROTOCOL;
+					return WS_ERROR;
+				}
+
+				wc->hdrNeed = 2 + 4 + (lenCode == 126 ? 2 :
+					lenCode == 127 ? 8 : 0);
+				continue;
+			}
+
+			if (wc->hdrLen < wc->hdrNeed)
+			{
+				return WS_MORE;
+			}
+
+			f->code = ws_startFrame(wc);
+			if (f->code != 0)
+			{
+				return WS_ERROR;
+			}
+		}
+
+		n = wc->remaining < *len ? (size_t)wc->remaining : *len;
+		ws_unmask(*data, n, wc->mask);
+
+		/* Keep the mask aligned with the next payload byte */
+		if (n & 3)
+		{
+			wc->mask = wc->mask >> (8 * (n & 3)) |
+				wc->mask << (32 - 8 * (n & 3));
+		}
+
+		/* A message must not end within a character */
+		if (wc->text && (ws_checkUtf8(wc, (const uint8_t *)*data, n) != 0 ||
+			(wc->fin && n == wc->remaining && wc->utf8Need > 0)))
+		{
+			f->code = WS_CLOSE_INVALID_DATA;
+			return WS_ERROR;
+		}
+
+		if (wc->opcode & 0x08)
+		{
+			memcpy(wc->ctl + wc->ctlLen, *data, n);
+			wc->ctlLen += (uint8_t)n;
+		}
+		else if (wc->fin && wc->msgOpcode == 0 && n == wc->remaining)
+		{
+			/* The whole message is in data */
+			f->opcode = wc->opcode;
+			f->data = *data;
+			f->len = n;
+			wc->lastOpcode = wc->opcode;
+			wc->remaining = 0;
+			wc->hdrLen = 0;
+			wc->hdrNeed = 2;
+			*data += n;
+			*len -= n;
+			return WS_MESSAGE;
+		}
+		else
+		{
+			if (wc->msgOpcode == 0)
+			{
+				wc->msgOpcode = wc->opcode;
+			}
+
+			if (ws_reserve(wc, wc->msgLen + n) != 0)
+			{
+				f->code = WS_CLOSE_TOO_BIG;
+				return WS_ERROR;
+			}
+
+			memcpy(wc->msg + wc->msgLen, *data, n);
+			wc->msgLen += n;
+		}
+
+		*data += n;
+		*len -= n;
+		wc->remaining -= n;
+
+		if (wc->remaining > 0)
+		{
+			return WS_MORE;
+		}
+
+		/* Frame complete */
+		wc->hdrLen = 0;
+		wc->hdrNeed = 2;
+
+		if (wc->opcode & 0x08)
+		{
+			return ws_control(wc, f);
+		}
+
+		if (wc->fin)
+		{
+			f->opcode = wc->msgOpcode;
+			f->data = wc->msg;
+			f->len = wc->msgLen;
+			wc->lastOpcode = wc->msgOpcode;
+			wc->msgOpcode = 0;
+			wc->delivered = 1;
+			return WS_MESSAGE;
+		}
+	}
+
+	return WS_MORE;
+}
+
+size_t ws_header(uint8_t *hdr, uint8_t opcode, size_t len)
+{
+	int i;
+
+	hdr[0] = WS_FIN | opcode;
+
+	if (len < 126)
+	{
+		hdr[1] = (uint8_t)len;
+		return 2;
+	}
+	else if (len <= 0xffff)
+	{
+		hdr[1] = 126;
+		hdr[2] = (uint8_t)(len >> 8);
+		hdr[3] = (uint8_t)len;
+		return 4;
+	}
+
+	hdr[1] = 127;
+	for (i = 0; i < 8; ++i)
+	{
+		hdr[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+	}
+
+	return 10;
+}
+
+void ws_connFree(struct ws_conn *wc)
+{
+	free(wc->msg);
+	wc->msg = NULL;
+	wc->msgLen = 0;
+	wc->msgCap = 0;
+	free(wc->held);
+	wc->held = NULL;
+	wc->heldLen = 0;
+}
+
+void ws_writeStats(const struct ws_stats *s, FILE *fp)
+{
+	fprintf(fp, "ws_handshakes %llu\n", (unsigned long long)s->handshakes);
+	fprintf(fp, "ws_rejected %llu\n", (unsigned long long)s->rejected);
+	fprintf(fp, "ws_messages_in %llu\n", (unsigned long long)s->messagesIn);
+	fprintf(fp, "ws_messages_out %llu\n",
+		(unsigned long long)s->messagesOut);
+	fprintf(fp, "ws_pings %llu\n", (unsigned long long)s->pings);
+	fprintf(fp, "ws_protocol_errors %llu\n", (unsigned long long)s->errors);
+}
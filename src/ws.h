@@ -0,0 +1,159 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WS_H
+#define WS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Largest upgrade request */
+#define WS_REQUEST_MAX (8 * 1024)
+/* Largest message after reassembly */
+#define WS_MESSAGE_MAX (1024 * 1024)
+/* Longest frame header: 2 bytes, 8 bytes length, 4 bytes mask */
+#define WS_HEADER_MAX 14
+/* Longest control frame payload */
+#define WS_CONTROL_MAX 125
+
+/* Opcodes */
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xa
+
+/* Close codes */
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL 1002
+#define WS_CLOSE_INVALID_DATA 1007
+#define WS_CLOSE_TOO_BIG 1009
+
+/* Results of ws_handshake() and ws_next() */
+#define WS_ERROR (-1)
+#define WS_MORE 0
+#define WS_DONE 1
+#define WS_MESSAGE 2
+#define WS_PING 3
+#define WS_PONG 4
+#define WS_CLOSE 5
+
+/* Per-client protocol state */
+struct ws_conn
+{
+	/* Upgrade finished */
+	uint8_t open;
+	/* Header of the current frame, complete once hdrLen == hdrNeed */
+	uint8_t hdr[WS_HEADER_MAX];
+	uint8_t hdrLen;
+	uint8_t hdrNeed;
+	/* Opcode and FIN bit of the current frame */
+	uint8_t opcode;
+	uint8_t fin;
+	/* Opcode of the message being reassembled, 0 if none */
+	uint8_t msgOpcode;
+	/* Opcode of the last complete message */
+	uint8_t lastOpcode;
+	/* The current frame carries text */
+	uint8_t text;
+	/* UTF-8 continuation bytes still expected and the range of the next */
+	uint8_t utf8Need;
+	uint8_t utf8Lo;
+	uint8_t utf8Hi;
+	/* Mask rotated to the position of the next payload byte */
+	uint32_t mask;
+	/* Payload bytes of the current frame still to come */
+	uint64_t remaining;
+	/* Upgrade request or fragments of a message, grown on demand */
+	char *msg;
+	size_t msgLen;
+	size_t msgCap;
+	/* The message in msg has been handed out */
+	uint8_t delivered;
+	/* Payload of the current control frame */
+	uint8_t ctlLen;
+	char ctl[WS_CONTROL_MAX];
+	/* Frames not parsed yet when the client got paused, NULL if none */
+	char *held;
+	size_t heldLen;
+};
+
+/* Counters of all WebSocket clients */
+struct ws_stats
+{
+	uint64_t handshakes;
+	uint64_t rejected;
+	uint64_t messagesIn;
+	uint64_t messagesOut;
+	uint64_t pings;
+	uint64_t errors;
+};
+
+/* A complete message or control frame, valid until the next ws_next() */
+struct ws_frame
+{
+	uint8_t opcode;
+	const char *data;
+	size_t len;
+	/* Close code to send with WS_ERROR */
+	uint16_t code;
+};
+
+/* Room needed for the answer to an upgrade request */
+#define WS_REPLY_MAX 256
+
+/*
+ * Collects the HTTP upgrade request from data. Consumed bytes are taken off
+ * data, what is left are frames.
+ * Returns WS_DONE once the connection is open or WS_ERROR if the request
+ * was rejected, both with the answer in reply, or WS_MORE if the request
+ * is incomplete.
+ */
+int ws_handshake(struct ws_conn *wc, char **data, size_t *len, char *reply,
+	size_t *replyLen);
+
+/*
+ * Parses frames from data, unmasking payloads in place. Complete messages
+ * sent in a single frame are handed out without copying, fragments are
+ * reassembled. Consumed bytes are taken off data.
+ * Returns WS_MESSAGE, WS_PING, WS_PONG or WS_CLOSE with f filled in,
+ * WS_MORE once data is used up or WS_ERROR with the close code in f.
+ */
+int ws_next(struct ws_conn *wc, char **data, size_t *len, struct ws_frame *f);
+
+/*
+ * Writes the header of an unmasked server frame to hdr, which must hold
+ * WS_HEADER_MAX bytes.
+ * Returns the header length.
+ */
+size_t ws_header(uint8_t *hdr, uint8_t opcode, size_t len);
+
+/*
+ * XORs len bytes with a mask already rotated to the first byte.
+ */
+void ws_unmask(char *data, size_t len, uint32_t mask);
+
+void ws_connFree(struct ws_conn *wc);
+
+/*
+ * Writes WebSocket statistics.
+ */
+void ws_writeStats(const struct ws_stats *s, FILE *fp);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Feeds hand-built client frames through the WebSocket parser.
+ *
+ * Usage: test-ws
+ */
+
+#include "ws.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int g_failed = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+			g_failed++; \
+		} \
+	} while (0)
+
+/*
+ * Appends a masked client frame with a short payload to buf.
+ * Returns the frame length.
+ */
+static size_t test_frame(char *buf, uint8_t opcode, int fin, const char *data,
+	size_t len)
+{
+	static const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+	uint8_t *p = (uint8_t *)buf;
+	size_t i;
+
+	p[0] = (uint8_t)((fin ? 0x80 : 0) | opcode);
+	p[1] = (uint8_t)(0x80 | len);
+	memcpy(p + 2, mask, 4);
+
+	for (i = 0; i < len; ++i)
+	{
+		p[6 + i] = (uint8_t)data[i] ^ mask[i & 3];
+	}
+
+	return 6 + len;
+}
+
+static void test_open(struct ws_conn *wc)
+{
+	memset(wc, 0, sizeof(struct ws_conn));
+	wc->open = 1;
+	wc->hdrNeed = 2;
+}
+
+/*
+ * A ping may come between the fragments of a text message, even where they
+ * split a character.
+ */
+static void test_pingBetweenFragments(void)
+{
+	struct ws_conn wc;
+	struct ws_frame f;
+	char buf[256];
+	char *data = buf;
+	size_t len = 0;
+
+	test_open(&wc);
+	len += test_frame(buf + len, WS_OP_TEXT, 0, "a\xe2\x82", 3);
+	len += test_frame(buf + len, WS_OP_PING, 1, "\xff\xfe", 2);
+	len += test_frame(buf + len, WS_OP_CONTINUATION, 1, "\xac" "b", 2);
+
+	CHECK(ws_next(&wc, &data, &len, &f) == WS_PING);
+	CHECK(f.len == 2 && memcmp(f.data, "\xff\xfe", 2) == 0);
+	CHECK(ws_next(&wc, &data, &len, &f) == WS_MESSAGE);
+	CHECK(f.opcode == WS_OP_TEXT);
+	CHECK(f.len == 5 && memcmp(f.data, "a\xe2\x82\xac" "b", 5) == 0);
+	CHECK(len == 0);
+	ws_connFree(&wc);
+}
+
+/*
+ * Control payloads after a text message are not checked as text.
+ */
+static void test_binaryPingAfterText(void)
+{
+	struct ws_conn wc;
+	struct ws_frame f;
+	char buf[256];
+	char *data = buf;
+	size_t len = 0;
+
+	test_open(&wc);
+	len += test_frame(buf + len, WS_OP_TEXT, 1, "hi", 2);
+	len += test_frame(buf + len, WS_OP_PING, 1, "\xc0\xaf", 2);
+
+	CHECK(ws_next(&wc, &data, &len, &f) == WS_MESSAGE);
+	CHECK(ws_next(&wc, &data, &len, &f) == WS_PING);
+	ws_connFree(&wc);
+}
+
+/*
+ * Text ending within a character is invalid.
+ */
+static void test_truncatedText(void)
+{
+	struct ws_conn wc;
+	struct ws_frame f;
+	char buf[256];
+	char *data = buf;
+	size_t len = 0;
+
+	test_open(&wc);
+	len += test_frame(buf + len, WS_OP_TEXT, 0, "a\xe2", 2);
+	len += test_frame(buf + len, WS_OP_CONTINUATION, 1, "\x82", 1);
+
+	CHECK(ws_next(&wc, &data, &len, &f) == WS_ERROR);
+	CHECK(f.code == WS_CLOSE_INVALID_DATA);
+	ws_connFree(&wc);
+}
+
+int main(void)
+{
+	test_pingBetweenFragments();
+	test_binaryPingAfterText();
+	test_truncatedText();
+
+	if (g_failed > 0)
+	{
+		fprintf(stderr, "%d checks failed.\n", g_failed);
+		return EXIT_FAILURE;
+	}
+
+	printf("All checks passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Attaches to the output stage of epoll-server -o and reads received data
+ * straight from the shared ring. Sleeps on the eventfd only when the ring
+ * is empty. Prints totals on exit, and each message with -v.
+ *
+ * Usage: epoll-consume [-v] socket
+ */
+
+#include "output.h"
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Messages consumed before their space is handed back to the server */
+#define RELEASE_BATCH 64
+
+static volatile sig_atomic_t g_quit = 0;
+
+static void onSignal(int sig)
+{
+	(void)sig;
+	g_quit = 1;
+}
+
+/*
+ * Connects to the server and receives the ring and the eventfd.
+ * Returns the socket, -1 on failure.
+ */
+static int attach(const char *path, int *memFd, int *wakeFd)
+{
+	struct output_hello hello;
+	int fds[2];
+	int sd;
+
+	sd = shm_connect(path);
+	if (sd == -1)
+	{
+		return -1;
+	}
+
+	if (shm_recvFds(sd, fds, 2, &hello, sizeof(hello)) != 2 ||
+		hello.magic != OUTPUT_MAGIC || hello.version != OUTPUT_VERSION)
+	{
+		fprintf(stderr, "Server did not hand over a ring.\n");
+		close(sd);
+		return -1;
+	}
+
+	*memFd = fds[0];
+	*wakeFd = fds[1];
+	return sd;
+}
+
+int main(int argc, char *argv[])
+{
+	struct shm_port port;
+	struct pollfd pfd[2];
+	void *base;
+	size_t mapLen;
+	uint64_t messages = 0, bytes = 0, sleeps = 0;
+	uint32_t unreleased = 0;
+	int verbose = 0, closing = 0, memFd, wakeFd, sd, ch;
+
+	while ((ch = getopt(argc, argv, "v")) != -1)
+	{
+		switch (ch)
+		{
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			goto on_usage;
+		}
+	}
+
+	if (optind + 1 != argc)
+	{
+		goto on_usage;
+	}
+
+	sd = attach(argv[optind], &memFd, &wakeFd);
+	if (sd == -1 || shm_attach(memFd, &base, &mapLen) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	shm_portInit(&port, shm_ringAt(base, 0));
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	pfd[0].fd = wakeFd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sd;
+	pfd[1].events = POLLIN;
+
+	while (g_quit == 0)
+	{
+		const struct output_msg *m;
+		uint32_t type, len;
+		uint64_t count;
+		int rc;
+
+		rc = shm_peek(&port, (const void **)&m, &type, &len);
+		if (rc < 0)
+		{
+			fprintf(stderr, "Invalid message in the output ring.\n");
+			break;
+		}
+
+		if (rc > 0)
+		{
+			if (type == OUTPUT_DATA && len >= sizeof(*m))
+			{
+				messages++;
+				bytes += len - sizeof(*m);
+
+				if (verbose)
+				{
+					printf("%llu %u\n", (unsigned long long)m->conn,
+						(unsigned)(len - sizeof(*m)));
+				}
+			}
+
+			shm_consume(&port);
+			if (++unreleased == RELEASE_BATCH)
+			{
+				shm_release(&port);
+				unreleased = 0;
+			}
+
+			continue;
+		}
+
+		shm_release(&port);
+		unreleased = 0;
+
+		if (closing)
+		{
+			break;
+		}
+
+		if (!shm_consumerSleep(&port))
+		{
+			continue;
+		}
+
+		sleeps++;
+		if (poll(pfd, 2, -1) == -1)
+		{
+			continue;
+		}
+
+		if (pfd[1].revents != 0)
+		{
+			/* Server closed the connection, read what is left */
+			closing = 1;
+			continue;
+		}
+
+		if (pfd[0].revents & POLLIN)
+		{
+			if (read(wakeFd, &count, sizeof(count)) != sizeof(count))
+			{
+				perror("read");
+			}
+		}
+	}
+
+	printf("messages %llu\n", (unsigned long long)messages);
+	printf("bytes %llu\n", (unsigned long long)bytes);
+	printf("sleeps %llu\n", (unsigned long long)sleeps);
+
+	return EXIT_SUCCESS;
+
+on_usage:
+	fprintf(stderr, "Usage: %s [-v] socket\n", argv[0]);
+	return EXIT_FAILURE;
+}
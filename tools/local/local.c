@@ -0,0 +1,211 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Echo benchmark for the shared memory transport of epoll-server -l. Sends
+ * count messages of the given size with up to window messages in flight and
+ * waits for the echoed bytes. Prints throughput and round trip times.
+ *
+ * Usage: epoll-local [-n count] [-s size] [-w window] socket
+ */
+
+#include "local.h"
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compareU64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Waits until the server signals this side.
+ */
+static void sleepOn(struct local_conn *lc)
+{
+	struct pollfd pfd;
+
+	pfd.fd = lc->selfFd;
+	pfd.events = POLLIN;
+
+	if (poll(&pfd, 1, 1000) > 0)
+	{
+		local_clearWakeup(lc);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct local_conn lc;
+	uint64_t *sentNs, *rtt;
+	uint64_t count = 100000, sent = 0, done = 0, received = 0;
+	uint64_t start, elapsed, sleeps = 0;
+	uint32_t size = 64, window = 16;
+	char *msg;
+	int sd, ch;
+
+	while ((ch = getopt(argc, argv, "n:s:w:")) != -1)
+	{
+		switch (ch)
+		{
+		case 'n':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			size = (uint32_t)atoi(optarg);
+			break;
+		case 'w':
+			window = (uint32_t)atoi(optarg);
+			break;
+		default:
+			goto on_usage;
+		}
+	}
+
+	if (optind + 1 != argc || count == 0 || size == 0 || window == 0)
+	{
+		goto on_usage;
+	}
+
+	sd = local_connect(argv[optind], &lc);
+	if (sd == -1)
+	{
+		return EXIT_FAILURE;
+	}
+
+	if (size > lc.chunkMax)
+	{
+		fprintf(stderr, "Message size is limited to %u bytes.\n", lc.chunkMax);
+		return EXIT_FAILURE;
+	}
+
+	msg = malloc(size);
+	sentNs = malloc(count * sizeof(uint64_t));
+	rtt = malloc(count * sizeof(uint64_t));
+	if (msg == NULL || sentNs == NULL || rtt == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(msg, 'x', size);
+	start = nowNs();
+
+	while (done < count)
+	{
+		const void *reply;
+		uint32_t type, len;
+		int progress = 0;
+		int rc;
+
+		while (sent < count && sent - done < window)
+		{
+			sentNs[sent] = nowNs();
+			if (local_send(&lc, msg, size) != size)
+			{
+				break;
+			}
+
+			sent++;
+			progress = 1;
+		}
+
+		/* Replies may be split or merged, only the byte count matters */
+		while ((rc = shm_peek(&lc.rx, &reply, &type, &len)) > 0)
+		{
+			uint64_t now = nowNs();
+
+			received += len;
+			while (done < sent && received >= (done + 1) * size)
+			{
+				rtt[done] = now - sentNs[done];
+				done++;
+			}
+
+			shm_consume(&lc.rx);
+			progress = 1;
+		}
+
+		if (rc < 0)
+		{
+			fprintf(stderr, "Invalid message in the reply ring.\n");
+			break;
+		}
+
+		local_release(&lc);
+
+		if (progress)
+		{
+			continue;
+		}
+
+		/* Blocked on a full request ring, wait for space as well */
+		if (sent < count && sent - done < window &&
+			!local_waitSpace(&lc, size))
+		{
+			continue;
+		}
+
+		if (shm_consumerSleep(&lc.rx))
+		{
+			sleeps++;
+			sleepOn(&lc);
+		}
+	}
+
+	elapsed = nowNs() - start;
+	qsort(rtt, count, sizeof(uint64_t), compareU64);
+
+	printf("messages %llu\n", (unsigned long long)count);
+	printf("seconds %.3f\n", elapsed / 1e9);
+	printf("messages_per_second %.0f\n", count / (elapsed / 1e9));
+	printf("mb_per_second %.1f\n", count * (double)size / elapsed * 1e3);
+	printf("rtt_p50_us %.2f\n", rtt[count / 2] / 1e3);
+	printf("rtt_p99_us %.2f\n", rtt[count - count / 100 - 1] / 1e3);
+	printf("rtt_max_us %.2f\n", rtt[count - 1] / 1e3);
+	printf("sleeps %llu\n", (unsigned long long)sleeps);
+	printf("wakeups_sent %llu\n", (unsigned long long)lc.wakeups);
+
+	local_close(&lc);
+	close(sd);
+	free(msg);
+	free(sentNs);
+	free(rtt);
+	return EXIT_SUCCESS;
+
+on_usage:
+	fprintf(stderr, "Usage: %s [-n count] [-s size] [-w window] socket\n",
+		argv[0]);
+	return EXIT_FAILURE;
+}
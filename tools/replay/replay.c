@@ -0,0 +1,476 @@
+/*
+This file is part of epoll-server.
+
+epoll-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+epoll-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with epoll-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Replays a capture file written by epoll-server -C against a server.
+ * Connections are opened, fed and closed in the recorded order, at the
+ * recorded pace divided by the speed factor. Server output is read and
+ * discarded. Records without payload are replayed with filler bytes.
+ *
+ * Usage: epoll-replay [-h host] [-p port] [-s speed] file
+ */
+
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/* Connection of the replay, indexed by the recorded client id */
+struct conn
+{
+	uint64_t id;
+	/* Socket, -1 if the slot is unused */
+	int fd;
+};
+
+struct replay
+{
+	struct sockaddr_in addr;
+	double speed;
+	int efd;
+	/* Open addressing table of connections */
+	struct conn *conns;
+	size_t capacity;
+	size_t used;
+	/* Half-closed sockets, still read until the end of the replay */
+	int *closing;
+	size_t closingCount;
+	/* Totals */
+	uint64_t records;
+	uint64_t connects;
+	uint64_t sent;
+	uint64_t received;
+};
+
+static char g_filler[16384];
+static char g_drain[65536];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t slotOf(const struct replay *r, uint64_t id)
+{
+	size_t i = (size_t)(id * 0x9E3779B97F4A7C15ull) & (r->capacity - 1);
+
+	while (r->conns[i].fd != -1 && r->conns[i].id != id)
+	{
+		i = (i + 1) & (r->capacity - 1);
+	}
+
+	return i;
+}
+
+/*
+ * Double the connection table.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int growTable(struct replay *r)
+{
+	struct conn *old = r->conns;
+	size_t oldCapacity = r->capacity;
+	size_t i;
+
+	r->capacity = oldCapacity ? oldCapacity * 2 : 1024;
+	r->conns = malloc(r->capacity * sizeof(struct conn));
+	if (r->conns == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < r->capacity; ++i)
+	{
+		r->conns[i].fd = -1;
+	}
+
+	for (i = 0; i < oldCapacity; ++i)
+	{
+		if (old[i].fd != -1)
+		{
+			r->conns[slotOf(r, old[i].id)] = old[i];
+		}
+	}
+
+	free(old);
+	return 0;
+}
+
+/*
+ * Read and discard everything the server sent.
+ */
+static void drain(struct replay *r, int timeoutMs)
+{
+	struct epoll_event events[64];
+	int n, i;
+
+	n = epoll_wait(r->efd, events, 64, timeoutMs);
+	for (i = 0; i < n; ++i)
+	{
+		ssize_t len;
+
+		while ((len = read(events[i].data.fd, g_drain, sizeof(g_drain))) > 0)
+		{
+			r->received += len;
+		}
+
+		/* Closed by the server */
+		if (len == 0)
+		{
+			epoll_ctl(r->efd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+		}
+	}
+}
+
+/*
+ * Shut down the sending side of a connection and remove it from the table,
+ * keeping probe sequences intact. The socket is read until the end of the
+ * replay so that responses still count.
+ */
+static void removeConn(struct replay *r, size_t i)
+{
+	size_t j = i;
+	int *closing;
+
+	shutdown(r->conns[i].fd, SHUT_WR);
+
+	closing = realloc(r->closing, (r->closingCount + 1) * sizeof(int));
+	if (closing != NULL)
+	{
+		r->closing = closing;
+		r->closing[r->closingCount++] = r->conns[i].fd;
+	}
+	else
+	{
+		close(r->conns[i].fd);
+	}
+
+	r->conns[i].fd = -1;
+	r->used--;
+
+	/* Reinsert the following entries of the cluster */
+	while (1)
+	{
+		struct conn c;
+
+		j = (j + 1) & (r->capacity - 1);
+		if (r->conns[j].fd == -1)
+		{
+			break;
+		}
+
+		c = r->conns[j];
+		r->conns[j].fd = -1;
+		r->conns[slotOf(r, c.id)] = c;
+	}
+}
+
+/*
+ * Returns the socket of a recorded connection, connecting it first if
+ * needed. Connections whose connect record was overwritten in the ring are
+ * opened on their first use. Returns -1 on failure.
+ */
+static int connFd(struct replay *r, uint64_t id)
+{
+	struct epoll_event ev;
+	size_t i;
+	int fd;
+
+	if (r->used * 2 >= r->capacity && growTable(r) != 0)
+	{
+		return -1;
+	}
+
+	i = slotOf(r, id);
+	if (r->conns[i].fd != -1)
+	{
+		return r->conns[i].fd;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&r->addr, sizeof(r->addr)) == -1)
+	{
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl(r->efd, EPOLL_CTL_ADD, fd, &ev);
+
+	r->conns[i].id = id;
+	r->conns[i].fd = fd;
+	r->used++;
+	r->connects++;
+
+	return fd;
+}
+
+/*
+ * Send a payload, draining server output while the socket is full.
+ */
+static int sendAll(struct replay *r, int fd, const uint8_t *data, size_t len)
+{
+	while (len > 0)
+	{
+		const void *p = data != NULL ? (const void *)data : g_filler;
+		size_t n = len;
+		ssize_t sent;
+
+		if (data == NULL && n > sizeof(g_filler))
+		{
+			n = sizeof(g_filler);
+		}
+
+		sent = send(fd, p, n, MSG_NOSIGNAL);
+		if (sent == -1)
+		{
+			if (errno != EAGAIN)
+			{
+				perror("send");
+				return -1;
+			}
+
+			drain(r, 10);
+			continue;
+		}
+
+		r->sent += sent;
+		len -= sent;
+		if (data != NULL)
+		{
+			data += sent;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Replay one record.
+ */
+static void replayRecord(struct replay *r, const struct cap_record *rec)
+{
+	size_t i;
+	int fd;
+
+	switch (rec->type)
+	{
+	case CAP_CONNECT:
+		connFd(r, rec->conn);
+		break;
+	case CAP_IN:
+		fd = connFd(r, rec->conn);
+		if (fd != -1)
+		{
+			sendAll(r, fd, rec->flags & CAP_PAYLOAD ?
+				(const uint8_t *)(rec + 1) : NULL, rec->len);
+		}
+		break;
+	case CAP_CLOSE:
+		i = slotOf(r, rec->conn);
+		if (r->capacity > 0 && r->conns[i].fd != -1)
+		{
+			removeConn(r, i);
+		}
+		break;
+	default:
+		/* Server output is not replayed */
+		break;
+	}
+}
+
+static int parseArgs(int argc, char *argv[], struct replay *r,
+	const char **path)
+{
+	const char *host = "127.0.0.1";
+	int port = 5033;
+	int ch;
+
+	r->speed = 1.0;
+
+	while ((ch = getopt(argc, argv, "h:p:s:")) != -1)
+	{
+		switch (ch)
+		{
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			r->speed = atof(optarg);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (optind + 1 != argc)
+	{
+		return -1;
+	}
+
+	*path = argv[optind];
+	r->addr.sin_family = AF_INET;
+	r->addr.sin_port = htons(port);
+
+	if (inet_pton(AF_INET, host, &r->addr.sin_addr) != 1)
+	{
+		fprintf(stderr, "Invalid host address: %s\n", host);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct replay r;
+	const struct cap_header *hdr;
+	const uint8_t *data;
+	const char *path;
+	struct stat st;
+	uint64_t pos, i, firstTicks = 0, lastTicks = 0;
+	double start, elapsed;
+	int fd;
+
+	memset(&r, 0, sizeof(r));
+	memset(g_filler, 'x', sizeof(g_filler));
+
+	if (parseArgs(argc, argv, &r, &path) != 0)
+	{
+		fprintf(stderr, "Usage: %s [-h host] [-p port] [-s speed] file\n"
+			"A speed of 0 replays as fast as possible.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1)
+	{
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (hdr == MAP_FAILED || (size_t)st.st_size < sizeof(*hdr) ||
+		memcmp(hdr->magic, CAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+		sizeof(*hdr) + hdr->size > (uint64_t)st.st_size)
+	{
+		fprintf(stderr, "%s is not a capture file.\n", path);
+		return EXIT_FAILURE;
+	}
+
+	r.efd = epoll_create1(EPOLL_CLOEXEC);
+	if (r.efd == -1 || growTable(&r) != 0)
+	{
+		perror("setup");
+		return EXIT_FAILURE;
+	}
+
+	data = (const uint8_t *)(hdr + 1);
+	pos = hdr->tail;
+	start = now();
+
+	for (i = 0; i < hdr->records; ++i)
+	{
+		const struct cap_record *rec;
+
+		if (hdr->size - pos < sizeof(struct cap_record) ||
+			((const struct cap_record *)(data + pos))->type == CAP_PAD)
+		{
+			pos = 0;
+		}
+
+		rec = (const struct cap_record *)(data + pos);
+		pos += cap_recordSize(rec->flags & CAP_PAYLOAD ? rec->len : 0);
+
+		if (i == 0)
+		{
+			firstTicks = rec->ticks;
+		}
+
+		/* Keep the recorded gaps, scaled by the speed factor */
+		if (r.speed > 0.0)
+		{
+			double due = (rec->ticks - firstTicks) / hdr->ticksPerUs / 1e6 /
+				r.speed;
+
+			while (now() - start < due)
+			{
+				drain(&r, (int)((due - (now() - start)) * 1000) + 1);
+			}
+		}
+
+		replayRecord(&r, rec);
+		lastTicks = rec->ticks;
+		r.records++;
+	}
+
+	/* Collect the remaining responses until the server goes quiet */
+	elapsed = now() - start;
+	do
+	{
+		pos = r.received;
+		drain(&r, 200);
+	}
+	while (r.received != pos);
+
+	for (i = 0; i < r.closingCount; ++i)
+	{
+		close(r.closing[i]);
+	}
+
+	printf("records %llu\n", (unsigned long long)r.records);
+	printf("connections %llu\n", (unsigned long long)r.connects);
+	printf("bytes_sent %llu\n", (unsigned long long)r.sent);
+	printf("bytes_received %llu\n", (unsigned long long)r.received);
+	printf("dropped_records %llu\n", (unsigned long long)hdr->dropped);
+	printf("recorded_seconds %.3f\n",
+		(lastTicks - firstTicks) / hdr->ticksPerUs / 1e6);
+	printf("replay_seconds %.3f\n", elapsed);
+
+	return EXIT_SUCCESS;
+}